@@ -62,6 +62,7 @@ LOCAL_SRC_FILES := \
 	bluez/android/map-client.c \
 	bluez/android/log.c \
 	bluez/src/shared/mgmt.c \
+	bluez/src/shared/idmap.c \
 	bluez/src/shared/util.c \
 	bluez/src/shared/queue.c \
 	bluez/src/shared/ringbuf.c \
@@ -552,6 +553,7 @@ LOCAL_SRC_FILES := \
 	bluez/src/shared/mainloop.c \
 	bluez/src/shared/io-mainloop.c \
 	bluez/src/shared/mgmt.c \
+	bluez/src/shared/idmap.c \
 	bluez/src/shared/queue.c \
 	bluez/src/shared/util.c \
 	bluez/src/shared/gap.c \
@@ -288,6 +288,7 @@ static bool hidp_recv_intr_data(GIOChannel *chan, struct input_device *idev)
 	ssize_t len;
 	uint8_t hdr;
 	uint8_t data[UHID_DATA_MAX + 1];
+	uint64_t rx_time;
 
 	fd = g_io_channel_unix_get_fd(chan);
 
@@ -297,13 +298,15 @@ static bool hidp_recv_intr_data(GIOChannel *chan, struct input_device *idev)
 		return false;
 	}
 
+	rx_time = relay_now();
+
 	if (len == 0) {
 		DBG("BT socket read returned 0 bytes");
 		return true;
 	}
 
 	if(capture_uhid_channels_for_devices){
-        id_send_data_to_local(idev->intr_io_local_connection, data, len);
+        id_send_data_to_local(idev, FALSE, data, len, rx_time);
         if(capture_uhid_channels_for_devices_exclusively) return true;
 	}
 
@@ -483,6 +486,7 @@ static bool hidp_recv_ctrl_message(GIOChannel *chan, struct input_device *idev)
 	ssize_t len;
 	uint8_t hdr, type, param;
 	uint8_t data[UHID_DATA_MAX + 1];
+	uint64_t rx_time;
 
 	fd = g_io_channel_unix_get_fd(chan);
 
@@ -492,13 +496,15 @@ static bool hidp_recv_ctrl_message(GIOChannel *chan, struct input_device *idev)
 		return false;
 	}
 
+	rx_time = relay_now();
+
 	if (len == 0) {
 		DBG("BT socket read returned 0 bytes");
 		return true;
 	}
 
     if(capture_uhid_channels_for_devices){
-        id_send_data_to_local(idev->ctrl_io_local_connection, data, len);
+        id_send_data_to_local(idev, TRUE, data, len, rx_time);
         if(capture_uhid_channels_for_devices_exclusively) return true;
     }
 
@@ -1437,10 +1443,61 @@ static gboolean property_get_socket_path_intr(const GDBusPropertyTable *property
     return TRUE;
 }
 
+static gboolean property_relay_exists(const GDBusPropertyTable *property, void *data)
+{
+    struct input_device *idev = data;
+    return idev->socket_path_ctrl != NULL;
+}
+
+static gboolean property_get_latency_p50(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    struct input_device *idev = data;
+    dbus_uint32_t value = relay_latency_percentile(&idev->latency, 50);
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT32, &value);
+    return TRUE;
+}
+
+static gboolean property_get_latency_p99(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    struct input_device *idev = data;
+    dbus_uint32_t value = relay_latency_percentile(&idev->latency, 99);
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT32, &value);
+    return TRUE;
+}
+
+static gboolean property_get_latency_max(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    struct input_device *idev = data;
+    dbus_uint32_t value = idev->latency.max;
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT32, &value);
+    return TRUE;
+}
+
+static gboolean property_get_relayed_reports(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    struct input_device *idev = data;
+    dbus_uint64_t value = idev->latency.count;
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT64, &value);
+    return TRUE;
+}
+
+static gboolean property_get_dropped_reports(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    struct input_device *idev = data;
+    dbus_uint64_t value = idev->local_relay_stats.dropped + idev->remote_relay_stats.dropped;
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT64, &value);
+    return TRUE;
+}
+
 static const GDBusPropertyTable input_properties[] = {
 	{ "ReconnectMode", "s", property_get_reconnect_mode },
     { "SocketPathCtrl", "s", property_get_socket_path_ctrl },
     { "SocketPathIntr", "s", property_get_socket_path_intr },
+    { "LatencyP50", "u", property_get_latency_p50, NULL, property_relay_exists },
+    { "LatencyP99", "u", property_get_latency_p99, NULL, property_relay_exists },
+    { "LatencyMax", "u", property_get_latency_max, NULL, property_relay_exists },
+    { "RelayedReports", "t", property_get_relayed_reports, NULL, property_relay_exists },
+    { "DroppedReports", "t", property_get_dropped_reports, NULL, property_relay_exists },
 	{ }
 };
 
@@ -23,6 +23,9 @@
 #ifndef BLUEZ_INPUT_DEVICE_H
 #define BLUEZ_INPUT_DEVICE_H
 
+#include "relay.h"
+#include "relay_shm.h"
+
 #define L2CAP_PSM_HIDP_CTRL	0x11
 #define L2CAP_PSM_HIDP_INTR	0x13
 
@@ -67,6 +70,11 @@ struct input_device {
     guint           intr_io_local_listener_watch;
     GIOChannel      *intr_io_local_connection;
     guint           intr_io_local_connection_watch;
+    struct relay_stats  local_relay_stats;
+    struct relay_stats  remote_relay_stats;
+    struct relay_latency latency;
+    struct relay_shm    *shm;
+    guint           shm_watch;
 
 };
 
@@ -78,6 +86,7 @@ void input_set_classic_bonded_only(bool state);
 bool input_get_classic_bonded_only(void);
 void input_device_set_capture_uhid_channels_for_devices(bool state);
 void input_device_set_capture_uhid_channels_for_devices_exclusively(bool state);
+void input_device_set_shared_memory_relay(bool state);
 void input_set_auto_sec(bool state);
 
 int input_device_register(struct btd_service *service);
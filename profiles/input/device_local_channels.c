@@ -13,6 +13,13 @@ static gboolean id_local_channel_watch_cb(GIOChannel *io, GIOCondition cond, gpo
 
 static bool id_receive_data_from_local(GIOChannel *chan, struct input_device *device,  bool is_control);
 
+static bool shared_memory_relay = false;
+
+void input_device_set_shared_memory_relay(bool state)
+{
+    shared_memory_relay = state;
+}
+
 
 GIOChannel *id_create_local_listening_sockets(struct input_device *device, bool is_control){
     int sock;
@@ -144,66 +151,185 @@ static gboolean id_local_channel_watch_cb(GIOChannel *io, GIOCondition cond, gpo
     return FALSE;
 }
 
-static bool id_receive_data_from_local(GIOChannel *chan, struct input_device *device,  bool is_control)
+struct id_local_relay {
+    struct input_device *device;
+    bool is_control;
+};
+
+static void id_local_shm_close(struct input_device *device)
+{
+    if (device->shm_watch > 0)
+        g_source_remove(device->shm_watch);
+    device->shm_watch = 0;
+
+    relay_shm_free(device->shm);
+    device->shm = NULL;
+}
+
+static bool id_forward_local_batch(struct relay_batch *batch, void *user_data);
+
+static void id_forward_local_shm_batch(struct relay_batch *batch, bool is_control, void *user_data)
 {
-    int fd;
-    ssize_t len;
-    uint8_t data[UHID_DATA_MAX + 1];
+    struct id_local_relay relay = { user_data, is_control };
 
-    fd = g_io_channel_unix_get_fd(chan);
+    id_forward_local_batch(batch, &relay);
+}
 
-    len = read(fd, data, sizeof(data));
-    if (len < 0) {
-        error("local socket read error: %s (%d)", strerror(errno), errno);
-        return FALSE;
-    }
+static gboolean id_local_shm_cb(GIOChannel *chan, GIOCondition cond, gpointer user_data)
+{
+    struct input_device *device = user_data;
+    int count;
 
-    if (len == 0) {
-        DBG("local socket read returned 0 bytes");
+    if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+        goto failed;
+
+    count = relay_shm_drain(device->shm, &device->local_relay_stats, id_forward_local_shm_batch, device);
+    if (count >= 0)
         return TRUE;
+
+    error("Input device %s shared memory ring corrupted, falling back to sockets", device->path);
+
+failed:
+    device->shm_watch = 0;
+    id_local_shm_close(device);
+    return FALSE;
+}
+
+/* Answers a local daemon asking to move reports to a shared memory ring */
+static void id_local_shm_setup(struct input_device *device)
+{
+    GIOChannel *io;
+    int status = 0;
+
+    if (!shared_memory_relay)
+        status = EOPNOTSUPP;
+    else if (!device->shm) {
+        device->shm = relay_shm_new();
+        if (!device->shm)
+            status = ENOMEM;
+    }
+
+    if (relay_shm_reply(g_io_channel_unix_get_fd(device->ctrl_io_local_connection), device->shm, status) < 0 ||
+            status) {
+        DBG("Shared memory relay refused for input device %s (%d)", device->path, status);
+        return;
+    }
+
+    if (device->shm_watch)
+        return;
+
+    io = g_io_channel_unix_new(relay_shm_get_fd(device->shm));
+    device->shm_watch = g_io_add_watch(io, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL, id_local_shm_cb, device);
+    g_io_channel_unref(io);
+
+    DBG("Input device %s relaying through shared memory", device->path);
+}
+
+static bool id_forward_local_batch(struct relay_batch *batch, void *user_data)
+{
+    struct id_local_relay *relay = user_data;
+    struct input_device *device = relay->device;
+    GIOChannel *chan = relay->is_control ? device->ctrl_io : device->intr_io;
+    int sent;
+
+    if (relay->is_control && relay_shm_take_request(batch)) {
+        id_local_shm_setup(device);
+        if (!batch->count)
+            return true;
+    }
+
+    if (!chan) {
+        error("BT socket not connected");
+        device->local_relay_stats.dropped += batch->count;
+        return true;
+    }
+
+    //local packets already carry the HIDP header, send them as they are
+    sent = relay_send_batch(g_io_channel_unix_get_fd(chan), batch, 0);
+    if (sent < 0) {
+        error("BT socket write error: %s (%d)", strerror(-sent), -sent);
+        device->local_relay_stats.dropped += batch->count;
+        return true;
+    }
+
+    relay_latency_record(&device->latency, batch->rx_time, sent);
+
+    if ((unsigned int) sent < batch->count) {
+        error("BT socket write error: sent %d of %u reports", sent, batch->count);
+        device->local_relay_stats.dropped += batch->count - sent;
+    }
+
+    return true;
+}
+
+static bool id_receive_data_from_local(GIOChannel *chan, struct input_device *device,  bool is_control)
+{
+    struct id_local_relay relay = { device, is_control };
+    int count;
+
+    count = relay_drain(g_io_channel_unix_get_fd(chan), &device->local_relay_stats, id_forward_local_batch, &relay);
+    if (count < 0) {
+        error("local socket read error: %s (%d)", strerror(-count), -count);
+        return FALSE;
     }
 
-    //send data  remote
-    hidp_send_message(is_control ? device->ctrl_io : device->intr_io, data[0], data+1, len-1);
     return TRUE;
 }
 
-bool id_send_data_to_local(GIOChannel *chan, const uint8_t *data, size_t size)
+bool id_send_data_to_local(struct input_device *device, bool is_control, const uint8_t *data, size_t size,
+                           uint64_t rx_time)
 {
-    int fd;
-    ssize_t len;
-    uint8_t msg[size];
+    GIOChannel *chan = is_control ? device->ctrl_io_local_connection : device->intr_io_local_connection;
+    int err;
+
+    device->remote_relay_stats.reports++;
 
     if (!chan) {
         error("local socket not connected for device");
+        device->remote_relay_stats.dropped++;
         return false;
     }
 
-    if (data == NULL)
-        size = 0;
+    if (device->shm) {
+        err = relay_shm_send(device->shm, is_control, data, size);
+        if (err < 0) {
+            error("shared memory ring for device full, dropping report");
+            device->remote_relay_stats.dropped++;
+            return false;
+        }
 
-    if (size > 0)
-        memcpy(&msg[0], data, size);
-
-    fd = g_io_channel_unix_get_fd(chan);
+        relay_latency_record(&device->latency, rx_time, 1);
+        return true;
+    }
 
-    len = write(fd, msg, size);
-    if (len < 0) {
-        error("local socket for device write error: %s (%d)", strerror(errno), errno);
+    err = relay_send(g_io_channel_unix_get_fd(chan), data, size);
+    if (err == -EMSGSIZE) {
+        error("local socket for device write error: partial write of %zu bytes", size);
+        device->remote_relay_stats.dropped++;
         return false;
     }
 
-    if ((size_t) len < size) {
-        error("local socket for device write error: partial write (%zd of %zu bytes)",
-              len, size);
+    if (err < 0) {
+        error("local socket for device write error: %s (%d)", strerror(-err), -err);
+        device->remote_relay_stats.dropped++;
         return false;
     }
 
+    relay_latency_record(&device->latency, rx_time, 1);
+
     return true;
 }
 
 
 void id_shutdown_local_connections(struct input_device *device){
+    if (device->local_relay_stats.batches)
+        DBG("Input device %s local relay: %" PRIu64 " reports in %" PRIu64 " batches (avg %.2f, max %u), %" PRIu64 " dropped",
+            device->path, device->local_relay_stats.reports, device->local_relay_stats.batches,
+            relay_stats_avg_batch(&device->local_relay_stats), device->local_relay_stats.max_batch,
+            device->local_relay_stats.dropped);
+
+    id_local_shm_close(device);
+
     if (device->intr_io_local_connection) {
         g_io_channel_shutdown(device->intr_io_local_connection, TRUE, NULL);
         g_io_channel_unref(device->intr_io_local_connection);
@@ -22,8 +22,10 @@
 
 #include "input_common.h"
 #include "device.h"
+#include "relay.h"
 GIOChannel *id_create_local_listening_sockets(struct input_device *device, bool is_control);
-bool id_send_data_to_local(GIOChannel *chan, const uint8_t *data, size_t size);
+bool id_send_data_to_local(struct input_device *device, bool is_control, const uint8_t *data, size_t size,
+                           uint64_t rx_time);
 
 void id_shutdown_local_connections(struct input_device *device);
 void id_shutdown_local_listeners(struct input_device *device);
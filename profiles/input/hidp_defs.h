@@ -70,6 +70,19 @@
 #define HIDP_PROTO_BOOT				0x00
 #define HIDP_PROTO_REPORT			0x01
 
+/* Boot protocol reports, offsets include the HIDP header and report ID */
+#define HIDP_BOOT_KEYBOARD_REPORT_ID		0x01
+#define HIDP_BOOT_MOUSE_REPORT_ID		0x02
+
+#define HIDP_BOOT_KEYBOARD_MODIFIERS		2
+#define HIDP_BOOT_KEYBOARD_KEYS			4
+#define HIDP_BOOT_KEYBOARD_SIZE			10
+
+#define HIDP_BOOT_MOUSE_BUTTONS			2
+#define HIDP_BOOT_MOUSE_X			3
+#define HIDP_BOOT_MOUSE_Y			4
+#define HIDP_BOOT_MOUSE_WHEEL			5
+
 #define HIDP_VIRTUAL_CABLE_UNPLUG		0
 #define HIDP_BOOT_PROTOCOL_MODE			1
 #define HIDP_BLUETOOTH_VENDOR_ID		9
@@ -3,17 +3,45 @@
 //
 
 #include "host.h"
+#include "server.h"
 #include "host_local_channels.h"
 #include "host_remote_channels.h"
+#include "host_router.h"
 
 
 #define INPUT_HOST_INTERFACE "org.bluez.InputHost1"
 
 static void ih_remote_control_reconnect_cb(GIOChannel *chan, GError *conn_err, gpointer user_data);
 static void ih_remote_interrupt_reconnect_cb(GIOChannel *chan, GError *conn_err, gpointer user_data);
+static void ih_set_remote_power(GIOChannel *chan);
 
 static GSList* hosts = NULL;
 
+static size_t relay_queue_size = RELAY_QUEUE_DEFAULT_SIZE;
+static enum relay_queue_policy relay_queue_policy = RELAY_QUEUE_DROP_OLDEST;
+static bool relay_merge_boot_reports = false;
+static unsigned int reconnect_replay_time = IH_RECONNECT_REPLAY_TIME;
+static unsigned int keep_alive_interval = 0;
+static bool stay_in_sniff = false;
+
+void input_host_set_relay_queue(size_t size, enum relay_queue_policy policy)
+{
+    relay_queue_size = size;
+    relay_queue_policy = policy;
+}
+
+void input_host_set_merge_boot_reports(bool merge)
+{
+    relay_merge_boot_reports = merge;
+}
+
+void input_host_set_reconnect_policy(unsigned int replay_time, unsigned int keep_alive, bool sniff)
+{
+    reconnect_replay_time = replay_time;
+    keep_alive_interval = keep_alive;
+    stay_in_sniff = sniff;
+}
+
 static gboolean property_get_socket_path_ctrl(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
 {
     struct input_host *host = data;
@@ -28,10 +56,78 @@ static gboolean property_get_socket_path_intr(const GDBusPropertyTable *property
     return TRUE;
 }
 
+static gboolean property_get_latency_p50(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    struct input_host *host = data;
+    ih_relay_thread_collect(host);
+    dbus_uint32_t value = relay_latency_percentile(&host->latency, 50);
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT32, &value);
+    return TRUE;
+}
+
+static gboolean property_get_latency_p99(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    struct input_host *host = data;
+    ih_relay_thread_collect(host);
+    dbus_uint32_t value = relay_latency_percentile(&host->latency, 99);
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT32, &value);
+    return TRUE;
+}
+
+static gboolean property_get_latency_max(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    struct input_host *host = data;
+    ih_relay_thread_collect(host);
+    dbus_uint32_t value = host->latency.max;
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT32, &value);
+    return TRUE;
+}
+
+static gboolean property_get_relayed_reports(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    struct input_host *host = data;
+    ih_relay_thread_collect(host);
+    dbus_uint64_t value = host->latency.count;
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT64, &value);
+    return TRUE;
+}
+
+static gboolean property_get_dropped_reports(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    struct input_host *host = data;
+    ih_relay_thread_collect(host);
+    dbus_uint64_t value = host->local_relay_stats.dropped + host->remote_relay_stats.dropped;
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT64, &value);
+    return TRUE;
+}
+
+static gboolean property_get_merged_reports(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    struct input_host *host = data;
+    ih_relay_thread_collect(host);
+    dbus_uint64_t value = host->local_relay_stats.merged;
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT64, &value);
+    return TRUE;
+}
+
+static gboolean property_get_reconnect_time(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    struct input_host *host = data;
+    dbus_uint32_t value = host->reconnect_time;
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_UINT32, &value);
+    return TRUE;
+}
 
 static const GDBusPropertyTable input_properties[] = {
         { "SocketPathCtrl", "s", property_get_socket_path_ctrl },
         { "SocketPathIntr", "s", property_get_socket_path_intr },
+        { "LatencyP50", "u", property_get_latency_p50 },
+        { "LatencyP99", "u", property_get_latency_p99 },
+        { "LatencyMax", "u", property_get_latency_max },
+        { "RelayedReports", "t", property_get_relayed_reports },
+        { "DroppedReports", "t", property_get_dropped_reports },
+        { "MergedReports", "t", property_get_merged_reports },
+        { "ReconnectTime", "u", property_get_reconnect_time },
         { }
 };
 
@@ -86,6 +182,18 @@ static struct input_host *create_input_host(const bdaddr_t *src, const bdaddr_t
     struct btd_device *device = btd_adapter_find_device(adapter_find(src), dst, BDADDR_BREDR);
     const char *path = device_get_path(device);
     struct input_host *new_host = g_new0(struct input_host, 1);
+    for (int i = 0; i < IH_ROUTE_COUNT; i++) {
+        new_host->relay_tx[i].host = new_host;
+        new_host->relay_tx[i].route = i;
+        new_host->relay_tx[i].queue = relay_queue_new(relay_queue_size, relay_queue_policy);
+        if (!new_host->relay_tx[i].queue) {
+            error("Unable to allocate %zu byte relay queue for input host", relay_queue_size);
+            for (int j = 0; j < i; j++)
+                relay_queue_free(new_host->relay_tx[j].queue);
+            g_free(new_host);
+            return NULL;
+        }
+    }
     new_host->path = g_strdup(path);
     new_host->dbus_interface_registered = false;
     bacpy(&new_host->src, src);
@@ -94,6 +202,11 @@ static struct input_host *create_input_host(const bdaddr_t *src, const bdaddr_t
     new_host->device = btd_device_ref(device);
     new_host->socket_path_ctrl = g_strjoin(NULL,"/tmp/BTIHS_", new_host->dst_address, "_Ctrl", NULL);
     new_host->socket_path_intr = g_strjoin(NULL,"/tmp/BTIHS_", new_host->dst_address, "_Intr", NULL);
+    /* Only motion headed for the congested BT interrupt channel is merged */
+    relay_queue_set_merge(new_host->relay_tx[IH_ROUTE_LOCAL_INTR].queue, relay_merge_boot_reports);
+    /* Reports buffered while reconnecting are only replayed while fresh */
+    relay_queue_set_max_age(new_host->relay_tx[IH_ROUTE_LOCAL_CTRL].queue, reconnect_replay_time * 1000ULL);
+    relay_queue_set_max_age(new_host->relay_tx[IH_ROUTE_LOCAL_INTR].queue, reconnect_replay_time * 1000ULL);
     hosts= g_slist_append(hosts, new_host);
 
 
@@ -122,18 +235,335 @@ static struct input_host *find_host(const bdaddr_t *src, const bdaddr_t *dst, bo
 
 
 
+/* With the relay thread running, data is read by the thread and the main
+ * loop only watches the data plane sockets for disconnection.
+ */
+GIOCondition ih_data_watch_cond(void)
+{
+    if (relay_thread_enabled())
+        return G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+
+    return G_IO_IN | G_IO_PRI | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+}
+
+void input_host_foreach(GFunc func, gpointer user_data)
+{
+    g_slist_foreach(hosts, func, user_data);
+}
+
+/* Local end of host's channel: its own client, or the router feeding it */
+static GIOChannel *ih_local_dst(struct input_host *host, bool is_control)
+{
+    GIOChannel *chan = is_control ? host->ctrl_io_local_connection : host->intr_io_local_connection;
+
+    return chan ? chan : ih_router_local_channel(host, is_control);
+}
+
+static int ih_channel_fd(GIOChannel *chan)
+{
+    return chan ? g_io_channel_unix_get_fd(chan) : -1;
+}
+
+static void ih_relay_thread_miss(void *user_data)
+{
+    struct input_host *host = user_data;
+
+    DBG("BT socket not connected. Trying to re-connect with input host");
+    input_host_reconnect(host);
+}
+
+static struct relay_stats *ih_route_stats(struct input_host *host, enum ih_relay_route_t route)
+{
+    if (route == IH_ROUTE_LOCAL_CTRL || route == IH_ROUTE_LOCAL_INTR)
+        return &host->local_relay_stats;
+
+    return &host->remote_relay_stats;
+}
+
+/* Statistics of host are only written by the main loop, this folds in
+ * what the relay thread counted for its routes since the last time.
+ */
+void ih_relay_thread_collect(struct input_host *host)
+{
+    int i;
+
+    for (i = 0; i < IH_ROUTE_COUNT; i++) {
+        if (host->relay_routes[i].id)
+            relay_thread_collect(host->relay_routes[i].id, ih_route_stats(host, i), &host->latency);
+    }
+}
+
+/* Brings the relay thread routes of host in line with its connected
+ * channels. Must be called whenever a data plane channel is closed, the
+ * thread holds on to the socket until its route is removed.
+ */
+void ih_relay_thread_sync(struct input_host *host)
+{
+    int i;
+
+    if (!relay_thread_enabled())
+        return;
+
+    for (i = 0; i < IH_ROUTE_COUNT; i++) {
+        struct ih_relay_route *route = &host->relay_routes[i];
+        relay_thread_miss_func_t miss_func = NULL;
+        struct relay_queue *protocol_queue = NULL;
+        unsigned int flags = 0;
+        int src_fd, dst_fd;
+
+        switch (i) {
+        case IH_ROUTE_LOCAL_CTRL:
+            src_fd = ih_channel_fd(host->ctrl_io_local_connection);
+            dst_fd = ih_channel_fd(host->ctrl_io_remote_connection);
+            miss_func = ih_relay_thread_miss;
+            flags = RELAY_THREAD_REFUSE_SHM;
+            break;
+        case IH_ROUTE_LOCAL_INTR:
+            src_fd = ih_channel_fd(host->intr_io_local_connection);
+            dst_fd = ih_channel_fd(host->intr_io_remote_connection);
+            miss_func = ih_relay_thread_miss;
+            break;
+        case IH_ROUTE_REMOTE_CTRL:
+            src_fd = ih_channel_fd(host->ctrl_io_remote_connection);
+            dst_fd = ih_channel_fd(ih_local_dst(host, TRUE));
+            protocol_queue = host->relay_tx[IH_ROUTE_LOCAL_INTR].queue;
+            break;
+        default:
+            src_fd = ih_channel_fd(host->intr_io_remote_connection);
+            dst_fd = ih_channel_fd(ih_local_dst(host, FALSE));
+            break;
+        }
+
+        /* Remote channels only carry data once their watch is set up,
+         * i.e. once the outgoing connection has completed.
+         */
+        if (i == IH_ROUTE_REMOTE_CTRL && !host->ctrl_io_remote_connection_watch)
+            src_fd = -1;
+        if (i == IH_ROUTE_REMOTE_INTR && !host->intr_io_remote_connection_watch)
+            src_fd = -1;
+        if (i == IH_ROUTE_LOCAL_CTRL && !host->ctrl_io_remote_connection_watch)
+            dst_fd = -1;
+        if (i == IH_ROUTE_LOCAL_INTR && !host->intr_io_remote_connection_watch)
+            dst_fd = -1;
+
+        if (route->id && route->src_fd != src_fd) {
+            relay_thread_remove(route->id, ih_route_stats(host, i), &host->latency);
+            route->id = 0;
+        }
+
+        if (!route->id) {
+            if (src_fd < 0)
+                continue;
+
+            route->id = relay_thread_add(src_fd, dst_fd, flags, host->relay_tx[i].queue, protocol_queue,
+                                         miss_func, host);
+            if (!route->id)
+                error("Unable to hand input host %s channel to relay thread", host->dst_address);
+            route->src_fd = src_fd;
+            route->dst_fd = dst_fd;
+            continue;
+        }
+
+        if (route->dst_fd != dst_fd) {
+            relay_thread_set_dst(route->id, dst_fd);
+            route->dst_fd = dst_fd;
+        }
+    }
+}
+
+static GIOChannel *ih_route_dst(struct input_host *host, enum ih_relay_route_t route)
+{
+    switch (route) {
+    case IH_ROUTE_LOCAL_CTRL:
+        return host->ctrl_io_remote_connection;
+    case IH_ROUTE_LOCAL_INTR:
+        return host->intr_io_remote_connection;
+    case IH_ROUTE_REMOTE_CTRL:
+        return ih_local_dst(host, TRUE);
+    default:
+        return ih_local_dst(host, FALSE);
+    }
+}
+
+static bool ih_route_from_local(enum ih_relay_route_t route)
+{
+    return route == IH_ROUTE_LOCAL_CTRL || route == IH_ROUTE_LOCAL_INTR;
+}
+
+static void ih_relay_pause_source(struct ih_relay_tx *tx, bool paused)
+{
+    bool is_control = tx->route == IH_ROUTE_LOCAL_CTRL || tx->route == IH_ROUTE_REMOTE_CTRL;
+
+    if (tx->source_paused == paused)
+        return;
+
+    tx->source_paused = paused;
+
+    if (ih_route_from_local(tx->route)) {
+        ih_local_channel_set_paused(tx->host, is_control, paused);
+        //routed hosts are fed by the router channel instead
+        ih_router_update_paused(is_control);
+    } else
+        ih_remote_channel_set_paused(tx->host, is_control, paused);
+}
+
+static gboolean ih_relay_tx_cb(GIOChannel *chan, GIOCondition cond, gpointer user_data)
+{
+    struct ih_relay_tx *tx = user_data;
+    int err;
+
+    if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+        goto done;
+
+    err = relay_queue_flush(tx->queue, g_io_channel_unix_get_fd(chan), &tx->host->latency);
+    if (err < 0) {
+        error("%s socket write error: %s (%d)", ih_route_from_local(tx->route) ? "BT" : "local",
+              strerror(-err), -err);
+        goto done;
+    }
+
+    if (relay_queue_pending(tx->queue))
+        return TRUE;
+
+done:
+    //the destination is gone or caught up - anything left is dropped
+    tx->watch = 0;
+    ih_relay_tx_reset(tx->host, tx->route);
+    return FALSE;
+}
+
+/* Forwards a batch along route, queueing what the destination cannot take
+ * right now and flushing it once the destination is writable again.
+ */
+bool ih_relay_send_batch(struct input_host *host, enum ih_relay_route_t route, struct relay_batch *batch)
+{
+    struct ih_relay_tx *tx = &host->relay_tx[route];
+    struct relay_stats *stats = ih_route_stats(host, route);
+    const char *side = ih_route_from_local(route) ? "BT" : "local";
+    GIOChannel *chan = ih_route_dst(host, route);
+    int pending;
+
+    //set up on request of the host's own local connection only
+    if (!ih_route_from_local(route) && host->shm)
+        return ih_send_batch_to_local_shm(host, route == IH_ROUTE_REMOTE_CTRL, batch);
+
+    if (!chan) {
+        error("%s socket not connected", side);
+        stats->dropped += batch->count;
+        return false;
+    }
+
+    pending = relay_queue_send_batch(tx->queue, g_io_channel_unix_get_fd(chan), batch, stats, &host->latency);
+    if (pending < 0) {
+        error("%s socket write error: %s (%d)", side, strerror(-pending), -pending);
+        return false;
+    }
+
+    if (pending == 0)
+        return true;
+
+    if (!tx->watch)
+        tx->watch = g_io_add_watch(chan, G_IO_OUT | G_IO_ERR | G_IO_HUP | G_IO_NVAL, ih_relay_tx_cb, tx);
+
+    if (relay_queue_blocked(tx->queue))
+        ih_relay_pause_source(tx, true);
+
+    return true;
+}
+
+/* Holds a batch for a BT channel that is still connecting, it is replayed
+ * by ih_relay_tx_kick() once the channel is up.
+ */
+void ih_relay_buffer_batch(struct input_host *host, enum ih_relay_route_t route, struct relay_batch *batch)
+{
+    struct ih_relay_tx *tx = &host->relay_tx[route];
+    struct relay_stats *stats = ih_route_stats(host, route);
+    unsigned int i;
+
+    for (i = 0; i < batch->count; i++) {
+        const uint8_t *data;
+        size_t size;
+        int ret;
+
+        data = relay_batch_packet(batch, i, &size);
+        ret = relay_queue_push(tx->queue, data, size, batch->rx_time);
+        stats->dropped += ret < 0 ? 1 : ret;
+    }
+
+    if (relay_queue_blocked(tx->queue))
+        ih_relay_pause_source(tx, true);
+}
+
+/* Starts flushing what was buffered for route while its destination was
+ * down. Routes run by the relay thread are flushed by the thread itself.
+ */
+void ih_relay_tx_kick(struct input_host *host, enum ih_relay_route_t route)
+{
+    struct ih_relay_tx *tx = &host->relay_tx[route];
+    struct relay_stats *stats = ih_route_stats(host, route);
+    GIOChannel *chan = ih_route_dst(host, route);
+    unsigned int expired;
+
+    if (host->relay_routes[route].id || !chan)
+        return;
+
+    expired = relay_queue_expire(tx->queue, relay_now());
+    if (expired) {
+        DBG("Dropping %u stale reports", expired);
+        stats->dropped += expired;
+    }
+
+    if (!relay_queue_pending(tx->queue)) {
+        ih_relay_pause_source(tx, false);
+        return;
+    }
+
+    DBG("Replaying %u reports", relay_queue_pending(tx->queue));
+
+    if (!tx->watch)
+        tx->watch = g_io_add_watch(chan, G_IO_OUT | G_IO_ERR | G_IO_HUP | G_IO_NVAL, ih_relay_tx_cb, tx);
+}
+
+/* Drops whatever is queued for route, e.g. because its destination closed */
+void ih_relay_tx_reset(struct input_host *host, enum ih_relay_route_t route)
+{
+    struct ih_relay_tx *tx = &host->relay_tx[route];
+
+    if (tx->watch > 0)
+        g_source_remove(tx->watch);
+    tx->watch = 0;
+
+    /* The relay thread drops the queue itself when the route changes, and
+     * may still be doing so for a route just removed.
+     */
+    if (relay_thread_enabled())
+        return;
+
+    if (relay_queue_pending(tx->queue)) {
+        DBG("Dropping %u queued reports", relay_queue_pending(tx->queue));
+        if (ih_route_from_local(route))
+            host->local_relay_stats.dropped += relay_queue_pending(tx->queue);
+        else
+            host->remote_relay_stats.dropped += relay_queue_pending(tx->queue);
+    }
+
+    relay_queue_reset(tx->queue);
+    ih_relay_pause_source(tx, false);
+}
+
 int input_host_set_channel(const bdaddr_t *src, const bdaddr_t *dst, int psm, GIOChannel *io) {
     struct input_host *host = find_host(src, dst, TRUE);
     if (host == NULL)
         return -ENOENT;
 
-    GIOCondition cond = G_IO_IN | G_IO_PRI | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+    GIOCondition cond = ih_data_watch_cond();
 
     switch (psm) {
         case L2CAP_PSM_HIDP_CTRL:
             if (host->ctrl_io_remote_connection)
                 return -EALREADY;
             host->ctrl_io_remote_connection = g_io_channel_ref(io);
+            ih_set_remote_power(io);
             host->ctrl_io_remote_connection_watch = g_io_add_watch(host->ctrl_io_remote_connection, cond,
                                                                    ih_remote_control_watch_cb, host);
             break;
@@ -141,6 +571,7 @@ int input_host_set_channel(const bdaddr_t *src, const bdaddr_t *dst, int psm, GI
             if (host->intr_io_remote_connection)
                 return -EALREADY;
             host->intr_io_remote_connection = g_io_channel_ref(io);
+            ih_set_remote_power(io);
             host->intr_io_remote_connection_watch = g_io_add_watch(host->intr_io_remote_connection, cond,
                                                                    ih_remote_interrupt_watch_cb, host);
 
@@ -156,12 +587,60 @@ int input_host_set_channel(const bdaddr_t *src, const bdaddr_t *dst, int psm, GI
             break;
     }
 
+    ih_relay_thread_sync(host);
+
     if(host->ctrl_io_remote_connection!= NULL && host->intr_io_remote_connection!=NULL){
         register_socket_and_dbus_interface(host);
+        ih_relay_tx_kick(host, IH_ROUTE_LOCAL_CTRL);
+        ih_relay_tx_kick(host, IH_ROUTE_LOCAL_INTR);
     }
     return 0;
 }
 
+static GIOChannel *ih_connect_remote(struct input_host *host, bool is_control, GError **err)
+{
+    return bt_io_connect(is_control ? ih_remote_control_reconnect_cb : ih_remote_interrupt_reconnect_cb, host,
+                         NULL, err,
+                         BT_IO_OPT_SOURCE_BDADDR, &host->src,
+                         BT_IO_OPT_DEST_BDADDR, &host->dst,
+                         BT_IO_OPT_PSM, is_control ? L2CAP_PSM_HIDP_CTRL : L2CAP_PSM_HIDP_INTR,
+                         BT_IO_OPT_SEC_LEVEL, BT_IO_SEC_MEDIUM,
+                         BT_IO_OPT_INVALID);
+}
+
+/* Reports always wake the link from sniff mode unless StayInSniff is set,
+ * an idle link is left for the controller to park in sniff.
+ */
+static void ih_set_remote_power(GIOChannel *chan)
+{
+    struct bt_power power;
+
+    memset(&power, 0, sizeof(power));
+    power.force_active = stay_in_sniff ? BT_POWER_FORCE_ACTIVE_OFF : BT_POWER_FORCE_ACTIVE_ON;
+
+    if (setsockopt(g_io_channel_unix_get_fd(chan), SOL_BLUETOOTH, BT_POWER, &power, sizeof(power)) < 0)
+        error("Unable to set BT_POWER: %s (%d)", strerror(errno), errno);
+}
+
+static void ih_reconnect_complete(struct input_host *host)
+{
+    host->reconnect_time = (g_get_monotonic_time() - host->reconnect_start) / 1000;
+    DBG("Input host %s reconnected in %u ms", host->dst_address, host->reconnect_time);
+
+    if (host->dbus_interface_registered)
+        g_dbus_emit_property_changed(btd_get_dbus_connection(), host->path, INPUT_HOST_INTERFACE,
+                                     "ReconnectTime");
+
+    ih_relay_tx_kick(host, IH_ROUTE_LOCAL_CTRL);
+    ih_relay_tx_kick(host, IH_ROUTE_LOCAL_INTR);
+}
+
+/*
+ * Opens the HID control and interrupt channels concurrently so that their
+ * L2CAP setup overlaps. Hosts insisting on the control channel coming up
+ * first reject the early interrupt channel, it is then retried once the
+ * control channel is connected.
+ */
 int input_host_reconnect(struct input_host *host)
 {
     GError *err = NULL;
@@ -183,65 +662,93 @@ int input_host_reconnect(struct input_host *host)
         return -EALREADY; //already reconnecting
 
     host->reconnect_attempt_start = g_get_real_time();
+    host->reconnect_start = g_get_monotonic_time();
+    host->reconnect_intr_retried = false;
 
-    io = bt_io_connect(ih_remote_control_reconnect_cb, host,
-                       NULL, &err,
-                       BT_IO_OPT_SOURCE_BDADDR, &host->src,
-                       BT_IO_OPT_DEST_BDADDR, &host->dst,
-                       BT_IO_OPT_PSM, L2CAP_PSM_HIDP_CTRL,
-                       BT_IO_OPT_SEC_LEVEL, BT_IO_SEC_MEDIUM,
-                       BT_IO_OPT_INVALID);
+    io = ih_connect_remote(host, TRUE, &err);
     host->ctrl_io_remote_connection = io;
 
-    if (err == NULL)
-        return 0;
+    if (err != NULL) {
+        error("%s", err->message);
+        g_error_free(err);
+        return -EIO;
+    }
+
+    host->intr_io_remote_connection = ih_connect_remote(host, FALSE, &err);
+    if (err != NULL) {
+        DBG("Deferring interrupt channel: %s", err->message);
+        g_clear_error(&err);
+    }
 
-    error("%s", err->message);
-    g_error_free(err);
-    return -EIO;
+    return 0;
 }
 
 static void ih_remote_control_reconnect_cb(GIOChannel *chan, GError *conn_err, gpointer user_data)
 {
     struct input_host *host = user_data;
-    GIOCondition cond = G_IO_IN | G_IO_PRI | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
-    GIOChannel *io;
+    GIOCondition cond = ih_data_watch_cond();
     GError *err = NULL;
 
+    //the attempt was abandoned meanwhile
+    if (chan != host->ctrl_io_remote_connection)
+        return;
+
     if (conn_err) {
         error("%s", conn_err->message);
         ih_shutdown_remote_connections(host);
         return;
     }
 
-    /* Connect to the HID interrupt channel */
-    io = bt_io_connect(ih_remote_interrupt_reconnect_cb, host,
-                       NULL, &err,
-                       BT_IO_OPT_SOURCE_BDADDR, &host->src,
-                       BT_IO_OPT_DEST_BDADDR, &host->dst,
-                       BT_IO_OPT_PSM, L2CAP_PSM_HIDP_INTR,
-                       BT_IO_OPT_SEC_LEVEL, BT_IO_SEC_MEDIUM,
-                       BT_IO_OPT_INVALID);
-    if (!io) {
-        error("%s", err->message);
-        g_error_free(err);
-        ih_shutdown_remote_connections(host);
-        return;
+    ih_set_remote_power(chan);
+    host->ctrl_io_remote_connection_watch = g_io_add_watch(host->ctrl_io_remote_connection, cond, ih_remote_control_watch_cb, host);
+
+    /* Connect to the HID interrupt channel if it was deferred or refused */
+    if (!host->intr_io_remote_connection) {
+        host->intr_io_remote_connection = ih_connect_remote(host, FALSE, &err);
+        if (!host->intr_io_remote_connection) {
+            error("%s", err->message);
+            g_error_free(err);
+            ih_shutdown_remote_connections(host);
+            return;
+        }
     }
 
-    host->intr_io_remote_connection = io;
+    ih_relay_thread_sync(host);
 
-    host->ctrl_io_remote_connection_watch = g_io_add_watch(host->ctrl_io_remote_connection, cond, ih_remote_control_watch_cb, host);
+    if (host->intr_io_remote_connection_watch)
+        ih_reconnect_complete(host);
 }
 
 static void ih_remote_interrupt_reconnect_cb(GIOChannel *chan, GError *conn_err, gpointer user_data)
 {
     struct input_host *host = user_data;
-    GIOCondition cond = G_IO_IN | G_IO_PRI | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
-    int err;
+    GIOCondition cond = ih_data_watch_cond();
+    GError *err = NULL;
+
+    if (chan != host->intr_io_remote_connection)
+        return;
+
+    if (conn_err && host->ctrl_io_remote_connection && !host->reconnect_intr_retried) {
+        DBG("Concurrent interrupt channel refused (%s), retrying after control", conn_err->message);
+        host->reconnect_intr_retried = true;
+        host->intr_io_remote_connection = NULL;
+        g_io_channel_shutdown(chan, TRUE, NULL);
+        g_io_channel_unref(chan);
+
+        //control is already up - its callback will not come again
+        if (host->ctrl_io_remote_connection_watch) {
+            host->intr_io_remote_connection = ih_connect_remote(host, FALSE, &err);
+            if (!host->intr_io_remote_connection) {
+                error("%s", err->message);
+                g_error_free(err);
+                ih_shutdown_remote_connections(host);
+            }
+        }
+        return;
+    }
 
     if (conn_err) {
-        err = -EIO;
+        error("%s", conn_err->message);
         ih_shutdown_remote_connections(host);
         return;
     }
@@ -251,8 +758,43 @@ static void ih_remote_interrupt_reconnect_cb(GIOChannel *chan, GError *conn_err,
         return;
     }
 
+    ih_set_remote_power(chan);
     host->intr_io_remote_connection_watch = g_io_add_watch(host->intr_io_remote_connection, cond,
                                                            ih_remote_interrupt_watch_cb, host);
+    ih_relay_thread_sync(host);
+
+    if (host->ctrl_io_remote_connection_watch)
+        ih_reconnect_complete(host);
+}
+
+/* Keeps an attached host warm: while the local side is connected and the
+ * BT link is down, reconnect instead of waiting for the next report.
+ */
+static gboolean ih_keep_alive_cb(gpointer user_data)
+{
+    struct input_host *host = user_data;
+
+    if (!host->ctrl_io_remote_connection) {
+        DBG("Keep-alive reconnect of input host %s", host->dst_address);
+        input_host_reconnect(host);
+    }
+
+    return TRUE;
+}
+
+void ih_keep_alive_start(struct input_host *host)
+{
+    if (!keep_alive_interval || host->keep_alive_timer)
+        return;
+
+    host->keep_alive_timer = g_timeout_add_seconds(keep_alive_interval, ih_keep_alive_cb, host);
+}
+
+void ih_keep_alive_stop(struct input_host *host)
+{
+    if (host->keep_alive_timer > 0)
+        g_source_remove(host->keep_alive_timer);
+    host->keep_alive_timer = 0;
 }
 
 
@@ -267,6 +809,15 @@ void ih_shutdown_channels(struct input_host *host){
     ih_shutdown_local_listeners(host);
 }
 
+static void ih_free_relay_queues(void *user_data)
+{
+    struct relay_queue **queues = user_data;
+
+    for (int i = 0; i < IH_ROUTE_COUNT; i++)
+        relay_queue_free(queues[i]);
+    g_free(queues);
+}
+
 //since we are not getting device remove notification, remove host when connection attempt unsuccessful
 int input_host_remove(const bdaddr_t *src, const bdaddr_t *dst)
 {
@@ -281,6 +832,17 @@ int input_host_remove(const bdaddr_t *src, const bdaddr_t *dst)
     g_free(host->path);
     if(host->socket_path_ctrl != NULL) g_free(host->socket_path_ctrl);
     if(host->socket_path_intr!=NULL) g_free(host->socket_path_intr);
+    struct relay_queue **queues = g_new0(struct relay_queue *, IH_ROUTE_COUNT);
+    for (int i = 0; i < IH_ROUTE_COUNT; i++) {
+        //the queue belongs to the relay thread as long as its route exists
+        if (host->relay_routes[i].id)
+            relay_thread_remove(host->relay_routes[i].id, NULL, NULL);
+        host->relay_routes[i].id = 0;
+        ih_relay_tx_reset(host, i);
+        queues[i] = host->relay_tx[i].queue;
+    }
+    //freed once the thread let go of the removed routes
+    relay_thread_barrier(ih_free_relay_queues, queues);
 
     hosts = g_slist_remove(hosts, host);
     g_free(host);
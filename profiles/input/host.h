@@ -17,6 +17,9 @@
 #include "src/shared/uhid.h"
 #include <unistd.h>
 #include "hidp_defs.h"
+#include "relay.h"
+#include "relay_thread.h"
+#include "relay_shm.h"
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
@@ -24,6 +27,30 @@
 #define L2CAP_PSM_HIDP_CTRL	0x11
 #define L2CAP_PSM_HIDP_INTR	0x13
 
+/* Data plane routes handed to the relay thread when it is enabled */
+enum ih_relay_route_t {
+    IH_ROUTE_LOCAL_CTRL = 0,
+    IH_ROUTE_LOCAL_INTR,
+    IH_ROUTE_REMOTE_CTRL,
+    IH_ROUTE_REMOTE_INTR,
+    IH_ROUTE_COUNT
+};
+
+struct ih_relay_route {
+    unsigned int    id;
+    int             src_fd;
+    int             dst_fd;
+};
+
+/* Reports of a route waiting for its destination to become writable */
+struct ih_relay_tx {
+    struct input_host   *host;
+    enum ih_relay_route_t route;
+    struct relay_queue  *queue;
+    guint               watch;
+    bool                source_paused;
+};
+
 struct input_host{
     struct btd_device	*device;
     char			*path;
@@ -45,7 +72,18 @@ struct input_host{
     guint           intr_io_local_listener_watch;
     GIOChannel      *intr_io_local_connection;
     guint           intr_io_local_connection_watch;
+    struct relay_shm    *shm;
+    guint           shm_watch;
     gint64			reconnect_attempt_start;
+    gint64			reconnect_start;
+    bool            reconnect_intr_retried;
+    uint32_t        reconnect_time;
+    guint           keep_alive_timer;
+    struct relay_stats  local_relay_stats;
+    struct relay_stats  remote_relay_stats;
+    struct relay_latency latency;
+    struct ih_relay_route relay_routes[IH_ROUTE_COUNT];
+    struct ih_relay_tx  relay_tx[IH_ROUTE_COUNT];
 
 
 /*
@@ -66,5 +104,15 @@ int input_host_set_channel(const bdaddr_t *src, const bdaddr_t *dst, int psm, GI
 int input_host_remove(const bdaddr_t *src, const bdaddr_t *dst);
 void ih_shutdown_channels(struct input_host *host);
 int input_host_reconnect(struct input_host *host);
+void input_host_foreach(GFunc func, gpointer user_data);
+GIOCondition ih_data_watch_cond(void);
+void ih_relay_thread_sync(struct input_host *host);
+void ih_relay_thread_collect(struct input_host *host);
+bool ih_relay_send_batch(struct input_host *host, enum ih_relay_route_t route, struct relay_batch *batch);
+void ih_relay_buffer_batch(struct input_host *host, enum ih_relay_route_t route, struct relay_batch *batch);
+void ih_relay_tx_kick(struct input_host *host, enum ih_relay_route_t route);
+void ih_relay_tx_reset(struct input_host *host, enum ih_relay_route_t route);
+void ih_keep_alive_start(struct input_host *host);
+void ih_keep_alive_stop(struct input_host *host);
 
 #endif //BLUEZ_INPUT_HOST_H
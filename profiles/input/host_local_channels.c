@@ -3,6 +3,13 @@
 //
 
 #include "host_local_channels.h"
+
+static bool shared_memory_relay = false;
+
+void input_host_set_shared_memory_relay(bool enabled)
+{
+    shared_memory_relay = enabled;
+}
 static gboolean ih_local_control_watch_cb(GIOChannel *io, GIOCondition cond,
                                        gpointer user_data);
 
@@ -110,7 +117,7 @@ static gboolean ih_local_channel_connect(GIOChannel *io, GIOCondition triggered_
     g_io_channel_set_close_on_unref(cli_io, TRUE);
     g_io_channel_set_flags(cli_io, G_IO_FLAG_NONBLOCK, NULL);
 
-    GIOCondition cond = G_IO_IN | G_IO_PRI | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+    GIOCondition cond = ih_data_watch_cond();
 
     if(is_control){
         host->ctrl_io_local_connection = cli_io;
@@ -124,6 +131,11 @@ static gboolean ih_local_channel_connect(GIOChannel *io, GIOCondition triggered_
                                                               ih_local_interrupt_watch_cb, host);
         DBG("local input host intr channel connected");
     }
+    //the host's own client takes over from the router
+    ih_relay_tx_reset(host, IH_ROUTE_LOCAL_CTRL);
+    ih_relay_tx_reset(host, IH_ROUTE_LOCAL_INTR);
+    ih_relay_thread_sync(host);
+    ih_keep_alive_start(host);
     return TRUE;
 }
 
@@ -156,64 +168,174 @@ static gboolean ih_local_channel_watch_cb(GIOChannel *io, GIOCondition cond,
 }
 
 
-static bool ih_receive_data_from_local(GIOChannel *chan, struct input_host *host,  bool is_control)
+/* While paused only disconnection is watched for, reports stay queued in
+ * the local socket until the BT side has caught up.
+ */
+void ih_local_channel_set_paused(struct input_host *host, bool is_control, bool paused)
 {
-    int fd;
-    ssize_t len;
-    uint8_t data[UHID_DATA_MAX + 1];
+    GIOChannel *chan = is_control ? host->ctrl_io_local_connection : host->intr_io_local_connection;
+    guint *watch = is_control ? &host->ctrl_io_local_connection_watch : &host->intr_io_local_connection_watch;
+    GIOCondition cond = paused ? G_IO_HUP | G_IO_ERR | G_IO_NVAL : ih_data_watch_cond();
 
-    fd = g_io_channel_unix_get_fd(chan);
+    if (!chan || *watch == 0)
+        return;
 
-    len = read(fd, data, sizeof(data));
-    if (len < 0) {
-        error("local socket read error: %s (%d)", strerror(errno), errno);
-        return FALSE;
-    }
+    g_source_remove(*watch);
+    *watch = g_io_add_watch(chan, cond, is_control ? ih_local_control_watch_cb : ih_local_interrupt_watch_cb, host);
+}
+
+struct ih_local_relay {
+    struct input_host *host;
+    bool is_control;
+};
+
+static void ih_local_shm_close(struct input_host *host)
+{
+    if (host->shm_watch > 0)
+        g_source_remove(host->shm_watch);
+    host->shm_watch = 0;
+
+    relay_shm_free(host->shm);
+    host->shm = NULL;
+}
+
+static bool ih_forward_local_batch(struct relay_batch *batch, void *user_data);
+
+static void ih_forward_local_shm_batch(struct relay_batch *batch, bool is_control, void *user_data)
+{
+    struct ih_local_relay relay = { user_data, is_control };
 
-    if (len == 0) {
-        DBG("local socket read returned 0 bytes");
+    ih_forward_local_batch(batch, &relay);
+}
+
+static gboolean ih_local_shm_cb(GIOChannel *chan, GIOCondition cond, gpointer user_data)
+{
+    struct input_host *host = user_data;
+    int count;
+
+    if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+        goto failed;
+
+    count = relay_shm_drain(host->shm, &host->local_relay_stats, ih_forward_local_shm_batch, host);
+    if (count >= 0)
         return TRUE;
+
+    error("Input host %s shared memory ring corrupted, falling back to sockets", host->dst_address);
+
+failed:
+    host->shm_watch = 0;
+    ih_local_shm_close(host);
+    return FALSE;
+}
+
+/* Answers a client asking to move reports to a shared memory ring */
+static void ih_local_shm_setup(struct input_host *host)
+{
+    GIOChannel *io;
+    int status = 0;
+
+    //the relay thread only knows about sockets
+    if (!shared_memory_relay || relay_thread_enabled())
+        status = EOPNOTSUPP;
+    else if (!host->shm) {
+        host->shm = relay_shm_new();
+        if (!host->shm)
+            status = ENOMEM;
+    }
+
+    if (relay_shm_reply(g_io_channel_unix_get_fd(host->ctrl_io_local_connection), host->shm, status) < 0 ||
+            status) {
+        DBG("Shared memory relay refused for input host %s (%d)", host->dst_address, status);
+        return;
     }
 
-    GIOChannel *rchan = is_control ? host->ctrl_io_remote_connection : host->intr_io_remote_connection;
-    if (!rchan) {
-        DBG("BT socket not connected. Trying to re-connect with input host");
+    if (host->shm_watch)
+        return;
+
+    io = g_io_channel_unix_new(relay_shm_get_fd(host->shm));
+    host->shm_watch = g_io_add_watch(io, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL, ih_local_shm_cb, host);
+    g_io_channel_unref(io);
+
+    DBG("Input host %s relaying through shared memory", host->dst_address);
+}
+
+bool ih_send_batch_to_local_shm(struct input_host *host, bool is_control, struct relay_batch *batch)
+{
+    int sent;
+
+    sent = relay_shm_send_batch(host->shm, is_control, batch);
+    if (sent < 0)
+        sent = 0;
+
+    relay_latency_record(&host->latency, batch->rx_time, sent);
+
+    if ((unsigned int) sent < batch->count) {
+        error("shared memory ring of host full, dropping %u reports", batch->count - sent);
+        host->remote_relay_stats.dropped += batch->count - sent;
+        return false;
+    }
+
+    return true;
+}
+
+static bool ih_forward_local_batch(struct relay_batch *batch, void *user_data)
+{
+    struct ih_local_relay *relay = user_data;
+    struct input_host *host = relay->host;
+    enum ih_relay_route_t route = relay->is_control ? IH_ROUTE_LOCAL_CTRL : IH_ROUTE_LOCAL_INTR;
+
+    if (relay->is_control && relay_shm_take_request(batch)) {
+        ih_local_shm_setup(host);
+        if (!batch->count)
+            return true;
+    }
+
+    if (!ih_remote_channel_connected(host, relay->is_control)) {
+        //hold the reports until the channel is back instead of losing the one that woke us up
+        if (!host->ctrl_io_remote_connection)
+            DBG("BT socket not connected. Trying to re-connect with input host");
+        ih_relay_buffer_batch(host, route, batch);
         input_host_reconnect(host);
-        return TRUE;
+    } else {
+        //send data  remote
+        ih_relay_send_batch(host, route, batch);
     }
-    //send data  remote
-    ih_send_data_to_remote(rchan, data, len);
+
+    //a blocked queue leaves the rest in the local socket
+    return !host->relay_tx[route].source_paused;
+}
+
+static bool ih_receive_data_from_local(GIOChannel *chan, struct input_host *host,  bool is_control)
+{
+    struct ih_local_relay relay = { host, is_control };
+    int count;
+
+    count = relay_drain(g_io_channel_unix_get_fd(chan), &host->local_relay_stats, ih_forward_local_batch, &relay);
+    if (count < 0) {
+        error("local socket read error: %s (%d)", strerror(-count), -count);
+        return FALSE;
+    }
+
     return TRUE;
 }
 
 bool ih_send_data_to_local(GIOChannel *chan, const uint8_t *data, size_t size)
 {
-    int fd;
-    ssize_t len;
-    uint8_t msg[size];
+    int err;
 
     if (!chan) {
         error("local socket not connected for host");
         return false;
     }
 
-    if (data == NULL)
-        size = 0;
-
-    if (size > 0)
-        memcpy(&msg[0], data, size);
-
-    fd = g_io_channel_unix_get_fd(chan);
-
-    len = write(fd, msg, size);
-    if (len < 0) {
-        error("local socket for host write error: %s (%d)", strerror(errno), errno);
+    err = relay_send(g_io_channel_unix_get_fd(chan), data, size);
+    if (err == -EMSGSIZE) {
+        error("local socket for host write error: partial write of %zu bytes", size);
         return false;
     }
 
-    if ((size_t) len < size) {
-        error("local socket for host write error: partial write (%zd of %zu bytes)",
-              len, size);
+    if (err < 0) {
+        error("local socket for host write error: %s (%d)", strerror(-err), -err);
         return false;
     }
 
@@ -221,10 +343,29 @@ bool ih_send_data_to_local(GIOChannel *chan, const uint8_t *data, size_t size)
 }
 
 void ih_shutdown_local_connections(struct input_host *host) {
-    if (host->intr_io_local_connection) {
-        g_io_channel_shutdown(host->intr_io_local_connection, TRUE, NULL);
-        g_io_channel_unref(host->intr_io_local_connection);
-        host->intr_io_local_connection = NULL;
+    ih_relay_thread_collect(host);
+    if (host->local_relay_stats.batches)
+        DBG("Input host %s local relay: %" PRIu64 " reports in %" PRIu64 " batches (avg %.2f, max %u), %" PRIu64 " dropped, %" PRIu64 " merged",
+            host->dst_address, host->local_relay_stats.reports, host->local_relay_stats.batches,
+            relay_stats_avg_batch(&host->local_relay_stats), host->local_relay_stats.max_batch,
+            host->local_relay_stats.dropped, host->local_relay_stats.merged);
+
+    ih_keep_alive_stop(host);
+    ih_local_shm_close(host);
+
+    GIOChannel *intr = host->intr_io_local_connection;
+    GIOChannel *ctrl = host->ctrl_io_local_connection;
+
+    //take the channels off the relay thread before their fds are closed
+    host->intr_io_local_connection = NULL;
+    host->ctrl_io_local_connection = NULL;
+    ih_relay_thread_sync(host);
+    ih_relay_tx_reset(host, IH_ROUTE_REMOTE_CTRL);
+    ih_relay_tx_reset(host, IH_ROUTE_REMOTE_INTR);
+
+    if (intr) {
+        g_io_channel_shutdown(intr, TRUE, NULL);
+        g_io_channel_unref(intr);
     }
 
     if (host->intr_io_local_connection_watch > 0)
@@ -232,10 +373,9 @@ void ih_shutdown_local_connections(struct input_host *host) {
     host->intr_io_local_connection_watch = 0;
 
 
-    if (host->ctrl_io_local_connection) {
-        g_io_channel_shutdown(host->ctrl_io_local_connection, TRUE, NULL);
-        g_io_channel_unref(host->ctrl_io_local_connection);
-        host->ctrl_io_local_connection = NULL;
+    if (ctrl) {
+        g_io_channel_shutdown(ctrl, TRUE, NULL);
+        g_io_channel_unref(ctrl);
     }
 
     if (host->ctrl_io_local_connection_watch > 0)
@@ -8,6 +8,8 @@
 #include "host_remote_channels.h"
 
 bool ih_send_data_to_local(GIOChannel *chan, const uint8_t *data, size_t size);
+bool ih_send_batch_to_local_shm(struct input_host *host, bool is_control, struct relay_batch *batch);
+void ih_local_channel_set_paused(struct input_host *host, bool is_control, bool paused);
 GIOChannel *ih_create_local_listening_sockets(struct input_host *host, bool is_control);
 void ih_shutdown_local_connections(struct input_host *host);
 void ih_shutdown_local_listeners(struct input_host *host);
@@ -6,60 +6,58 @@
 
 bool ih_send_data_to_remote(GIOChannel *chan, const uint8_t *data, size_t size)
 {
-    int fd;
-    ssize_t len;
-    uint8_t msg[size];
+    int err;
 
     if (!chan) {
         error("BT socket not connected");
         return false;
     }
 
-    if (data == NULL)
-        size = 0;
-
-    if (size > 0)
-        memcpy(&msg[0], data, size);
-
-    fd = g_io_channel_unix_get_fd(chan);
-
-    len = write(fd, msg, size);
-    if (len < 0) {
-        error("BT socket write error: %s (%d)", strerror(errno), errno);
+    err = relay_send(g_io_channel_unix_get_fd(chan), data, size);
+    if (err == -EMSGSIZE) {
+        error("BT socket write error: partial write of %zu bytes", size);
         return false;
     }
 
-    if ((size_t) len < size) {
-        error("BT socket write error: partial write (%zd of %zu bytes)",
-              len, size);
+    if (err < 0) {
+        error("BT socket write error: %s (%d)", strerror(-err), -err);
         return false;
     }
 
     return true;
 }
 
+struct ih_remote_relay {
+    struct input_host *host;
+    bool is_control;
+};
 
-static bool ih_receive_data_from_remote(GIOChannel *chan, struct input_host *host, bool is_control)
+static bool ih_forward_remote_batch(struct relay_batch *batch, void *user_data)
 {
-    int fd;
-    ssize_t len;
-    uint8_t hdr;
-    uint8_t data[UHID_DATA_MAX + 1];
+    struct ih_remote_relay *relay = user_data;
+    struct input_host *host = relay->host;
+    enum ih_relay_route_t route = relay->is_control ? IH_ROUTE_REMOTE_CTRL : IH_ROUTE_REMOTE_INTR;
 
-    fd = g_io_channel_unix_get_fd(chan);
+    //boot reports are only merged while the PC has asked for boot protocol
+    if (relay->is_control)
+        relay_queue_track_protocol(host->relay_tx[IH_ROUTE_LOCAL_INTR].queue, batch);
 
-    len = read(fd, data, sizeof(data));
-    if (len < 0) {
-        error("BT socket read error: %s (%d)", strerror(errno), errno);
-        return false;
-    }
+    ih_relay_send_batch(host, route, batch);
 
-    if (len == 0) {
-        DBG("BT socket read returned 0 bytes");
-        return true;
-    }
+    //a blocked queue leaves the rest in the L2CAP socket
+    return !host->relay_tx[route].source_paused;
+}
 
-    ih_send_data_to_local(is_control ? host->ctrl_io_local_connection : host->intr_io_local_connection, data, len);
+static bool ih_receive_data_from_remote(GIOChannel *chan, struct input_host *host, bool is_control)
+{
+    struct ih_remote_relay relay = { host, is_control };
+    int count;
+
+    count = relay_drain(g_io_channel_unix_get_fd(chan), &host->remote_relay_stats, ih_forward_remote_batch, &relay);
+    if (count < 0) {
+        error("BT socket read error: %s (%d)", strerror(-count), -count);
+        return false;
+    }
 
     return true;
 }
@@ -90,7 +88,39 @@ gboolean ih_remote_control_watch_cb(GIOChannel *chan, GIOCondition cond, gpointe
     return ih_remote_channel_watch_cb(chan, cond, data, TRUE);
 }
 
+/* A remote channel carries data once its outgoing connection completed */
+bool ih_remote_channel_connected(struct input_host *host, bool is_control)
+{
+    if (is_control)
+        return host->ctrl_io_remote_connection && host->ctrl_io_remote_connection_watch;
+
+    return host->intr_io_remote_connection && host->intr_io_remote_connection_watch;
+}
+
+/* While paused only disconnection is watched for, reports stay queued in
+ * the L2CAP socket until the local side has caught up.
+ */
+void ih_remote_channel_set_paused(struct input_host *host, bool is_control, bool paused)
+{
+    GIOChannel *chan = is_control ? host->ctrl_io_remote_connection : host->intr_io_remote_connection;
+    guint *watch = is_control ? &host->ctrl_io_remote_connection_watch : &host->intr_io_remote_connection_watch;
+    GIOCondition cond = paused ? G_IO_HUP | G_IO_ERR | G_IO_NVAL : ih_data_watch_cond();
+
+    if (!chan || *watch == 0)
+        return;
+
+    g_source_remove(*watch);
+    *watch = g_io_add_watch(chan, cond, is_control ? ih_remote_control_watch_cb : ih_remote_interrupt_watch_cb, host);
+}
+
 void ih_shutdown_remote_connections(struct input_host *host) {
+    ih_relay_thread_collect(host);
+    if (host->remote_relay_stats.batches)
+        DBG("Input host %s BT relay: %" PRIu64 " reports in %" PRIu64 " batches (avg %.2f, max %u), %" PRIu64 " dropped",
+            host->dst_address, host->remote_relay_stats.reports, host->remote_relay_stats.batches,
+            relay_stats_avg_batch(&host->remote_relay_stats), host->remote_relay_stats.max_batch,
+            host->remote_relay_stats.dropped);
+
     if (host->ctrl_io_remote_connection_watch > 0)
         g_source_remove(host->ctrl_io_remote_connection_watch);
     host->ctrl_io_remote_connection_watch = 0;
@@ -99,15 +129,25 @@ void ih_shutdown_remote_connections(struct input_host *host) {
         g_source_remove(host->intr_io_remote_connection_watch);
     host->intr_io_remote_connection_watch = 0;
 
-    if (host->intr_io_remote_connection) {
-        g_io_channel_shutdown(host->intr_io_remote_connection, TRUE, NULL);
-        g_io_channel_unref(host->intr_io_remote_connection);
-        host->intr_io_remote_connection = NULL;
+    GIOChannel *intr = host->intr_io_remote_connection;
+    GIOChannel *ctrl = host->ctrl_io_remote_connection;
+
+    //take the channels off the relay thread before their fds are closed
+    host->intr_io_remote_connection = NULL;
+    host->ctrl_io_remote_connection = NULL;
+    ih_relay_thread_sync(host);
+    ih_relay_tx_reset(host, IH_ROUTE_LOCAL_CTRL);
+    ih_relay_tx_reset(host, IH_ROUTE_LOCAL_INTR);
+    //a new connection starts in report protocol
+    relay_queue_set_boot_protocol(host->relay_tx[IH_ROUTE_LOCAL_INTR].queue, false);
+
+    if (intr) {
+        g_io_channel_shutdown(intr, TRUE, NULL);
+        g_io_channel_unref(intr);
     }
 
-    if (host->ctrl_io_remote_connection) {
-        g_io_channel_shutdown(host->ctrl_io_remote_connection, TRUE, NULL);
-        g_io_channel_unref(host->ctrl_io_remote_connection);
-        host->ctrl_io_remote_connection = NULL;
+    if (ctrl) {
+        g_io_channel_shutdown(ctrl, TRUE, NULL);
+        g_io_channel_unref(ctrl);
     }
 }
\ No newline at end of file
@@ -6,9 +6,12 @@
 #define BLUEZ_HOST_REMOTE_CHANNELS_H
 #include "host.h"
 #include "host_local_channels.h"
+#include "relay.h"
 gboolean ih_remote_control_watch_cb(GIOChannel *chan, GIOCondition cond, gpointer data);
 gboolean ih_remote_interrupt_watch_cb(GIOChannel *chan, GIOCondition cond, gpointer data);
 bool ih_send_data_to_remote(GIOChannel *chan, const uint8_t *data, size_t size);
+bool ih_remote_channel_connected(struct input_host *host, bool is_control);
+void ih_remote_channel_set_paused(struct input_host *host, bool is_control, bool paused);
 void ih_shutdown_remote_connections(struct input_host *host);
 
 #endif //BLUEZ_HOST_REMOTE_CHANNELS_H
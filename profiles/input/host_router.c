@@ -0,0 +1,484 @@
+//
+// Routes one local producer to several input hosts.
+//
+// An input host normally relays between the BT channels of one connected
+// PC and its own pair of local sockets. The router adds a shared pair of
+// local sockets whose reports are read once and written to every input
+// host that has no local client of its own: all of them in broadcast
+// mode, only the selected one in select mode. Reports coming back from
+// those hosts are merged into the router sockets the same way. Mode and
+// target can be changed at runtime on the InputHostRouter1 interface
+// without the producer reconnecting.
+//
+// The router is driven by the main loop, also when the relay thread runs:
+// routed hosts have no local routes of their own, so the thread never
+// shares their outgoing queues. With the block queue policy a router
+// channel is not read while the queue of any host it feeds is blocked.
+//
+
+#include "gdbus/gdbus.h"
+#include "src/dbus-common.h"
+#include "src/error.h"
+
+#include "host_router.h"
+#include "server.h"
+#include "host_local_channels.h"
+#include "host_remote_channels.h"
+
+#define INPUT_ROUTER_INTERFACE "org.bluez.InputHostRouter1"
+#define INPUT_ROUTER_PATH "/org/bluez"
+#define INPUT_ROUTER_SOCKET_CTRL "/tmp/BTIHS_Router_Ctrl"
+#define INPUT_ROUTER_SOCKET_INTR "/tmp/BTIHS_Router_Intr"
+
+struct ih_router_channel {
+    bool            is_control;
+    const char      *socket_path;
+    GIOChannel      *listener;
+    guint           listener_watch;
+    GIOChannel      *connection;
+    guint           connection_watch;
+    bool            paused;
+};
+
+struct ih_router {
+    enum ih_router_mode mode;
+    char                *target;
+    struct relay_stats  stats;
+    struct ih_router_channel ctrl;
+    struct ih_router_channel intr;
+};
+
+static struct ih_router *router;
+
+static const char *ih_router_modes[] = {
+    [IH_ROUTER_SELECT] = "select",
+    [IH_ROUTER_BROADCAST] = "broadcast",
+};
+
+static bool ih_router_parse_mode(const char *str, enum ih_router_mode *mode)
+{
+    unsigned int i;
+
+    for (i = 0; i < G_N_ELEMENTS(ih_router_modes); i++) {
+        if (!strcmp(str, ih_router_modes[i])) {
+            *mode = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* A host takes part in routing unless a client uses its own sockets */
+static bool ih_router_is_target(struct input_host *host)
+{
+    if (!router)
+        return false;
+
+    if (host->ctrl_io_local_connection || host->intr_io_local_connection)
+        return false;
+
+    if (router->mode == IH_ROUTER_BROADCAST)
+        return true;
+
+    return router->target && !g_strcmp0(host->path, router->target);
+}
+
+/* Router socket that reports from host's channel are merged into */
+GIOChannel *ih_router_local_channel(struct input_host *host, bool is_control)
+{
+    if (!ih_router_is_target(host))
+        return NULL;
+
+    return is_control ? router->ctrl.connection : router->intr.connection;
+}
+
+static void ih_router_sync_host(gpointer data, gpointer user_data)
+{
+    struct input_host *host = data;
+
+    ih_relay_thread_sync(host);
+}
+
+struct ih_router_fanout {
+    struct relay_batch  *batch;
+    bool                is_control;
+    bool                blocked;
+};
+
+static void ih_router_forward_host(gpointer data, gpointer user_data)
+{
+    struct input_host *host = data;
+    struct ih_router_fanout *fanout = user_data;
+    enum ih_relay_route_t route = fanout->is_control ? IH_ROUTE_LOCAL_CTRL : IH_ROUTE_LOCAL_INTR;
+
+    if (!ih_router_is_target(host))
+        return;
+
+    if (ih_remote_channel_connected(host, fanout->is_control)) {
+        ih_relay_send_batch(host, route, fanout->batch);
+    } else if (router->mode == IH_ROUTER_SELECT) {
+        /* Broadcast only reaches the hosts that are there, a selected
+         * host is brought back like a directly attached one.
+         */
+        ih_relay_buffer_batch(host, route, fanout->batch);
+        input_host_reconnect(host);
+    }
+
+    if (host->relay_tx[route].source_paused)
+        fanout->blocked = true;
+}
+
+static bool ih_router_forward_batch(struct relay_batch *batch, void *user_data)
+{
+    struct ih_router_channel *chan = user_data;
+    struct ih_router_fanout fanout = { batch, chan->is_control, false };
+
+    input_host_foreach(ih_router_forward_host, &fanout);
+
+    return !fanout.blocked;
+}
+
+static gboolean ih_router_watch_cb(GIOChannel *io, GIOCondition cond, gpointer user_data);
+
+static void ih_router_check_blocked(gpointer data, gpointer user_data)
+{
+    struct input_host *host = data;
+    struct ih_router_fanout *fanout = user_data;
+    enum ih_relay_route_t route = fanout->is_control ? IH_ROUTE_LOCAL_CTRL : IH_ROUTE_LOCAL_INTR;
+
+    if (ih_router_is_target(host) && host->relay_tx[route].source_paused)
+        fanout->blocked = true;
+}
+
+/* Stops reading a router channel while a host it feeds has a blocked
+ * queue, and resumes once all of them have caught up. Routed hosts have
+ * no local socket of their own to pause.
+ */
+void ih_router_update_paused(bool is_control)
+{
+    struct ih_router_fanout fanout = { NULL, is_control, false };
+    struct ih_router_channel *chan;
+    GIOCondition cond;
+
+    if (!router)
+        return;
+
+    chan = is_control ? &router->ctrl : &router->intr;
+    if (!chan->connection || !chan->connection_watch)
+        return;
+
+    input_host_foreach(ih_router_check_blocked, &fanout);
+    if (chan->paused == fanout.blocked)
+        return;
+
+    chan->paused = fanout.blocked;
+    cond = chan->paused ? G_IO_HUP | G_IO_ERR | G_IO_NVAL : G_IO_IN | G_IO_PRI | G_IO_HUP | G_IO_ERR | G_IO_NVAL;
+
+    g_source_remove(chan->connection_watch);
+    chan->connection_watch = g_io_add_watch(chan->connection, cond, ih_router_watch_cb, chan);
+}
+
+static void ih_router_shutdown_connections(void)
+{
+    GIOChannel *ctrl = router->ctrl.connection;
+    GIOChannel *intr = router->intr.connection;
+
+    if (router->stats.batches)
+        DBG("Input host router: %" PRIu64 " reports in %" PRIu64 " batches (avg %.2f, max %u)",
+            router->stats.reports, router->stats.batches,
+            relay_stats_avg_batch(&router->stats), router->stats.max_batch);
+
+    if (router->ctrl.connection_watch > 0)
+        g_source_remove(router->ctrl.connection_watch);
+    router->ctrl.connection_watch = 0;
+
+    if (router->intr.connection_watch > 0)
+        g_source_remove(router->intr.connection_watch);
+    router->intr.connection_watch = 0;
+
+    //take the sockets off the relay thread before they are closed
+    router->ctrl.connection = NULL;
+    router->intr.connection = NULL;
+    router->ctrl.paused = false;
+    router->intr.paused = false;
+    input_host_foreach(ih_router_sync_host, NULL);
+
+    if (intr) {
+        g_io_channel_shutdown(intr, TRUE, NULL);
+        g_io_channel_unref(intr);
+    }
+
+    if (ctrl) {
+        g_io_channel_shutdown(ctrl, TRUE, NULL);
+        g_io_channel_unref(ctrl);
+    }
+}
+
+static gboolean ih_router_watch_cb(GIOChannel *io, GIOCondition cond, gpointer user_data)
+{
+    struct ih_router_channel *chan = user_data;
+
+    if (cond & (G_IO_IN | G_IO_PRI)) {
+        relay_drain(g_io_channel_unix_get_fd(io), &router->stats, ih_router_forward_batch, chan);
+        if (!(cond & (G_IO_HUP | G_IO_ERR | G_IO_NVAL)))
+            return TRUE;
+    }
+
+    DBG("router %s channel disconnected", chan->is_control ? "ctrl" : "intr");
+    chan->connection_watch = 0;
+    ih_router_shutdown_connections();
+    return FALSE;
+}
+
+static gboolean ih_router_connect_cb(GIOChannel *io, GIOCondition cond, gpointer user_data)
+{
+    struct ih_router_channel *chan = user_data;
+    GIOChannel *cli_io;
+    int cli_sock;
+
+    if ((cond & G_IO_NVAL) || check_nval(io))
+        return FALSE;
+
+    cli_sock = accept(g_io_channel_unix_get_fd(io), NULL, NULL);
+    if (cli_sock < 0)
+        return TRUE;
+
+    if (chan->connection) {
+        error("router %s socket already has a client", chan->is_control ? "ctrl" : "intr");
+        close(cli_sock);
+        return TRUE;
+    }
+
+    cli_io = g_io_channel_unix_new(cli_sock);
+    g_io_channel_set_close_on_unref(cli_io, TRUE);
+    g_io_channel_set_flags(cli_io, G_IO_FLAG_NONBLOCK, NULL);
+
+    chan->connection = cli_io;
+    chan->connection_watch = g_io_add_watch(cli_io, G_IO_IN | G_IO_PRI | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+                                            ih_router_watch_cb, chan);
+    DBG("router %s channel connected", chan->is_control ? "ctrl" : "intr");
+
+    input_host_foreach(ih_router_sync_host, NULL);
+    return TRUE;
+}
+
+static bool ih_router_listen(struct ih_router_channel *chan)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    sock = socket(PF_LOCAL, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        error("Unable to open router socket %s: %s", chan->socket_path, strerror(errno));
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, chan->socket_path, sizeof(addr.sun_path) - 1);
+
+    unlink(addr.sun_path);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sock, 1) < 0) {
+        error("Unable to listen on router socket %s: %s", chan->socket_path, strerror(errno));
+        close(sock);
+        return false;
+    }
+
+    if (chmod(addr.sun_path, 0666) < 0)
+        error("Failed to change mode");
+
+    chan->listener = g_io_channel_unix_new(sock);
+    g_io_channel_set_close_on_unref(chan->listener, TRUE);
+    g_io_channel_set_flags(chan->listener, G_IO_FLAG_NONBLOCK, NULL);
+    chan->listener_watch = g_io_add_watch(chan->listener, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+                                          ih_router_connect_cb, chan);
+
+    return true;
+}
+
+static void ih_router_unlisten(struct ih_router_channel *chan)
+{
+    if (chan->listener_watch > 0)
+        g_source_remove(chan->listener_watch);
+    chan->listener_watch = 0;
+
+    if (chan->listener) {
+        g_io_channel_shutdown(chan->listener, TRUE, NULL);
+        g_io_channel_unref(chan->listener);
+        chan->listener = NULL;
+        unlink(chan->socket_path);
+    }
+}
+
+static gboolean property_get_socket_path_ctrl(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    const char *path = INPUT_ROUTER_SOCKET_CTRL;
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &path);
+    return TRUE;
+}
+
+static gboolean property_get_socket_path_intr(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    const char *path = INPUT_ROUTER_SOCKET_INTR;
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &path);
+    return TRUE;
+}
+
+static gboolean property_get_mode(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    const char *mode = ih_router_modes[router->mode];
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &mode);
+    return TRUE;
+}
+
+static void property_set_mode(const GDBusPropertyTable *property, DBusMessageIter *iter,
+                              GDBusPendingPropertySet id, void *data)
+{
+    enum ih_router_mode mode;
+    const char *str;
+
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRING) {
+        g_dbus_pending_property_error(id, ERROR_INTERFACE ".InvalidArguments", "Invalid arguments in method call");
+        return;
+    }
+
+    dbus_message_iter_get_basic(iter, &str);
+
+    if (!ih_router_parse_mode(str, &mode)) {
+        g_dbus_pending_property_error(id, ERROR_INTERFACE ".InvalidArguments", "Unknown mode");
+        return;
+    }
+
+    g_dbus_pending_property_success(id);
+
+    if (mode == router->mode)
+        return;
+
+    DBG("Input host router mode %s", str);
+    router->mode = mode;
+    input_host_foreach(ih_router_sync_host, NULL);
+    ih_router_update_paused(TRUE);
+    ih_router_update_paused(FALSE);
+    g_dbus_emit_property_changed(btd_get_dbus_connection(), INPUT_ROUTER_PATH, INPUT_ROUTER_INTERFACE, "Mode");
+}
+
+static gboolean property_get_target(const GDBusPropertyTable *property, DBusMessageIter *iter, void *data)
+{
+    dbus_message_iter_append_basic(iter, DBUS_TYPE_OBJECT_PATH, &router->target);
+    return TRUE;
+}
+
+static gboolean property_target_exists(const GDBusPropertyTable *property, void *data)
+{
+    return router->target != NULL;
+}
+
+struct ih_router_lookup {
+    const char          *path;
+    struct input_host   *host;
+};
+
+static void ih_router_find_host(gpointer data, gpointer user_data)
+{
+    struct input_host *host = data;
+    struct ih_router_lookup *lookup = user_data;
+
+    if (!g_strcmp0(host->path, lookup->path))
+        lookup->host = host;
+}
+
+static void property_set_target(const GDBusPropertyTable *property, DBusMessageIter *iter,
+                                GDBusPendingPropertySet id, void *data)
+{
+    struct ih_router_lookup lookup = { NULL, NULL };
+
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_OBJECT_PATH) {
+        g_dbus_pending_property_error(id, ERROR_INTERFACE ".InvalidArguments", "Invalid arguments in method call");
+        return;
+    }
+
+    dbus_message_iter_get_basic(iter, &lookup.path);
+
+    input_host_foreach(ih_router_find_host, &lookup);
+    if (!lookup.host) {
+        g_dbus_pending_property_error(id, ERROR_INTERFACE ".DoesNotExist", "No such input host");
+        return;
+    }
+
+    g_dbus_pending_property_success(id);
+
+    if (!g_strcmp0(router->target, lookup.path))
+        return;
+
+    DBG("Input host router target %s", lookup.path);
+    g_free(router->target);
+    router->target = g_strdup(lookup.path);
+    input_host_foreach(ih_router_sync_host, NULL);
+    ih_router_update_paused(TRUE);
+    ih_router_update_paused(FALSE);
+    g_dbus_emit_property_changed(btd_get_dbus_connection(), INPUT_ROUTER_PATH, INPUT_ROUTER_INTERFACE, "Target");
+}
+
+static const GDBusPropertyTable router_properties[] = {
+        { "SocketPathCtrl", "s", property_get_socket_path_ctrl },
+        { "SocketPathIntr", "s", property_get_socket_path_intr },
+        { "Mode", "s", property_get_mode, property_set_mode },
+        { "Target", "o", property_get_target, property_set_target, property_target_exists },
+        { }
+};
+
+bool input_host_router_start(const char *mode_str)
+{
+    enum ih_router_mode mode = IH_ROUTER_SELECT;
+
+    if (router)
+        return true;
+
+    if (mode_str && !ih_router_parse_mode(mode_str, &mode)) {
+        error("Unknown input host router mode %s", mode_str);
+        return false;
+    }
+
+    router = g_new0(struct ih_router, 1);
+    router->mode = mode;
+    router->ctrl.is_control = true;
+    router->ctrl.socket_path = INPUT_ROUTER_SOCKET_CTRL;
+    router->intr.is_control = false;
+    router->intr.socket_path = INPUT_ROUTER_SOCKET_INTR;
+
+    if (!ih_router_listen(&router->ctrl) || !ih_router_listen(&router->intr))
+        goto failed;
+
+    if (!g_dbus_register_interface(btd_get_dbus_connection(), INPUT_ROUTER_PATH, INPUT_ROUTER_INTERFACE,
+                                   NULL, NULL, router_properties, NULL, NULL)) {
+        error("Unable to register %s interface", INPUT_ROUTER_INTERFACE);
+        goto failed;
+    }
+
+    DBG("Input host router started in %s mode", ih_router_modes[mode]);
+    return true;
+
+failed:
+    ih_router_unlisten(&router->ctrl);
+    ih_router_unlisten(&router->intr);
+    g_free(router);
+    router = NULL;
+    return false;
+}
+
+void input_host_router_stop(void)
+{
+    if (!router)
+        return;
+
+    g_dbus_unregister_interface(btd_get_dbus_connection(), INPUT_ROUTER_PATH, INPUT_ROUTER_INTERFACE);
+
+    ih_router_shutdown_connections();
+    ih_router_unlisten(&router->ctrl);
+    ih_router_unlisten(&router->intr);
+
+    g_free(router->target);
+    g_free(router);
+    router = NULL;
+}
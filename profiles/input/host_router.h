@@ -0,0 +1,17 @@
+//
+// Routes one local producer to several input hosts.
+//
+
+#ifndef BLUEZ_HOST_ROUTER_H
+#define BLUEZ_HOST_ROUTER_H
+#include "host.h"
+
+enum ih_router_mode {
+    IH_ROUTER_SELECT = 0,
+    IH_ROUTER_BROADCAST,
+};
+
+GIOChannel *ih_router_local_channel(struct input_host *host, bool is_control);
+void ih_router_update_paused(bool is_control);
+
+#endif //BLUEZ_HOST_ROUTER_H
@@ -42,6 +42,7 @@
 
 #include "device.h"
 #include "server.h"
+#include "relay_thread.h"
 
 #include <glib.h>
 #include <glib/gstdio.h>
@@ -121,6 +122,11 @@ static int input_init(void)
 	if (config) {
 		int idle_timeout;
 		gboolean uhid_enabled, classic_bonded_only, auto_sec, input_device_profile_enabled, capture_uhid_channels_for_devices, capture_uhid_channels_for_devices_exclusively;
+		gboolean relay_thread, merge_boot_reports, stay_in_sniff, host_router, shared_memory_relay;
+		int reconnect_replay_time, keep_alive_interval;
+		int relay_queue_size;
+		enum relay_queue_policy relay_queue_policy = RELAY_QUEUE_DROP_OLDEST;
+		int relay_thread_priority, relay_thread_cpu;
 		char* str;
 
 		idle_timeout = g_key_file_get_integer(config, "General",
@@ -214,6 +220,123 @@ static int input_init(void)
             }
         }
 
+        relay_thread = g_key_file_get_boolean(config, "General", "RelayThread", &err);
+        if (!err) {
+            DBG("input.conf: RelayThread=%s", relay_thread ? "true" : "false");
+        } else {
+            relay_thread = FALSE;
+            g_clear_error(&err);
+        }
+
+        if (relay_thread) {
+            relay_thread_priority = g_key_file_get_integer(config, "General", "RelayThreadPriority", &err);
+            if (!err) {
+                DBG("input.conf: RelayThreadPriority=%d", relay_thread_priority);
+            } else {
+                relay_thread_priority = 0;
+                g_clear_error(&err);
+            }
+
+            relay_thread_cpu = g_key_file_get_integer(config, "General", "RelayThreadCPU", &err);
+            if (!err) {
+                DBG("input.conf: RelayThreadCPU=%d", relay_thread_cpu);
+            } else {
+                relay_thread_cpu = -1;
+                g_clear_error(&err);
+            }
+
+            if (!relay_thread_start(relay_thread_priority, relay_thread_cpu))
+                error("Input relay thread disabled, relaying on the main loop");
+        }
+
+        relay_queue_size = g_key_file_get_integer(config, "General", "RelayQueueSize", &err);
+        if (!err) {
+            DBG("input.conf: RelayQueueSize=%d", relay_queue_size);
+        } else {
+            relay_queue_size = RELAY_QUEUE_DEFAULT_SIZE;
+            g_clear_error(&err);
+        }
+
+        str = g_key_file_get_string(config, "General", "RelayQueuePolicy", &err);
+        if (!err) {
+            DBG("input.conf: RelayQueuePolicy=%s", str);
+            if (!relay_queue_parse_policy(str, &relay_queue_policy))
+                error("Unknown RelayQueuePolicy %s, using %s", str,
+                        relay_queue_policy_to_str(relay_queue_policy));
+            g_free(str);
+        } else
+            g_clear_error(&err);
+
+        if (relay_queue_size < RELAY_QUEUE_MIN_SIZE || relay_queue_size > RELAY_QUEUE_MAX_SIZE) {
+            int size = relay_queue_size < RELAY_QUEUE_MIN_SIZE ? RELAY_QUEUE_MIN_SIZE : RELAY_QUEUE_MAX_SIZE;
+
+            error("Invalid RelayQueueSize %d, using %d", relay_queue_size, size);
+            relay_queue_size = size;
+        }
+
+        input_host_set_relay_queue(relay_queue_size, relay_queue_policy);
+
+        merge_boot_reports = g_key_file_get_boolean(config, "General", "MergeBootReports", &err);
+        if (!err) {
+            DBG("input.conf: MergeBootReports=%s", merge_boot_reports ? "true" : "false");
+            input_host_set_merge_boot_reports(merge_boot_reports);
+        } else
+            g_clear_error(&err);
+
+        shared_memory_relay = g_key_file_get_boolean(config, "General", "SharedMemoryRelay", &err);
+        if (!err) {
+            DBG("input.conf: SharedMemoryRelay=%s", shared_memory_relay ? "true" : "false");
+            input_host_set_shared_memory_relay(shared_memory_relay);
+            input_device_set_shared_memory_relay(shared_memory_relay);
+        } else
+            g_clear_error(&err);
+
+        reconnect_replay_time = g_key_file_get_integer(config, "General", "ReconnectReplayTime", &err);
+        if (!err) {
+            DBG("input.conf: ReconnectReplayTime=%d", reconnect_replay_time);
+        } else {
+            reconnect_replay_time = IH_RECONNECT_REPLAY_TIME;
+            g_clear_error(&err);
+        }
+
+        keep_alive_interval = g_key_file_get_integer(config, "General", "KeepAliveInterval", &err);
+        if (!err) {
+            DBG("input.conf: KeepAliveInterval=%d", keep_alive_interval);
+        } else {
+            keep_alive_interval = 0;
+            g_clear_error(&err);
+        }
+
+        stay_in_sniff = g_key_file_get_boolean(config, "General", "StayInSniff", &err);
+        if (!err) {
+            DBG("input.conf: StayInSniff=%s", stay_in_sniff ? "true" : "false");
+        } else {
+            stay_in_sniff = FALSE;
+            g_clear_error(&err);
+        }
+
+        input_host_set_reconnect_policy(MAX(reconnect_replay_time, 0), MAX(keep_alive_interval, 0), stay_in_sniff);
+
+        host_router = g_key_file_get_boolean(config, "General", "HostRouter", &err);
+        if (!err) {
+            DBG("input.conf: HostRouter=%s", host_router ? "true" : "false");
+        } else {
+            host_router = FALSE;
+            g_clear_error(&err);
+        }
+
+        if (host_router) {
+            str = g_key_file_get_string(config, "General", "HostRouterMode", &err);
+            if (!err)
+                DBG("input.conf: HostRouterMode=%s", str);
+            else
+                g_clear_error(&err);
+
+            if (!input_host_router_start(str))
+                error("Input host router disabled");
+            g_free(str);
+        }
+
     }
 
 	btd_profile_register(&input_profile);
@@ -228,6 +351,8 @@ static int input_init(void)
 static void input_exit(void)
 {
 	btd_profile_unregister(&input_profile);
+	input_host_router_stop();
+	relay_thread_stop();
 }
 
 BLUETOOTH_PLUGIN_DEFINE(input, VERSION, BLUETOOTH_PLUGIN_PRIORITY_DEFAULT,
@@ -0,0 +1,931 @@
+//
+// HID report relay engine shared by the input host and input device
+// local socket bridges.
+//
+// Both ends of the relay are packet oriented (L2CAP and SOCK_SEQPACKET),
+// so every PDU is received straight into a batch buffer and handed to
+// the destination socket from that same buffer, without staging copies.
+// Queued packets are pulled with recvmmsg() and pushed with sendmmsg(),
+// which keeps message boundaries while costing one syscall per batch.
+//
+// When the destination cannot keep up, reports that could not be written
+// are kept in a bounded per-channel queue built on src/shared/ringbuf and
+// flushed once the socket becomes writable again. A queue is only ever
+// used by the thread forwarding its channel, so it needs no locking.
+//
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "src/shared/ringbuf.h"
+
+#include "hidp_defs.h"
+#include "relay.h"
+
+struct relay_record {
+    uint16_t        len;
+    uint64_t        rx_time;
+} __attribute__ ((packed));
+
+struct relay_queue {
+    struct ringbuf  *ring;
+    enum relay_queue_policy policy;
+    bool            merge;
+    /* Set by SET_PROTOCOL seen on the control route, possibly by the
+     * relay thread, so accessed atomically.
+     */
+    bool            boot_protocol;
+    /* Reports older than this are discarded by relay_queue_expire() */
+    uint64_t        max_age;
+    unsigned int    count;
+    /* Offset of the newest record, valid while count is not zero */
+    size_t          tail;
+};
+
+static struct relay_batch relay_batch;
+
+int relay_send(int fd, const uint8_t *data, size_t size)
+{
+    ssize_t len;
+
+    if (fd < 0)
+        return -ENOTCONN;
+
+    if (data == NULL)
+        size = 0;
+
+    len = send(fd, data, size, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (len < 0)
+        return -errno;
+
+    if ((size_t) len < size)
+        return -EMSGSIZE;
+
+    return 0;
+}
+
+/*
+ * Pulls up to RELAY_BATCH_MAX queued packets from fd with one syscall.
+ * On return every iovec of the batch is trimmed to its packet length so
+ * the batch can be handed to relay_send_batch() as it is.
+ */
+int relay_recv_batch(int fd, struct relay_batch *batch)
+{
+    struct mmsghdr msgs[RELAY_BATCH_MAX];
+    unsigned int i;
+    int ret;
+
+    batch->count = 0;
+
+    memset(msgs, 0, sizeof(msgs));
+
+    for (i = 0; i < RELAY_BATCH_MAX; i++) {
+        batch->iov[i].iov_base = batch->buf[i];
+        batch->iov[i].iov_len = RELAY_MTU;
+        msgs[i].msg_hdr.msg_iov = &batch->iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    do {
+        ret = recvmmsg(fd, msgs, RELAY_BATCH_MAX, MSG_DONTWAIT, NULL);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0)
+        return -errno;
+
+    for (i = 0; i < (unsigned int) ret; i++) {
+        /* Zero length read means the peer has gone away, the watch
+         * reports the hang up separately.
+         */
+        if (msgs[i].msg_len == 0)
+            break;
+
+        batch->iov[i].iov_len = msgs[i].msg_len;
+    }
+
+    batch->count = i;
+    batch->rx_time = relay_now();
+
+    return i;
+}
+
+/*
+ * Sends the packets of batch starting at offset, preserving boundaries.
+ * Returns the number of packets written, which may be short when the
+ * socket fills up, or a negative errno if nothing could be written.
+ */
+int relay_send_batch(int fd, const struct relay_batch *batch,
+							unsigned int offset)
+{
+    struct mmsghdr msgs[RELAY_BATCH_MAX];
+    unsigned int i, sent = 0;
+
+    if (fd < 0)
+        return -ENOTCONN;
+
+    if (offset >= batch->count)
+        return 0;
+
+    memset(msgs, 0, sizeof(msgs));
+
+    for (i = offset; i < batch->count; i++) {
+        msgs[i - offset].msg_hdr.msg_iov = (struct iovec *) &batch->iov[i];
+        msgs[i - offset].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (offset + sent < batch->count) {
+        int ret;
+
+        ret = sendmmsg(fd, msgs + sent, batch->count - offset - sent,
+                                        MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return sent ? (int) sent : -errno;
+        }
+
+        if (ret == 0)
+            break;
+
+        sent += ret;
+    }
+
+    return sent;
+}
+
+const uint8_t *relay_batch_packet(const struct relay_batch *batch,
+					unsigned int index, size_t *size)
+{
+    if (index >= batch->count)
+        return NULL;
+
+    if (size)
+        *size = batch->iov[index].iov_len;
+
+    return batch->buf[index];
+}
+
+void relay_stats_add_batch(struct relay_stats *stats, unsigned int count)
+{
+    stats->batches++;
+    stats->reports += count;
+    stats->batch_sizes[count]++;
+
+    if (count > stats->max_batch)
+        stats->max_batch = count;
+}
+
+/*
+ * Reads every packet currently queued on fd, up to RELAY_DRAIN_BUDGET,
+ * and passes them to func one batch at a time until it returns false.
+ * Returns the number of packets handled or a negative errno if the very
+ * first read failed.
+ */
+int relay_drain(int fd, struct relay_stats *stats, relay_batch_func_t func,
+							void *user_data)
+{
+    int count = 0;
+
+    if (stats)
+        stats->wakeups++;
+
+    while (count < RELAY_DRAIN_BUDGET) {
+        int ret;
+
+        ret = relay_recv_batch(fd, &relay_batch);
+        if (ret < 0) {
+            if (ret == -EAGAIN || ret == -EWOULDBLOCK)
+                break;
+            return count ? count : ret;
+        }
+
+        if (ret == 0)
+            break;
+
+        if (stats)
+            relay_stats_add_batch(stats, ret);
+
+        count += ret;
+
+        /* The rest stays in the socket until the sender is resumed */
+        if (!func(&relay_batch, user_data))
+            break;
+
+        /* A short batch means the socket queue is empty */
+        if (ret < RELAY_BATCH_MAX)
+            break;
+    }
+
+    return count;
+}
+
+void relay_stats_reset(struct relay_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+/* Adds the counters of src to dst, e.g. to fold in another thread's share */
+void relay_stats_merge(struct relay_stats *dst, const struct relay_stats *src)
+{
+    unsigned int i;
+
+    dst->wakeups += src->wakeups;
+    dst->batches += src->batches;
+    dst->reports += src->reports;
+    dst->dropped += src->dropped;
+    dst->merged += src->merged;
+
+    for (i = 0; i <= RELAY_BATCH_MAX; i++)
+        dst->batch_sizes[i] += src->batch_sizes[i];
+
+    if (src->max_batch > dst->max_batch)
+        dst->max_batch = src->max_batch;
+}
+
+/*
+ * Takes the counters of src off dst, turning a running total into what was
+ * counted since src was taken. Maxima cannot be split and stay as they are.
+ */
+void relay_stats_sub(struct relay_stats *dst, const struct relay_stats *src)
+{
+    unsigned int i;
+
+    dst->wakeups -= src->wakeups;
+    dst->batches -= src->batches;
+    dst->reports -= src->reports;
+    dst->dropped -= src->dropped;
+    dst->merged -= src->merged;
+
+    for (i = 0; i <= RELAY_BATCH_MAX; i++)
+        dst->batch_sizes[i] -= src->batch_sizes[i];
+}
+
+double relay_stats_avg_batch(const struct relay_stats *stats)
+{
+    if (!stats->batches)
+        return 0;
+
+    return (double) stats->reports / stats->batches;
+}
+
+/* Microseconds on CLOCK_MONOTONIC, used to stamp report ingress/egress */
+uint64_t relay_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int relay_hist_index(uint32_t value)
+{
+    unsigned int shift;
+
+    if (value < RELAY_HIST_SUB)
+        return value;
+
+    shift = 32 - __builtin_clz(value) - RELAY_HIST_SUB_BITS - 1;
+
+    return (shift + 1) * RELAY_HIST_SUB + (value >> shift) - RELAY_HIST_SUB;
+}
+
+/* Highest value that falls into bucket index */
+static uint32_t relay_hist_value(unsigned int index)
+{
+    unsigned int shift;
+
+    if (index < RELAY_HIST_SUB)
+        return index;
+
+    shift = index / RELAY_HIST_SUB - 1;
+
+    return (((uint64_t) (index % RELAY_HIST_SUB + RELAY_HIST_SUB + 1))
+                                                        << shift) - 1;
+}
+
+/* Records count reports received at rx_time that have just left */
+void relay_latency_record(struct relay_latency *lat, uint64_t rx_time,
+							unsigned int count)
+{
+    uint64_t delta = relay_now() - rx_time;
+    uint32_t value = delta > UINT32_MAX ? UINT32_MAX : delta;
+
+    if (!count)
+        return;
+
+    lat->count += count;
+    lat->sum += (uint64_t) value * count;
+    lat->buckets[relay_hist_index(value)] += count;
+
+    if (value > lat->max)
+        lat->max = value;
+}
+
+uint32_t relay_latency_percentile(const struct relay_latency *lat,
+							unsigned int pct)
+{
+    uint64_t target, seen = 0;
+    unsigned int i;
+
+    if (!lat->count)
+        return 0;
+
+    if (pct >= 100)
+        return lat->max;
+
+    target = (lat->count * pct + 99) / 100;
+    if (!target)
+        target = 1;
+
+    for (i = 0; i < RELAY_HIST_BUCKETS; i++) {
+        seen += lat->buckets[i];
+        if (seen >= target) {
+            uint32_t value = relay_hist_value(i);
+
+            return value < lat->max ? value : lat->max;
+        }
+    }
+
+    return lat->max;
+}
+
+void relay_latency_merge(struct relay_latency *dst,
+					const struct relay_latency *src)
+{
+    unsigned int i;
+
+    if (!src->count)
+        return;
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+
+    for (i = 0; i < RELAY_HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/* As relay_stats_sub() for a latency histogram */
+void relay_latency_sub(struct relay_latency *dst,
+					const struct relay_latency *src)
+{
+    unsigned int i;
+
+    dst->count -= src->count;
+    dst->sum -= src->sum;
+
+    for (i = 0; i < RELAY_HIST_BUCKETS; i++)
+        dst->buckets[i] -= src->buckets[i];
+}
+
+void relay_latency_reset(struct relay_latency *lat)
+{
+    memset(lat, 0, sizeof(*lat));
+}
+
+static void relay_ring_copy_out(struct ringbuf *ring, size_t offset,
+							void *data, size_t len)
+{
+    size_t nowrap;
+    uint8_t *ptr;
+
+    ptr = ringbuf_peek(ring, offset, &nowrap);
+    if (nowrap > len)
+        nowrap = len;
+
+    memcpy(data, ptr, nowrap);
+
+    if (len > nowrap)
+        memcpy((uint8_t *) data + nowrap,
+                    ringbuf_peek(ring, offset + nowrap, NULL), len - nowrap);
+}
+
+static void relay_ring_copy_in(struct ringbuf *ring, size_t offset,
+						const void *data, size_t len)
+{
+    size_t nowrap;
+    uint8_t *ptr;
+
+    ptr = ringbuf_peek(ring, offset, &nowrap);
+    if (nowrap > len)
+        nowrap = len;
+
+    memcpy(ptr, data, nowrap);
+
+    if (len > nowrap)
+        memcpy(ringbuf_peek(ring, offset + nowrap, NULL),
+                    (const uint8_t *) data + nowrap, len - nowrap);
+}
+
+/* Fills iov with the (possibly wrapped) payload of the record at offset
+ * and returns the number of vectors used.
+ */
+static int relay_ring_iov(struct ringbuf *ring, size_t offset, size_t len,
+							struct iovec *iov)
+{
+    size_t nowrap;
+
+    iov[0].iov_base = ringbuf_peek(ring, offset, &nowrap);
+    if (nowrap >= len) {
+        iov[0].iov_len = len;
+        return 1;
+    }
+
+    iov[0].iov_len = nowrap;
+    iov[1].iov_base = ringbuf_peek(ring, offset + nowrap, NULL);
+    iov[1].iov_len = len - nowrap;
+
+    return 2;
+}
+
+struct relay_queue *relay_queue_new(size_t size,
+					enum relay_queue_policy policy)
+{
+    struct relay_queue *queue;
+
+    queue = calloc(1, sizeof(*queue));
+    if (!queue)
+        return NULL;
+
+    queue->ring = ringbuf_new(size);
+    if (!queue->ring) {
+        free(queue);
+        return NULL;
+    }
+
+    queue->policy = policy;
+
+    return queue;
+}
+
+void relay_queue_free(struct relay_queue *queue)
+{
+    if (!queue)
+        return;
+
+    ringbuf_free(queue->ring);
+    free(queue);
+}
+
+/* Enables merging of boot mouse and keyboard reports waiting in the
+ * queue. Reports are only merged while the receiver has switched to the
+ * boot protocol, in report protocol the same report IDs can carry any
+ * layout.
+ */
+void relay_queue_set_merge(struct relay_queue *queue, bool merge)
+{
+    if (queue)
+        queue->merge = merge;
+}
+
+void relay_queue_set_boot_protocol(struct relay_queue *queue, bool boot)
+{
+    if (queue)
+        __atomic_store_n(&queue->boot_protocol, boot, __ATOMIC_RELAXED);
+}
+
+bool relay_queue_get_boot_protocol(struct relay_queue *queue)
+{
+    return queue && __atomic_load_n(&queue->boot_protocol, __ATOMIC_RELAXED);
+}
+
+/* Follows the HIDP SET_PROTOCOL requests in a batch read from the control
+ * channel of the HID host, whose reports then go through queue.
+ */
+void relay_queue_track_protocol(struct relay_queue *queue,
+					const struct relay_batch *batch)
+{
+    unsigned int i;
+
+    if (!queue || !queue->merge)
+        return;
+
+    for (i = 0; i < batch->count; i++) {
+        const uint8_t *data = batch->buf[i];
+
+        if (!batch->iov[i].iov_len || (data[0] & HIDP_HEADER_TRANS_MASK) !=
+                                                HIDP_TRANS_SET_PROTOCOL)
+            continue;
+
+        relay_queue_set_boot_protocol(queue,
+                    (data[0] & HIDP_HEADER_PARAM_MASK) == HIDP_PROTO_BOOT);
+    }
+}
+
+void relay_queue_set_max_age(struct relay_queue *queue, uint64_t max_age)
+{
+    if (queue)
+        queue->max_age = max_age;
+}
+
+enum relay_queue_policy relay_queue_get_policy(struct relay_queue *queue)
+{
+    return queue->policy;
+}
+
+unsigned int relay_queue_pending(struct relay_queue *queue)
+{
+    return queue ? queue->count : 0;
+}
+
+/* With the block policy the source must not be read while reports are
+ * pending, leaving the backlog in the kernel socket of the sender.
+ */
+bool relay_queue_blocked(struct relay_queue *queue)
+{
+    return queue && queue->policy == RELAY_QUEUE_BLOCK && queue->count;
+}
+
+static void relay_queue_drain(struct relay_queue *queue, size_t len)
+{
+    ringbuf_drain(queue->ring, len);
+    queue->count--;
+    queue->tail = queue->count ? queue->tail - len : 0;
+}
+
+static void relay_queue_drop_head(struct relay_queue *queue)
+{
+    struct relay_record rec;
+
+    relay_ring_copy_out(queue->ring, 0, &rec, sizeof(rec));
+    relay_queue_drain(queue, sizeof(rec) + rec.len);
+}
+
+static bool relay_is_boot_report(const uint8_t *data, size_t size,
+						uint8_t id, size_t min_size)
+{
+    return size >= min_size &&
+            data[0] == (HIDP_TRANS_DATA | HIDP_DATA_RTYPE_INPUT) &&
+            data[1] == id;
+}
+
+static bool relay_add_delta(uint8_t *dst, uint8_t delta)
+{
+    int sum = (int8_t) *dst + (int8_t) delta;
+
+    if (sum < INT8_MIN + 1 || sum > INT8_MAX)
+        return false;
+
+    *dst = (uint8_t) sum;
+
+    return true;
+}
+
+/* Folds a boot mouse report into the newest queued one when the button
+ * state is unchanged: X, Y and wheel deltas are summed, anything after
+ * the wheel has to match. The queued report keeps its receive time.
+ */
+static bool relay_merge_mouse(uint8_t *queued, const uint8_t *data,
+								size_t size)
+{
+    uint8_t merged[HIDP_BOOT_MOUSE_WHEEL + 1];
+    unsigned int i, last;
+
+    if (queued[HIDP_BOOT_MOUSE_BUTTONS] != data[HIDP_BOOT_MOUSE_BUTTONS])
+        return false;
+
+    last = size > HIDP_BOOT_MOUSE_WHEEL ? HIDP_BOOT_MOUSE_WHEEL :
+                                                    HIDP_BOOT_MOUSE_Y;
+
+    if (size > HIDP_BOOT_MOUSE_WHEEL + 1 &&
+                memcmp(queued + HIDP_BOOT_MOUSE_WHEEL + 1,
+                        data + HIDP_BOOT_MOUSE_WHEEL + 1,
+                        size - HIDP_BOOT_MOUSE_WHEEL - 1))
+        return false;
+
+    memcpy(merged, queued, last + 1);
+
+    for (i = HIDP_BOOT_MOUSE_X; i <= last; i++) {
+        if (!relay_add_delta(&merged[i], data[i]))
+            return false;
+    }
+
+    memcpy(queued, merged, last + 1);
+
+    return true;
+}
+
+/*
+ * Merges a report into the newest queued record if that loses nothing
+ * the receiver would notice: relative boot mouse motion with the same
+ * buttons is summed and a boot keyboard report repeating the queued key
+ * state is dropped. Reports are never merged across a button or key
+ * transition, nor past another queued report.
+ */
+static bool relay_queue_merge(struct relay_queue *queue, const uint8_t *data,
+								size_t size)
+{
+    struct relay_record rec;
+    uint8_t queued[RELAY_MTU];
+    bool merged;
+
+    if (!queue->merge || !queue->count ||
+                                    !relay_queue_get_boot_protocol(queue))
+        return false;
+
+    if (!relay_is_boot_report(data, size, HIDP_BOOT_MOUSE_REPORT_ID,
+                                        HIDP_BOOT_MOUSE_Y + 1) &&
+            !relay_is_boot_report(data, size, HIDP_BOOT_KEYBOARD_REPORT_ID,
+                                        HIDP_BOOT_KEYBOARD_SIZE))
+        return false;
+
+    relay_ring_copy_out(queue->ring, queue->tail, &rec, sizeof(rec));
+    if (rec.len != size)
+        return false;
+
+    relay_ring_copy_out(queue->ring, queue->tail + sizeof(rec), queued, size);
+    if (queued[0] != data[0] || queued[1] != data[1])
+        return false;
+
+    if (data[1] == HIDP_BOOT_MOUSE_REPORT_ID)
+        merged = relay_merge_mouse(queued, data, size);
+    else
+        merged = !memcmp(queued, data, size);
+
+    if (merged)
+        relay_ring_copy_in(queue->ring, queue->tail + sizeof(rec), queued,
+                                                                    size);
+
+    return merged;
+}
+
+/* Replaces a queued input report carrying the same HIDP header and
+ * report ID with the latest one, keeping its place in the queue. Only
+ * used once the queue is full, and never for a keyboard report whose key
+ * state differs from the newest queued one, as that would lose a key
+ * press or release.
+ */
+static bool relay_queue_coalesce(struct relay_queue *queue,
+					const uint8_t *data, size_t size)
+{
+    uint8_t queued[RELAY_MTU];
+    size_t offset = 0, last = 0;
+    bool keyboard, found = false;
+    unsigned int i;
+
+    if (size < 2 || (data[0] & HIDP_HEADER_TRANS_MASK) != HIDP_TRANS_DATA)
+        return false;
+
+    /* Replacing relative motion would lose the queued deltas */
+    if (relay_is_boot_report(data, size, HIDP_BOOT_MOUSE_REPORT_ID,
+                                                HIDP_BOOT_MOUSE_Y + 1))
+        return false;
+
+    keyboard = relay_is_boot_report(data, size, HIDP_BOOT_KEYBOARD_REPORT_ID,
+                                                HIDP_BOOT_KEYBOARD_SIZE);
+
+    for (i = 0; i < queue->count; i++) {
+        struct relay_record rec;
+        uint8_t hdr[2];
+
+        relay_ring_copy_out(queue->ring, offset, &rec, sizeof(rec));
+        offset += sizeof(rec);
+
+        if (rec.len == size) {
+            relay_ring_copy_out(queue->ring, offset, hdr, sizeof(hdr));
+            if (hdr[0] == data[0] && hdr[1] == data[1]) {
+                if (!keyboard) {
+                    relay_ring_copy_in(queue->ring, offset, data, size);
+                    return true;
+                }
+
+                last = offset;
+                found = true;
+            }
+        }
+
+        offset += rec.len;
+    }
+
+    /* A repeat of the latest queued key state carries nothing new */
+    if (!found)
+        return false;
+
+    relay_ring_copy_out(queue->ring, last, queued, size);
+
+    return !memcmp(queued, data, size);
+}
+
+/*
+ * Queues a report. Returns the number of older reports discarded to make
+ * room for it (0 when it was merged into a queued one), or a negative
+ * errno if the report itself could not be queued.
+ */
+int relay_queue_push(struct relay_queue *queue, const uint8_t *data,
+					size_t size, uint64_t rx_time)
+{
+    struct relay_record rec;
+    int dropped = 0;
+
+    if (size + sizeof(rec) > ringbuf_capacity(queue->ring))
+        return -EMSGSIZE;
+
+    while (ringbuf_avail(queue->ring) < size + sizeof(rec)) {
+        if (queue->policy == RELAY_QUEUE_BLOCK)
+            return -ENOBUFS;
+
+        /* Out of room, fold it into a queued report before dropping */
+        if (queue->policy == RELAY_QUEUE_COALESCE &&
+                            relay_queue_coalesce(queue, data, size))
+            return dropped;
+
+        relay_queue_drop_head(queue);
+        dropped++;
+    }
+
+    rec.len = size;
+    rec.rx_time = rx_time;
+
+    queue->tail = ringbuf_len(queue->ring);
+    ringbuf_put(queue->ring, &rec, sizeof(rec));
+    ringbuf_put(queue->ring, data, size);
+    queue->count++;
+
+    return dropped;
+}
+
+/*
+ * Writes queued reports to fd, a batch per syscall, until the queue is
+ * empty or the socket is full. Returns the number of reports written or
+ * a negative errno on a write error other than the socket being full.
+ */
+int relay_queue_flush(struct relay_queue *queue, int fd,
+					struct relay_latency *latency)
+{
+    int total = 0;
+
+    while (queue->count) {
+        struct mmsghdr msgs[RELAY_BATCH_MAX];
+        struct iovec iov[RELAY_BATCH_MAX][2];
+        uint64_t rx_times[RELAY_BATCH_MAX];
+        size_t lens[RELAY_BATCH_MAX];
+        size_t offset = 0;
+        unsigned int i, count;
+        int ret;
+
+        count = queue->count < RELAY_BATCH_MAX ? queue->count :
+                                                        RELAY_BATCH_MAX;
+
+        memset(msgs, 0, sizeof(msgs));
+
+        for (i = 0; i < count; i++) {
+            struct relay_record rec;
+
+            relay_ring_copy_out(queue->ring, offset, &rec, sizeof(rec));
+            offset += sizeof(rec);
+
+            msgs[i].msg_hdr.msg_iov = iov[i];
+            msgs[i].msg_hdr.msg_iovlen = relay_ring_iov(queue->ring, offset,
+                                                        rec.len, iov[i]);
+            rx_times[i] = rec.rx_time;
+            lens[i] = sizeof(rec) + rec.len;
+            offset += rec.len;
+        }
+
+        do {
+            ret = sendmmsg(fd, msgs, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+        } while (ret < 0 && errno == EINTR);
+
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return total ? total : -errno;
+        }
+
+        for (i = 0; i < (unsigned int) ret; i++) {
+            if (latency)
+                relay_latency_record(latency, rx_times[i], 1);
+            relay_queue_drain(queue, lens[i]);
+        }
+
+        total += ret;
+
+        if ((unsigned int) ret < count)
+            break;
+    }
+
+    return total;
+}
+
+/*
+ * Drops queued reports received more than the queue's max age before now,
+ * e.g. keystrokes buffered while a link was down which would only confuse
+ * the receiver if delivered late. Returns the number of reports dropped.
+ */
+unsigned int relay_queue_expire(struct relay_queue *queue, uint64_t now)
+{
+    unsigned int dropped = 0;
+
+    if (!queue || !queue->max_age)
+        return 0;
+
+    while (queue->count) {
+        struct relay_record rec;
+
+        relay_ring_copy_out(queue->ring, 0, &rec, sizeof(rec));
+        if (rec.rx_time + queue->max_age >= now)
+            break;
+
+        relay_queue_drain(queue, sizeof(rec) + rec.len);
+        dropped++;
+    }
+
+    return dropped;
+}
+
+void relay_queue_reset(struct relay_queue *queue)
+{
+    if (!queue)
+        return;
+
+    ringbuf_drain(queue->ring, ringbuf_len(queue->ring));
+    queue->count = 0;
+    queue->tail = 0;
+}
+
+/*
+ * Sends a received batch to fd behind any reports already queued for it.
+ * Whatever the socket does not take is queued according to the queue
+ * policy, overflow is accounted as dropped in stats. Returns the number
+ * of reports left pending, the caller waits for fd to become writable
+ * and calls relay_queue_flush() while it is not zero. A negative errno
+ * is returned, and the batch dropped, if the socket is broken.
+ */
+int relay_queue_send_batch(struct relay_queue *queue, int fd,
+					const struct relay_batch *batch,
+					struct relay_stats *stats,
+					struct relay_latency *latency)
+{
+    unsigned int i, sent = 0;
+    int ret;
+
+    if (queue->count) {
+        ret = relay_queue_flush(queue, fd, latency);
+        if (ret < 0) {
+            stats->dropped += batch->count;
+            return ret;
+        }
+    }
+
+    if (!queue->count) {
+        ret = relay_send_batch(fd, batch, 0);
+        if (ret < 0 && ret != -EAGAIN && ret != -EWOULDBLOCK) {
+            stats->dropped += batch->count;
+            return ret;
+        }
+
+        sent = ret < 0 ? 0 : ret;
+        relay_latency_record(latency, batch->rx_time, sent);
+    }
+
+    for (i = sent; i < batch->count; i++) {
+        if (relay_queue_merge(queue, batch->buf[i], batch->iov[i].iov_len)) {
+            stats->merged++;
+            continue;
+        }
+
+        ret = relay_queue_push(queue, batch->buf[i], batch->iov[i].iov_len,
+                                                        batch->rx_time);
+        if (ret < 0)
+            stats->dropped++;
+        else
+            stats->dropped += ret;
+    }
+
+    return queue->count;
+}
+
+static const char *relay_queue_policies[] = {
+    [RELAY_QUEUE_DROP_OLDEST] = "drop-oldest",
+    [RELAY_QUEUE_COALESCE] = "coalesce",
+    [RELAY_QUEUE_BLOCK] = "block",
+};
+
+bool relay_queue_parse_policy(const char *str,
+					enum relay_queue_policy *policy)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(relay_queue_policies) /
+                                sizeof(relay_queue_policies[0]); i++) {
+        if (!strcmp(str, relay_queue_policies[i])) {
+            *policy = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+const char *relay_queue_policy_to_str(enum relay_queue_policy policy)
+{
+    return relay_queue_policies[policy];
+}
@@ -0,0 +1,132 @@
+//
+// HID report relay engine shared by the input host and input device
+// local socket bridges.
+//
+
+#ifndef BLUEZ_INPUT_RELAY_H
+#define BLUEZ_INPUT_RELAY_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <sys/uio.h>
+#include "uhid_copy.h"
+
+/* Largest HIDP PDU we relay: HIDP header followed by a full report */
+#define RELAY_MTU			(UHID_DATA_MAX + 1)
+
+/* Maximum number of packets forwarded per wakeup so that a flooding
+ * peer cannot starve the rest of the main loop.
+ */
+#define RELAY_DRAIN_BUDGET		64
+
+/* Packets pulled from the kernel with one recvmmsg() call */
+#define RELAY_BATCH_MAX			16
+
+/* HDR style latency histogram: values below RELAY_HIST_SUB microseconds
+ * are exact, above that every power of two is split in RELAY_HIST_SUB
+ * linear buckets, giving ~6% relative precision up to 2^32 us.
+ */
+#define RELAY_HIST_SUB_BITS		4
+#define RELAY_HIST_SUB			(1 << RELAY_HIST_SUB_BITS)
+#define RELAY_HIST_BUCKETS		((32 - RELAY_HIST_SUB_BITS + 1) * \
+							RELAY_HIST_SUB)
+
+struct relay_latency {
+    uint64_t        count;
+    uint64_t        sum;
+    uint32_t        max;
+    uint32_t        buckets[RELAY_HIST_BUCKETS];
+};
+
+struct relay_batch {
+    struct iovec    iov[RELAY_BATCH_MAX];
+    unsigned int    count;
+    uint64_t        rx_time;
+    uint8_t         buf[RELAY_BATCH_MAX][RELAY_MTU];
+};
+
+struct relay_stats {
+    uint64_t        wakeups;
+    uint64_t        batches;
+    uint64_t        reports;
+    uint64_t        dropped;
+    /* reports folded into one already queued */
+    uint64_t        merged;
+    unsigned int    max_batch;
+    /* batch_sizes[n] counts batches that coalesced n reports */
+    uint64_t        batch_sizes[RELAY_BATCH_MAX + 1];
+};
+
+/* What to do with a report when the destination queue is full */
+enum relay_queue_policy {
+    RELAY_QUEUE_DROP_OLDEST = 0,
+    RELAY_QUEUE_COALESCE,
+    RELAY_QUEUE_BLOCK,
+};
+
+#define RELAY_QUEUE_DEFAULT_SIZE	4096
+#define RELAY_QUEUE_MIN_SIZE		64
+#define RELAY_QUEUE_MAX_SIZE		(1024 * 1024)
+
+struct relay_queue;
+
+/* Returns false to stop draining, e.g. once the destination blocked */
+typedef bool (*relay_batch_func_t)(struct relay_batch *batch,
+							void *user_data);
+
+int relay_send(int fd, const uint8_t *data, size_t size);
+
+int relay_recv_batch(int fd, struct relay_batch *batch);
+int relay_send_batch(int fd, const struct relay_batch *batch,
+							unsigned int offset);
+const uint8_t *relay_batch_packet(const struct relay_batch *batch,
+					unsigned int index, size_t *size);
+
+int relay_drain(int fd, struct relay_stats *stats, relay_batch_func_t func,
+							void *user_data);
+
+void relay_stats_add_batch(struct relay_stats *stats, unsigned int count);
+void relay_stats_reset(struct relay_stats *stats);
+void relay_stats_merge(struct relay_stats *dst, const struct relay_stats *src);
+void relay_stats_sub(struct relay_stats *dst, const struct relay_stats *src);
+double relay_stats_avg_batch(const struct relay_stats *stats);
+
+struct relay_queue *relay_queue_new(size_t size,
+					enum relay_queue_policy policy);
+void relay_queue_free(struct relay_queue *queue);
+void relay_queue_set_merge(struct relay_queue *queue, bool merge);
+void relay_queue_set_boot_protocol(struct relay_queue *queue, bool boot);
+bool relay_queue_get_boot_protocol(struct relay_queue *queue);
+void relay_queue_track_protocol(struct relay_queue *queue,
+					const struct relay_batch *batch);
+void relay_queue_set_max_age(struct relay_queue *queue, uint64_t max_age);
+enum relay_queue_policy relay_queue_get_policy(struct relay_queue *queue);
+unsigned int relay_queue_pending(struct relay_queue *queue);
+bool relay_queue_blocked(struct relay_queue *queue);
+int relay_queue_push(struct relay_queue *queue, const uint8_t *data,
+					size_t size, uint64_t rx_time);
+int relay_queue_flush(struct relay_queue *queue, int fd,
+					struct relay_latency *latency);
+unsigned int relay_queue_expire(struct relay_queue *queue, uint64_t now);
+void relay_queue_reset(struct relay_queue *queue);
+int relay_queue_send_batch(struct relay_queue *queue, int fd,
+					const struct relay_batch *batch,
+					struct relay_stats *stats,
+					struct relay_latency *latency);
+bool relay_queue_parse_policy(const char *str,
+					enum relay_queue_policy *policy);
+const char *relay_queue_policy_to_str(enum relay_queue_policy policy);
+
+uint64_t relay_now(void);
+void relay_latency_record(struct relay_latency *lat, uint64_t rx_time,
+							unsigned int count);
+uint32_t relay_latency_percentile(const struct relay_latency *lat,
+							unsigned int pct);
+void relay_latency_merge(struct relay_latency *dst,
+					const struct relay_latency *src);
+void relay_latency_sub(struct relay_latency *dst,
+					const struct relay_latency *src);
+void relay_latency_reset(struct relay_latency *lat);
+
+#endif //BLUEZ_INPUT_RELAY_H
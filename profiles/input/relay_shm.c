@@ -0,0 +1,354 @@
+//
+// Shared memory report channel between bluetoothd and a local HID daemon.
+//
+// On small systems a sendmsg()/recvmsg() pair per report dominates the
+// relay's CPU use. A local client can instead ask, over its control
+// socket, for a memfd holding two single producer/single consumer rings
+// plus an eventfd doorbell per direction. Reports then move through the
+// rings and the doorbells are only rung when the other side went to
+// sleep, so a steady stream of reports costs no syscalls at all.
+//
+// The sockets stay connected and keep carrying connection lifetime and
+// the handshake. Everything read from the mapping is treated as hostile:
+// indices and lengths are checked and reports are copied out of the ring
+// before they are looked at. The memfd is sealed against resizing so the
+// client cannot make the mapping fault under bluetoothd.
+//
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "relay_shm.h"
+
+struct relay_shm {
+    struct relay_shm_layout *map;
+    int             memfd;
+    /* Rung by the client when it produced, watched by bluetoothd */
+    int             rx_fd;
+    /* Rung by bluetoothd when it produced for a sleeping client */
+    int             tx_fd;
+};
+
+static struct relay_batch relay_shm_batch;
+
+static void relay_shm_signal(int fd)
+{
+    uint64_t one = 1;
+
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+static void relay_shm_clear(int fd)
+{
+    uint64_t value;
+
+    while (read(fd, &value, sizeof(value)) < 0 && errno == EINTR);
+}
+
+struct relay_shm *relay_shm_new(void)
+{
+    struct relay_shm *shm;
+
+    shm = calloc(1, sizeof(*shm));
+    if (!shm)
+        return NULL;
+
+    shm->rx_fd = shm->tx_fd = -1;
+
+    shm->memfd = memfd_create("bluetoothd-hid-relay",
+                                        MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (shm->memfd < 0)
+        goto failed;
+
+    if (ftruncate(shm->memfd, sizeof(*shm->map)) < 0)
+        goto failed;
+
+    if (fcntl(shm->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+                                                    F_SEAL_SEAL) < 0)
+        goto failed;
+
+    shm->map = mmap(NULL, sizeof(*shm->map), PROT_READ | PROT_WRITE,
+                                            MAP_SHARED, shm->memfd, 0);
+    if (shm->map == MAP_FAILED) {
+        shm->map = NULL;
+        goto failed;
+    }
+
+    shm->rx_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    shm->tx_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (shm->rx_fd < 0 || shm->tx_fd < 0)
+        goto failed;
+
+    shm->map->magic = RELAY_SHM_MAGIC;
+    shm->map->slots = RELAY_SHM_SLOTS;
+    shm->map->slot_size = sizeof(struct relay_shm_slot);
+    shm->map->to_daemon.need_wakeup = 1;
+    shm->map->to_client.need_wakeup = 1;
+
+    return shm;
+
+failed:
+    relay_shm_free(shm);
+    return NULL;
+}
+
+void relay_shm_free(struct relay_shm *shm)
+{
+    if (!shm)
+        return;
+
+    if (shm->map)
+        munmap(shm->map, sizeof(*shm->map));
+    if (shm->memfd >= 0)
+        close(shm->memfd);
+    if (shm->rx_fd >= 0)
+        close(shm->rx_fd);
+    if (shm->tx_fd >= 0)
+        close(shm->tx_fd);
+
+    free(shm);
+}
+
+/* The doorbell to watch for reports from the client */
+int relay_shm_get_fd(struct relay_shm *shm)
+{
+    return shm->rx_fd;
+}
+
+/*
+ * Removes shared memory requests from a batch read off a control socket,
+ * keeping the remaining reports in order. Returns true if there was one.
+ */
+bool relay_shm_take_request(struct relay_batch *batch)
+{
+    unsigned int i, count = 0;
+    bool found = false;
+
+    for (i = 0; i < batch->count; i++) {
+        size_t len = batch->iov[i].iov_len;
+
+        if (len == RELAY_SHM_REQUEST_LEN &&
+                !memcmp(batch->buf[i], RELAY_SHM_REQUEST, len)) {
+            found = true;
+            continue;
+        }
+
+        if (count != i) {
+            memcpy(batch->buf[count], batch->buf[i], len);
+            batch->iov[count].iov_base = batch->buf[count];
+            batch->iov[count].iov_len = len;
+        }
+
+        count++;
+    }
+
+    batch->count = count;
+
+    return found;
+}
+
+/* Answers a request on sock, handing over the fds of shm on success */
+int relay_shm_reply(int sock, struct relay_shm *shm, int status)
+{
+    uint8_t reply[RELAY_SHM_REPLY_LEN];
+    union {
+        struct cmsghdr cmsg;
+        uint8_t buf[CMSG_SPACE(3 * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    struct iovec iov;
+
+    memcpy(reply, RELAY_SHM_REQUEST, RELAY_SHM_REQUEST_LEN);
+    reply[RELAY_SHM_REQUEST_LEN] = status;
+
+    iov.iov_base = reply;
+    iov.iov_len = sizeof(reply);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (shm && !status) {
+        struct cmsghdr *cmsg;
+        int fds[3] = { shm->memfd, shm->rx_fd, shm->tx_fd };
+
+        memset(&control, 0, sizeof(control));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    }
+
+    if (sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        return -errno;
+
+    return 0;
+}
+
+static int relay_shm_push(struct relay_shm *shm, bool is_control,
+					const uint8_t *data, size_t size)
+{
+    struct relay_shm_ring *ring = &shm->map->to_client;
+    struct relay_shm_slot *slot;
+    uint32_t head, tail;
+
+    if (size > RELAY_MTU)
+        return -EMSGSIZE;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    /* A tail the client moved past head counts as a full ring too */
+    if (head - tail >= RELAY_SHM_SLOTS)
+        return -ENOBUFS;
+
+    slot = &ring->slots[head % RELAY_SHM_SLOTS];
+    slot->len = size;
+    slot->flags = is_control ? RELAY_SHM_CTRL : 0;
+    memcpy(slot->data, data, size);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static void relay_shm_kick(struct relay_shm *shm)
+{
+    struct relay_shm_ring *ring = &shm->map->to_client;
+
+    /* Pairs with the fence of a client going to sleep */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ring->need_wakeup, __ATOMIC_RELAXED))
+        relay_shm_signal(shm->tx_fd);
+}
+
+/*
+ * Hands a batch to the client. Returns the number of reports placed in
+ * the ring, which is short of batch->count when the ring is full, or a
+ * negative errno if none could be.
+ */
+int relay_shm_send_batch(struct relay_shm *shm, bool is_control,
+					const struct relay_batch *batch)
+{
+    unsigned int i;
+    int err = 0;
+
+    for (i = 0; i < batch->count; i++) {
+        err = relay_shm_push(shm, is_control, batch->buf[i],
+                                            batch->iov[i].iov_len);
+        if (err < 0)
+            break;
+    }
+
+    if (i)
+        relay_shm_kick(shm);
+
+    return i ? (int) i : err;
+}
+
+int relay_shm_send(struct relay_shm *shm, bool is_control,
+					const uint8_t *data, size_t size)
+{
+    int err;
+
+    err = relay_shm_push(shm, is_control, data, size);
+    if (err < 0)
+        return err;
+
+    relay_shm_kick(shm);
+
+    return 0;
+}
+
+/*
+ * Consumes reports the client placed in the ring, in batches of reports
+ * for the same channel, up to RELAY_DRAIN_BUDGET per call. Call it when
+ * the doorbell returned by relay_shm_get_fd() is readable. Returns the
+ * number of reports consumed or -EPROTO if the client corrupted the ring.
+ */
+int relay_shm_drain(struct relay_shm *shm, struct relay_stats *stats,
+			relay_shm_batch_func_t func, void *user_data)
+{
+    struct relay_shm_ring *ring = &shm->map->to_daemon;
+    struct relay_batch *batch = &relay_shm_batch;
+    int count = 0;
+
+    relay_shm_clear(shm->rx_fd);
+
+    if (stats)
+        stats->wakeups++;
+
+    /* Awake - the client can skip the doorbell */
+    __atomic_store_n(&ring->need_wakeup, 0, __ATOMIC_RELAXED);
+
+    while (count < RELAY_DRAIN_BUDGET) {
+        uint32_t head, tail;
+        bool is_control;
+
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            __atomic_store_n(&ring->need_wakeup, 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+            head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            if (head == tail)
+                return count;
+
+            __atomic_store_n(&ring->need_wakeup, 0, __ATOMIC_RELAXED);
+        }
+
+        if (head - tail > RELAY_SHM_SLOTS)
+            return -EPROTO;
+
+        batch->count = 0;
+        is_control = ring->slots[tail % RELAY_SHM_SLOTS].flags &
+                                                        RELAY_SHM_CTRL;
+
+        while (tail != head && batch->count < RELAY_BATCH_MAX) {
+            struct relay_shm_slot *slot;
+            uint32_t len;
+
+            slot = &ring->slots[tail % RELAY_SHM_SLOTS];
+            if (!!(slot->flags & RELAY_SHM_CTRL) != is_control)
+                break;
+
+            len = __atomic_load_n(&slot->len, __ATOMIC_RELAXED);
+            if (len > RELAY_MTU)
+                return -EPROTO;
+
+            memcpy(batch->buf[batch->count], slot->data, len);
+            batch->iov[batch->count].iov_base = batch->buf[batch->count];
+            batch->iov[batch->count].iov_len = len;
+            batch->count++;
+            tail++;
+        }
+
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        batch->rx_time = relay_now();
+        if (stats)
+            relay_stats_add_batch(stats, batch->count);
+
+        func(batch, is_control, user_data);
+        count += batch->count;
+    }
+
+    /* Out of budget with reports left, come back on the next iteration */
+    relay_shm_signal(shm->rx_fd);
+
+    return count;
+}
@@ -0,0 +1,79 @@
+//
+// Shared memory report channel between bluetoothd and a local HID daemon.
+//
+
+#ifndef BLUEZ_INPUT_RELAY_SHM_H
+#define BLUEZ_INPUT_RELAY_SHM_H
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "relay.h"
+
+/* A local client asks for the shared memory channel by sending this
+ * message on its control socket. The reply starts with the same four
+ * bytes followed by a status byte (0 or an errno value); on success the
+ * memfd, the client to daemon doorbell and the daemon to client doorbell
+ * eventfds are attached to it, in that order, as SCM_RIGHTS.
+ */
+#define RELAY_SHM_HEADER		0xff
+#define RELAY_SHM_REQUEST		"\xff" "SHM"
+#define RELAY_SHM_REQUEST_LEN		4
+#define RELAY_SHM_REPLY_LEN		(RELAY_SHM_REQUEST_LEN + 1)
+
+#define RELAY_SHM_MAGIC			0x314d5352	/* "RSM1" */
+#define RELAY_SHM_SLOTS			32
+
+/* Slot flags */
+#define RELAY_SHM_CTRL			0x01
+
+struct relay_shm_slot {
+    uint32_t        len;
+    uint32_t        flags;
+    uint8_t         data[RELAY_MTU];
+};
+
+/*
+ * Single producer/single consumer ring. The producer owns head and the
+ * consumer owns tail, both only ever increase. A consumer about to sleep
+ * sets need_wakeup and checks the ring once more, the producer rings the
+ * doorbell only when it finds need_wakeup set after publishing, so a busy
+ * consumer costs the producer no syscalls.
+ */
+struct relay_shm_ring {
+    uint32_t        head;
+    uint32_t        need_wakeup;
+    uint8_t         pad0[56];
+    uint32_t        tail;
+    uint8_t         pad1[60];
+    struct relay_shm_slot slots[RELAY_SHM_SLOTS];
+};
+
+struct relay_shm_layout {
+    uint32_t        magic;
+    uint32_t        slots;
+    uint32_t        slot_size;
+    uint32_t        reserved;
+    struct relay_shm_ring to_daemon;
+    struct relay_shm_ring to_client;
+};
+
+struct relay_shm;
+
+typedef void (*relay_shm_batch_func_t)(struct relay_batch *batch,
+					bool is_control, void *user_data);
+
+struct relay_shm *relay_shm_new(void);
+void relay_shm_free(struct relay_shm *shm);
+int relay_shm_get_fd(struct relay_shm *shm);
+
+bool relay_shm_take_request(struct relay_batch *batch);
+int relay_shm_reply(int sock, struct relay_shm *shm, int status);
+
+int relay_shm_send_batch(struct relay_shm *shm, bool is_control,
+					const struct relay_batch *batch);
+int relay_shm_send(struct relay_shm *shm, bool is_control,
+					const uint8_t *data, size_t size);
+int relay_shm_drain(struct relay_shm *shm, struct relay_stats *stats,
+			relay_shm_batch_func_t func, void *user_data);
+
+#endif //BLUEZ_INPUT_RELAY_SHM_H
@@ -0,0 +1,1013 @@
+//
+// Optional real-time thread running the HID relay data plane.
+//
+// Routes (source fd -> destination fd) are owned by the relay thread and
+// driven by its own epoll loop, so report forwarding is not delayed by
+// D-Bus, GATT or storage work on the main loop. The main loop keeps the
+// control plane: it adds, retargets and removes routes through a
+// lock-free single producer/single consumer command ring without waiting
+// for the thread. The thread works on duplicates of the route fds and
+// closes them itself, so the main loop may close its own right away.
+// Commands carry a sequence number the thread acknowledges through an
+// eventfd watched by the main loop, which runs the callbacks queued with
+// relay_thread_barrier() once everything posted before them is done, e.g.
+// to free the queues of removed routes. Events going the other way (a
+// report read while the destination is down) come back through a second
+// ring and eventfd.
+//
+// Counters of thread routes are private to the thread, which publishes
+// their running totals after every loop iteration in a per route seqlock
+// snapshot. The main loop, which owns the host statistics, reads it
+// without waiting on the thread and folds in what was counted since the
+// last time.
+//
+// Reports the destination does not take right away wait in the route's
+// relay_queue. Destination fds are frequently the source of another route
+// and so already registered with epoll, instead of watching them for
+// EPOLLOUT the loop polls backlogged routes every RELAY_THREAD_FLUSH_MS.
+//
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include <glib.h>
+
+#include "src/log.h"
+
+#include "relay_shm.h"
+#include "relay_thread.h"
+
+#define RELAY_RING_SIZE			64
+#define RELAY_THREAD_MAX_ROUTES		32
+#define RELAY_THREAD_DOORBELL		UINT32_MAX
+#define RELAY_THREAD_ACK_WARN		1000
+#define RELAY_THREAD_FLUSH_MS		1
+
+enum relay_cmd_op {
+    RELAY_CMD_ADD,
+    RELAY_CMD_SET_DST,
+    RELAY_CMD_REMOVE,
+    RELAY_CMD_QUIT,
+};
+
+struct relay_cmd {
+    enum relay_cmd_op   op;
+    unsigned int        seq;
+    unsigned int        id;
+    unsigned int        slot;
+    int                 src_fd;
+    int                 dst_fd;
+    unsigned int        flags;
+    struct relay_queue  *queue;
+    struct relay_queue  *protocol_queue;
+};
+
+struct relay_event {
+    unsigned int        id;
+    unsigned int        slot;
+};
+
+struct relay_cmd_ring {
+    struct relay_cmd    slots[RELAY_RING_SIZE];
+    unsigned int        head;
+    unsigned int        tail;
+};
+
+struct relay_event_ring {
+    struct relay_event  slots[RELAY_RING_SIZE];
+    unsigned int        head;
+    unsigned int        tail;
+};
+
+/* Thread side state of a route, its fds are the thread's own duplicates */
+struct relay_route {
+    unsigned int        id;
+    int                 src_fd;
+    int                 dst_fd;
+    bool                miss_posted;
+    bool                paused;
+    bool                dirty;
+    unsigned int        flags;
+    struct relay_queue  *queue;
+    struct relay_queue  *protocol_queue;
+    struct relay_stats  stats;
+    struct relay_latency latency;
+};
+
+/*
+ * Counters of a route as last published by the thread. seq is odd while
+ * the thread writes, readers retry until they copied an even one that did
+ * not change meanwhile.
+ */
+struct relay_snapshot {
+    unsigned int        seq;
+    unsigned int        id;
+    struct relay_stats  stats;
+    struct relay_latency latency;
+};
+
+/* Main loop side state of a route, indexed by the slot it uses */
+struct relay_route_handler {
+    unsigned int        id;
+    relay_thread_miss_func_t miss_func;
+    void                *user_data;
+    /* Totals already handed out by relay_thread_collect() */
+    struct relay_stats  stats;
+    struct relay_latency latency;
+};
+
+struct relay_barrier {
+    unsigned int        seq;
+    relay_thread_done_func_t func;
+    void                *user_data;
+};
+
+static pthread_t relay_tid;
+static bool relay_running;
+static int relay_epfd = -1;
+static int relay_doorbell_fd = -1;
+static int relay_ack_fd = -1;
+static int relay_event_fd = -1;
+static guint relay_event_watch;
+static guint relay_ack_watch;
+static unsigned int relay_next_id = 1;
+static struct relay_route_handler *relay_handlers[RELAY_THREAD_MAX_ROUTES];
+static GSList *relay_barriers;
+static unsigned int relay_cmd_seq;
+static unsigned int relay_cmd_acked;
+static bool relay_thread_exited;
+
+static struct relay_cmd_ring relay_cmds;
+static struct relay_event_ring relay_events;
+static struct relay_snapshot relay_snapshots[RELAY_THREAD_MAX_ROUTES];
+
+/* Only ever touched by the relay thread, slots are picked by the main loop */
+static struct relay_route relay_routes[RELAY_THREAD_MAX_ROUTES];
+static struct relay_batch relay_thread_batch;
+
+#define RING_PUSH(ring, item) ({ \
+    unsigned int head = __atomic_load_n(&(ring)->head, __ATOMIC_RELAXED); \
+    unsigned int tail = __atomic_load_n(&(ring)->tail, __ATOMIC_ACQUIRE); \
+    bool pushed = false; \
+    if (head - tail < RELAY_RING_SIZE) { \
+        (ring)->slots[head % RELAY_RING_SIZE] = *(item); \
+        __atomic_store_n(&(ring)->head, head + 1, __ATOMIC_RELEASE); \
+        pushed = true; \
+    } \
+    pushed; \
+})
+
+#define RING_POP(ring, item) ({ \
+    unsigned int tail = __atomic_load_n(&(ring)->tail, __ATOMIC_RELAXED); \
+    unsigned int head = __atomic_load_n(&(ring)->head, __ATOMIC_ACQUIRE); \
+    bool popped = false; \
+    if (head != tail) { \
+        *(item) = (ring)->slots[tail % RELAY_RING_SIZE]; \
+        __atomic_store_n(&(ring)->tail, tail + 1, __ATOMIC_RELEASE); \
+        popped = true; \
+    } \
+    popped; \
+})
+
+static void relay_eventfd_signal(int fd)
+{
+    uint64_t one = 1;
+
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+static void relay_eventfd_clear(int fd)
+{
+    uint64_t value;
+
+    while (read(fd, &value, sizeof(value)) < 0 && errno == EINTR);
+}
+
+static void relay_close_fd(int fd)
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+/* Gives the thread its own fd, so the caller may close fd whenever */
+static int relay_dup_fd(int fd)
+{
+    if (fd < 0)
+        return -1;
+
+    return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+}
+
+static struct relay_route *relay_route_find(const struct relay_cmd *cmd)
+{
+    struct relay_route *route = &relay_routes[cmd->slot];
+
+    return route->id == cmd->id ? route : NULL;
+}
+
+static void relay_route_publish(struct relay_route *route)
+{
+    struct relay_snapshot *snap = &relay_snapshots[route - relay_routes];
+    unsigned int seq = snap->seq;
+
+    __atomic_store_n(&snap->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    snap->id = route->id;
+    snap->stats = route->stats;
+    snap->latency = route->latency;
+
+    __atomic_store_n(&snap->seq, seq + 2, __ATOMIC_RELEASE);
+
+    route->dirty = false;
+}
+
+/* Copies the snapshot of slot, false if it is not the one of route id */
+static bool relay_snapshot_read(unsigned int slot, unsigned int id,
+					struct relay_stats *stats,
+					struct relay_latency *latency)
+{
+    const struct relay_snapshot *snap = &relay_snapshots[slot];
+    unsigned int seq;
+    bool found;
+
+    do {
+        seq = __atomic_load_n(&snap->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        found = snap->id == id;
+        if (found) {
+            *stats = snap->stats;
+            *latency = snap->latency;
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) ||
+                __atomic_load_n(&snap->seq, __ATOMIC_RELAXED) != seq);
+
+    return found;
+}
+
+static void relay_route_set_paused(struct relay_route *route, bool paused)
+{
+    struct epoll_event ev;
+
+    if (route->paused == paused)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = paused ? 0 : EPOLLIN;
+    ev.data.u32 = route - relay_routes;
+    epoll_ctl(relay_epfd, EPOLL_CTL_MOD, route->src_fd, &ev);
+
+    route->paused = paused;
+}
+
+static void relay_route_drop_queue(struct relay_route *route)
+{
+    route->stats.dropped += relay_queue_pending(route->queue);
+    route->dirty = true;
+    relay_queue_reset(route->queue);
+    relay_route_set_paused(route, false);
+}
+
+static void relay_route_buffer(struct relay_route *route,
+					const struct relay_batch *batch)
+{
+    unsigned int i;
+
+    if (!route->queue) {
+        route->stats.dropped += batch->count;
+        return;
+    }
+
+    for (i = 0; i < batch->count; i++) {
+        const uint8_t *data;
+        size_t size;
+        int ret;
+
+        data = relay_batch_packet(batch, i, &size);
+        ret = relay_queue_push(route->queue, data, size, batch->rx_time);
+        route->stats.dropped += ret < 0 ? 1 : ret;
+    }
+}
+
+/* Hands a batch to the destination, returns true if the queue blocked */
+static bool relay_route_deliver(struct relay_route *route,
+					const struct relay_batch *batch)
+{
+    if (route->dst_fd < 0) {
+        struct relay_event event = { route->id, route - relay_routes };
+
+        /* Keep the reports for when the destination comes back */
+        relay_route_buffer(route, batch);
+
+        /* One notification per outage is enough */
+        if (!route->miss_posted && RING_PUSH(&relay_events, &event)) {
+            route->miss_posted = true;
+            relay_eventfd_signal(relay_event_fd);
+        }
+    } else
+        relay_queue_send_batch(route->queue, route->dst_fd, batch,
+                                            &route->stats, &route->latency);
+
+    return relay_queue_blocked(route->queue);
+}
+
+static void relay_route_forward(struct relay_route *route)
+{
+    int count = 0;
+
+    route->stats.wakeups++;
+    route->dirty = true;
+
+    while (count < RELAY_DRAIN_BUDGET) {
+        struct relay_batch *batch = &relay_thread_batch;
+        int ret;
+
+        ret = relay_recv_batch(route->src_fd, batch);
+        if (ret <= 0)
+            break;
+
+        relay_stats_add_batch(&route->stats, ret);
+        relay_queue_track_protocol(route->protocol_queue, batch);
+        count += ret;
+
+        /* Shared memory needs the main loop, which no longer reads the
+         * socket, so the client is told right away.
+         */
+        if ((route->flags & RELAY_THREAD_REFUSE_SHM) &&
+                                        relay_shm_take_request(batch))
+            relay_shm_reply(route->src_fd, NULL, EOPNOTSUPP);
+
+        if (batch->count && relay_route_deliver(route, batch)) {
+            relay_route_set_paused(route, true);
+            break;
+        }
+
+        if (ret < RELAY_BATCH_MAX)
+            break;
+    }
+}
+
+/* Returns true if some route still has reports waiting */
+static bool relay_routes_flush(void)
+{
+    bool backlog = false;
+    unsigned int i;
+
+    for (i = 0; i < RELAY_THREAD_MAX_ROUTES; i++) {
+        struct relay_route *route = &relay_routes[i];
+
+        /* Reports buffered while dst_fd is down wait for set_dst */
+        if (!route->id || route->dst_fd < 0 ||
+                                    !relay_queue_pending(route->queue))
+            continue;
+
+        route->stats.dropped += relay_queue_expire(route->queue,
+                                                        relay_now());
+        route->dirty = true;
+
+        if (relay_queue_flush(route->queue, route->dst_fd,
+                                                &route->latency) < 0) {
+            relay_route_drop_queue(route);
+            continue;
+        }
+
+        if (relay_queue_pending(route->queue))
+            backlog = true;
+        else
+            relay_route_set_paused(route, false);
+    }
+
+    return backlog;
+}
+
+/* Takes over the fds in cmd, closing what it does not keep */
+static void relay_thread_process(const struct relay_cmd *cmd)
+{
+    struct relay_route *route;
+    struct epoll_event ev;
+
+    switch (cmd->op) {
+    case RELAY_CMD_ADD:
+        route = &relay_routes[cmd->slot];
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = cmd->slot;
+        if (epoll_ctl(relay_epfd, EPOLL_CTL_ADD, cmd->src_fd, &ev) < 0) {
+            error("Unable to watch input relay route %u: %s (%d)",
+                                    cmd->id, strerror(errno), errno);
+            relay_close_fd(cmd->src_fd);
+            relay_close_fd(cmd->dst_fd);
+            break;
+        }
+
+        memset(route, 0, sizeof(*route));
+        route->id = cmd->id;
+        route->src_fd = cmd->src_fd;
+        route->dst_fd = cmd->dst_fd;
+        route->flags = cmd->flags;
+        route->queue = cmd->queue;
+        route->protocol_queue = cmd->protocol_queue;
+        relay_route_publish(route);
+        break;
+    case RELAY_CMD_SET_DST:
+        route = relay_route_find(cmd);
+        if (!route) {
+            relay_close_fd(cmd->dst_fd);
+            break;
+        }
+
+        /* Whatever was queued for an old destination is stale, reports
+         * buffered while there was none are replayed to the new one.
+         */
+        if (route->dst_fd >= 0)
+            relay_route_drop_queue(route);
+        relay_close_fd(route->dst_fd);
+        route->dst_fd = cmd->dst_fd;
+        route->miss_posted = false;
+        break;
+    case RELAY_CMD_REMOVE:
+        route = relay_route_find(cmd);
+        if (!route)
+            break;
+
+        epoll_ctl(relay_epfd, EPOLL_CTL_DEL, route->src_fd, NULL);
+        relay_close_fd(route->src_fd);
+        relay_close_fd(route->dst_fd);
+        relay_queue_reset(route->queue);
+        memset(route, 0, sizeof(*route));
+        relay_route_publish(route);
+        break;
+    case RELAY_CMD_QUIT:
+        break;
+    }
+}
+
+/* Handles the commands posted so far, returns true once told to quit */
+static bool relay_thread_commands(void)
+{
+    struct relay_cmd cmd;
+    bool quit = false;
+
+    while (!quit && RING_POP(&relay_cmds, &cmd)) {
+        relay_thread_process(&cmd);
+
+        __atomic_store_n(&relay_cmd_acked, cmd.seq, __ATOMIC_RELEASE);
+        relay_eventfd_signal(relay_ack_fd);
+
+        quit = cmd.op == RELAY_CMD_QUIT;
+    }
+
+    return quit;
+}
+
+static void *relay_thread_main(void *user_data)
+{
+    struct epoll_event events[RELAY_THREAD_MAX_ROUTES + 1];
+    bool backlog = false;
+    bool quit = false;
+
+    while (!quit) {
+        int i, nfds;
+
+        nfds = epoll_wait(relay_epfd, events, G_N_ELEMENTS(events),
+                                    backlog ? RELAY_THREAD_FLUSH_MS : -1);
+        if (nfds < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            if (events[i].data.u32 == RELAY_THREAD_DOORBELL)
+                relay_eventfd_clear(relay_doorbell_fd);
+        }
+
+        /* Commands go first, reports read from here on were sent after
+         * they were posted.
+         */
+        quit = relay_thread_commands();
+        if (quit)
+            break;
+
+        for (i = 0; i < nfds; i++) {
+            struct relay_route *route;
+
+            if (events[i].data.u32 == RELAY_THREAD_DOORBELL)
+                continue;
+
+            route = &relay_routes[events[i].data.u32];
+            if (!route->id)
+                continue;
+
+            if (events[i].events & EPOLLIN)
+                relay_route_forward(route);
+
+            /* The main loop sees the hang up on its own watch and tears
+             * the route down, stop polling the dead socket meanwhile.
+             */
+            if (events[i].events & (EPOLLHUP | EPOLLERR))
+                epoll_ctl(relay_epfd, EPOLL_CTL_DEL, route->src_fd, NULL);
+        }
+
+        backlog = relay_routes_flush();
+
+        for (i = 0; i < RELAY_THREAD_MAX_ROUTES; i++) {
+            if (relay_routes[i].dirty)
+                relay_route_publish(&relay_routes[i]);
+        }
+    }
+
+    if (!quit)
+        error("Input relay thread failed: %s (%d)", strerror(errno), errno);
+
+    /* Nothing is touched past this point, let a waiting caller go */
+    __atomic_store_n(&relay_thread_exited, true, __ATOMIC_RELEASE);
+    relay_eventfd_signal(relay_ack_fd);
+
+    return NULL;
+}
+
+static bool relay_thread_gone(void)
+{
+    return !relay_running ||
+                __atomic_load_n(&relay_thread_exited, __ATOMIC_ACQUIRE);
+}
+
+/* Sequence numbers wrap, a is done once acked reached it */
+static bool relay_seq_done(unsigned int seq, unsigned int acked)
+{
+    return (int) (acked - seq) >= 0;
+}
+
+/*
+ * Waits for the thread to make progress. Only used when the command ring
+ * is full, which takes RELAY_RING_SIZE commands posted faster than the
+ * thread handles them.
+ */
+static void relay_thread_wait(void)
+{
+    struct pollfd pfd;
+    int ret;
+
+    pfd.fd = relay_ack_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    ret = poll(&pfd, 1, RELAY_THREAD_ACK_WARN);
+    if (ret < 0 && errno != EINTR)
+        error("Unable to wait for input relay thread: %s (%d)",
+                                            strerror(errno), errno);
+    else if (ret == 0)
+        error("Input relay thread is late handling commands");
+
+    /* Consumed here, so wake the watch running the barriers up again */
+    if (pfd.revents & POLLIN) {
+        relay_eventfd_clear(relay_ack_fd);
+        relay_eventfd_signal(relay_ack_fd);
+    }
+}
+
+/*
+ * Queues cmd for the relay thread without waiting for it to be handled.
+ * Returns false if the thread is gone, in which case nothing is touched
+ * by it anymore either.
+ */
+static bool relay_thread_post(struct relay_cmd *cmd)
+{
+    if (relay_thread_gone())
+        return false;
+
+    cmd->seq = relay_cmd_seq + 1;
+
+    while (!RING_PUSH(&relay_cmds, cmd)) {
+        relay_thread_wait();
+
+        if (relay_thread_gone())
+            return false;
+    }
+
+    relay_cmd_seq = cmd->seq;
+    relay_eventfd_signal(relay_doorbell_fd);
+
+    return true;
+}
+
+/* Runs the barriers whose commands are all done, every one if all is set */
+static void relay_barriers_run(bool all)
+{
+    unsigned int acked;
+
+    acked = __atomic_load_n(&relay_cmd_acked, __ATOMIC_ACQUIRE);
+
+    /* Barriers are appended in sequence order */
+    while (relay_barriers) {
+        struct relay_barrier *barrier = relay_barriers->data;
+
+        if (!all && !relay_seq_done(barrier->seq, acked))
+            break;
+
+        relay_barriers = g_slist_delete_link(relay_barriers,
+                                                    relay_barriers);
+        barrier->func(barrier->user_data);
+        g_free(barrier);
+    }
+}
+
+static gboolean relay_ack_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+    if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+        return FALSE;
+
+    relay_eventfd_clear(relay_ack_fd);
+
+    relay_barriers_run(relay_thread_gone());
+
+    return TRUE;
+}
+
+static gboolean relay_event_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+    struct relay_event event;
+
+    if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL))
+        return FALSE;
+
+    relay_eventfd_clear(relay_event_fd);
+
+    while (RING_POP(&relay_events, &event)) {
+        struct relay_route_handler *handler;
+
+        handler = relay_handlers[event.slot];
+        if (!handler || handler->id != event.id)
+            continue;
+
+        if (handler->miss_func)
+            handler->miss_func(handler->user_data);
+    }
+
+    return TRUE;
+}
+
+static void relay_thread_close_fds(void)
+{
+    if (relay_epfd >= 0)
+        close(relay_epfd);
+    if (relay_doorbell_fd >= 0)
+        close(relay_doorbell_fd);
+    if (relay_ack_fd >= 0)
+        close(relay_ack_fd);
+    if (relay_event_fd >= 0)
+        close(relay_event_fd);
+
+    relay_epfd = relay_doorbell_fd = relay_ack_fd = relay_event_fd = -1;
+}
+
+/*
+ * Starts the relay thread. A priority between 1 and 99 runs it with
+ * SCHED_FIFO, cpu pins it to one CPU; both are best effort and fall back
+ * to the default scheduling if the daemon lacks the privileges.
+ */
+bool relay_thread_start(int priority, int cpu)
+{
+    struct epoll_event ev;
+    GIOChannel *io;
+    int err;
+
+    if (relay_running)
+        return true;
+
+    relay_epfd = epoll_create1(EPOLL_CLOEXEC);
+    relay_doorbell_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    relay_ack_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    relay_event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+    if (relay_epfd < 0 || relay_doorbell_fd < 0 || relay_ack_fd < 0 ||
+                                                    relay_event_fd < 0) {
+        error("Unable to create input relay thread fds: %s (%d)",
+                                            strerror(errno), errno);
+        relay_thread_close_fds();
+        return false;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = RELAY_THREAD_DOORBELL;
+    if (epoll_ctl(relay_epfd, EPOLL_CTL_ADD, relay_doorbell_fd, &ev) < 0) {
+        error("Unable to watch input relay doorbell: %s (%d)",
+                                            strerror(errno), errno);
+        relay_thread_close_fds();
+        return false;
+    }
+
+    err = pthread_create(&relay_tid, NULL, relay_thread_main, NULL);
+    if (err) {
+        error("Unable to start input relay thread: %s (%d)",
+                                                    strerror(err), err);
+        relay_thread_close_fds();
+        return false;
+    }
+
+    pthread_setname_np(relay_tid, "input-relay");
+
+    if (priority > 0) {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = priority;
+
+        err = pthread_setschedparam(relay_tid, SCHED_FIFO, &param);
+        if (err)
+            error("Unable to set SCHED_FIFO priority %d for input relay "
+                    "thread: %s (%d)", priority, strerror(err), err);
+    }
+
+    if (cpu >= 0) {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        err = pthread_setaffinity_np(relay_tid, sizeof(set), &set);
+        if (err)
+            error("Unable to pin input relay thread to CPU %d: %s (%d)",
+                                            cpu, strerror(err), err);
+    }
+
+    io = g_io_channel_unix_new(relay_event_fd);
+    relay_event_watch = g_io_add_watch(io, G_IO_IN | G_IO_ERR | G_IO_HUP |
+                                        G_IO_NVAL, relay_event_cb, NULL);
+    g_io_channel_unref(io);
+
+    io = g_io_channel_unix_new(relay_ack_fd);
+    relay_ack_watch = g_io_add_watch(io, G_IO_IN | G_IO_ERR | G_IO_HUP |
+                                        G_IO_NVAL, relay_ack_cb, NULL);
+    g_io_channel_unref(io);
+
+    relay_running = true;
+
+    DBG("Input relay thread started (priority %d, cpu %d)", priority, cpu);
+
+    return true;
+}
+
+void relay_thread_stop(void)
+{
+    struct relay_cmd cmd;
+    unsigned int i;
+
+    if (!relay_running)
+        return;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.op = RELAY_CMD_QUIT;
+
+    if (!relay_thread_post(&cmd))
+        pthread_cancel(relay_tid);
+
+    /* The fds below must outlive the thread */
+    pthread_join(relay_tid, NULL);
+
+    /* Routes left behind still hold duplicates of their fds */
+    for (i = 0; i < RELAY_THREAD_MAX_ROUTES; i++) {
+        struct relay_route *route = &relay_routes[i];
+
+        if (!route->id)
+            continue;
+
+        relay_close_fd(route->src_fd);
+        relay_close_fd(route->dst_fd);
+        memset(route, 0, sizeof(*route));
+        relay_route_publish(route);
+    }
+
+    relay_running = false;
+    relay_thread_exited = false;
+
+    /* Nothing is in use anymore */
+    relay_barriers_run(true);
+
+    if (relay_event_watch > 0)
+        g_source_remove(relay_event_watch);
+    relay_event_watch = 0;
+
+    if (relay_ack_watch > 0)
+        g_source_remove(relay_ack_watch);
+    relay_ack_watch = 0;
+
+    for (i = 0; i < RELAY_THREAD_MAX_ROUTES; i++) {
+        g_free(relay_handlers[i]);
+        relay_handlers[i] = NULL;
+    }
+
+    relay_thread_close_fds();
+}
+
+bool relay_thread_enabled(void)
+{
+    return relay_running;
+}
+
+/*
+ * Hands src_fd over to the relay thread, which forwards everything read
+ * from it to dst_fd. queue buffers reports dst_fd is not ready for, and
+ * while dst_fd is -1 everything read is buffered there for the next
+ * destination and miss_func is called. The queue belongs to the thread
+ * until the route is removed and a relay_thread_barrier() queued after
+ * that has run. SET_PROTOCOL requests read from src_fd are tracked in
+ * protocol_queue, if any. flags is a mask of RELAY_THREAD_* route flags.
+ * The thread works on duplicates of the fds, the caller keeps its own.
+ * Returns the route id, 0 on failure.
+ */
+unsigned int relay_thread_add(int src_fd, int dst_fd, unsigned int flags,
+				struct relay_queue *queue,
+				struct relay_queue *protocol_queue,
+				relay_thread_miss_func_t miss_func,
+				void *user_data)
+{
+    struct relay_route_handler *handler;
+    struct relay_cmd cmd;
+    unsigned int slot;
+
+    if (relay_thread_gone())
+        return 0;
+
+    /* A slot is free again as soon as its removal is posted, the thread
+     * handles commands in order.
+     */
+    for (slot = 0; slot < RELAY_THREAD_MAX_ROUTES; slot++) {
+        if (!relay_handlers[slot])
+            break;
+    }
+
+    if (slot == RELAY_THREAD_MAX_ROUTES)
+        return 0;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.op = RELAY_CMD_ADD;
+    cmd.id = relay_next_id++;
+    cmd.slot = slot;
+    cmd.src_fd = relay_dup_fd(src_fd);
+    cmd.dst_fd = relay_dup_fd(dst_fd);
+    cmd.flags = flags;
+    cmd.queue = queue;
+    cmd.protocol_queue = protocol_queue;
+
+    if (!relay_next_id)
+        relay_next_id = 1;
+
+    if (cmd.src_fd < 0 || (dst_fd >= 0 && cmd.dst_fd < 0) ||
+                                            !relay_thread_post(&cmd)) {
+        relay_close_fd(cmd.src_fd);
+        relay_close_fd(cmd.dst_fd);
+        return 0;
+    }
+
+    handler = g_new0(struct relay_route_handler, 1);
+    handler->id = cmd.id;
+    handler->miss_func = miss_func;
+    handler->user_data = user_data;
+    relay_handlers[slot] = handler;
+
+    return cmd.id;
+}
+
+static unsigned int relay_handler_slot(unsigned int id)
+{
+    unsigned int slot;
+
+    for (slot = 0; slot < RELAY_THREAD_MAX_ROUTES; slot++) {
+        if (relay_handlers[slot] && relay_handlers[slot]->id == id)
+            break;
+    }
+
+    return slot;
+}
+
+bool relay_thread_set_dst(unsigned int id, int dst_fd)
+{
+    struct relay_cmd cmd;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.op = RELAY_CMD_SET_DST;
+    cmd.id = id;
+    cmd.slot = relay_handler_slot(id);
+    cmd.dst_fd = relay_dup_fd(dst_fd);
+
+    if (cmd.slot == RELAY_THREAD_MAX_ROUTES ||
+                (dst_fd >= 0 && cmd.dst_fd < 0) || !relay_thread_post(&cmd)) {
+        relay_close_fd(cmd.dst_fd);
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * Adds what the route counted since the last collection to stats and
+ * latency, either may be NULL to discard it. This reads what the thread
+ * last published and never waits for it.
+ */
+bool relay_thread_collect(unsigned int id, struct relay_stats *stats,
+					struct relay_latency *latency)
+{
+    struct relay_route_handler *handler;
+    struct relay_stats route_stats;
+    struct relay_latency route_latency;
+    unsigned int slot;
+
+    slot = relay_handler_slot(id);
+    if (slot == RELAY_THREAD_MAX_ROUTES)
+        return false;
+
+    handler = relay_handlers[slot];
+
+    /* Not added by the thread yet, nothing was counted */
+    if (!relay_snapshot_read(slot, id, &route_stats, &route_latency))
+        return true;
+
+    if (stats) {
+        struct relay_stats delta = route_stats;
+
+        relay_stats_sub(&delta, &handler->stats);
+        relay_stats_merge(stats, &delta);
+    }
+
+    if (latency) {
+        struct relay_latency delta = route_latency;
+
+        relay_latency_sub(&delta, &handler->latency);
+        relay_latency_merge(latency, &delta);
+    }
+
+    handler->stats = route_stats;
+    handler->latency = route_latency;
+
+    return true;
+}
+
+/*
+ * Removes the route, collecting its last counters as relay_thread_collect().
+ * Reports still in its queue are dropped without being counted. The thread
+ * lets go of the route asynchronously, see relay_thread_barrier().
+ */
+bool relay_thread_remove(unsigned int id, struct relay_stats *stats,
+					struct relay_latency *latency)
+{
+    struct relay_cmd cmd;
+    unsigned int slot;
+
+    slot = relay_handler_slot(id);
+    if (slot == RELAY_THREAD_MAX_ROUTES)
+        return false;
+
+    relay_thread_collect(id, stats, latency);
+
+    g_free(relay_handlers[slot]);
+    relay_handlers[slot] = NULL;
+
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.op = RELAY_CMD_REMOVE;
+    cmd.id = id;
+    cmd.slot = slot;
+
+    return relay_thread_post(&cmd);
+}
+
+/*
+ * Calls func on the main loop once the thread handled every command posted
+ * so far, e.g. to free the queues of removed routes. It is called right
+ * away if that is already the case or the thread is not running.
+ */
+void relay_thread_barrier(relay_thread_done_func_t func, void *user_data)
+{
+    struct relay_barrier *barrier;
+
+    if (relay_thread_gone() || relay_seq_done(relay_cmd_seq,
+                    __atomic_load_n(&relay_cmd_acked, __ATOMIC_ACQUIRE))) {
+        func(user_data);
+        return;
+    }
+
+    barrier = g_new0(struct relay_barrier, 1);
+    barrier->seq = relay_cmd_seq;
+    barrier->func = func;
+    barrier->user_data = user_data;
+    relay_barriers = g_slist_append(relay_barriers, barrier);
+}
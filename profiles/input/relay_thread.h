@@ -0,0 +1,37 @@
+//
+// Optional real-time thread running the HID relay data plane.
+//
+
+#ifndef BLUEZ_INPUT_RELAY_THREAD_H
+#define BLUEZ_INPUT_RELAY_THREAD_H
+#include <stdbool.h>
+#include "relay.h"
+
+/* Called on the main loop when a route read reports while its
+ * destination was not connected.
+ */
+typedef void (*relay_thread_miss_func_t)(void *user_data);
+
+/* Called on the main loop by relay_thread_barrier() */
+typedef void (*relay_thread_done_func_t)(void *user_data);
+
+/* src_fd is a local control socket, refuse RELAY_SHM_REQUEST read from it */
+#define RELAY_THREAD_REFUSE_SHM		0x01
+
+bool relay_thread_start(int priority, int cpu);
+void relay_thread_stop(void);
+bool relay_thread_enabled(void);
+
+unsigned int relay_thread_add(int src_fd, int dst_fd, unsigned int flags,
+				struct relay_queue *queue,
+				struct relay_queue *protocol_queue,
+				relay_thread_miss_func_t miss_func,
+				void *user_data);
+bool relay_thread_set_dst(unsigned int id, int dst_fd);
+bool relay_thread_collect(unsigned int id, struct relay_stats *stats,
+					struct relay_latency *latency);
+bool relay_thread_remove(unsigned int id, struct relay_stats *stats,
+					struct relay_latency *latency);
+void relay_thread_barrier(relay_thread_done_func_t func, void *user_data);
+
+#endif //BLUEZ_INPUT_RELAY_THREAD_H
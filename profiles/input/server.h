@@ -21,7 +21,18 @@
  *
  */
 
+/* Default age in ms up to which reports buffered while an input host
+ * reconnects are replayed once its BT channels are back.
+ */
+#define IH_RECONNECT_REPLAY_TIME	3000
+
 void set_input_device_profile_enabled(bool input_device_profile_enabled);
 void set_input_device_profile_sdp_record(sdp_record_t *rec);
+void input_host_set_relay_queue(size_t size, enum relay_queue_policy policy);
+void input_host_set_merge_boot_reports(bool merge);
+void input_host_set_shared_memory_relay(bool enabled);
+bool input_host_router_start(const char *mode);
+void input_host_router_stop(void);
+void input_host_set_reconnect_policy(unsigned int replay_time, unsigned int keep_alive, bool sniff);
 int server_start(const bdaddr_t *src);
 void server_stop(const bdaddr_t *src);
@@ -6338,6 +6338,8 @@ static void adapter_remove(struct btd_adapter *adapter)
 	g_slist_free(adapter->connect_list);
 	adapter->connect_list = NULL;
 
+	btd_gatt_database_store_ccc(adapter->database);
+
 	for (l = adapter->devices; l; l = l->next)
 		device_remove(l->data, FALSE);
 
@@ -9698,6 +9700,8 @@ int adapter_init(void)
 
 void adapter_cleanup(void)
 {
+	struct mgmt_read_stats stats;
+
 	g_list_free(adapter_list);
 
 	while (adapters) {
@@ -9727,6 +9731,11 @@ void adapter_cleanup(void)
 	 */
 	mgmt_cancel_index(mgmt_master, MGMT_INDEX_NONE);
 
+	if (mgmt_get_read_stats(mgmt_master, &stats) && stats.wakeups)
+		DBG("mgmt: %" PRIu64 " events in %" PRIu64 " wakeups (max %u)",
+					stats.events, stats.wakeups,
+					stats.max_events);
+
 	mgmt_unref(mgmt_master);
 	mgmt_master = NULL;
 
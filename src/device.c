@@ -35,6 +35,8 @@
 #include <errno.h>
 #include <dirent.h>
 #include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <glib.h>
 #include <dbus/dbus.h>
@@ -195,6 +197,7 @@ struct btd_device {
 	bool		le;
 	bool		pending_paired;		/* "Paired" waiting for SDP */
 	bool		svc_refreshed;
+	bool		gatt_keyfile;		/* Attributes left in cache file */
 
 	/* Manage whether this device can wake the system from suspend.
 	 * - wake_support: Requires a profile that supports wake (i.e. HID)
@@ -604,9 +607,19 @@ static void gatt_client_cleanup(struct btd_device *device)
 
 static void gatt_server_cleanup(struct btd_device *device)
 {
+	struct bt_gatt_server_nfy_mult_stats stats;
+
 	if (!device->server)
 		return;
 
+	if (bt_gatt_server_get_nfy_mult_stats(device->server, &stats) &&
+								stats.pdus)
+		DBG("Multiple notifications: %u values in %u PDUs, "
+			"%llu us average added latency, %u us max",
+			stats.values, stats.pdus,
+			(unsigned long long) stats.latency / stats.values,
+			stats.max_latency);
+
 	btd_gatt_database_att_disconnected(
 			btd_adapter_get_database(device->adapter), device);
 
@@ -2309,12 +2322,71 @@ static void store_services(struct btd_device *device)
 	g_key_file_free(key_file);
 }
 
+/*
+ * The remote database is cached in a binary file next to the cache file of
+ * the device. It is a header followed by one record per declaration, in
+ * handle order, so it can be mapped and loaded in a single pass without any
+ * text parsing:
+ *
+ *   header:     magic[4] "BGC1", length of the records (le32)
+ *   service:    type (0 primary, 1 secondary), handle, end handle, uuid
+ *   include:    type (2), handle, service start, service end
+ *   chrc:       type (3), handle, value handle, properties (u8), uuid,
+ *               value length (u8), value (the Database Hash)
+ *   descriptor: type (4), handle, uuid, value length (u8), value
+ *               (the Extended Properties)
+ *
+ * Handles are le16, UUIDs a length (2 or 16) followed by the UUID in
+ * little endian.
+ */
+#define GATT_CACHE_MAGIC		"BGC1"
+#define GATT_CACHE_HDR_LEN		8
+
+enum {
+	GATT_CACHE_PRIM,
+	GATT_CACHE_SND,
+	GATT_CACHE_INCL,
+	GATT_CACHE_CHRC,
+	GATT_CACHE_DESC,
+};
+
 struct gatt_saver {
 	struct btd_device *device;
 	uint16_t ext_props;
-	GKeyFile *key_file;
+	GByteArray *buf;
 };
 
+static void gatt_cache_put_u8(GByteArray *buf, uint8_t val)
+{
+	g_byte_array_append(buf, &val, sizeof(val));
+}
+
+static void gatt_cache_put_le16(GByteArray *buf, uint16_t val)
+{
+	uint8_t le[2];
+
+	put_le16(val, le);
+	g_byte_array_append(buf, le, sizeof(le));
+}
+
+static void gatt_cache_put_uuid(GByteArray *buf, const bt_uuid_t *uuid)
+{
+	uint8_t le[16];
+	uint8_t len = uuid->type == BT_UUID16 ? 2 : 16;
+
+	bt_uuid_to_le(uuid, le);
+	gatt_cache_put_u8(buf, len);
+	g_byte_array_append(buf, le, len);
+}
+
+static void gatt_cache_put_value(GByteArray *buf, const uint8_t *value,
+								uint8_t len)
+{
+	gatt_cache_put_u8(buf, len);
+	if (len)
+		g_byte_array_append(buf, value, len);
+}
+
 static void db_hash_read_value_cb(struct gatt_db_attribute *attrib,
 						int err, const uint8_t *value,
 						size_t length, void *user_data)
@@ -2330,35 +2402,31 @@ static void db_hash_read_value_cb(struct gatt_db_attribute *attrib,
 static void store_desc(struct gatt_db_attribute *attr, void *user_data)
 {
 	struct gatt_saver *saver = user_data;
-	GKeyFile *key_file = saver->key_file;
-	char handle[6], value[100], uuid_str[MAX_LEN_UUID_STR];
 	const bt_uuid_t *uuid;
 	bt_uuid_t ext_uuid;
-	uint16_t handle_num;
-
-	handle_num = gatt_db_attribute_get_handle(attr);
-	sprintf(handle, "%04hx", handle_num);
+	uint8_t value[2];
 
 	uuid = gatt_db_attribute_get_type(attr);
-	bt_uuid_to_string(uuid, uuid_str, sizeof(uuid_str));
 
-	bt_uuid16_create(&ext_uuid, GATT_CHARAC_EXT_PROPER_UUID);
-	if (!bt_uuid_cmp(uuid, &ext_uuid) && saver->ext_props)
-		sprintf(value, "%04hx:%s", saver->ext_props, uuid_str);
-	else
-		sprintf(value, "%s", uuid_str);
+	gatt_cache_put_u8(saver->buf, GATT_CACHE_DESC);
+	gatt_cache_put_le16(saver->buf, gatt_db_attribute_get_handle(attr));
+	gatt_cache_put_uuid(saver->buf, uuid);
 
-	g_key_file_set_string(key_file, "Attributes", handle, value);
+	bt_uuid16_create(&ext_uuid, GATT_CHARAC_EXT_PROPER_UUID);
+	if (!bt_uuid_cmp(uuid, &ext_uuid) && saver->ext_props) {
+		put_le16(saver->ext_props, value);
+		gatt_cache_put_value(saver->buf, value, sizeof(value));
+	} else
+		gatt_cache_put_value(saver->buf, NULL, 0);
 }
 
 static void store_chrc(struct gatt_db_attribute *attr, void *user_data)
 {
 	struct gatt_saver *saver = user_data;
-	GKeyFile *key_file = saver->key_file;
-	char handle[6], value[100], uuid_str[MAX_LEN_UUID_STR];
 	uint16_t handle_num, value_handle;
 	uint8_t properties;
 	bt_uuid_t uuid, hash_uuid;
+	const uint8_t *hash = NULL;
 
 	if (!gatt_db_attribute_get_char_data(attr, &handle_num, &value_handle,
 						&properties, &saver->ext_props,
@@ -2367,37 +2435,23 @@ static void store_chrc(struct gatt_db_attribute *attr, void *user_data)
 		return;
 	}
 
-	sprintf(handle, "%04hx", handle_num);
-	bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-
 	/* Store Database Hash  value if available */
 	bt_uuid16_create(&hash_uuid, GATT_CHARAC_DB_HASH);
 	if (!bt_uuid_cmp(&uuid, &hash_uuid)) {
-		const uint8_t *hash = NULL;
+		struct gatt_db_attribute *value_attr;
 
-		attr = gatt_db_get_attribute(saver->device->db, value_handle);
-
-		gatt_db_attribute_read(attr, 0, BT_ATT_OP_READ_REQ, NULL,
+		value_attr = gatt_db_get_attribute(saver->device->db,
+								value_handle);
+		gatt_db_attribute_read(value_attr, 0, BT_ATT_OP_READ_REQ, NULL,
 					db_hash_read_value_cb, &hash);
-		if (hash)
-			sprintf(value, GATT_CHARAC_UUID_STR ":%04hx:%02hhx:"
-				"%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx"
-				"%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx%02hhx"
-				"%02hhx%02hhx:%s", value_handle, properties,
-				hash[0], hash[1], hash[2], hash[3],
-				hash[4], hash[5], hash[6], hash[7],
-				hash[8], hash[9], hash[10], hash[11],
-				hash[12], hash[13], hash[14], hash[15],
-				uuid_str);
-		else
-			sprintf(value, GATT_CHARAC_UUID_STR ":%04hx:%02hhx:%s",
-				value_handle, properties, uuid_str);
-
-	} else
-		sprintf(value, GATT_CHARAC_UUID_STR ":%04hx:%02hhx:%s",
-				value_handle, properties, uuid_str);
+	}
 
-	g_key_file_set_string(key_file, "Attributes", handle, value);
+	gatt_cache_put_u8(saver->buf, GATT_CACHE_CHRC);
+	gatt_cache_put_le16(saver->buf, handle_num);
+	gatt_cache_put_le16(saver->buf, value_handle);
+	gatt_cache_put_u8(saver->buf, properties);
+	gatt_cache_put_uuid(saver->buf, &uuid);
+	gatt_cache_put_value(saver->buf, hash, hash ? 16 : 0);
 
 	gatt_db_service_foreach_desc(attr, store_desc, saver);
 }
@@ -2405,42 +2459,25 @@ static void store_chrc(struct gatt_db_attribute *attr, void *user_data)
 static void store_incl(struct gatt_db_attribute *attr, void *user_data)
 {
 	struct gatt_saver *saver = user_data;
-	GKeyFile *key_file = saver->key_file;
-	struct gatt_db_attribute *service;
-	char handle[6], value[100], uuid_str[MAX_LEN_UUID_STR];
 	uint16_t handle_num, start, end;
-	bt_uuid_t uuid;
 
 	if (!gatt_db_attribute_get_incl_data(attr, &handle_num, &start, &end)) {
 		warn("Error storing included service - can't get data");
 		return;
 	}
 
-	service = gatt_db_get_attribute(saver->device->db, start);
-	if (!service) {
-		warn("Error storing included service - can't find it");
-		return;
-	}
-
-	sprintf(handle, "%04hx", handle_num);
-
-	gatt_db_attribute_get_service_uuid(service, &uuid);
-	bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
-	sprintf(value, GATT_INCLUDE_UUID_STR ":%04hx:%04hx:%s", start,
-								end, uuid_str);
-
-	g_key_file_set_string(key_file, "Attributes", handle, value);
+	gatt_cache_put_u8(saver->buf, GATT_CACHE_INCL);
+	gatt_cache_put_le16(saver->buf, handle_num);
+	gatt_cache_put_le16(saver->buf, start);
+	gatt_cache_put_le16(saver->buf, end);
 }
 
 static void store_service(struct gatt_db_attribute *attr, void *user_data)
 {
 	struct gatt_saver *saver = user_data;
-	GKeyFile *key_file = saver->key_file;
-	char uuid_str[MAX_LEN_UUID_STR], handle[6], value[256];
 	uint16_t start, end;
 	bt_uuid_t uuid;
 	bool primary;
-	char *type;
 
 	if (!gatt_db_attribute_get_service_data(attr, &start, &end, &primary,
 								&uuid)) {
@@ -2448,31 +2485,63 @@ static void store_service(struct gatt_db_attribute *attr, void *user_data)
 		return;
 	}
 
-	sprintf(handle, "%04hx", start);
+	gatt_cache_put_u8(saver->buf, primary ? GATT_CACHE_PRIM :
+							GATT_CACHE_SND);
+	gatt_cache_put_le16(saver->buf, start);
+	gatt_cache_put_le16(saver->buf, end);
+	gatt_cache_put_uuid(saver->buf, &uuid);
 
-	bt_uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+	gatt_db_service_foreach_incl(attr, store_incl, saver);
+	gatt_db_service_foreach_char(attr, store_chrc, saver);
+}
 
-	if (primary)
-		type = GATT_PRIM_SVC_UUID_STR;
-	else
-		type = GATT_SND_SVC_UUID_STR;
+static bool gatt_cache_unchanged(const char *filename, const GByteArray *buf)
+{
+	char *data;
+	gsize length;
+	bool unchanged;
 
-	sprintf(value, "%s:%04hx:%s", type, end, uuid_str);
+	if (!g_file_get_contents(filename, &data, &length, NULL))
+		return false;
 
-	g_key_file_set_string(key_file, "Attributes", handle, value);
+	unchanged = length == buf->len && !memcmp(data, buf->data, length);
 
-	gatt_db_service_foreach_incl(attr, store_incl, saver);
-	gatt_db_service_foreach_char(attr, store_chrc, saver);
+	g_free(data);
+
+	return unchanged;
 }
 
-static void store_gatt_db(struct btd_device *device)
+/* Drops the text format attributes once the binary cache replaced them */
+static void remove_gatt_db_keyfile(struct btd_device *device,
+							const char *dst_addr)
 {
 	char filename[PATH_MAX];
-	char dst_addr[18];
 	GKeyFile *key_file;
 	char *data;
 	gsize length = 0;
+
+	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s",
+				btd_adapter_get_storage_dir(device->adapter),
+				dst_addr);
+
+	key_file = g_key_file_new();
+	g_key_file_load_from_file(key_file, filename, 0, NULL);
+
+	if (g_key_file_remove_group(key_file, "Attributes", NULL)) {
+		data = g_key_file_to_data(key_file, &length, NULL);
+		g_file_set_contents(filename, data, length, NULL);
+		g_free(data);
+	}
+
+	g_key_file_free(key_file);
+}
+
+static void store_gatt_db(struct btd_device *device)
+{
+	char filename[PATH_MAX];
+	char dst_addr[18];
 	struct gatt_saver saver;
+	uint8_t len[4];
 
 	if (device_address_is_private(device)) {
 		DBG("Can't store GATT db for private addressed device %s",
@@ -2485,29 +2554,44 @@ static void store_gatt_db(struct btd_device *device)
 
 	ba2str(&device->bdaddr, dst_addr);
 
-	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s",
-				btd_adapter_get_storage_dir(device->adapter),
-				dst_addr);
-	create_file(filename, S_IRUSR | S_IWUSR);
+	saver.device = device;
+	saver.buf = g_byte_array_new();
 
-	key_file = g_key_file_new();
-	g_key_file_load_from_file(key_file, filename, 0, NULL);
+	g_byte_array_append(saver.buf, (const guint8 *) GATT_CACHE_MAGIC, 4);
+	g_byte_array_append(saver.buf, len, sizeof(len));
 
-	/* Remove current attributes since it might have changed */
-	g_key_file_remove_group(key_file, "Attributes", NULL);
+	gatt_db_foreach_service(device->db, NULL, store_service, &saver);
 
-	saver.key_file = key_file;
-	saver.device = device;
+	put_le32(saver.buf->len - GATT_CACHE_HDR_LEN, saver.buf->data + 4);
 
-	gatt_db_foreach_service(device->db, NULL, store_service, &saver);
+	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s.gatt",
+				btd_adapter_get_storage_dir(device->adapter),
+				dst_addr);
 
-	data = g_key_file_to_data(key_file, &length, NULL);
-	g_file_set_contents(filename, data, length, NULL);
+	/* Skip the write when nothing changed, e.g. when the hash matched */
+	if (!gatt_cache_unchanged(filename, saver.buf)) {
+		GError *gerr = NULL;
 
-	g_free(data);
-	g_key_file_free(key_file);
-}
+		create_file(filename, S_IRUSR | S_IWUSR);
+		if (!g_file_set_contents(filename,
+					(const char *) saver.buf->data,
+					saver.buf->len, &gerr)) {
+			error("Unable to store gatt db for %s: %s", dst_addr,
+								gerr->message);
+			g_error_free(gerr);
+			g_byte_array_unref(saver.buf);
+			return;
+		}
+	}
 
+	g_byte_array_unref(saver.buf);
+
+	/* The text format is only dropped once the binary one is stored */
+	if (device->gatt_keyfile) {
+		remove_gatt_db_keyfile(device, dst_addr);
+		device->gatt_keyfile = false;
+	}
+}
 
 static void browse_request_complete(struct browse_req *req, uint8_t type,
 						uint8_t bdaddr_type, int err)
@@ -3732,17 +3816,353 @@ static int load_gatt_db_impl(GKeyFile *key_file, char **keys,
 	return 0;
 }
 
+struct gatt_cache_record {
+	uint8_t type;
+	uint16_t handle;
+	/* End handle of services, value handle of characteristics */
+	uint16_t end;
+	uint16_t incl_start;
+	uint8_t properties;
+	bt_uuid_t uuid;
+	const uint8_t *value;
+	uint8_t value_len;
+};
+
+struct gatt_cache_reader {
+	const uint8_t *data;
+	size_t len;
+	size_t off;
+};
+
+static bool gatt_cache_get_u8(struct gatt_cache_reader *r, uint8_t *val)
+{
+	if (r->len - r->off < 1)
+		return false;
+
+	*val = r->data[r->off++];
+
+	return true;
+}
+
+static bool gatt_cache_get_le16(struct gatt_cache_reader *r, uint16_t *val)
+{
+	if (r->len - r->off < 2)
+		return false;
+
+	*val = get_le16(r->data + r->off);
+	r->off += 2;
+
+	return true;
+}
+
+static bool gatt_cache_get_uuid(struct gatt_cache_reader *r, bt_uuid_t *uuid)
+{
+	uint128_t u128;
+	uint8_t len;
+
+	if (!gatt_cache_get_u8(r, &len) || r->len - r->off < len)
+		return false;
+
+	switch (len) {
+	case 2:
+		bt_uuid16_create(uuid, get_le16(r->data + r->off));
+		break;
+	case 16:
+		bswap_128(r->data + r->off, &u128);
+		bt_uuid128_create(uuid, u128);
+		break;
+	default:
+		return false;
+	}
+
+	r->off += len;
+
+	return true;
+}
+
+static bool gatt_cache_get_value(struct gatt_cache_reader *r,
+						struct gatt_cache_record *rec)
+{
+	if (!gatt_cache_get_u8(r, &rec->value_len) ||
+					r->len - r->off < rec->value_len)
+		return false;
+
+	rec->value = r->data + r->off;
+	r->off += rec->value_len;
+
+	return true;
+}
+
+/* Decodes the next record, values point into the mapping */
+static int gatt_cache_next(struct gatt_cache_reader *r,
+						struct gatt_cache_record *rec)
+{
+	if (r->off == r->len)
+		return 0;
+
+	if (!gatt_cache_get_u8(r, &rec->type) ||
+				!gatt_cache_get_le16(r, &rec->handle))
+		return -EIO;
+
+	switch (rec->type) {
+	case GATT_CACHE_PRIM:
+	case GATT_CACHE_SND:
+		if (!gatt_cache_get_le16(r, &rec->end) ||
+					!gatt_cache_get_uuid(r, &rec->uuid) ||
+					rec->end < rec->handle)
+			return -EIO;
+		break;
+	case GATT_CACHE_INCL:
+		if (!gatt_cache_get_le16(r, &rec->incl_start) ||
+					!gatt_cache_get_le16(r, &rec->end))
+			return -EIO;
+		break;
+	case GATT_CACHE_CHRC:
+		if (!gatt_cache_get_le16(r, &rec->end) ||
+				!gatt_cache_get_u8(r, &rec->properties) ||
+				!gatt_cache_get_uuid(r, &rec->uuid) ||
+				!gatt_cache_get_value(r, rec))
+			return -EIO;
+		break;
+	case GATT_CACHE_DESC:
+		if (!gatt_cache_get_uuid(r, &rec->uuid) ||
+					!gatt_cache_get_value(r, rec))
+			return -EIO;
+		break;
+	default:
+		return -EIO;
+	}
+
+	return 1;
+}
+
+static int load_cache_service(struct gatt_db *db,
+					const struct gatt_cache_record *rec)
+{
+	DBG("loading service: 0x%04x, end: 0x%04x", rec->handle, rec->end);
+
+	if (!gatt_db_insert_service(db, rec->handle, &rec->uuid,
+					rec->type == GATT_CACHE_PRIM,
+					rec->end - rec->handle + 1)) {
+		error("Unable load service into db!");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int load_cache_incl(struct gatt_db *db,
+					const struct gatt_cache_record *rec,
+					struct gatt_db_attribute *service)
+{
+	struct gatt_db_attribute *att;
+
+	DBG("loading included service: 0x%04x, end: 0x%04x",
+						rec->incl_start, rec->end);
+
+	att = gatt_db_get_attribute(db, rec->incl_start);
+	if (!att) {
+		warn("loading included service to db failed - no such service");
+		return -EIO;
+	}
+
+	att = gatt_db_service_insert_included(service, rec->handle, att);
+	if (!att || gatt_db_attribute_get_handle(att) != rec->handle) {
+		warn("loading included service to db failed");
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int load_cache_chrc(const struct gatt_cache_record *rec,
+					struct gatt_db_attribute *service)
+{
+	struct gatt_db_attribute *att;
+
+	DBG("loading characteristic handle: 0x%04x, value handle: 0x%04x,"
+				" properties 0x%02x", rec->handle, rec->end,
+				rec->properties);
+
+	att = gatt_db_service_insert_characteristic(service, rec->end,
+							&rec->uuid, 0,
+							rec->properties,
+							NULL, NULL, NULL);
+	if (!att || gatt_db_attribute_get_handle(att) != rec->end) {
+		warn("loading characteristic to db failed");
+		return -EIO;
+	}
+
+	if (rec->value_len && !gatt_db_attribute_write(att, 0, rec->value,
+						rec->value_len, 0, NULL,
+						load_desc_value, NULL))
+		return -EIO;
+
+	return 0;
+}
+
+static int load_cache_desc(const struct gatt_cache_record *rec,
+					struct gatt_db_attribute *service)
+{
+	struct gatt_db_attribute *att;
+	bt_uuid_t ext_uuid;
+
+	DBG("loading descriptor handle: 0x%04x", rec->handle);
+
+	/* If it is CEP then it must contain the value */
+	bt_uuid16_create(&ext_uuid, GATT_CHARAC_EXT_PROPER_UUID);
+	if (!bt_uuid_cmp(&rec->uuid, &ext_uuid) && !rec->value_len) {
+		warn("cannot load CEP descriptor without value");
+		return -EIO;
+	}
+
+	att = gatt_db_service_insert_descriptor(service, rec->handle,
+							&rec->uuid, 0, NULL,
+							NULL, NULL);
+	if (!att || gatt_db_attribute_get_handle(att) != rec->handle) {
+		warn("loading descriptor to db failed");
+		return -EIO;
+	}
+
+	if (rec->value_len && !gatt_db_attribute_write(att, 0, rec->value,
+						rec->value_len, 0, NULL,
+						load_desc_value, NULL))
+		return -EIO;
+
+	return 0;
+}
+
+static int load_gatt_cache_impl(const uint8_t *data, size_t len,
+							struct gatt_db *db)
+{
+	struct gatt_db_attribute *current_service = NULL;
+	struct gatt_cache_record rec;
+	struct gatt_cache_reader r;
+	int ret;
+
+	/* first load service definitions */
+	r = (struct gatt_cache_reader) { data, len, 0 };
+	while ((ret = gatt_cache_next(&r, &rec)) > 0) {
+		if (rec.type != GATT_CACHE_PRIM && rec.type != GATT_CACHE_SND)
+			continue;
+
+		ret = load_cache_service(db, &rec);
+		if (ret)
+			break;
+	}
+
+	if (ret) {
+		gatt_db_clear(db);
+		return ret;
+	}
+
+	/* then fill them with data */
+	r = (struct gatt_cache_reader) { data, len, 0 };
+	while ((ret = gatt_cache_next(&r, &rec)) > 0) {
+		switch (rec.type) {
+		case GATT_CACHE_PRIM:
+		case GATT_CACHE_SND:
+			if (current_service)
+				gatt_db_service_set_active(current_service,
+									true);
+
+			current_service = gatt_db_get_attribute(db, rec.handle);
+			ret = current_service ? 0 : -EIO;
+			break;
+		case GATT_CACHE_INCL:
+			ret = current_service ? load_cache_incl(db, &rec,
+						current_service) : -EIO;
+			break;
+		case GATT_CACHE_CHRC:
+			ret = current_service ? load_cache_chrc(&rec,
+						current_service) : -EIO;
+			break;
+		case GATT_CACHE_DESC:
+			ret = current_service ? load_cache_desc(&rec,
+						current_service) : -EIO;
+			break;
+		}
+
+		if (ret)
+			break;
+	}
+
+	if (ret) {
+		gatt_db_clear(db);
+		return ret;
+	}
+
+	if (current_service)
+		gatt_db_service_set_active(current_service, true);
+
+	return 0;
+}
+
+/* Returns -ENOENT if there is no binary cache for the device */
+static int load_gatt_cache(struct btd_device *device, const char *local,
+							const char *peer)
+{
+	char filename[PATH_MAX];
+	struct stat st;
+	uint8_t *map;
+	size_t len;
+	int fd, err;
+
+	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s.gatt", local,
+									peer);
+
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -ENOENT;
+
+	if (fstat(fd, &st) < 0 || st.st_size < GATT_CACHE_HDR_LEN) {
+		close(fd);
+		return -EIO;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	err = map == MAP_FAILED ? -errno : 0;
+	close(fd);
+
+	if (err < 0)
+		return err;
+
+	len = get_le32(map + 4);
+
+	if (memcmp(map, GATT_CACHE_MAGIC, 4) ||
+				len != (size_t) st.st_size - GATT_CACHE_HDR_LEN)
+		err = -EIO;
+	else
+		err = load_gatt_cache_impl(map + GATT_CACHE_HDR_LEN, len,
+								device->db);
+
+	munmap(map, st.st_size);
+
+	return err;
+}
+
 static void load_gatt_db(struct btd_device *device, const char *local,
 							const char *peer)
 {
 	char **keys, filename[PATH_MAX];
 	GKeyFile *key_file;
+	int err;
 
 	if (!gatt_cache_is_enabled(device))
 		return;
 
 	DBG("Restoring %s gatt database from file", peer);
 
+	err = load_gatt_cache(device, local, peer);
+	if (!err)
+		goto done;
+
+	if (err != -ENOENT) {
+		warn("Unable to load gatt db from file for %s", peer);
+		return;
+	}
+
+	/* Fallback to the text format of older versions */
 	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s", local, peer);
 
 	key_file = g_key_file_new();
@@ -3758,9 +4178,13 @@ static void load_gatt_db(struct btd_device *device, const char *local,
 	if (load_gatt_db_impl(key_file, keys, device->db))
 		warn("Unable to load gatt db from file for %s", peer);
 
+	/* Converted to the binary format by the next store_gatt_db() */
+	device->gatt_keyfile = true;
+
 	g_strfreev(keys);
 	g_key_file_free(key_file);
 
+done:
 	g_slist_free_full(device->primaries, g_free);
 	device->primaries = NULL;
 	gatt_db_foreach_service(device->db, NULL, add_primary,
@@ -4418,6 +4842,7 @@ static void device_remove_stored(struct btd_device *device)
 	key_file = g_key_file_new();
 	g_key_file_load_from_file(key_file, filename, 0, NULL);
 	g_key_file_remove_group(key_file, "ServiceRecords", NULL);
+	g_key_file_remove_group(key_file, "Attributes", NULL);
 
 	data = g_key_file_to_data(key_file, &length, NULL);
 	if (length > 0) {
@@ -4427,6 +4852,12 @@ static void device_remove_stored(struct btd_device *device)
 
 	g_free(data);
 	g_key_file_free(key_file);
+
+	snprintf(filename, PATH_MAX, STORAGEDIR "/%s/cache/%s.gatt",
+				btd_adapter_get_storage_dir(device->adapter),
+				device_addr);
+	unlink(filename);
+	device->gatt_keyfile = false;
 }
 
 void device_remove(struct btd_device *device, gboolean remove_stored)
@@ -5211,6 +5642,8 @@ static void gatt_server_init(struct btd_device *device,
 
 	bt_att_set_enc_key_size(device->att, device->ltk_enc_size);
 	bt_gatt_server_set_debug(device->server, gatt_debug, NULL, NULL);
+	bt_gatt_server_set_nfy_mult_latency(device->server,
+					main_opts.gatt_nfy_mult_latency);
 
 	btd_gatt_database_server_connected(database, device->server);
 }
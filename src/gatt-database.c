@@ -63,6 +63,9 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
 
+/* Seconds CCC changes are held before being written to storage */
+#define CCC_STORE_DELAY	1
+
 struct gatt_record {
 	struct btd_gatt_database *database;
 	uint32_t handle;
@@ -86,6 +89,15 @@ struct btd_gatt_database {
 	struct gatt_db_attribute *eatt;
 	struct queue *apps;
 	struct queue *profiles;
+	struct queue *ccc_stores;
+	guint ccc_store_id;
+};
+
+/* A Service Changed CCC value waiting to be written to storage */
+struct ccc_store {
+	bdaddr_t bdaddr;
+	uint8_t bdaddr_type;
+	uint16_t value;
 };
 
 struct gatt_app {
@@ -166,6 +178,7 @@ struct notify {
 	uint16_t handle, ccc_handle;
 	uint8_t *value;
 	uint16_t len;
+	struct bt_gatt_server_nfy *nfy;
 	bt_gatt_server_conf_func_t conf;
 	void *user_data;
 };
@@ -318,6 +331,102 @@ static void clear_ccc_state(void *data, void *user_data)
 		ccc_cb->callback(NULL, ccc_cb->user_data);
 }
 
+static bool ccc_store_match(const void *data, const void *match_data)
+{
+	const struct ccc_store *store = data;
+	const struct device_state *state = match_data;
+
+	return store->bdaddr_type == state->bdaddr_type &&
+				!bacmp(&store->bdaddr, &state->bdaddr);
+}
+
+static void ccc_store_write(void *data, void *user_data)
+{
+	struct ccc_store *store = data;
+	struct btd_gatt_database *database = user_data;
+	struct btd_device *device;
+
+	/* Storage of removed or unpaired devices is not kept */
+	device = btd_adapter_find_device(database->adapter, &store->bdaddr,
+							store->bdaddr_type);
+	if (device && device_is_bonded(device, store->bdaddr_type))
+		device_store_svc_chng_ccc(device, store->bdaddr_type,
+								store->value);
+}
+
+static void ccc_store_flush(struct btd_gatt_database *database)
+{
+	if (database->ccc_store_id) {
+		g_source_remove(database->ccc_store_id);
+		database->ccc_store_id = 0;
+	}
+
+	if (queue_isempty(database->ccc_stores))
+		return;
+
+	DBG("Storing %u CCC values", queue_length(database->ccc_stores));
+
+	queue_foreach(database->ccc_stores, ccc_store_write, database);
+	queue_remove_all(database->ccc_stores, NULL, NULL, free);
+}
+
+/* Writes CCC values still queued, before the devices go away */
+void btd_gatt_database_store_ccc(struct btd_gatt_database *database)
+{
+	if (!database)
+		return;
+
+	ccc_store_flush(database);
+}
+
+static gboolean ccc_store_cb(gpointer user_data)
+{
+	struct btd_gatt_database *database = user_data;
+
+	database->ccc_store_id = 0;
+	ccc_store_flush(database);
+
+	return FALSE;
+}
+
+/*
+ * Writes the Service Changed CCC value of a connected device behind.
+ * Changes made within CCC_STORE_DELAY are batched across devices, and
+ * each device is written once with its latest value. Files are replaced
+ * atomically, so a crash can only lose the values still queued, never
+ * corrupt stored ones.
+ */
+static void ccc_store_queue(struct device_state *state, uint16_t value)
+{
+	struct btd_gatt_database *database = state->db;
+	struct ccc_store *store;
+
+	store = queue_find(database->ccc_stores, ccc_store_match, state);
+	if (!store) {
+		store = new0(struct ccc_store, 1);
+		bacpy(&store->bdaddr, &state->bdaddr);
+		store->bdaddr_type = state->bdaddr_type;
+		queue_push_tail(database->ccc_stores, store);
+	}
+
+	store->value = value;
+
+	if (!database->ccc_store_id)
+		database->ccc_store_id = g_timeout_add_seconds(CCC_STORE_DELAY,
+							ccc_store_cb, database);
+}
+
+/* Writes the value right away, superseding any queued one for state */
+static void ccc_store_now(struct device_state *state, struct btd_device *device,
+								uint16_t value)
+{
+	struct btd_gatt_database *database = state->db;
+
+	queue_remove_all(database->ccc_stores, ccc_store_match, state, free);
+
+	device_store_svc_chng_ccc(device, state->bdaddr_type, value);
+}
+
 static void att_disconnected(int err, void *user_data)
 {
 	struct device_state *state = user_data;
@@ -339,10 +448,12 @@ static void att_disconnected(int err, void *user_data)
 
 		handle = gatt_db_attribute_get_handle(state->db->svc_chngd_ccc);
 
+		/* Only writes made while connected are batched, the
+		 * final value is stored right away.
+		 */
 		ccc = find_ccc_state(state, handle);
 		if (ccc)
-			device_store_svc_chng_ccc(device, state->bdaddr_type,
-								ccc->value);
+			ccc_store_now(state, device, ccc->value);
 
 		return;
 	}
@@ -600,6 +711,9 @@ static void gatt_database_free(void *data)
 		g_io_channel_unref(database->bredr_io);
 	}
 
+	ccc_store_flush(database);
+	queue_destroy(database->ccc_stores, NULL);
+
 	/* TODO: Persistently store CCC states before freeing them */
 	gatt_db_unregister(database->db, database->db_id);
 
@@ -1025,9 +1139,19 @@ static void gatt_ccc_write_cb(struct gatt_db_attribute *attrib,
 			pending_op_free(op);
 	}
 
-	if (!ecode)
+	if (!ecode) {
 		ccc->value = val;
 
+		/* Store it now rather than on disconnect, surviving a crash */
+		if (attrib == database->svc_chngd_ccc) {
+			struct device_state *state;
+
+			state = get_device_state(database, att);
+			if (state)
+				ccc_store_queue(state, val);
+		}
+	}
+
 done:
 	gatt_db_attribute_write_result(attrib, id, ecode);
 }
@@ -1378,9 +1502,8 @@ static void send_notification_to_device(void *data, void *user_data)
 	 */
 	if (!notify->conf) {
 		DBG("GATT server sending notification");
-		bt_gatt_server_send_notification(server,
-					notify->handle, notify->value,
-					notify->len, device_state->cli_feat[0] &
+		bt_gatt_server_send_nfy(server, notify->nfy,
+					device_state->cli_feat[0] &
 					BT_GATT_CHRC_CLI_FEAT_NFY_MULTI);
 		return;
 	}
@@ -1419,8 +1542,17 @@ static void send_notification_to_devices(struct btd_gatt_database *database,
 	notify.conf = conf;
 	notify.user_data = user_data;
 
+	/* Notifications are encoded once for all subscribers */
+	if (!conf) {
+		notify.nfy = bt_gatt_server_nfy_new(handle, value, len);
+		if (!notify.nfy)
+			return;
+	}
+
 	queue_foreach(database->device_states, send_notification_to_device,
 								&notify);
+
+	bt_gatt_server_nfy_free(notify.nfy);
 }
 
 static void send_service_changed(struct btd_gatt_database *database,
@@ -3629,6 +3761,7 @@ struct btd_gatt_database *btd_gatt_database_new(struct btd_adapter *adapter)
 	database->device_states = queue_new();
 	database->apps = queue_new();
 	database->profiles = queue_new();
+	database->ccc_stores = queue_new();
 	database->ccc_callbacks = queue_new();
 
 	addr = btd_adapter_get_address(adapter);
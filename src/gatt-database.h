@@ -29,3 +29,4 @@ void btd_gatt_database_server_connected(struct btd_gatt_database *database,
 						struct bt_gatt_server *server);
 
 void btd_gatt_database_restore_svc_chng_ccc(struct btd_gatt_database *database);
+void btd_gatt_database_store_ccc(struct btd_gatt_database *database);
@@ -110,6 +110,7 @@ struct main_opts {
 	bt_gatt_cache_t gatt_cache;
 	uint16_t	gatt_mtu;
 	uint8_t		gatt_channels;
+	uint16_t	gatt_nfy_mult_latency;
 	enum mps_mode_t	mps;
 
 	uint8_t		key_size;
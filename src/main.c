@@ -139,6 +139,7 @@ static const char *gatt_options[] = {
 	"KeySize",
 	"ExchangeMTU",
 	"Channels",
+	"NotifyMultipleLatency",
 	NULL
 };
 
@@ -671,6 +672,19 @@ static void parse_config(GKeyFile *config)
 		main_opts.gatt_channels = val;
 	}
 
+	val = g_key_file_get_integer(config, "GATT", "NotifyMultipleLatency",
+									&err);
+	if (err) {
+		DBG("%s", err->message);
+		g_clear_error(&err);
+	} else {
+		DBG("NotifyMultipleLatency=%d", val);
+		/* Ensure the latency is within a valid range. */
+		val = MIN(val, 1000);
+		val = MAX(val, 1);
+		main_opts.gatt_nfy_mult_latency = val;
+	}
+
 	parse_controller_config(config);
 }
 
@@ -704,6 +718,7 @@ static void init_defaults(void)
 	main_opts.gatt_cache = BT_GATT_CACHE_ALWAYS;
 	main_opts.gatt_mtu = BT_ATT_MAX_LE_MTU;
 	main_opts.gatt_channels = 3;
+	main_opts.gatt_nfy_mult_latency = 10;
 }
 
 static void log_handler(const gchar *log_domain, GLogLevelFlags log_level,
@@ -28,9 +28,11 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include "src/shared/io.h"
 #include "src/shared/queue.h"
+#include "src/shared/idmap.h"
 #include "src/shared/util.h"
 #include "src/shared/timeout.h"
 #include "lib/bluetooth.h"
@@ -39,10 +41,21 @@
 #include "src/shared/att.h"
 #include "src/shared/crypto.h"
 
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
 #define ATT_MIN_PDU_LEN			1  /* At least 1 byte for the opcode. */
 #define ATT_OP_CMD_MASK			0x40
 #define ATT_OP_SIGNED_MASK		0x80
 #define ATT_TIMEOUT_INTERVAL		30000  /* 30000 ms */
+#define ATT_OP_POOL_SIZE		16
+#define ATT_NFY_BURST			4  /* Notifications sent ahead of a
+					    * queued channel PDU */
 
 /* Length of signature in write signed packet */
 #define BT_ATT_SIGNATURE_LEN		12
@@ -66,6 +79,10 @@ struct bt_att_chan {
 
 	uint8_t *buf;
 	uint16_t mtu;
+
+	unsigned int nfy_burst;		/* Notifications sent ahead in a row */
+	uint64_t req_time;		/* When pending_req was written */
+	struct bt_att_chan_stats stats;
 };
 
 struct bt_att {
@@ -84,12 +101,23 @@ struct bt_att {
 	struct queue *req_queue;	/* Queued ATT protocol requests */
 	struct queue *ind_queue;	/* Queued ATT protocol indications */
 	struct queue *write_queue;	/* Queue of PDUs ready to send */
+	struct idmap *send_ops;		/* Ops with an ID by their ID */
 	bool in_disc;			/* Cleanup queues on disconnect_cb */
 
 	bt_att_timeout_func_t timeout_callback;
 	bt_att_destroy_func_t timeout_destroy;
 	void *timeout_data;
 
+	bt_att_idle_func_t idle_callback;	/* Channel ran out of PDUs */
+	bt_att_destroy_func_t idle_destroy;
+	void *idle_data;
+
+	/* Send ops, with their PDU buffer, kept for reuse */
+	struct att_send_op *op_pool[ATT_OP_POOL_SIZE];
+	unsigned int op_pool_len;
+	unsigned int op_pool_hits;
+	unsigned int op_pool_misses;
+
 	bt_att_debug_func_t debug_callback;
 	bt_att_destroy_func_t debug_destroy;
 	void *debug_data;
@@ -135,6 +163,8 @@ static const struct {
 	{ BT_ATT_OP_READ_BLOB_RSP,		ATT_OP_TYPE_RSP },
 	{ BT_ATT_OP_READ_MULT_REQ,		ATT_OP_TYPE_REQ },
 	{ BT_ATT_OP_READ_MULT_RSP,		ATT_OP_TYPE_RSP },
+	{ BT_ATT_OP_READ_MULT_VL_REQ,		ATT_OP_TYPE_REQ },
+	{ BT_ATT_OP_READ_MULT_VL_RSP,		ATT_OP_TYPE_RSP },
 	{ BT_ATT_OP_READ_BY_GRP_TYPE_REQ,	ATT_OP_TYPE_REQ },
 	{ BT_ATT_OP_READ_BY_GRP_TYPE_RSP,	ATT_OP_TYPE_RSP },
 	{ BT_ATT_OP_WRITE_REQ,			ATT_OP_TYPE_REQ },
@@ -178,6 +208,7 @@ static const struct {
 	{ BT_ATT_OP_READ_REQ,			BT_ATT_OP_READ_RSP },
 	{ BT_ATT_OP_READ_BLOB_REQ,		BT_ATT_OP_READ_BLOB_RSP },
 	{ BT_ATT_OP_READ_MULT_REQ,		BT_ATT_OP_READ_MULT_RSP },
+	{ BT_ATT_OP_READ_MULT_VL_REQ,		BT_ATT_OP_READ_MULT_VL_RSP },
 	{ BT_ATT_OP_READ_BY_GRP_TYPE_REQ,	BT_ATT_OP_READ_BY_GRP_TYPE_RSP },
 	{ BT_ATT_OP_WRITE_REQ,			BT_ATT_OP_WRITE_RSP },
 	{ BT_ATT_OP_PREP_WRITE_REQ,		BT_ATT_OP_PREP_WRITE_RSP },
@@ -198,17 +229,74 @@ static uint8_t get_req_opcode(uint8_t rsp_opcode)
 }
 
 struct att_send_op {
+	struct bt_att *att;
 	unsigned int id;
 	unsigned int timeout_id;
 	enum att_op_type type;
 	uint8_t opcode;
 	void *pdu;
 	uint16_t len;
+	uint16_t size;			/* Size of the PDU buffer */
 	bt_att_response_func_t callback;
 	bt_att_destroy_func_t destroy;
 	void *user_data;
+	uint8_t buf[0];
 };
 
+/*
+ * Ops are allocated together with an MTU sized PDU buffer and, once sent,
+ * kept by their bt_att to be reused so a steady flow of PDUs does not go
+ * through the heap.
+ */
+static struct att_send_op *att_send_op_new(struct bt_att *att, uint16_t len)
+{
+	struct att_send_op *op = NULL;
+	uint16_t size;
+
+	if (att->op_pool_len) {
+		op = att->op_pool[--att->op_pool_len];
+		if (op->size >= len) {
+			att->op_pool_hits++;
+			goto done;
+		}
+
+		free(op);
+	}
+
+	att->op_pool_misses++;
+
+	size = MAX(len, MIN(att->mtu, BT_ATT_MAX_LE_MTU));
+	op = malloc(sizeof(*op) + size);
+	if (!op)
+		return NULL;
+
+	op->size = size;
+
+done:
+	size = op->size;
+	memset(op, 0, sizeof(*op));
+	op->att = att;
+	op->size = size;
+	op->pdu = op->buf;
+
+	return op;
+}
+
+static void att_send_op_free(struct att_send_op *op)
+{
+	struct bt_att *att = op->att;
+
+	if (op->id)
+		idmap_remove(att->send_ops, op->id);
+
+	if (att->op_pool_len < ATT_OP_POOL_SIZE) {
+		att->op_pool[att->op_pool_len++] = op;
+		return;
+	}
+
+	free(op);
+}
+
 static void destroy_att_send_op(void *data)
 {
 	struct att_send_op *op = data;
@@ -219,8 +307,7 @@ static void destroy_att_send_op(void *data)
 	if (op->destroy)
 		op->destroy(op->user_data);
 
-	free(op->pdu);
-	free(op);
+	att_send_op_free(op);
 }
 
 static void cancel_att_send_op(void *data)
@@ -287,26 +374,28 @@ static bool match_disconn_id(const void *a, const void *b)
 	return disconn->id == id;
 }
 
-static bool encode_pdu(struct bt_att *att, struct att_send_op *op,
+static uint16_t encoded_pdu_len(struct bt_att *att, uint8_t opcode,
 					const void *pdu, uint16_t length)
 {
 	uint16_t pdu_len = 1;
-	struct sign_info *sign = att->local_sign;
-	uint32_t sign_cnt;
 
-	if (sign && (op->opcode & ATT_OP_SIGNED_MASK))
+	if (att->local_sign && (opcode & ATT_OP_SIGNED_MASK))
 		pdu_len += BT_ATT_SIGNATURE_LEN;
 
 	if (length && pdu)
 		pdu_len += length;
 
-	if (pdu_len > att->mtu)
-		return false;
+	return pdu_len;
+}
+
+static bool encode_pdu(struct bt_att *att, struct att_send_op *op,
+					const void *pdu, uint16_t length)
+{
+	uint16_t pdu_len = encoded_pdu_len(att, op->opcode, pdu, length);
+	struct sign_info *sign = att->local_sign;
+	uint32_t sign_cnt;
 
 	op->len = pdu_len;
-	op->pdu = malloc(op->len);
-	if (!op->pdu)
-		return false;
 
 	((uint8_t *) op->pdu)[0] = op->opcode;
 	if (pdu_len > 1)
@@ -316,7 +405,7 @@ static bool encode_pdu(struct bt_att *att, struct att_send_op *op,
 		return true;
 
 	if (!sign->counter(&sign_cnt, sign->user_data))
-		goto fail;
+		return false;
 
 	if ((bt_crypto_sign_att(att->crypto, sign->key, op->pdu, 1 + length,
 				sign_cnt, &((uint8_t *) op->pdu)[1 + length])))
@@ -325,8 +414,6 @@ static bool encode_pdu(struct bt_att *att, struct att_send_op *op,
 	util_debug(att->debug_callback, att->debug_data,
 					"ATT unable to generate signature");
 
-fail:
-	free(op->pdu);
 	return false;
 }
 
@@ -340,6 +427,7 @@ static struct att_send_op *create_att_send_op(struct bt_att *att,
 {
 	struct att_send_op *op;
 	enum att_op_type type;
+	uint16_t pdu_len;
 
 	if (length && !pdu)
 		return NULL;
@@ -361,53 +449,111 @@ static struct att_send_op *create_att_send_op(struct bt_att *att,
 	if (!callback && (type == ATT_OP_TYPE_REQ || type == ATT_OP_TYPE_IND))
 		return NULL;
 
-	op = new0(struct att_send_op, 1);
+	pdu_len = encoded_pdu_len(att, opcode, pdu, length);
+	if (pdu_len > att->mtu)
+		return NULL;
+
+	op = att_send_op_new(att, pdu_len);
+	if (!op)
+		return NULL;
+
 	op->type = type;
 	op->opcode = opcode;
-	op->callback = callback;
-	op->destroy = destroy;
-	op->user_data = user_data;
 
 	if (!encode_pdu(att, op, pdu, length)) {
-		free(op);
+		att_send_op_free(op);
 		return NULL;
 	}
 
+	op->callback = callback;
+	op->destroy = destroy;
+	op->user_data = user_data;
+
 	return op;
 }
 
+static uint64_t att_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static bool match_op_fits(const void *a, const void *b)
+{
+	const struct att_send_op *op = a;
+	const struct bt_att_chan *chan = b;
+
+	return op->len <= chan->mtu;
+}
+
+/*
+ * Pops the first op of a shared queue this channel can carry. An op too big
+ * for a bearer with a smaller MTU is left for the others instead of blocking
+ * everything queued behind it.
+ */
+static struct att_send_op *pop_op_fits(struct queue *queue,
+						struct bt_att_chan *chan)
+{
+	struct att_send_op *op;
+
+	op = queue_peek_head(queue);
+	if (!op)
+		return NULL;
+
+	if (op->len <= chan->mtu)
+		return queue_pop_head(queue);
+
+	return queue_remove_if(queue, match_op_fits, chan);
+}
+
 static struct att_send_op *pick_next_send_op(struct bt_att_chan *chan)
 {
 	struct bt_att *att = chan->att;
 	struct att_send_op *op;
 
+	/* Notifications go ahead of what is queued on the channel, which
+	 * are mostly responses to bulk reads, but only a few in a row so
+	 * the responses are not starved.
+	 */
+	op = queue_peek_head(att->write_queue);
+	if (op && op->type == ATT_OP_TYPE_NFY && op->len <= chan->mtu &&
+					(queue_isempty(chan->queue) ||
+					chan->nfy_burst < ATT_NFY_BURST)) {
+		chan->nfy_burst++;
+		return queue_pop_head(att->write_queue);
+	}
+
+	chan->nfy_burst = 0;
+
 	/* Check if there is anything queued on the channel */
 	op = queue_pop_head(chan->queue);
 	if (op)
 		return op;
 
 	/* See if any operations are already in the write queue */
-	op = queue_peek_head(att->write_queue);
-	if (op && op->len <= chan->mtu)
-		return queue_pop_head(att->write_queue);
+	op = pop_op_fits(att->write_queue, chan);
+	if (op)
+		return op;
 
 	/* If there is no pending request, pick an operation from the
-	 * request queue.
+	 * request queue. Each bearer has at most one request outstanding so
+	 * requests spread over the idle bearers, and a stalled one does not
+	 * hold back the others.
 	 */
 	if (!chan->pending_req) {
-		op = queue_peek_head(att->req_queue);
-		if (op && op->len <= chan->mtu)
-			return queue_pop_head(att->req_queue);
+		op = pop_op_fits(att->req_queue, chan);
+		if (op)
+			return op;
 	}
 
 	/* There is either a request pending or no requests queued. If there is
 	 * no pending indication, pick an operation from the indication queue.
 	 */
-	if (!chan->pending_ind) {
-		op = queue_peek_head(att->ind_queue);
-		if (op && op->len <= chan->mtu)
-			return queue_pop_head(att->ind_queue);
-	}
+	if (!chan->pending_ind)
+		return pop_op_fits(att->ind_queue, chan);
 
 	return NULL;
 }
@@ -507,8 +653,16 @@ static bool can_write_data(struct io *io, void *user_data)
 	struct timeout_data *timeout;
 
 	op = pick_next_send_op(chan);
-	if (!op)
-		return false;
+	if (!op) {
+		/* Give the upper layer a chance to send what it held back */
+		if (chan->att->idle_callback) {
+			chan->att->idle_callback(chan->att->idle_data);
+			op = pick_next_send_op(chan);
+		}
+
+		if (!op)
+			return false;
+	}
 
 	if (!bt_att_chan_write(chan, op->opcode, op->pdu, op->len)) {
 		if (op->callback)
@@ -522,9 +676,12 @@ static bool can_write_data(struct io *io, void *user_data)
 	 * pending indication. If it came from the write queue, then there is
 	 * no need to keep it around.
 	 */
+	chan->stats.pdus++;
+
 	switch (op->type) {
 	case ATT_OP_TYPE_REQ:
 		chan->pending_req = op;
+		chan->req_time = att_now();
 		break;
 	case ATT_OP_TYPE_IND:
 		chan->pending_ind = op;
@@ -768,6 +925,23 @@ static bool handle_error_rsp(struct bt_att_chan *chan, uint8_t *pdu,
 	return queue_push_head(att->req_queue, op);
 }
 
+static void chan_update_latency(struct bt_att_chan *chan)
+{
+	struct bt_att_chan_stats *stats = &chan->stats;
+	uint32_t latency = att_now() - chan->req_time;
+
+	/* Smoothed the same way as TCP does for its round trip time */
+	if (!stats->reqs)
+		stats->latency = latency;
+	else
+		stats->latency = (7 * (uint64_t) stats->latency + latency) / 8;
+
+	if (latency > stats->max_latency)
+		stats->max_latency = latency;
+
+	stats->reqs++;
+}
+
 static void handle_rsp(struct bt_att_chan *chan, uint8_t opcode, uint8_t *pdu,
 								ssize_t pdu_len)
 {
@@ -823,6 +997,8 @@ fail:
 	rsp_opcode = BT_ATT_OP_ERROR_RSP;
 
 done:
+	chan_update_latency(chan);
+
 	if (op->callback)
 		op->callback(rsp_opcode, rsp_pdu, rsp_pdu_len, op->user_data);
 
@@ -1094,13 +1270,34 @@ static bool is_io_l2cap_based(int fd)
 	return proto == BTPROTO_L2CAP;
 }
 
+static void debug_chan_stats(struct bt_att_chan *chan,
+					const struct bt_att_chan_stats *stats,
+					void *user_data)
+{
+	struct bt_att *att = user_data;
+
+	util_debug(att->debug_callback, att->debug_data,
+			"(chan %p) %u PDUs, %u requests, latency %u us "
+			"(max %u us)", chan, stats->pdus, stats->reqs,
+			stats->latency, stats->max_latency);
+}
+
 static void bt_att_free(struct bt_att *att)
 {
 	bt_crypto_unref(att->crypto);
 
+	util_debug(att->debug_callback, att->debug_data,
+				"ATT op pool: %u reused, %u allocated",
+				att->op_pool_hits, att->op_pool_misses);
+
+	bt_att_foreach_chan_stats(att, debug_chan_stats, att);
+
 	if (att->timeout_destroy)
 		att->timeout_destroy(att->timeout_data);
 
+	if (att->idle_destroy)
+		att->idle_destroy(att->idle_data);
+
 	if (att->debug_destroy)
 		att->debug_destroy(att->debug_data);
 
@@ -1114,6 +1311,11 @@ static void bt_att_free(struct bt_att *att)
 	queue_destroy(att->disconn_list, NULL);
 	queue_destroy(att->chans, bt_att_chan_free);
 
+	while (att->op_pool_len)
+		free(att->op_pool[--att->op_pool_len]);
+
+	idmap_free(att->send_ops);
+
 	free(att);
 }
 
@@ -1237,6 +1439,7 @@ struct bt_att *bt_att_new(int fd, bool ext_signed)
 	att->req_queue = queue_new();
 	att->ind_queue = queue_new();
 	att->write_queue = queue_new();
+	att->send_ops = idmap_new();
 	att->notify_list = queue_new();
 	att->disconn_list = queue_new();
 
@@ -1296,7 +1499,9 @@ int bt_att_attach_fd(struct bt_att *att, int fd)
 	if (!att || fd < 0)
 		return -EINVAL;
 
-	chan = bt_att_chan_new(fd, BT_ATT_EATT);
+	/* Local sockets, as used by the unit tests, have no L2CAP MTU */
+	chan = bt_att_chan_new(fd, is_io_l2cap_based(fd) ? BT_ATT_EATT :
+								BT_ATT_LOCAL);
 	if (!chan)
 		return -EINVAL;
 
@@ -1328,6 +1533,35 @@ int bt_att_get_channels(struct bt_att *att)
 	return queue_length(att->chans);
 }
 
+struct chan_stats_data {
+	bt_att_chan_stats_func_t func;
+	void *user_data;
+};
+
+static void chan_stats(void *data, void *user_data)
+{
+	struct bt_att_chan *chan = data;
+	struct chan_stats_data *d = user_data;
+	struct bt_att_chan_stats stats = chan->stats;
+
+	stats.queued = queue_length(chan->queue) + !!chan->pending_req +
+							!!chan->pending_ind;
+
+	d->func(chan, &stats, d->user_data);
+}
+
+void bt_att_foreach_chan_stats(struct bt_att *att,
+					bt_att_chan_stats_func_t func,
+					void *user_data)
+{
+	struct chan_stats_data d = { func, user_data };
+
+	if (!att || !func)
+		return;
+
+	queue_foreach(att->chans, chan_stats, &d);
+}
+
 bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
 				void *user_data, bt_att_destroy_func_t destroy)
 {
@@ -1414,6 +1648,23 @@ bool bt_att_set_timeout_cb(struct bt_att *att, bt_att_timeout_func_t callback,
 	return true;
 }
 
+bool bt_att_set_idle_cb(struct bt_att *att, bt_att_idle_func_t callback,
+						void *user_data,
+						bt_att_destroy_func_t destroy)
+{
+	if (!att)
+		return false;
+
+	if (att->idle_destroy)
+		att->idle_destroy(att->idle_data);
+
+	att->idle_callback = callback;
+	att->idle_destroy = destroy;
+	att->idle_data = user_data;
+
+	return true;
+}
+
 unsigned int bt_att_register_disconnect(struct bt_att *att,
 					bt_att_disconnect_func_t callback,
 					void *user_data,
@@ -1490,6 +1741,8 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 
 	op->id = att->next_send_id++;
 
+	idmap_insert(att->send_ops, op->id, op);
+
 	/* Add the op to the correct queue based on its type */
 	switch (op->type) {
 	case ATT_OP_TYPE_REQ:
@@ -1509,8 +1762,7 @@ unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 	}
 
 	if (!result) {
-		free(op->pdu);
-		free(op);
+		att_send_op_free(op);
 		return 0;
 	}
 
@@ -1536,8 +1788,7 @@ unsigned int bt_att_chan_send(struct bt_att_chan *chan, uint8_t opcode,
 		return -EINVAL;
 
 	if (!queue_push_tail(chan->queue, op)) {
-		free(op->pdu);
-		free(op);
+		att_send_op_free(op);
 		return 0;
 	}
 
@@ -1581,28 +1832,22 @@ bool bt_att_chan_cancel(struct bt_att_chan *chan, unsigned int id)
 	return true;
 }
 
-static bool bt_att_disc_cancel(struct bt_att *att, unsigned int id)
+static struct queue *att_op_queue(struct bt_att *att,
+						struct att_send_op *op)
 {
-	struct att_send_op *op;
-
-	op = queue_find(att->req_queue, match_op_id, UINT_TO_PTR(id));
-	if (op)
-		goto done;
-
-	op = queue_find(att->ind_queue, match_op_id, UINT_TO_PTR(id));
-	if (op)
-		goto done;
-
-	op = queue_find(att->write_queue, match_op_id, UINT_TO_PTR(id));
-
-done:
-	if (!op)
-		return false;
-
-	/* Just cancel since disconnect_cb will be cleaning up */
-	cancel_att_send_op(op);
-
-	return true;
+	switch (op->type) {
+	case ATT_OP_TYPE_REQ:
+		return att->req_queue;
+	case ATT_OP_TYPE_IND:
+		return att->ind_queue;
+	case ATT_OP_TYPE_CMD:
+	case ATT_OP_TYPE_NFY:
+	case ATT_OP_TYPE_UNKNOWN:
+	case ATT_OP_TYPE_RSP:
+	case ATT_OP_TYPE_CONF:
+	default:
+		return att->write_queue;
+	}
 }
 
 bool bt_att_cancel(struct bt_att *att, unsigned int id)
@@ -1613,34 +1858,32 @@ bool bt_att_cancel(struct bt_att *att, unsigned int id)
 	if (!att || !id)
 		return false;
 
-	/* Lookuo request on each channel first */
+	op = idmap_find(att->send_ops, id);
+	if (!op)
+		return false;
+
+	/* Don't cancel a request or indication in flight, remove its
+	 * handlers.
+	 */
 	for (entry = queue_get_entries(att->chans); entry;
 						entry = entry->next) {
 		struct bt_att_chan *chan = entry->data;
 
-		if (bt_att_chan_cancel(chan, id))
+		if (chan->pending_req == op || chan->pending_ind == op) {
+			cancel_att_send_op(op);
 			return true;
+		}
 	}
 
-	if (att->in_disc)
-		return bt_att_disc_cancel(att, id);
-
-	op = queue_remove_if(att->req_queue, match_op_id, UINT_TO_PTR(id));
-	if (op)
-		goto done;
-
-	op = queue_remove_if(att->ind_queue, match_op_id, UINT_TO_PTR(id));
-	if (op)
-		goto done;
-
-	op = queue_remove_if(att->write_queue, match_op_id, UINT_TO_PTR(id));
-	if (op)
-		goto done;
+	/* Just cancel since disconnect_cb will be cleaning up */
+	if (att->in_disc) {
+		cancel_att_send_op(op);
+		return true;
+	}
 
-	if (!op)
+	if (!queue_remove(att_op_queue(att, op), op))
 		return false;
 
-done:
 	destroy_att_send_op(op);
 
 	wakeup_writer(att);
@@ -42,6 +42,21 @@ int bt_att_attach_fd(struct bt_att *att, int fd);
 
 int bt_att_get_channels(struct bt_att *att);
 
+struct bt_att_chan_stats {
+	unsigned int queued;		/* PDUs waiting for this bearer */
+	unsigned int pdus;		/* PDUs written */
+	unsigned int reqs;		/* Requests answered */
+	uint32_t latency;		/* Smoothed request latency, in usec */
+	uint32_t max_latency;		/* Highest request latency, in usec */
+};
+
+typedef void (*bt_att_chan_stats_func_t)(struct bt_att_chan *chan,
+					const struct bt_att_chan_stats *stats,
+					void *user_data);
+void bt_att_foreach_chan_stats(struct bt_att *att,
+					bt_att_chan_stats_func_t func,
+					void *user_data);
+
 typedef void (*bt_att_response_func_t)(uint8_t opcode, const void *pdu,
 					uint16_t length, void *user_data);
 typedef void (*bt_att_notify_func_t)(struct bt_att_chan *chan,
@@ -52,6 +67,7 @@ typedef void (*bt_att_debug_func_t)(const char *str, void *user_data);
 typedef void (*bt_att_timeout_func_t)(unsigned int id, uint8_t opcode,
 							void *user_data);
 typedef void (*bt_att_disconnect_func_t)(int err, void *user_data);
+typedef void (*bt_att_idle_func_t)(void *user_data);
 typedef bool (*bt_att_counter_func_t)(uint32_t *sign_cnt, void *user_data);
 
 bool bt_att_set_debug(struct bt_att *att, bt_att_debug_func_t callback,
@@ -64,6 +80,9 @@ uint8_t bt_att_get_link_type(struct bt_att *att);
 bool bt_att_set_timeout_cb(struct bt_att *att, bt_att_timeout_func_t callback,
 						void *user_data,
 						bt_att_destroy_func_t destroy);
+bool bt_att_set_idle_cb(struct bt_att *att, bt_att_idle_func_t callback,
+						void *user_data,
+						bt_att_destroy_func_t destroy);
 
 unsigned int bt_att_send(struct bt_att *att, uint8_t opcode,
 					const void *pdu, uint16_t length,
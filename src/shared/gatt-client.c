@@ -123,6 +123,7 @@ struct request {
 	struct bt_gatt_client *client;
 	bool long_write;
 	bool prep_write;
+	bool bulk_read;
 	bool removed;
 	int ref_count;
 	unsigned int id;
@@ -2541,6 +2542,8 @@ static bool cancel_prep_write_session(struct bt_gatt_client *client,
 							req, request_unref);
 }
 
+static bool cancel_read_bulk(struct request *req);
+
 static bool cancel_request(struct request *req)
 {
 	req->removed = true;
@@ -2551,6 +2554,9 @@ static bool cancel_request(struct request *req)
 	if (req->prep_write)
 		return cancel_prep_write_session(req->client, req);
 
+	if (req->bulk_read)
+		return cancel_read_bulk(req);
+
 	return bt_att_cancel(req->client->att, req->att_id);
 }
 
@@ -2795,6 +2801,328 @@ unsigned int bt_gatt_client_read_multiple(struct bt_gatt_client *client,
 	return req->id;
 }
 
+/*
+ * Reads many values at once. Handles are split into Read Multiple Variable
+ * Length requests, at least one per bearer so that EATT bearers answer
+ * them in parallel. Values missing from a truncated response are asked
+ * for again, truncated values are completed with Read Blob and requests
+ * failing as a whole are retried handle by handle so each value gets its
+ * own error.
+ */
+struct read_bulk_op {
+	struct bt_gatt_client *client;
+	struct bt_gatt_client_bulk_value *values;
+	uint16_t num_values;
+	struct queue *chunks;
+	bt_gatt_client_read_bulk_callback_t callback;
+	void *user_data;
+	bt_gatt_client_destroy_func_t destroy;
+};
+
+struct read_bulk_chunk {
+	struct request *req;
+	unsigned int att_id;
+	uint16_t first;
+	uint16_t count;
+	uint16_t offset;	/* Read Blob offset of a truncated value */
+};
+
+static void destroy_read_bulk_op(void *data)
+{
+	struct read_bulk_op *op = data;
+	uint16_t i;
+
+	if (op->destroy)
+		op->destroy(op->user_data);
+
+	for (i = 0; i < op->num_values; i++)
+		free((void *) op->values[i].value);
+
+	queue_destroy(op->chunks, NULL);
+	free(op->values);
+	free(op);
+}
+
+static void read_bulk_chunk_free(void *data)
+{
+	struct read_bulk_chunk *chunk = data;
+	struct read_bulk_op *op = chunk->req->data;
+
+	queue_remove(op->chunks, chunk);
+	request_unref(chunk->req);
+	free(chunk);
+}
+
+static void read_bulk_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data);
+
+static bool read_bulk_send(struct request *req, uint16_t first,
+					uint16_t count, uint16_t offset)
+{
+	struct read_bulk_op *op = req->data;
+	struct read_bulk_chunk *chunk;
+	uint8_t pdu[count * 2 + 2];
+	uint16_t len = count * 2;
+	uint8_t opcode;
+	uint16_t i;
+
+	for (i = 0; i < count; i++)
+		put_le16(op->values[first + i].handle, pdu + 2 * i);
+
+	if (offset) {
+		opcode = BT_ATT_OP_READ_BLOB_REQ;
+		put_le16(offset, pdu + 2);
+		len += 2;
+	} else if (count > 1)
+		opcode = BT_ATT_OP_READ_MULT_VL_REQ;
+	else
+		opcode = BT_ATT_OP_READ_REQ;
+
+	chunk = new0(struct read_bulk_chunk, 1);
+	chunk->req = request_ref(req);
+	chunk->first = first;
+	chunk->count = count;
+	chunk->offset = offset;
+
+	chunk->att_id = bt_att_send(op->client->att, opcode, pdu, len,
+						read_bulk_cb, chunk,
+						read_bulk_chunk_free);
+	if (!chunk->att_id) {
+		request_unref(req);
+		free(chunk);
+		return false;
+	}
+
+	queue_push_tail(op->chunks, chunk);
+
+	return true;
+}
+
+static bool read_bulk_append(struct bt_gatt_client_bulk_value *value,
+					const uint8_t *data, uint16_t len)
+{
+	uint8_t *buf;
+
+	if (!len)
+		return true;
+
+	buf = realloc((void *) value->value, value->length + len);
+	if (!buf)
+		return false;
+
+	memcpy(buf + value->length, data, len);
+	value->value = buf;
+	value->length += len;
+
+	return true;
+}
+
+static void read_bulk_fail(struct read_bulk_op *op, uint16_t first,
+					uint16_t count, uint8_t att_ecode)
+{
+	uint16_t i;
+
+	for (i = 0; i < count; i++)
+		op->values[first + i].att_ecode = att_ecode ? att_ecode :
+							BT_ATT_ERROR_UNLIKELY;
+}
+
+static void read_bulk_parse(struct read_bulk_chunk *chunk,
+					const uint8_t *pdu, uint16_t length)
+{
+	struct request *req = chunk->req;
+	struct read_bulk_op *op = req->data;
+	uint16_t mtu = bt_att_get_mtu(op->client->att);
+	uint16_t i;
+
+	if (chunk->offset || chunk->count == 1) {
+		struct bt_gatt_client_bulk_value *value;
+
+		value = &op->values[chunk->first];
+		if (!read_bulk_append(value, pdu, length)) {
+			read_bulk_fail(op, chunk->first, 1, 0);
+			return;
+		}
+
+		/* A full response means there may be more to read */
+		if (length == mtu - 1 && value->length < BT_ATT_MAX_VALUE_LEN &&
+				!read_bulk_send(req, chunk->first, 1,
+							value->length))
+			read_bulk_fail(op, chunk->first, 1, 0);
+
+		return;
+	}
+
+	/* Length Value Tuple List, in the order of the request */
+	for (i = 0; i < chunk->count && length >= 2; i++) {
+		uint16_t index = chunk->first + i;
+		uint16_t len = get_le16(pdu);
+
+		pdu += 2;
+		length -= 2;
+
+		if (len <= length) {
+			if (!read_bulk_append(&op->values[index], pdu, len))
+				read_bulk_fail(op, index, 1, 0);
+
+			pdu += len;
+			length -= len;
+			continue;
+		}
+
+		/* Truncated by the MTU, read the rest with Read Blob */
+		if (!read_bulk_append(&op->values[index], pdu, length) ||
+				!read_bulk_send(req, index, 1, length))
+			read_bulk_fail(op, index, 1, 0);
+
+		length = 0;
+		i++;
+		break;
+	}
+
+	if (i == chunk->count)
+		return;
+
+	/* Not a single value, asking again would not get any further */
+	if (!i) {
+		read_bulk_fail(op, chunk->first, chunk->count, 0);
+		return;
+	}
+
+	/* Values that did not fit at all go in a new request */
+	if (!read_bulk_send(req, chunk->first + i, chunk->count - i, 0))
+		read_bulk_fail(op, chunk->first + i, chunk->count - i, 0);
+}
+
+static void read_bulk_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+	struct read_bulk_chunk *chunk = user_data;
+	struct read_bulk_op *op = chunk->req->data;
+	uint8_t att_ecode = 0;
+	uint16_t i;
+	bool success = true;
+
+	if (opcode == BT_ATT_OP_ERROR_RSP) {
+		att_ecode = process_error(pdu, length);
+
+		/* Retry one by one to find out which handles failed */
+		if (chunk->count > 1) {
+			for (i = 0; i < chunk->count; i++)
+				if (!read_bulk_send(chunk->req,
+							chunk->first + i, 1, 0))
+					read_bulk_fail(op, chunk->first + i,
+								1, 0);
+		} else
+			read_bulk_fail(op, chunk->first, 1, att_ecode);
+	} else if ((!pdu && length) || (opcode != BT_ATT_OP_READ_RSP &&
+					opcode != BT_ATT_OP_READ_BLOB_RSP &&
+					opcode != BT_ATT_OP_READ_MULT_VL_RSP))
+		read_bulk_fail(op, chunk->first, chunk->count, 0);
+	else
+		read_bulk_parse(chunk, pdu, length);
+
+	/*
+	 * This request is done, so canceling from the callback must leave it
+	 * alone. Wait for the requests still going on.
+	 */
+	queue_remove(op->chunks, chunk);
+	if (!queue_isempty(op->chunks) || !op->callback)
+		return;
+
+	for (i = 0; i < op->num_values; i++)
+		if (op->values[i].att_ecode)
+			success = false;
+
+	op->callback(success, op->values, op->num_values, op->user_data);
+}
+
+static bool cancel_read_bulk(struct request *req)
+{
+	struct read_bulk_op *op = req->data;
+	struct read_bulk_chunk *chunk;
+
+	op->callback = NULL;
+
+	/* Freeing the last chunk would free op along with req */
+	request_ref(req);
+
+	/* Canceling frees the chunk which removes it from the queue */
+	while ((chunk = queue_peek_head(op->chunks))) {
+		if (!bt_att_cancel(req->client->att, chunk->att_id))
+			read_bulk_chunk_free(chunk);
+	}
+
+	request_unref(req);
+
+	return true;
+}
+
+unsigned int bt_gatt_client_read_bulk(struct bt_gatt_client *client,
+				const uint16_t *handles, uint16_t num_handles,
+				bt_gatt_client_read_bulk_callback_t callback,
+				void *user_data,
+				bt_gatt_client_destroy_func_t destroy)
+{
+	struct request *req;
+	struct read_bulk_op *op;
+	uint16_t per_req, first;
+	int bearers;
+	unsigned int id;
+
+	if (!client || !handles || !num_handles)
+		return 0;
+
+	op = new0(struct read_bulk_op, 1);
+
+	req = request_create(client);
+	if (!req) {
+		free(op);
+		return 0;
+	}
+
+	op->client = client;
+	op->values = new0(struct bt_gatt_client_bulk_value, num_handles);
+	op->num_values = num_handles;
+	op->chunks = queue_new();
+
+	for (first = 0; first < num_handles; first++)
+		op->values[first].handle = handles[first];
+
+	req->data = op;
+	req->destroy = destroy_read_bulk_op;
+	req->bulk_read = true;
+
+	/* Without Read Multiple Variable Length read one by one */
+	if (bt_gatt_client_get_features(client) &
+						BT_GATT_CHRC_CLI_FEAT_EATT) {
+		bearers = MAX(bt_att_get_channels(client->att), 1);
+		per_req = (num_handles + bearers - 1) / bearers;
+		per_req = MIN(per_req, (bt_att_get_mtu(client->att) - 1) / 2);
+		per_req = MAX(per_req, 2);
+	} else
+		per_req = 1;
+
+	for (first = 0; first < num_handles; first += per_req) {
+		uint16_t count = MIN(per_req, num_handles - first);
+
+		if (!read_bulk_send(req, first, count, 0)) {
+			cancel_read_bulk(req);
+			request_unref(req);
+			return 0;
+		}
+	}
+
+	op->callback = callback;
+	op->user_data = user_data;
+	op->destroy = destroy;
+
+	id = req->id;
+	request_unref(req);
+
+	return id;
+}
+
 struct read_long_op {
 	struct bt_gatt_client *client;
 	int ref_count;
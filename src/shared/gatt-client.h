@@ -97,6 +97,23 @@ unsigned int bt_gatt_client_read_multiple(struct bt_gatt_client *client,
 					void *user_data,
 					bt_gatt_client_destroy_func_t destroy);
 
+struct bt_gatt_client_bulk_value {
+	uint16_t handle;
+	uint8_t att_ecode;
+	const uint8_t *value;
+	uint16_t length;
+};
+
+typedef void (*bt_gatt_client_read_bulk_callback_t)(bool success,
+			const struct bt_gatt_client_bulk_value *values,
+			uint16_t num_values, void *user_data);
+
+unsigned int bt_gatt_client_read_bulk(struct bt_gatt_client *client,
+				const uint16_t *handles, uint16_t num_handles,
+				bt_gatt_client_read_bulk_callback_t callback,
+				void *user_data,
+				bt_gatt_client_destroy_func_t destroy);
+
 unsigned int bt_gatt_client_write_without_response(
 					struct bt_gatt_client *client,
 					uint16_t value_handle,
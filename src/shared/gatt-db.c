@@ -65,13 +65,36 @@ struct gatt_db {
 	uint16_t next_handle;
 	struct queue *services;
 
+	/* Services sorted by handle, for lookups by handle and range */
+	struct gatt_db_service **svc_index;
+	unsigned int svc_count;
+	unsigned int svc_size;
+
+	/*
+	 * Attributes of services in the db sorted by type then handle. If it
+	 * ever fails to grow it is dropped and lookups by type walk the
+	 * services instead.
+	 */
+	struct type_entry *type_index;
+	unsigned int type_count;
+	unsigned int type_size;
+	bool no_type_index;
+
 	struct queue *notify_list;
 	unsigned int next_notify_id;
 
+	/* Data other modules keep alongside the db, e.g. response caches */
+	struct queue *data_list;
+
 	gatt_db_authorize_cb_t authorize;
 	void *authorize_data;
 };
 
+struct type_entry {
+	uint128_t type;
+	struct gatt_db_attribute *attrib;
+};
+
 struct notify {
 	unsigned int id;
 	gatt_db_attribute_cb_t service_added;
@@ -81,6 +104,12 @@ struct notify {
 	void *user_data;
 };
 
+struct db_data {
+	const void *key;
+	void *data;
+	gatt_db_destroy_func_t destroy;
+};
+
 struct attribute_notify {
 	unsigned int id;
 	gatt_db_attribute_cb_t removed;
@@ -132,8 +161,245 @@ struct gatt_db_service {
 	bool claimed;
 	uint16_t num_handles;
 	struct gatt_db_attribute **attributes;
+	/* Serialized Database Hash input, NULL if it needs regenerating */
+	uint8_t *hash_data;
+	size_t hash_len;
 };
 
+static void gatt_db_service_get_handles(const struct gatt_db_service *service,
+							uint16_t *start_handle,
+							uint16_t *end_handle);
+
+static bool index_grow(void **array, unsigned int *size, unsigned int count,
+							size_t elem_size)
+{
+	unsigned int new_size;
+	void *new_array;
+
+	if (count < *size)
+		return true;
+
+	new_size = *size ? *size * 2 : 16;
+
+	new_array = realloc(*array, new_size * elem_size);
+	if (!new_array)
+		return false;
+
+	*array = new_array;
+	*size = new_size;
+
+	return true;
+}
+
+/* Index of the first service ending at or after handle */
+static unsigned int svc_index_lookup(struct gatt_db *db, uint16_t handle)
+{
+	unsigned int lo = 0, hi = db->svc_count;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		uint16_t end;
+
+		gatt_db_service_get_handles(db->svc_index[mid], NULL, &end);
+
+		if (end < handle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static bool svc_index_add(struct gatt_db *db, struct gatt_db_service *service)
+{
+	unsigned int i;
+	uint16_t start;
+
+	if (!index_grow((void **) &db->svc_index, &db->svc_size,
+					db->svc_count, sizeof(*db->svc_index)))
+		return false;
+
+	gatt_db_service_get_handles(service, &start, NULL);
+
+	i = svc_index_lookup(db, start);
+
+	memmove(&db->svc_index[i + 1], &db->svc_index[i],
+			(db->svc_count - i) * sizeof(*db->svc_index));
+	db->svc_index[i] = service;
+	db->svc_count++;
+
+	return true;
+}
+
+static void svc_index_remove(struct gatt_db *db,
+					struct gatt_db_service *service)
+{
+	unsigned int i;
+	uint16_t start;
+
+	gatt_db_service_get_handles(service, &start, NULL);
+
+	i = svc_index_lookup(db, start);
+	if (i >= db->svc_count || db->svc_index[i] != service)
+		return;
+
+	db->svc_count--;
+	memmove(&db->svc_index[i], &db->svc_index[i + 1],
+			(db->svc_count - i) * sizeof(*db->svc_index));
+}
+
+/* Looks up the service containing handle or, failing that, the next one */
+static struct gatt_db_service *svc_index_next(struct gatt_db *db,
+							uint16_t handle)
+{
+	unsigned int i;
+
+	i = svc_index_lookup(db, handle);
+	if (i >= db->svc_count)
+		return NULL;
+
+	return db->svc_index[i];
+}
+
+static void type_to_key(const bt_uuid_t *uuid, uint128_t *key)
+{
+	bt_uuid_t uuid128;
+
+	bt_uuid_to_uuid128(uuid, &uuid128);
+	memcpy(key, &uuid128.value.u128, sizeof(*key));
+}
+
+static int type_entry_cmp(const struct type_entry *entry,
+				const uint128_t *type, uint16_t handle)
+{
+	int ret;
+
+	ret = memcmp(&entry->type, type, sizeof(*type));
+	if (ret)
+		return ret;
+
+	if (entry->attrib->handle < handle)
+		return -1;
+
+	return entry->attrib->handle > handle;
+}
+
+/* Index of the first attribute of the given type at or after handle */
+static unsigned int type_index_lookup(struct gatt_db *db,
+					const uint128_t *type, uint16_t handle)
+{
+	unsigned int lo = 0, hi = db->type_count;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (type_entry_cmp(&db->type_index[mid], type, handle) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void type_index_add(struct gatt_db *db,
+					struct gatt_db_attribute *attrib)
+{
+	struct type_entry entry;
+	unsigned int i;
+
+	if (db->no_type_index)
+		return;
+
+	if (!index_grow((void **) &db->type_index, &db->type_size,
+				db->type_count, sizeof(*db->type_index))) {
+		free(db->type_index);
+		db->type_index = NULL;
+		db->type_count = 0;
+		db->type_size = 0;
+		db->no_type_index = true;
+		return;
+	}
+
+	type_to_key(&attrib->uuid, &entry.type);
+	entry.attrib = attrib;
+
+	i = type_index_lookup(db, &entry.type, attrib->handle);
+
+	memmove(&db->type_index[i + 1], &db->type_index[i],
+			(db->type_count - i) * sizeof(*db->type_index));
+	db->type_index[i] = entry;
+	db->type_count++;
+}
+
+static void type_index_remove(struct gatt_db *db,
+					struct gatt_db_attribute *attrib)
+{
+	uint128_t type;
+	unsigned int i;
+
+	type_to_key(&attrib->uuid, &type);
+
+	i = type_index_lookup(db, &type, attrib->handle);
+
+	/* Skip over attributes wrongly inserted with the same handle */
+	while (i < db->type_count && db->type_index[i].attrib != attrib &&
+			!type_entry_cmp(&db->type_index[i], &type,
+							attrib->handle))
+		i++;
+
+	if (i >= db->type_count || db->type_index[i].attrib != attrib)
+		return;
+
+	db->type_count--;
+	memmove(&db->type_index[i], &db->type_index[i + 1],
+			(db->type_count - i) * sizeof(*db->type_index));
+}
+
+/* Makes an attribute added to a service in the db visible to lookups */
+static struct gatt_db_attribute *
+service_index_attribute(struct gatt_db_service *service,
+					struct gatt_db_attribute *attrib)
+{
+	if (attrib && service->db)
+		type_index_add(service->db, attrib);
+
+	return attrib;
+}
+
+/*
+ * Attributes of a service occupy a prefix of its attributes array, in
+ * increasing handle order. Returns the index of the first attribute with
+ * a handle at or above handle, or num_handles if there is none.
+ */
+static unsigned int service_attribute_lookup(
+					const struct gatt_db_service *service,
+					uint16_t handle)
+{
+	unsigned int lo = 0, hi = service->num_handles;
+	uint16_t start;
+
+	gatt_db_service_get_handles(service, &start, NULL);
+
+	/* Handles grow by at least one per slot */
+	if (handle >= start && handle - start + 1u < hi)
+		hi = handle - start + 1;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		const struct gatt_db_attribute *attrib;
+
+		attrib = service->attributes[mid];
+		if (attrib && attrib->handle < handle)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
 static void set_attribute_data(struct gatt_db_attribute *attribute,
 						gatt_db_read_t read_func,
 						gatt_db_write_t write_func,
@@ -205,6 +471,19 @@ static void attribute_destroy(struct gatt_db_attribute *attribute)
 	free(attribute);
 }
 
+static void db_hash_schedule(struct gatt_db *db);
+
+static void service_hash_invalidate(struct gatt_db_service *service)
+{
+	free(service->hash_data);
+	service->hash_data = NULL;
+	service->hash_len = 0;
+
+	/* Attributes added to a service already exposed change the hash */
+	if (service->active && service->db)
+		db_hash_schedule(service->db);
+}
+
 static struct gatt_db_attribute *new_attribute(struct gatt_db_service *service,
 							uint16_t handle,
 							const bt_uuid_t *type,
@@ -215,6 +494,8 @@ static struct gatt_db_attribute *new_attribute(struct gatt_db_service *service,
 
 	attribute = new0(struct gatt_db_attribute, 1);
 
+	service_hash_invalidate(service);
+
 	attribute->service = service;
 	attribute->handle = handle;
 	attribute->uuid = *type;
@@ -256,6 +537,7 @@ struct gatt_db *gatt_db_new(void)
 	db->crypto = bt_crypto_new();
 	db->services = queue_new();
 	db->notify_list = queue_new();
+	db->data_list = queue_new();
 	db->next_handle = 0x0001;
 
 	return gatt_db_ref(db);
@@ -271,6 +553,16 @@ static void notify_destroy(void *data)
 	free(notify);
 }
 
+static void db_data_destroy(void *data)
+{
+	struct db_data *entry = data;
+
+	if (entry->destroy)
+		entry->destroy(entry->data);
+
+	free(entry);
+}
+
 static bool match_notify_id(const void *a, const void *b)
 {
 	const struct notify *notify = a;
@@ -297,83 +589,130 @@ static void handle_notify(void *data, void *user_data)
 
 struct hash_data {
 	struct iovec *iov;
-	uint16_t i;
+	unsigned int i;
 };
 
-static void gen_hash_m(struct gatt_db_attribute *attr, void *user_data)
+/* Returns the length an attribute contributes to the hash input */
+static size_t attr_hash_len(const struct gatt_db_attribute *attr)
 {
-	struct hash_data *hash = user_data;
-	uint8_t *data;
-	size_t len;
-
 	if (bt_uuid_len(&attr->uuid) != 2)
-		return;
+		return 0;
 
 	switch (attr->uuid.value.u16) {
 	case GATT_PRIM_SVC_UUID:
 	case GATT_SND_SVC_UUID:
 	case GATT_INCLUDE_UUID:
 	case GATT_CHARAC_UUID:
-		/* Allocate space for handle + type + value */
-		len = 2 + 2 + attr->value_len;
-		data = malloc(2 + 2 + attr->value_len);
-		put_le16(attr->handle, data);
-		bt_uuid_to_le(&attr->uuid, data + 2);
-		memcpy(data + 4, attr->value, attr->value_len);
-		break;
+		/* handle + type + value */
+		return 2 + 2 + attr->value_len;
 	case GATT_CHARAC_USER_DESC_UUID:
 	case GATT_CLIENT_CHARAC_CFG_UUID:
 	case GATT_SERVER_CHARAC_CFG_UUID:
 	case GATT_CHARAC_FMT_UUID:
 	case GATT_CHARAC_AGREG_FMT_UUID:
-		/* Allocate space for handle + type  */
-		len = 2 + 2;
-		data = malloc(2 + 2 + attr->value_len);
-		put_le16(attr->handle, data);
-		bt_uuid_to_le(&attr->uuid, data + 2);
-		break;
+		/* handle + type */
+		return 2 + 2;
 	default:
-		return;
+		return 0;
 	}
+}
 
-	hash->iov[hash->i].iov_base = data;
-	hash->iov[hash->i].iov_len = len;
+/*
+ * Serializes the hash input of a service once and keeps it until one of
+ * its attributes changes, so a change to the db only costs regenerating
+ * the services affected by it.
+ */
+static bool service_gen_hash_data(struct gatt_db_service *service)
+{
+	uint8_t *ptr;
+	size_t len = 0;
+	int i;
 
-	hash->i++;
+	if (service->hash_data)
+		return true;
+
+	for (i = 0; i < service->num_handles; i++) {
+		if (service->attributes[i])
+			len += attr_hash_len(service->attributes[i]);
+	}
+
+	service->hash_data = malloc(len);
+	if (!service->hash_data)
+		return false;
+
+	service->hash_len = len;
+
+	for (i = 0, ptr = service->hash_data; i < service->num_handles; i++) {
+		struct gatt_db_attribute *attr = service->attributes[i];
+		size_t attr_len;
 
-	return;
+		if (!attr)
+			continue;
+
+		attr_len = attr_hash_len(attr);
+		if (!attr_len)
+			continue;
+
+		put_le16(attr->handle, ptr);
+		bt_uuid_to_le(&attr->uuid, ptr + 2);
+		memcpy(ptr + 4, attr->value, attr_len - 4);
+		ptr += attr_len;
+	}
+
+	return true;
 }
 
 static void service_gen_hash_m(struct gatt_db_attribute *attr, void *user_data)
 {
-	gatt_db_service_foreach(attr, NULL, gen_hash_m, user_data);
+	struct gatt_db_service *service = attr->service;
+	struct hash_data *hash = user_data;
+
+	if (!service_gen_hash_data(service) || !service->hash_len)
+		return;
+
+	hash->iov[hash->i].iov_base = service->hash_data;
+	hash->iov[hash->i].iov_len = service->hash_len;
+	hash->i++;
 }
 
 static bool db_hash_update(void *user_data)
 {
 	struct gatt_db *db = user_data;
 	struct hash_data hash;
-	uint16_t i;
 
 	db->hash_id = 0;
 
 	if (!db->next_handle)
 		return false;
 
-	hash.iov = new0(struct iovec, db->next_handle);
+	/* One entry per service, the CMAC is fed all of them at once */
+	hash.iov = new0(struct iovec, queue_length(db->services) + 1);
 	hash.i = 0;
 
 	gatt_db_foreach_service(db, NULL, service_gen_hash_m, &hash);
-	bt_crypto_gatt_hash(db->crypto, hash.iov, db->next_handle, db->hash);
-
-	for (i = 0; i < hash.i; i++)
-		free(hash.iov[i].iov_base);
+	bt_crypto_gatt_hash(db->crypto, hash.iov, hash.i, db->hash);
 
 	free(hash.iov);
 
 	return false;
 }
 
+/*
+ * Restarts the hash timer on every change so a burst of services being
+ * registered or removed is hashed once, after the last of them.
+ */
+static void db_hash_schedule(struct gatt_db *db)
+{
+	if (!db->crypto)
+		return;
+
+	if (db->hash_id)
+		timeout_remove(db->hash_id);
+
+	db->hash_id = timeout_add(HASH_UPDATE_TIMEOUT, db_hash_update, db,
+									NULL);
+}
+
 static void handle_attribute_notify(void *data, void *user_data)
 {
 	struct attribute_notify *notify = data;
@@ -406,6 +745,9 @@ static void notify_service_changed(struct gatt_db *db,
 	if (!added)
 		notify_attribute_changed(service);
 
+	/* Tigger hash update, even if nobody is watching the db */
+	db_hash_schedule(db);
+
 	if (queue_isempty(db->notify_list))
 		return;
 
@@ -416,11 +758,6 @@ static void notify_service_changed(struct gatt_db *db,
 
 	queue_foreach(db->notify_list, handle_notify, &data);
 
-	/* Tigger hash update */
-	if (!db->hash_id && db->crypto)
-		db->hash_id = timeout_add(HASH_UPDATE_TIMEOUT, db_hash_update,
-								db, NULL);
-
 	gatt_db_unref(db);
 }
 
@@ -429,12 +766,23 @@ static void gatt_db_service_destroy(void *data)
 	struct gatt_db_service *service = data;
 	int i;
 
+	if (service->db) {
+		svc_index_remove(service->db, service);
+
+		for (i = 0; i < service->num_handles; i++) {
+			if (service->attributes[i])
+				type_index_remove(service->db,
+						service->attributes[i]);
+		}
+	}
+
 	if (service->active)
 		notify_service_changed(service->db, service, false);
 
 	for (i = 0; i < service->num_handles; i++)
 		attribute_destroy(service->attributes[i]);
 
+	free(service->hash_data);
 	free(service->attributes);
 	free(service);
 }
@@ -445,6 +793,8 @@ static void gatt_db_destroy(struct gatt_db *db)
 		return;
 
 	bt_crypto_unref(db->crypto);
+	/* Services going away below must not schedule a hash update */
+	db->crypto = NULL;
 
 	/*
 	 * Clear the notify list before clearing the services to prevent the
@@ -456,7 +806,14 @@ static void gatt_db_destroy(struct gatt_db *db)
 	if (db->hash_id)
 		timeout_remove(db->hash_id);
 
+	/* No lookups from here on, skip keeping the indexes up to date */
+	db->svc_count = 0;
+	db->type_count = 0;
+
 	queue_destroy(db->services, gatt_db_service_destroy);
+	queue_destroy(db->data_list, db_data_destroy);
+	free(db->svc_index);
+	free(db->type_index);
 	free(db);
 }
 
@@ -611,6 +968,9 @@ bool gatt_db_clear_range(struct gatt_db *db, uint16_t start_handle,
 
 	/* Check if it is a full clear */
 	if (start_handle == 1 && end_handle == UINT16_MAX) {
+		db->svc_count = 0;
+		db->type_count = 0;
+		db->no_type_index = false;
 		queue_remove_all(db->services, NULL, NULL,
 						gatt_db_service_destroy);
 		goto done;
@@ -657,16 +1017,17 @@ static struct gatt_db_service *find_insert_loc(struct gatt_db *db,
 						uint16_t start, uint16_t end,
 						struct gatt_db_service **after)
 {
-	const struct queue_entry *services_entry;
 	struct gatt_db_service *service;
 	uint16_t cur_start, cur_end;
+	unsigned int i;
 
-	*after = NULL;
+	/* Services before this one end before start */
+	i = svc_index_lookup(db, start);
 
-	services_entry = queue_get_entries(db->services);
+	*after = i ? db->svc_index[i - 1] : NULL;
 
-	while (services_entry) {
-		service = services_entry->data;
+	for (; i < db->svc_count; i++) {
+		service = db->svc_index[i];
 
 		gatt_db_service_get_handles(service, &cur_start, &cur_end);
 
@@ -680,7 +1041,6 @@ static struct gatt_db_service *find_insert_loc(struct gatt_db *db,
 			return NULL;
 
 		*after = service;
-		services_entry = services_entry->next;
 	}
 
 	return NULL;
@@ -740,10 +1100,17 @@ struct gatt_db_attribute *gatt_db_insert_service(struct gatt_db *db,
 		goto fail;
 	}
 
-	service->db = db;
 	service->attributes[0]->handle = handle;
 	service->num_handles = num_handles;
 
+	if (!svc_index_add(db, service)) {
+		queue_remove(db->services, service);
+		goto fail;
+	}
+
+	service->db = db;
+	type_index_add(db, service->attributes[0]);
+
 	/* Fast-forward next_handle if the new service was added to the end */
 	db->next_handle = MAX(handle + num_handles, db->next_handle);
 
@@ -809,6 +1176,56 @@ bool gatt_db_unregister(struct gatt_db *db, unsigned int id)
 	return true;
 }
 
+static bool match_db_data_key(const void *a, const void *b)
+{
+	const struct db_data *entry = a;
+
+	return entry->key == b;
+}
+
+bool gatt_db_set_data(struct gatt_db *db, const void *key, void *data,
+					gatt_db_destroy_func_t destroy)
+{
+	struct db_data *entry;
+
+	if (!db || !key)
+		return false;
+
+	entry = queue_remove_if(db->data_list, match_db_data_key,
+							(void *) key);
+	if (entry)
+		db_data_destroy(entry);
+
+	if (!data)
+		return true;
+
+	entry = new0(struct db_data, 1);
+	entry->key = key;
+	entry->data = data;
+	entry->destroy = destroy;
+
+	if (!queue_push_tail(db->data_list, entry)) {
+		free(entry);
+		return false;
+	}
+
+	return true;
+}
+
+void *gatt_db_get_data(struct gatt_db *db, const void *key)
+{
+	struct db_data *entry;
+
+	if (!db)
+		return NULL;
+
+	entry = queue_find(db->data_list, match_db_data_key, key);
+	if (!entry)
+		return NULL;
+
+	return entry->data;
+}
+
 bool gatt_db_set_authorize(struct gatt_db *db, gatt_db_authorize_cb_t cb,
 							void *user_data)
 {
@@ -904,7 +1321,9 @@ service_insert_characteristic(struct gatt_db_service *service,
 	set_attribute_data(service->attributes[i], read_func, write_func,
 							permissions, user_data);
 
-	return service->attributes[i];
+	service_index_attribute(service, service->attributes[i - 1]);
+
+	return service_index_attribute(service, service->attributes[i]);
 }
 
 struct gatt_db_attribute *
@@ -995,7 +1414,7 @@ service_insert_descriptor(struct gatt_db_service *service,
 	set_attribute_data(service->attributes[i], read_func, write_func,
 							permissions, user_data);
 
-	return service->attributes[i];
+	return service_index_attribute(service, service->attributes[i]);
 }
 
 struct gatt_db_attribute *
@@ -1107,7 +1526,7 @@ service_insert_included(struct gatt_db_service *service, uint16_t handle,
 	set_attribute_data(service->attributes[index], NULL, NULL,
 					BT_ATT_PERM_READ, NULL);
 
-	return service->attributes[index];
+	return service_index_attribute(service, service->attributes[index]);
 }
 
 struct gatt_db_attribute *
@@ -1349,7 +1768,7 @@ static void foreach_in_range(void *data, void *user_data)
 	struct gatt_db_service *service = data;
 	struct foreach_data *foreach_data = user_data;
 	uint16_t svc_start, svc_end;
-	int i;
+	unsigned int i;
 
 	if (!service->active)
 		return;
@@ -1367,15 +1786,14 @@ static void foreach_in_range(void *data, void *user_data)
 		return foreach_service_in_range(data, user_data);
 	}
 
-	for (i = 0; i < service->num_handles; i++) {
+	i = service_attribute_lookup(service, foreach_data->start);
+
+	for (; i < service->num_handles; i++) {
 		struct gatt_db_attribute *attribute = service->attributes[i];
 
 		if (!attribute)
 			continue;
 
-		if (attribute->handle < foreach_data->start)
-			continue;
-
 		if (attribute->handle > foreach_data->end)
 			return;
 
@@ -1387,6 +1805,73 @@ static void foreach_in_range(void *data, void *user_data)
 	}
 }
 
+/*
+ * Walks the services overlapping the range in handle order. The next
+ * service is looked up again after each one so that the callbacks may
+ * add or remove services.
+ */
+static void foreach_service_index(struct gatt_db *db,
+					struct foreach_data *foreach_data)
+{
+	uint16_t handle = foreach_data->start;
+
+	while (handle <= foreach_data->end) {
+		struct gatt_db_service *service;
+		uint16_t svc_start, svc_end;
+
+		service = svc_index_next(db, handle);
+		if (!service)
+			return;
+
+		gatt_db_service_get_handles(service, &svc_start, &svc_end);
+		if (svc_start > foreach_data->end)
+			return;
+
+		foreach_in_range(service, foreach_data);
+
+		if (svc_end == UINT16_MAX)
+			return;
+
+		handle = svc_end + 1;
+	}
+}
+
+/* Walks the attributes of one type in the range using the type index */
+static void foreach_type_index(struct gatt_db *db,
+					struct foreach_data *foreach_data)
+{
+	uint16_t handle = foreach_data->start;
+	uint128_t type;
+
+	type_to_key(foreach_data->uuid, &type);
+
+	while (handle <= foreach_data->end) {
+		struct gatt_db_attribute *attribute;
+		struct type_entry *entry;
+		unsigned int i;
+
+		i = type_index_lookup(db, &type, handle);
+		if (i >= db->type_count)
+			return;
+
+		entry = &db->type_index[i];
+		if (memcmp(&entry->type, &type, sizeof(type)))
+			return;
+
+		attribute = entry->attrib;
+		if (attribute->handle > foreach_data->end)
+			return;
+
+		if (attribute->service->active)
+			foreach_data->func(attribute, foreach_data->user_data);
+
+		if (attribute->handle == UINT16_MAX)
+			return;
+
+		handle = attribute->handle + 1;
+	}
+}
+
 void gatt_db_foreach_service_in_range(struct gatt_db *db,
 						const bt_uuid_t *uuid,
 						gatt_db_attribute_cb_t func,
@@ -1406,7 +1891,7 @@ void gatt_db_foreach_service_in_range(struct gatt_db *db,
 	data.end = end_handle;
 	data.attr = false;
 
-	queue_foreach(db->services, foreach_in_range, &data);
+	foreach_service_index(db, &data);
 }
 
 void gatt_db_foreach_in_range(struct gatt_db *db, const bt_uuid_t *uuid,
@@ -1427,7 +1912,10 @@ void gatt_db_foreach_in_range(struct gatt_db *db, const bt_uuid_t *uuid,
 	data.end = end_handle;
 	data.attr = true;
 
-	queue_foreach(db->services, foreach_in_range, &data);
+	if (uuid && !db->no_type_index)
+		foreach_type_index(db, &data);
+	else
+		foreach_service_index(db, &data);
 }
 
 void gatt_db_service_foreach(struct gatt_db_attribute *attrib,
@@ -1510,30 +1998,23 @@ void gatt_db_service_foreach_incl(struct gatt_db_attribute *attrib,
 								user_data);
 }
 
-static bool find_service_for_handle(const void *data, const void *user_data)
-{
-	const struct gatt_db_service *service = data;
-	uint16_t handle = PTR_TO_UINT(user_data);
-	uint16_t start, end;
-
-	gatt_db_service_get_handles(service, &start, &end);
-
-	return (start <= handle) && (handle <= end);
-}
-
 struct gatt_db_attribute *gatt_db_get_service(struct gatt_db *db,
 							uint16_t handle)
 {
 	struct gatt_db_service *service;
+	uint16_t start;
 
 	if (!db || !handle)
 		return NULL;
 
-	service = queue_find(db->services, find_service_for_handle,
-						UINT_TO_PTR(handle));
+	service = svc_index_next(db, handle);
 	if (!service)
 		return NULL;
 
+	gatt_db_service_get_handles(service, &start, NULL);
+	if (start > handle)
+		return NULL;
+
 	return service->attributes[0];
 }
 
@@ -1542,7 +2023,7 @@ struct gatt_db_attribute *gatt_db_get_attribute(struct gatt_db *db,
 {
 	struct gatt_db_attribute *attrib;
 	struct gatt_db_service *service;
-	int i;
+	unsigned int i;
 
 	attrib = gatt_db_get_service(db, handle);
 	if (!attrib)
@@ -1550,6 +2031,12 @@ struct gatt_db_attribute *gatt_db_get_attribute(struct gatt_db *db,
 
 	service = attrib->service;
 
+	i = service_attribute_lookup(service, handle);
+	if (i < service->num_handles && service->attributes[i] &&
+				service->attributes[i]->handle == handle)
+		return service->attributes[i];
+
+	/* Attributes inserted out of handle order */
 	for (i = 0; i < service->num_handles; i++) {
 		if (!service->attributes[i])
 			continue;
@@ -1995,6 +2482,10 @@ bool gatt_db_attribute_write(struct gatt_db_attribute *attrib, uint16_t offset,
 
 	memcpy(&attrib->value[offset], value, len);
 
+	/* Declaration values are part of the hash input */
+	if (attr_hash_len(attrib) > 4)
+		service_hash_invalidate(attrib->service);
+
 done:
 	func(attrib, 0, user_data);
 
@@ -205,6 +205,14 @@ unsigned int gatt_db_register(struct gatt_db *db,
 					gatt_db_destroy_func_t destroy);
 bool gatt_db_unregister(struct gatt_db *db, unsigned int id);
 
+/*
+ * Attaches data to the db under key, replacing and destroying any data
+ * previously set for it. The data is destroyed along with the db.
+ */
+bool gatt_db_set_data(struct gatt_db *db, const void *key, void *data,
+					gatt_db_destroy_func_t destroy);
+void *gatt_db_get_data(struct gatt_db *db, const void *key);
+
 typedef uint8_t (*gatt_db_authorize_cb_t)(struct gatt_db_attribute *attrib,
 					uint8_t opcode, struct bt_att *att,
 					void *user_data);
@@ -27,6 +27,7 @@
 
 #include <sys/uio.h>
 #include <errno.h>
+#include <time.h>
 
 #include "src/shared/att.h"
 #include "lib/bluetooth.h"
@@ -54,11 +55,18 @@
 
 #define NFY_MULT_TIMEOUT 10
 
+/* Discovery responses kept per db, oldest ones are evicted first */
+#define RSP_CACHE_MAX 64
+
 struct async_read_op {
 	struct bt_att_chan *chan;
 	struct bt_gatt_server *server;
 	uint8_t opcode;
 	bool done;
+	bool cache;
+	uint16_t start;
+	uint16_t end;
+	bt_uuid_t type;
 	uint8_t *pdu;
 	size_t pdu_len;
 	size_t value_len;
@@ -94,6 +102,32 @@ struct nfy_mult_data {
 	uint8_t *pdu;
 	uint16_t offset;
 	uint16_t len;
+	unsigned int count;
+	uint64_t time_sum;	/* Sum of the times values were queued at */
+};
+
+/*
+ * Responses to discovery requests only depend on the declarations in the
+ * db, which do not change while a service is active, and on the MTU. They
+ * are cached per db, attached to it so that they outlive connections, and
+ * flushed when services are added or removed.
+ */
+struct rsp_cache {
+	struct gatt_db *db;
+	unsigned int db_id;
+	struct queue *entries;
+};
+
+struct rsp_cache_entry {
+	uint8_t opcode;
+	uint16_t start;
+	uint16_t end;
+	bt_uuid_t type;
+	uint16_t mtu;
+	uint8_t ecode;
+	uint16_t ehandle;
+	uint16_t len;
+	uint8_t pdu[0];
 };
 
 struct bt_gatt_server {
@@ -101,6 +135,7 @@ struct bt_gatt_server {
 	struct bt_att *att;
 	int ref_count;
 	uint16_t mtu;
+	struct rsp_cache *rsp_cache;
 
 	unsigned int mtu_id;
 	unsigned int read_by_grp_type_id;
@@ -132,6 +167,8 @@ struct bt_gatt_server {
 	void *authorize_data;
 
 	struct nfy_mult_data *nfy_mult;
+	unsigned int nfy_mult_latency;
+	struct bt_gatt_server_nfy_mult_stats nfy_mult_stats;
 };
 
 static void bt_gatt_server_free(struct bt_gatt_server *server)
@@ -161,11 +198,160 @@ static void bt_gatt_server_free(struct bt_gatt_server *server)
 
 	queue_destroy(server->prep_queue, prep_write_data_destroy);
 
+	bt_att_set_idle_cb(server->att, NULL, NULL, NULL);
+
+	if (server->nfy_mult) {
+		timeout_remove(server->nfy_mult->id);
+		free(server->nfy_mult->pdu);
+		free(server->nfy_mult);
+	}
+
 	gatt_db_unref(server->db);
 	bt_att_unref(server->att);
 	free(server);
 }
 
+static void rsp_cache_flush(struct gatt_db_attribute *attrib, void *user_data)
+{
+	struct rsp_cache *cache = user_data;
+
+	queue_remove_all(cache->entries, NULL, NULL, free);
+}
+
+static void rsp_cache_free(void *data)
+{
+	struct rsp_cache *cache = data;
+
+	gatt_db_unregister(cache->db, cache->db_id);
+	queue_destroy(cache->entries, free);
+	free(cache);
+}
+
+/* Returns the cache of db, which lives as long as the db itself */
+static struct rsp_cache *rsp_cache_get(struct gatt_db *db)
+{
+	static const char key[] = "gatt-server-rsp-cache";
+	struct rsp_cache *cache;
+
+	cache = gatt_db_get_data(db, key);
+	if (cache)
+		return cache;
+
+	cache = new0(struct rsp_cache, 1);
+	cache->db = db;
+	cache->entries = queue_new();
+	cache->db_id = gatt_db_register(db, rsp_cache_flush, rsp_cache_flush,
+								cache, NULL);
+	if (!cache->db_id || !gatt_db_set_data(db, key, cache,
+							rsp_cache_free)) {
+		gatt_db_unregister(db, cache->db_id);
+		queue_destroy(cache->entries, NULL);
+		free(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+static bool rsp_cache_cacheable(const bt_uuid_t *type)
+{
+	if (type->type != BT_UUID16)
+		return false;
+
+	switch (type->value.u16) {
+	case GATT_PRIM_SVC_UUID:
+	case GATT_SND_SVC_UUID:
+	case GATT_INCLUDE_UUID:
+	case GATT_CHARAC_UUID:
+		return true;
+	}
+
+	return false;
+}
+
+struct rsp_cache_key {
+	uint8_t opcode;
+	uint16_t start;
+	uint16_t end;
+	const bt_uuid_t *type;
+	uint16_t mtu;
+};
+
+static bool match_rsp_cache_entry(const void *a, const void *b)
+{
+	const struct rsp_cache_entry *entry = a;
+	const struct rsp_cache_key *key = b;
+
+	if (entry->opcode != key->opcode || entry->start != key->start ||
+				entry->end != key->end || entry->mtu != key->mtu)
+		return false;
+
+	return !key->type || !bt_uuid_cmp(&entry->type, key->type);
+}
+
+/* Answers a request from the cache, returns false on a miss */
+static bool rsp_cache_send(struct bt_gatt_server *server,
+					struct bt_att_chan *chan, uint8_t opcode,
+					uint16_t start, uint16_t end,
+					const bt_uuid_t *type, uint16_t mtu)
+{
+	struct rsp_cache_key key = { opcode, start, end, type, mtu };
+	struct rsp_cache_entry *entry;
+
+	if (!server->rsp_cache)
+		return false;
+
+	entry = queue_find(server->rsp_cache->entries, match_rsp_cache_entry,
+									&key);
+	if (!entry)
+		return false;
+
+	util_debug(server->debug_callback, server->debug_data,
+						"Response served from cache");
+
+	if (entry->ecode)
+		bt_att_chan_send_error_rsp(chan, opcode, entry->ehandle,
+								entry->ecode);
+	else
+		bt_att_chan_send_rsp(chan, opcode + 1, entry->pdu, entry->len);
+
+	return true;
+}
+
+static void rsp_cache_add(struct bt_gatt_server *server, uint8_t opcode,
+					uint16_t start, uint16_t end,
+					const bt_uuid_t *type, uint16_t mtu,
+					const uint8_t *pdu, uint16_t len,
+					uint8_t ecode, uint16_t ehandle)
+{
+	struct rsp_cache_entry *entry;
+
+	if (!server->rsp_cache)
+		return;
+
+	if (queue_length(server->rsp_cache->entries) >= RSP_CACHE_MAX)
+		free(queue_pop_head(server->rsp_cache->entries));
+
+	entry = malloc(sizeof(*entry) + len);
+	if (!entry)
+		return;
+
+	memset(entry, 0, sizeof(*entry));
+	entry->opcode = opcode;
+	entry->start = start;
+	entry->end = end;
+	if (type)
+		entry->type = *type;
+	entry->mtu = mtu;
+	entry->ecode = ecode;
+	entry->ehandle = ehandle;
+	entry->len = len;
+	if (len)
+		memcpy(entry->pdu, pdu, len);
+
+	queue_push_tail(server->rsp_cache->entries, entry);
+}
+
 static bool get_uuid_le(const uint8_t *uuid, size_t len, bt_uuid_t *out_uuid)
 {
 	uint128_t u128;
@@ -310,10 +496,17 @@ static void read_by_grp_type_cb(struct bt_att_chan *chan, uint8_t opcode,
 		goto error;
 	}
 
+	if (rsp_cache_send(server, chan, opcode, start, end, &type, mtu)) {
+		queue_destroy(q, NULL);
+		return;
+	}
+
 	gatt_db_read_by_group_type(server->db, start, end, type, q);
 
 	if (queue_isempty(q)) {
 		ecode = BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+		rsp_cache_add(server, opcode, start, end, &type, mtu, NULL, 0,
+							ecode, ehandle);
 		goto error;
 	}
 
@@ -325,6 +518,9 @@ static void read_by_grp_type_cb(struct bt_att_chan *chan, uint8_t opcode,
 
 	queue_destroy(q, NULL);
 
+	rsp_cache_add(server, opcode, start, end, &type, mtu, rsp_pdu, rsp_len,
+									0, 0);
+
 	bt_att_chan_send_rsp(chan, BT_ATT_OP_READ_BY_GRP_TYPE_RSP,
 						rsp_pdu, rsp_len);
 
@@ -467,6 +663,11 @@ static void process_read_by_type(struct async_read_op *op)
 	attr = queue_pop_head(op->db_data);
 
 	if (op->done || !attr) {
+		if (op->cache)
+			rsp_cache_add(server, op->opcode, op->start, op->end,
+					&op->type, bt_att_get_mtu(server->att),
+					op->pdu, op->pdu_len, 0, 0);
+
 		bt_att_chan_send_rsp(op->chan, BT_ATT_OP_READ_BY_TYPE_RSP,
 						op->pdu, op->pdu_len);
 		async_read_op_destroy(op);
@@ -502,6 +703,7 @@ static void read_by_type_cb(struct bt_att_chan *chan, uint8_t opcode,
 	uint8_t ecode;
 	struct queue *q = NULL;
 	struct async_read_op *op;
+	bool cache;
 
 	if (length != 6 && length != 20) {
 		ecode = BT_ATT_ERROR_INVALID_PDU;
@@ -530,10 +732,22 @@ static void read_by_type_cb(struct bt_att_chan *chan, uint8_t opcode,
 		goto error;
 	}
 
+	/* Only declarations, whose values are held by the db, are cached */
+	cache = rsp_cache_cacheable(&type);
+	if (cache && rsp_cache_send(server, chan, opcode, start, end, &type,
+						bt_att_get_mtu(server->att))) {
+		queue_destroy(q, NULL);
+		return;
+	}
+
 	gatt_db_read_by_type(server->db, start, end, type, q);
 
 	if (queue_isempty(q)) {
 		ecode = BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+		if (cache)
+			rsp_cache_add(server, opcode, start, end, &type,
+					bt_att_get_mtu(server->att), NULL, 0,
+					ecode, ehandle);
 		goto error;
 	}
 
@@ -554,6 +768,10 @@ static void read_by_type_cb(struct bt_att_chan *chan, uint8_t opcode,
 	op->opcode = opcode;
 	op->server = server;
 	op->db_data = q;
+	op->cache = cache;
+	op->start = start;
+	op->end = end;
+	op->type = type;
 	server->pending_read_op = op;
 
 	process_read_by_type(op);
@@ -658,10 +876,17 @@ static void find_info_cb(struct bt_att_chan *chan, uint8_t opcode,
 		goto error;
 	}
 
+	if (rsp_cache_send(server, chan, opcode, start, end, NULL, mtu)) {
+		queue_destroy(q, NULL);
+		return;
+	}
+
 	gatt_db_find_information(server->db, start, end, q);
 
 	if (queue_isempty(q)) {
 		ecode = BT_ATT_ERROR_ATTRIBUTE_NOT_FOUND;
+		rsp_cache_add(server, opcode, start, end, NULL, mtu, NULL, 0,
+							ecode, ehandle);
 		goto error;
 	}
 
@@ -670,6 +895,9 @@ static void find_info_cb(struct bt_att_chan *chan, uint8_t opcode,
 		goto error;
 	}
 
+	rsp_cache_add(server, opcode, start, end, NULL, mtu, rsp_pdu, rsp_len,
+									0, 0);
+
 	bt_att_chan_send_rsp(chan, BT_ATT_OP_FIND_INFO_RSP, rsp_pdu, rsp_len);
 
 	queue_destroy(q, NULL);
@@ -1660,6 +1888,127 @@ static bool gatt_server_register_att_handlers(struct bt_gatt_server *server)
 	return true;
 }
 
+static uint64_t nfy_mult_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+enum nfy_mult_flush {
+	NFY_MULT_FLUSH_FULL,
+	NFY_MULT_FLUSH_TIMEOUT,
+	NFY_MULT_FLUSH_IDLE,
+};
+
+static void nfy_mult_send(struct bt_gatt_server *server,
+						enum nfy_mult_flush reason)
+{
+	struct nfy_mult_data *data = server->nfy_mult;
+	struct bt_gatt_server_nfy_mult_stats *stats = &server->nfy_mult_stats;
+	uint64_t now = nfy_mult_now();
+	uint64_t latency;
+
+	server->nfy_mult = NULL;
+
+	if (data->id)
+		timeout_remove(data->id);
+
+	bt_att_send(server->att, BT_ATT_OP_HANDLE_NFY_MULT, data->pdu,
+					data->offset, NULL, NULL, NULL);
+
+	latency = now * data->count - data->time_sum;
+
+	stats->pdus++;
+	stats->values += data->count;
+	stats->latency += latency;
+	stats->max_latency = MAX(stats->max_latency,
+					(uint32_t) (latency / data->count));
+
+	switch (reason) {
+	case NFY_MULT_FLUSH_FULL:
+		stats->flush_full++;
+		break;
+	case NFY_MULT_FLUSH_TIMEOUT:
+		stats->flush_timeout++;
+		break;
+	case NFY_MULT_FLUSH_IDLE:
+		stats->flush_idle++;
+		break;
+	}
+
+	free(data->pdu);
+	free(data);
+}
+
+static bool notify_multiple(void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+
+	/* Returning false removes the timeout */
+	server->nfy_mult->id = 0;
+	nfy_mult_send(server, NFY_MULT_FLUSH_TIMEOUT);
+
+	return false;
+}
+
+/*
+ * Called once the ATT channels sent everything they had queued. Holding
+ * values back any longer would only add latency, there is nothing left
+ * for them to wait behind.
+ */
+static void nfy_mult_idle(void *user_data)
+{
+	struct bt_gatt_server *server = user_data;
+
+	if (server->nfy_mult)
+		nfy_mult_send(server, NFY_MULT_FLUSH_IDLE);
+}
+
+static bool nfy_mult_append(struct bt_gatt_server *server,
+					const uint8_t *pdu, uint16_t length)
+{
+	struct nfy_mult_data *data = server->nfy_mult;
+	uint16_t mtu = bt_att_get_mtu(server->att);
+
+	/* A value that does not fit is sent right away, not truncated */
+	if (data && data->offset + length + 2 > data->len)
+		nfy_mult_send(server, NFY_MULT_FLUSH_FULL);
+
+	if (length + 2 > mtu - 1)
+		return false;
+
+	data = server->nfy_mult;
+	if (!data) {
+		data = new0(struct nfy_mult_data, 1);
+		data->len = mtu - 1;
+		data->pdu = malloc(data->len);
+		server->nfy_mult = data;
+	}
+
+	/* Handle, then the length of the value and the value itself */
+	memcpy(data->pdu + data->offset, pdu, 2);
+	put_le16(length - 2, data->pdu + data->offset + 2);
+	memcpy(data->pdu + data->offset + 4, pdu + 2, length - 2);
+	data->offset += length + 2;
+	data->count++;
+	data->time_sum += nfy_mult_now();
+
+	/* Full already, no need to wait for anything else */
+	if (data->offset + 4 >= data->len) {
+		nfy_mult_send(server, NFY_MULT_FLUSH_FULL);
+		return true;
+	}
+
+	if (!data->id)
+		data->id = timeout_add(server->nfy_mult_latency,
+						notify_multiple, server, NULL);
+
+	return true;
+}
+
 struct bt_gatt_server *bt_gatt_server_new(struct gatt_db *db,
 					struct bt_att *att, uint16_t mtu,
 					uint8_t min_enc_size)
@@ -1676,12 +2025,16 @@ struct bt_gatt_server *bt_gatt_server_new(struct gatt_db *db,
 	server->max_prep_queue_len = DEFAULT_MAX_PREP_QUEUE_LEN;
 	server->prep_queue = queue_new();
 	server->min_enc_size = min_enc_size;
+	server->rsp_cache = rsp_cache_get(db);
+	server->nfy_mult_latency = NFY_MULT_TIMEOUT;
 
 	if (!gatt_server_register_att_handlers(server)) {
 		bt_gatt_server_free(server);
 		return NULL;
 	}
 
+	bt_att_set_idle_cb(att, nfy_mult_idle, server, NULL);
+
 	return bt_gatt_server_ref(server);
 }
 
@@ -1740,69 +2093,99 @@ bool bt_gatt_server_set_debug(struct bt_gatt_server *server,
 	return true;
 }
 
-static bool notify_multiple(void *user_data)
+/*
+ * A notification encoded once, as the handle followed by the value, so that
+ * sending it to several connections does not build the PDU for each one.
+ */
+struct bt_gatt_server_nfy {
+	uint16_t len;
+	uint8_t pdu[0];
+};
+
+struct bt_gatt_server_nfy *bt_gatt_server_nfy_new(uint16_t handle,
+							const uint8_t *value,
+							uint16_t length)
 {
-	struct bt_gatt_server *server = user_data;
+	struct bt_gatt_server_nfy *nfy;
 
-	bt_att_send(server->att, BT_ATT_OP_HANDLE_NFY_MULT,
-			server->nfy_mult->pdu, server->nfy_mult->offset, NULL,
-			NULL, NULL);
+	if (length && !value)
+		return NULL;
 
-	free(server->nfy_mult->pdu);
-	free(server->nfy_mult);
-	server->nfy_mult = NULL;
+	nfy = malloc(sizeof(*nfy) + 2 + length);
+	if (!nfy)
+		return NULL;
 
-	return false;
+	nfy->len = 2 + length;
+	put_le16(handle, nfy->pdu);
+	if (length)
+		memcpy(nfy->pdu + 2, value, length);
+
+	return nfy;
 }
 
-bool bt_gatt_server_send_notification(struct bt_gatt_server *server,
-					uint16_t handle, const uint8_t *value,
-					uint16_t length, bool multiple)
+void bt_gatt_server_nfy_free(struct bt_gatt_server_nfy *nfy)
 {
-	struct nfy_mult_data *data = NULL;
-	bool result;
+	free(nfy);
+}
 
-	if (!server || (length && !value))
+bool bt_gatt_server_set_nfy_mult_latency(struct bt_gatt_server *server,
+							unsigned int msec)
+{
+	if (!server || !msec)
 		return false;
 
-	if (multiple)
-		data = server->nfy_mult;
-
-	if (!data) {
-		data = new0(struct nfy_mult_data, 1);
-		data->len = bt_att_get_mtu(server->att) - 1;
-		data->pdu = malloc(data->len);
-	}
+	server->nfy_mult_latency = msec;
 
-	put_le16(handle, data->pdu + data->offset);
-	data->offset += 2;
+	return true;
+}
 
-	length = MIN(data->len - data->offset, length);
+bool bt_gatt_server_get_nfy_mult_stats(struct bt_gatt_server *server,
+				struct bt_gatt_server_nfy_mult_stats *stats)
+{
+	if (!server || !stats)
+		return false;
 
-	if (multiple) {
-		put_le16(length, data->pdu + data->offset);
-		data->offset += 2;
-	}
+	*stats = server->nfy_mult_stats;
 
-	memcpy(data->pdu + data->offset, value, length);
-	data->offset += length;
+	return true;
+}
 
-	if (multiple) {
-		if (!server->nfy_mult)
-			server->nfy_mult = data;
+bool bt_gatt_server_send_nfy(struct bt_gatt_server *server,
+					struct bt_gatt_server_nfy *nfy,
+					bool multiple)
+{
+	uint16_t length;
 
-		if (!server->nfy_mult->id)
-			server->nfy_mult->id = timeout_add(NFY_MULT_TIMEOUT,
-						   notify_multiple, server,
-						   NULL);
+	if (!server || !nfy)
+		return false;
 
+	if (multiple && nfy_mult_append(server, nfy->pdu, nfy->len))
 		return true;
-	}
 
-	result = !!bt_att_send(server->att, BT_ATT_OP_HANDLE_NFY,
-				data->pdu, data->offset, NULL, NULL, NULL);
-	free(data->pdu);
-	free(data);
+	/* Values longer than the MTU allows are truncated */
+	length = MIN(nfy->len, bt_att_get_mtu(server->att) - 1);
+
+	return !!bt_att_send(server->att, BT_ATT_OP_HANDLE_NFY, nfy->pdu,
+						length, NULL, NULL, NULL);
+}
+
+bool bt_gatt_server_send_notification(struct bt_gatt_server *server,
+					uint16_t handle, const uint8_t *value,
+					uint16_t length, bool multiple)
+{
+	struct bt_gatt_server_nfy *nfy;
+	bool result;
+
+	if (!server || (length && !value))
+		return false;
+
+	nfy = bt_gatt_server_nfy_new(handle, value, length);
+	if (!nfy)
+		return false;
+
+	result = bt_gatt_server_send_nfy(server, nfy, multiple);
+
+	bt_gatt_server_nfy_free(nfy);
 
 	return result;
 }
@@ -54,6 +54,37 @@ bool bt_gatt_server_send_notification(struct bt_gatt_server *server,
 					uint16_t handle, const uint8_t *value,
 					uint16_t length, bool multiple);
 
+/*
+ * Multiple Handle Value Notifications are sent once the PDU is full, once
+ * the ATT channels have nothing else queued or, at the latest, after the
+ * latency budget.
+ */
+struct bt_gatt_server_nfy_mult_stats {
+	unsigned int pdus;		/* PDUs sent */
+	unsigned int values;		/* Values carried by them */
+	unsigned int flush_full;	/* PDUs sent because they were full */
+	unsigned int flush_timeout;	/* ... when the latency budget ran out */
+	unsigned int flush_idle;	/* ... when the channels went idle */
+	uint64_t latency;		/* Total added latency, in usec */
+	uint32_t max_latency;		/* Highest average of one PDU, in usec */
+};
+
+bool bt_gatt_server_set_nfy_mult_latency(struct bt_gatt_server *server,
+							unsigned int msec);
+bool bt_gatt_server_get_nfy_mult_stats(struct bt_gatt_server *server,
+				struct bt_gatt_server_nfy_mult_stats *stats);
+
+struct bt_gatt_server_nfy;
+
+struct bt_gatt_server_nfy *bt_gatt_server_nfy_new(uint16_t handle,
+							const uint8_t *value,
+							uint16_t length);
+void bt_gatt_server_nfy_free(struct bt_gatt_server_nfy *nfy);
+
+bool bt_gatt_server_send_nfy(struct bt_gatt_server *server,
+					struct bt_gatt_server_nfy *nfy,
+					bool multiple);
+
 bool bt_gatt_server_send_indication(struct bt_gatt_server *server,
 					uint16_t handle, const uint8_t *value,
 					uint16_t length,
@@ -36,6 +36,7 @@
 #include "src/shared/io.h"
 #include "src/shared/util.h"
 #include "src/shared/queue.h"
+#include "src/shared/idmap.h"
 #include "src/shared/hci.h"
 
 #define BTPROTO_HCI	1
@@ -49,6 +50,8 @@ struct sockaddr_hci {
 
 #define SOL_HCI		0
 #define HCI_FILTER	2
+
+#define HCI_READ_BUDGET	16
 struct hci_filter {
 	uint32_t type_mask;
 	uint32_t event_mask[2];
@@ -65,11 +68,19 @@ struct bt_hci {
 	unsigned int next_evt_id;
 	struct queue *cmd_queue;
 	struct queue *rsp_queue;
-	struct queue *evt_list;
+	struct idmap *cmd_map;
+	/* Event handlers by event code, created on first registration */
+	struct queue *evt_table[256];
+	bool in_notify;
+	bool need_notify_cleanup;
+	unsigned int read_budget;
+	struct bt_hci_read_stats read_stats;
 };
 
 struct cmd {
+	struct bt_hci *hci;
 	unsigned int id;
+	bool cancelled;
 	uint16_t opcode;
 	void *data;
 	uint8_t size;
@@ -81,6 +92,7 @@ struct cmd {
 struct evt {
 	unsigned int id;
 	uint8_t event;
+	bool removed;
 	bt_hci_callback_func_t callback;
 	bt_hci_destroy_func_t destroy;
 	void *user_data;
@@ -90,6 +102,8 @@ static void cmd_free(void *data)
 {
 	struct cmd *cmd = data;
 
+	idmap_remove(cmd->hci->cmd_map, cmd->id);
+
 	if (cmd->destroy)
 		cmd->destroy(cmd->user_data);
 
@@ -144,7 +158,10 @@ static bool io_write_callback(struct io *io, void *user_data)
 	struct bt_hci *hci = user_data;
 	struct cmd *cmd;
 
-	cmd = queue_pop_head(hci->cmd_queue);
+	/* Drop the commands cancelled while waiting their turn */
+	while ((cmd = queue_pop_head(hci->cmd_queue)) && cmd->cancelled)
+		cmd_free(cmd);
+
 	if (cmd) {
 		send_command(hci, cmd->opcode, cmd->data, cmd->size);
 		queue_push_tail(hci->rsp_queue, cmd);
@@ -200,6 +217,9 @@ static void process_response(struct bt_hci *hci, uint16_t opcode,
 	 */
 	bt_hci_ref(hci);
 
+	/* Too late to cancel it from the callback */
+	idmap_remove(hci->cmd_map, cmd->id);
+
 	if (cmd->callback)
 		cmd->callback(data, size, cmd->user_data);
 
@@ -215,11 +235,46 @@ static void process_notify(void *data, void *user_data)
 	struct bt_hci_evt_hdr *hdr = user_data;
 	struct evt *evt = data;
 
-	if (evt->event == hdr->evt)
+	if (!evt->removed)
 		evt->callback(user_data + sizeof(struct bt_hci_evt_hdr),
 						hdr->plen, evt->user_data);
 }
 
+static bool match_evt_removed(const void *a, const void *b)
+{
+	const struct evt *evt = a;
+
+	return evt->removed;
+}
+
+/*
+ * Handlers unregistered from a callback are only marked removed and freed
+ * once the event has been dispatched.
+ */
+static void notify_event(struct bt_hci *hci,
+					const struct bt_hci_evt_hdr *hdr)
+{
+	unsigned int i;
+
+	if (queue_isempty(hci->evt_table[hdr->evt]))
+		return;
+
+	hci->in_notify = true;
+
+	queue_foreach(hci->evt_table[hdr->evt], process_notify, (void *) hdr);
+
+	hci->in_notify = false;
+
+	if (!hci->need_notify_cleanup)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(hci->evt_table); i++)
+		queue_remove_all(hci->evt_table[i], match_evt_removed, NULL,
+								evt_free);
+
+	hci->need_notify_cleanup = false;
+}
+
 static void process_event(struct bt_hci *hci, const void *data, size_t size)
 {
 	const struct bt_hci_evt_hdr *hdr = data;
@@ -255,15 +310,21 @@ static void process_event(struct bt_hci *hci, const void *data, size_t size)
 		break;
 
 	default:
-		queue_foreach(hci->evt_list, process_notify, (void *) hdr);
+		notify_event(hci, hdr);
 		break;
 	}
 }
 
+/*
+ * Drains the packets already queued on the socket, up to read_budget per
+ * wakeup, dispatching them in order. Anything left wakes the mainloop
+ * again.
+ */
 static bool io_read_callback(struct io *io, void *user_data)
 {
 	struct bt_hci *hci = user_data;
 	uint8_t buf[512];
+	unsigned int count = 0;
 	ssize_t len;
 	int fd;
 
@@ -278,15 +339,30 @@ static bool io_read_callback(struct io *io, void *user_data)
 	if (len < 0)
 		return false;
 
-	if (len < 1)
-		return true;
+	bt_hci_ref(hci);
 
-	switch (buf[0]) {
-	case BT_H4_EVT_PKT:
-		process_event(hci, buf + 1, len - 1);
-		break;
+	while (1) {
+		if (len > 0 && buf[0] == BT_H4_EVT_PKT)
+			process_event(hci, buf + 1, len - 1);
+
+		count++;
+
+		/* Stop once the owner let go of it from a callback */
+		if (count >= hci->read_budget || hci->ref_count == 1)
+			break;
+
+		len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len < 0)
+			break;
 	}
 
+	hci->read_stats.wakeups++;
+	hci->read_stats.events += count;
+	if (count > hci->read_stats.max_events)
+		hci->read_stats.max_events = count;
+
+	bt_hci_unref(hci);
+
 	return true;
 }
 
@@ -306,16 +382,17 @@ static struct bt_hci *create_hci(int fd)
 
 	hci->is_stream = true;
 	hci->writer_active = false;
+	hci->read_budget = HCI_READ_BUDGET;
 	hci->num_cmds = 1;
 	hci->next_cmd_id = 1;
 	hci->next_evt_id = 1;
 
 	hci->cmd_queue = queue_new();
 	hci->rsp_queue = queue_new();
-	hci->evt_list = queue_new();
+	hci->cmd_map = idmap_new();
 
 	if (!io_set_read_handler(hci->io, io_read_callback, hci, NULL)) {
-		queue_destroy(hci->evt_list, NULL);
+		idmap_free(hci->cmd_map);
 		queue_destroy(hci->rsp_queue, NULL);
 		queue_destroy(hci->cmd_queue, NULL);
 		io_destroy(hci->io);
@@ -427,21 +504,46 @@ struct bt_hci *bt_hci_ref(struct bt_hci *hci)
 
 void bt_hci_unref(struct bt_hci *hci)
 {
+	unsigned int i;
+
 	if (!hci)
 		return;
 
 	if (__sync_sub_and_fetch(&hci->ref_count, 1))
 		return;
 
-	queue_destroy(hci->evt_list, evt_free);
+	for (i = 0; i < ARRAY_SIZE(hci->evt_table); i++)
+		queue_destroy(hci->evt_table[i], evt_free);
+
 	queue_destroy(hci->cmd_queue, cmd_free);
 	queue_destroy(hci->rsp_queue, cmd_free);
+	idmap_free(hci->cmd_map);
 
 	io_destroy(hci->io);
 
 	free(hci);
 }
 
+bool bt_hci_set_read_budget(struct bt_hci *hci, unsigned int budget)
+{
+	if (!hci || !budget)
+		return false;
+
+	hci->read_budget = budget;
+
+	return true;
+}
+
+bool bt_hci_get_read_stats(struct bt_hci *hci, struct bt_hci_read_stats *stats)
+{
+	if (!hci || !stats)
+		return false;
+
+	*stats = hci->read_stats;
+
+	return true;
+}
+
 bool bt_hci_set_close_on_unref(struct bt_hci *hci, bool do_close)
 {
 	if (!hci)
@@ -477,6 +579,7 @@ unsigned int bt_hci_send(struct bt_hci *hci, uint16_t opcode,
 	if (hci->next_cmd_id < 1)
 		hci->next_cmd_id = 1;
 
+	cmd->hci = hci;
 	cmd->id = hci->next_cmd_id++;
 
 	cmd->callback = callback;
@@ -489,19 +592,18 @@ unsigned int bt_hci_send(struct bt_hci *hci, uint16_t opcode,
 		return 0;
 	}
 
+	idmap_insert(hci->cmd_map, cmd->id, cmd);
+
 	wakeup_writer(hci);
 
 	return cmd->id;
 }
 
-static bool match_cmd_id(const void *a, const void *b)
-{
-	const struct cmd *cmd = a;
-	unsigned int id = PTR_TO_UINT(b);
-
-	return cmd->id == id;
-}
-
+/*
+ * Commands sent and waiting for their response are unlinked right away.
+ * Those still queued are only disarmed and dropped when their turn comes,
+ * which keeps cancelling one out of a long queue cheap.
+ */
 bool bt_hci_cancel(struct bt_hci *hci, unsigned int id)
 {
 	struct cmd *cmd;
@@ -509,17 +611,22 @@ bool bt_hci_cancel(struct bt_hci *hci, unsigned int id)
 	if (!hci || !id)
 		return false;
 
-	cmd = queue_remove_if(hci->cmd_queue, match_cmd_id, UINT_TO_PTR(id));
-	if (!cmd) {
-		cmd = queue_remove_if(hci->rsp_queue, match_cmd_id,
-							UINT_TO_PTR(id));
-		if (!cmd)
-			return false;
+	cmd = idmap_remove(hci->cmd_map, id);
+	if (!cmd)
+		return false;
+
+	if (queue_remove(hci->rsp_queue, cmd)) {
+		cmd_free(cmd);
+		wakeup_writer(hci);
+		return true;
 	}
 
-	cmd_free(cmd);
+	if (cmd->destroy)
+		cmd->destroy(cmd->user_data);
 
-	wakeup_writer(hci);
+	cmd->callback = NULL;
+	cmd->destroy = NULL;
+	cmd->cancelled = true;
 
 	return true;
 }
@@ -549,6 +656,9 @@ unsigned int bt_hci_register(struct bt_hci *hci, uint8_t event,
 	if (!hci)
 		return 0;
 
+	if (!hci->evt_table[event])
+		hci->evt_table[event] = queue_new();
+
 	evt = new0(struct evt, 1);
 	evt->event = event;
 
@@ -561,7 +671,7 @@ unsigned int bt_hci_register(struct bt_hci *hci, uint8_t event,
 	evt->destroy = destroy;
 	evt->user_data = user_data;
 
-	if (!queue_push_tail(hci->evt_list, evt)) {
+	if (!queue_push_tail(hci->evt_table[event], evt)) {
 		free(evt);
 		return 0;
 	}
@@ -579,15 +689,26 @@ static bool match_evt_id(const void *a, const void *b)
 
 bool bt_hci_unregister(struct bt_hci *hci, unsigned int id)
 {
-	struct evt *evt;
+	struct evt *evt = NULL;
+	unsigned int i;
 
 	if (!hci || !id)
 		return false;
 
-	evt = queue_remove_if(hci->evt_list, match_evt_id, UINT_TO_PTR(id));
-	if (!evt)
+	for (i = 0; i < ARRAY_SIZE(hci->evt_table) && !evt; i++)
+		evt = queue_find(hci->evt_table[i], match_evt_id,
+							UINT_TO_PTR(id));
+
+	if (!evt || evt->removed)
 		return false;
 
+	if (hci->in_notify) {
+		evt->removed = true;
+		hci->need_notify_cleanup = true;
+		return true;
+	}
+
+	queue_remove(hci->evt_table[evt->event], evt);
 	evt_free(evt);
 
 	return true;
@@ -37,6 +37,16 @@ void bt_hci_unref(struct bt_hci *hci);
 
 bool bt_hci_set_close_on_unref(struct bt_hci *hci, bool do_close);
 
+/* Packets read per wakeup, events / wakeups is the average batch */
+struct bt_hci_read_stats {
+	uint64_t wakeups;
+	uint64_t events;
+	unsigned int max_events;
+};
+
+bool bt_hci_set_read_budget(struct bt_hci *hci, unsigned int budget);
+bool bt_hci_get_read_stats(struct bt_hci *hci, struct bt_hci_read_stats *stats);
+
 typedef void (*bt_hci_callback_func_t)(const void *data, uint8_t size,
 							void *user_data);
 
@@ -0,0 +1,191 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "src/shared/util.h"
+#include "src/shared/idmap.h"
+
+/*
+ * Maps the non-zero IDs handed out for requests and commands back to them,
+ * so they can be found without walking the queues they wait in. Open
+ * addressing with linear probing; removal shifts the following entries
+ * back so no tombstones are left behind.
+ */
+
+#define IDMAP_MIN_SIZE 16
+
+struct idmap_entry {
+	unsigned int id;
+	void *data;
+};
+
+struct idmap {
+	struct idmap_entry *entries;
+	unsigned int size;
+	unsigned int count;
+};
+
+static unsigned int idmap_slot(const struct idmap *map, unsigned int id)
+{
+	/* IDs are mostly sequential, spread them with a Fibonacci hash */
+	return (id * 2654435761u) & (map->size - 1);
+}
+
+struct idmap *idmap_new(void)
+{
+	struct idmap *map;
+
+	map = new0(struct idmap, 1);
+	map->size = IDMAP_MIN_SIZE;
+	map->entries = new0(struct idmap_entry, map->size);
+
+	return map;
+}
+
+void idmap_free(struct idmap *map)
+{
+	if (!map)
+		return;
+
+	free(map->entries);
+	free(map);
+}
+
+static void idmap_place(struct idmap *map, unsigned int id, void *data)
+{
+	unsigned int i = idmap_slot(map, id);
+
+	while (map->entries[i].id)
+		i = (i + 1) & (map->size - 1);
+
+	map->entries[i].id = id;
+	map->entries[i].data = data;
+}
+
+static void idmap_grow(struct idmap *map)
+{
+	struct idmap_entry *entries = map->entries;
+	unsigned int i, size = map->size;
+
+	map->size = size * 2;
+	map->entries = new0(struct idmap_entry, map->size);
+
+	for (i = 0; i < size; i++) {
+		if (entries[i].id)
+			idmap_place(map, entries[i].id, entries[i].data);
+	}
+
+	free(entries);
+}
+
+static struct idmap_entry *idmap_lookup(struct idmap *map, unsigned int id)
+{
+	unsigned int i = idmap_slot(map, id);
+
+	while (map->entries[i].id) {
+		if (map->entries[i].id == id)
+			return &map->entries[i];
+
+		i = (i + 1) & (map->size - 1);
+	}
+
+	return NULL;
+}
+
+bool idmap_insert(struct idmap *map, unsigned int id, void *data)
+{
+	if (!map || !id)
+		return false;
+
+	if (idmap_lookup(map, id))
+		return false;
+
+	/* Keep at least half of the slots free so probes stay short */
+	if ((map->count + 1) * 2 > map->size)
+		idmap_grow(map);
+
+	idmap_place(map, id, data);
+	map->count++;
+
+	return true;
+}
+
+void *idmap_find(struct idmap *map, unsigned int id)
+{
+	struct idmap_entry *entry;
+
+	if (!map || !id)
+		return NULL;
+
+	entry = idmap_lookup(map, id);
+	if (!entry)
+		return NULL;
+
+	return entry->data;
+}
+
+void *idmap_remove(struct idmap *map, unsigned int id)
+{
+	struct idmap_entry *entry;
+	unsigned int i, j;
+	void *data;
+
+	if (!map || !id)
+		return NULL;
+
+	entry = idmap_lookup(map, id);
+	if (!entry)
+		return NULL;
+
+	data = entry->data;
+	map->count--;
+
+	/* Move back whatever probed past the freed slot */
+	i = entry - map->entries;
+
+	for (j = (i + 1) & (map->size - 1); map->entries[j].id;
+					j = (j + 1) & (map->size - 1)) {
+		unsigned int home = idmap_slot(map, map->entries[j].id);
+
+		/* Leave entries whose home lies cyclically within (i, j] */
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+
+		map->entries[i] = map->entries[j];
+		i = j;
+	}
+
+	map->entries[i].id = 0;
+	map->entries[i].data = NULL;
+
+	return data;
+}
+
+unsigned int idmap_count(struct idmap *map)
+{
+	if (!map)
+		return 0;
+
+	return map->count;
+}
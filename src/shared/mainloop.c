@@ -33,7 +33,9 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <stdbool.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
 #include <sys/epoll.h>
@@ -43,7 +45,7 @@
 #include "mainloop.h"
 #include "mainloop-notify.h"
 
-#define MAX_EPOLL_EVENTS 10
+#define MAX_EPOLL_EVENTS 64
 
 static int epoll_fd;
 static int epoll_terminate;
@@ -55,27 +57,62 @@ struct mainloop_data {
 	mainloop_event_func callback;
 	mainloop_destroy_func destroy;
 	void *user_data;
+	/* Entries removed while events are dispatched are freed after it */
+	struct mainloop_data *next_removed;
 };
 
-#define MAX_MAINLOOP_ENTRIES 128
+/* Indexed by fd, grown as higher fds are added */
+static struct mainloop_data **mainloop_list;
+static unsigned int mainloop_size;
 
-static struct mainloop_data *mainloop_list[MAX_MAINLOOP_ENTRIES];
+static bool dispatching;
+static struct mainloop_data *removed_list;
+
+/*
+ * Timeouts share a single timerfd driving a hierarchical timing wheel of
+ * TIMER_LEVELS levels of TIMER_SLOTS slots with a resolution of 1 ms. A
+ * timeout sits in the level covering its expiry and is moved down to a
+ * finer level when the wheel reaches its slot, so adding, modifying and
+ * removing a timeout are O(1) and the timerfd is only armed for the
+ * earliest expiry or cascade.
+ */
+#define TIMER_BITS	6
+#define TIMER_SLOTS	(1 << TIMER_BITS)
+#define TIMER_MASK	(TIMER_SLOTS - 1)
+#define TIMER_LEVELS	5
+
+#define LEVEL_SPAN(l)	(1ULL << (TIMER_BITS * (l)))
 
 struct timeout_data {
-	int fd;
+	int id;
+	uint64_t expires;
+	int level;
+	struct timeout_data *next;
+	struct timeout_data **pprev;
 	mainloop_timeout_func callback;
 	mainloop_destroy_func destroy;
 	void *user_data;
 };
 
+static struct timeout_data *timer_wheel[TIMER_LEVELS][TIMER_SLOTS];
+static unsigned int timer_count[TIMER_LEVELS];
+static uint64_t timer_time;
+static uint64_t timer_armed;
+static int timer_fd = -1;
+
+/* Indexed by id - 1, free ids are reused */
+static struct timeout_data **timeout_list;
+static unsigned int timeout_size;
+static int *timeout_free;
+static unsigned int timeout_free_count;
+
 void mainloop_init(void)
 {
-	unsigned int i;
-
 	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
 
-	for (i = 0; i < MAX_MAINLOOP_ENTRIES; i++)
-		mainloop_list[i] = NULL;
+	free(mainloop_list);
+	mainloop_list = NULL;
+	mainloop_size = 0;
 
 	epoll_terminate = 0;
 
@@ -101,6 +138,18 @@ void mainloop_exit_failure(void)
 	epoll_terminate = 1;
 }
 
+static void free_removed(void)
+{
+	while (removed_list) {
+		struct mainloop_data *data = removed_list;
+
+		removed_list = data->next_removed;
+		free(data);
+	}
+}
+
+static void timeout_free_all(void);
+
 int mainloop_run(void)
 {
 	unsigned int i;
@@ -113,15 +162,26 @@ int mainloop_run(void)
 		if (nfds < 0)
 			continue;
 
+		dispatching = true;
+
 		for (n = 0; n < nfds; n++) {
 			struct mainloop_data *data = events[n].data.ptr;
 
+			/* Removed by a callback earlier in this batch */
+			if (data->fd < 0)
+				continue;
+
 			data->callback(data->fd, events[n].events,
 							data->user_data);
 		}
+
+		dispatching = false;
+		free_removed();
 	}
 
-	for (i = 0; i < MAX_MAINLOOP_ENTRIES; i++) {
+	timeout_free_all();
+
+	for (i = 0; i < mainloop_size; i++) {
 		struct mainloop_data *data = mainloop_list[i];
 
 		mainloop_list[i] = NULL;
@@ -136,6 +196,10 @@ int mainloop_run(void)
 		}
 	}
 
+	free(mainloop_list);
+	mainloop_list = NULL;
+	mainloop_size = 0;
+
 	close(epoll_fd);
 	epoll_fd = 0;
 
@@ -144,6 +208,31 @@ int mainloop_run(void)
 	return exit_status;
 }
 
+static bool mainloop_list_grow(int fd)
+{
+	struct mainloop_data **list;
+	unsigned int size;
+
+	if ((unsigned int) fd < mainloop_size)
+		return true;
+
+	size = mainloop_size ? mainloop_size : 128;
+	while (size <= (unsigned int) fd)
+		size *= 2;
+
+	list = realloc(mainloop_list, size * sizeof(*list));
+	if (!list)
+		return false;
+
+	memset(list + mainloop_size, 0,
+			(size - mainloop_size) * sizeof(*list));
+
+	mainloop_list = list;
+	mainloop_size = size;
+
+	return true;
+}
+
 int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
 				void *user_data, mainloop_destroy_func destroy)
 {
@@ -151,9 +240,12 @@ int mainloop_add_fd(int fd, uint32_t events, mainloop_event_func callback,
 	struct epoll_event ev;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1 || !callback)
+	if (fd < 0 || !callback)
 		return -EINVAL;
 
+	if (!mainloop_list_grow(fd))
+		return -ENOMEM;
+
 	data = malloc(sizeof(*data));
 	if (!data)
 		return -ENOMEM;
@@ -186,7 +278,7 @@ int mainloop_modify_fd(int fd, uint32_t events)
 	struct epoll_event ev;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1)
+	if (fd < 0 || (unsigned int) fd >= mainloop_size)
 		return -EINVAL;
 
 	data = mainloop_list[fd];
@@ -211,7 +303,7 @@ int mainloop_remove_fd(int fd)
 	struct mainloop_data *data;
 	int err;
 
-	if (fd < 0 || fd > MAX_MAINLOOP_ENTRIES - 1)
+	if (fd < 0 || (unsigned int) fd >= mainloop_size)
 		return -EINVAL;
 
 	data = mainloop_list[fd];
@@ -225,53 +317,370 @@ int mainloop_remove_fd(int fd)
 	if (data->destroy)
 		data->destroy(data->user_data);
 
+	/* Pending events of this batch may still point to it */
+	if (dispatching) {
+		data->fd = -1;
+		data->next_removed = removed_list;
+		removed_list = data;
+		return err;
+	}
+
 	free(data);
 
 	return err;
 }
 
-static void timeout_destroy(void *user_data)
+static uint64_t timer_now(void)
 {
-	struct timeout_data *data = user_data;
+	struct timespec ts;
 
-	close(data->fd);
-	data->fd = -1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	if (data->destroy)
-		data->destroy(data->user_data);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	free(data);
+static void timer_unlink(struct timeout_data *data)
+{
+	if (!data->pprev)
+		return;
+
+	*data->pprev = data->next;
+	if (data->next)
+		data->next->pprev = data->pprev;
+
+	data->next = NULL;
+	data->pprev = NULL;
+
+	if (data->level >= 0)
+		timer_count[data->level]--;
+}
+
+static void timer_link(struct timeout_data **head, struct timeout_data *data)
+{
+	data->next = *head;
+	if (data->next)
+		data->next->pprev = &data->next;
+
+	data->pprev = head;
+	*head = data;
+}
+
+/* Places a timeout in the wheel relative to timer_time */
+static void timer_insert(struct timeout_data *data)
+{
+	uint64_t expires = data->expires;
+	uint64_t delta;
+	int level;
+
+	if (expires <= timer_time)
+		expires = timer_time + 1;
+
+	delta = expires - timer_time;
+
+	for (level = 0; level < TIMER_LEVELS - 1; level++) {
+		if (delta < LEVEL_SPAN(level + 1))
+			break;
+	}
+
+	/* Beyond the wheel, park it in the last slot reachable */
+	if (delta >= LEVEL_SPAN(TIMER_LEVELS))
+		expires = timer_time + LEVEL_SPAN(TIMER_LEVELS) - 1;
+
+	data->level = level;
+	timer_count[level]++;
+
+	timer_link(&timer_wheel[level][(expires >> (TIMER_BITS * level)) &
+							TIMER_MASK], data);
+}
+
+/* Returns the earliest time the wheel needs to be run at, 0 if empty */
+static uint64_t timer_next(void)
+{
+	uint64_t next = 0;
+	int level, i;
+
+	if (timer_count[0]) {
+		for (i = 1; i <= TIMER_SLOTS; i++) {
+			if (timer_wheel[0][(timer_time + i) & TIMER_MASK]) {
+				next = timer_time + i;
+				break;
+			}
+		}
+	}
+
+	/*
+	 * A timeout in a higher level may be due before the next one in
+	 * level 0, so the cascade of the lowest level in use bounds it too.
+	 */
+	for (level = 1; level < TIMER_LEVELS; level++) {
+		uint64_t span = LEVEL_SPAN(level);
+		uint64_t cascade;
+
+		if (!timer_count[level])
+			continue;
+
+		cascade = (timer_time / span + 1) * span;
+		if (!next || cascade < next)
+			next = cascade;
+
+		break;
+	}
+
+	return next;
+}
+
+static void timer_rearm(void)
+{
+	struct itimerspec itimer;
+	uint64_t next;
+
+	next = timer_next();
+	if (next == timer_armed)
+		return;
+
+	timer_armed = next;
+
+	memset(&itimer, 0, sizeof(itimer));
+	itimer.it_value.tv_sec = next / 1000;
+	itimer.it_value.tv_nsec = (next % 1000) * 1000 * 1000;
+
+	timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &itimer, NULL);
+}
+
+static void timer_cascade(int level, unsigned int slot)
+{
+	struct timeout_data *list = timer_wheel[level][slot];
+
+	timer_wheel[level][slot] = NULL;
+	if (list)
+		list->pprev = &list;
+
+	while (list) {
+		struct timeout_data *data = list;
+
+		timer_unlink(data);
+		timer_insert(data);
+	}
+}
+
+static void timer_expire(unsigned int slot)
+{
+	struct timeout_data *list = timer_wheel[0][slot];
+
+	timer_wheel[0][slot] = NULL;
+	if (list)
+		list->pprev = &list;
+
+	/*
+	 * The callbacks may add, modify or remove any timeout, including the
+	 * ones left in list, which unlinking keeps consistent.
+	 */
+	while (list) {
+		struct timeout_data *data = list;
+
+		timer_unlink(data);
+
+		/* Parked beyond the wheel, not due yet */
+		if (data->expires > timer_time) {
+			timer_insert(data);
+			continue;
+		}
+
+		data->callback(data->id, data->user_data);
+	}
+}
+
+static void timer_run(uint64_t now)
+{
+	while (timer_time < now) {
+		uint64_t t = timer_time + 1;
+		int level;
+
+		/* Skip ahead to the next slot or cascade anything is in */
+		if (!timer_count[0]) {
+			uint64_t span;
+
+			for (level = 1; level < TIMER_LEVELS; level++) {
+				if (timer_count[level])
+					break;
+			}
+
+			if (level == TIMER_LEVELS) {
+				timer_time = now;
+				break;
+			}
+
+			span = LEVEL_SPAN(level);
+			t = (t + span - 1) / span * span;
+			if (t > now) {
+				timer_time = now;
+				break;
+			}
+		}
+
+		timer_time = t;
+
+		for (level = 1; level < TIMER_LEVELS; level++) {
+			if (t & (LEVEL_SPAN(level) - 1))
+				break;
+
+			timer_cascade(level, (t >> (TIMER_BITS * level)) &
+								TIMER_MASK);
+		}
+
+		timer_expire(t & TIMER_MASK);
+	}
 }
 
-static void timeout_callback(int fd, uint32_t events, void *user_data)
+static void timer_callback(int fd, uint32_t events, void *user_data)
 {
-	struct timeout_data *data = user_data;
 	uint64_t expired;
-	ssize_t result;
 
 	if (events & (EPOLLERR | EPOLLHUP))
 		return;
 
-	result = read(data->fd, &expired, sizeof(expired));
-	if (result != sizeof(expired))
+	if (read(fd, &expired, sizeof(expired)) < 0)
 		return;
 
-	if (data->callback)
-		data->callback(data->fd, data->user_data);
+	timer_armed = 0;
+	timer_run(timer_now());
+	timer_rearm();
 }
 
-static inline int timeout_set(int fd, unsigned int msec)
+static void timer_destroy(void *user_data)
 {
-	struct itimerspec itimer;
-	unsigned int sec = msec / 1000;
+	close(timer_fd);
+	timer_fd = -1;
+	timer_armed = 0;
+}
 
-	memset(&itimer, 0, sizeof(itimer));
-	itimer.it_interval.tv_sec = 0;
-	itimer.it_interval.tv_nsec = 0;
-	itimer.it_value.tv_sec = sec;
-	itimer.it_value.tv_nsec = (msec - (sec * 1000)) * 1000 * 1000;
+static int timer_init(void)
+{
+	unsigned int i;
+
+	if (timer_fd >= 0)
+		return 0;
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0)
+		return -EIO;
+
+	if (mainloop_add_fd(timer_fd, EPOLLIN, timer_callback, NULL,
+						timer_destroy) < 0) {
+		close(timer_fd);
+		timer_fd = -1;
+		return -EIO;
+	}
+
+	memset(timer_wheel, 0, sizeof(timer_wheel));
+	for (i = 0; i < TIMER_LEVELS; i++)
+		timer_count[i] = 0;
+
+	timer_time = timer_now();
+	timer_armed = 0;
+
+	return 0;
+}
+
+static bool timer_empty(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < TIMER_LEVELS; i++) {
+		if (timer_count[i])
+			return false;
+	}
+
+	return true;
+}
+
+static void timeout_schedule(struct timeout_data *data, unsigned int msec)
+{
+	uint64_t now = timer_now();
+
+	timer_unlink(data);
+
+	/* Nothing to catch up with, start the wheel from now */
+	if (timer_empty())
+		timer_time = now;
+
+	data->expires = now + msec;
+	timer_insert(data);
+	timer_rearm();
+}
+
+static struct timeout_data *timeout_lookup(int id)
+{
+	if (id <= 0 || (unsigned int) id > timeout_size)
+		return NULL;
+
+	return timeout_list[id - 1];
+}
+
+static int timeout_alloc_id(struct timeout_data *data)
+{
+	struct timeout_data **list;
+	int *free_ids;
+	unsigned int size, i;
 
-	return timerfd_settime(fd, 0, &itimer, NULL);
+	if (!timeout_free_count) {
+		size = timeout_size ? timeout_size * 2 : 64;
+
+		list = realloc(timeout_list, size * sizeof(*list));
+		if (!list)
+			return -ENOMEM;
+
+		timeout_list = list;
+
+		free_ids = realloc(timeout_free, size * sizeof(*free_ids));
+		if (!free_ids)
+			return -ENOMEM;
+
+		timeout_free = free_ids;
+
+		/* Push in reverse so the lowest ids are used first */
+		for (i = size; i > timeout_size; i--) {
+			timeout_list[i - 1] = NULL;
+			timeout_free[timeout_free_count++] = i;
+		}
+
+		timeout_size = size;
+	}
+
+	data->id = timeout_free[--timeout_free_count];
+	timeout_list[data->id - 1] = data;
+
+	return data->id;
+}
+
+static void timeout_destroy(struct timeout_data *data)
+{
+	timer_unlink(data);
+
+	timeout_list[data->id - 1] = NULL;
+	timeout_free[timeout_free_count++] = data->id;
+
+	if (data->destroy)
+		data->destroy(data->user_data);
+
+	free(data);
+}
+
+static void timeout_free_all(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < timeout_size; i++) {
+		if (timeout_list[i])
+			timeout_destroy(timeout_list[i]);
+	}
+
+	free(timeout_list);
+	timeout_list = NULL;
+	free(timeout_free);
+	timeout_free = NULL;
+	timeout_size = 0;
+	timeout_free_count = 0;
 }
 
 int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
@@ -282,53 +691,55 @@ int mainloop_add_timeout(unsigned int msec, mainloop_timeout_func callback,
 	if (!callback)
 		return -EINVAL;
 
+	if (timer_init() < 0)
+		return -EIO;
+
 	data = malloc(sizeof(*data));
 	if (!data)
 		return -ENOMEM;
 
 	memset(data, 0, sizeof(*data));
+	data->level = -1;
 	data->callback = callback;
 	data->destroy = destroy;
 	data->user_data = user_data;
 
-	data->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-	if (data->fd < 0) {
+	if (timeout_alloc_id(data) < 0) {
 		free(data);
-		return -EIO;
-	}
-
-	if (msec > 0) {
-		if (timeout_set(data->fd, msec) < 0) {
-			close(data->fd);
-			free(data);
-			return -EIO;
-		}
+		return -ENOMEM;
 	}
 
-	if (mainloop_add_fd(data->fd, EPOLLIN | EPOLLONESHOT,
-				timeout_callback, data, timeout_destroy) < 0) {
-		close(data->fd);
-		free(data);
-		return -EIO;
-	}
+	/* A timeout of 0 stays disarmed until modified */
+	if (msec > 0)
+		timeout_schedule(data, msec);
 
-	return data->fd;
+	return data->id;
 }
 
 int mainloop_modify_timeout(int id, unsigned int msec)
 {
-	if (msec > 0) {
-		if (timeout_set(id, msec) < 0)
-			return -EIO;
-	}
+	struct timeout_data *data;
 
-	if (mainloop_modify_fd(id, EPOLLIN | EPOLLONESHOT) < 0)
+	data = timeout_lookup(id);
+	if (!data)
 		return -EIO;
 
+	if (msec > 0)
+		timeout_schedule(data, msec);
+
 	return 0;
 }
 
 int mainloop_remove_timeout(int id)
 {
-	return mainloop_remove_fd(id);
+	struct timeout_data *data;
+
+	data = timeout_lookup(id);
+	if (!data)
+		return -ENXIO;
+
+	timeout_destroy(data);
+	timer_rearm();
+
+	return 0;
 }
@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/socket.h>
 
 #include "lib/bluetooth.h"
 #include "lib/mgmt.h"
@@ -36,32 +37,44 @@
 
 #include "src/shared/io.h"
 #include "src/shared/queue.h"
+#include "src/shared/idmap.h"
 #include "src/shared/util.h"
 #include "src/shared/mgmt.h"
 
+#define MGMT_READ_BUDGET 16
+
+/* Covers every event defined so far, later ones share notify_other */
+#define MGMT_NOTIFY_TABLE_SIZE 0x0040
+
 struct mgmt {
 	int ref_count;
 	int fd;
 	bool close_on_unref;
 	struct io *io;
 	bool writer_active;
-	struct queue *request_queue;
+	struct queue_list request_queue;
 	struct queue *reply_queue;
 	struct queue *pending_list;
-	struct queue *notify_list;
+	struct idmap *request_map;
+	struct queue *notify_table[MGMT_NOTIFY_TABLE_SIZE];
+	struct queue *notify_other;
 	unsigned int next_request_id;
 	unsigned int next_notify_id;
 	bool need_notify_cleanup;
 	bool in_notify;
 	void *buf;
 	uint16_t len;
+	unsigned int read_budget;
+	struct mgmt_read_stats read_stats;
 	mgmt_debug_func_t debug_callback;
 	mgmt_destroy_func_t debug_destroy;
 	void *debug_data;
 };
 
 struct mgmt_request {
+	struct mgmt *mgmt;
 	unsigned int id;
+	struct queue_link link;
 	uint16_t opcode;
 	uint16_t index;
 	void *buf;
@@ -85,6 +98,8 @@ static void destroy_request(void *data)
 {
 	struct mgmt_request *request = data;
 
+	idmap_remove(request->mgmt->request_map, request->id);
+
 	if (request->destroy)
 		request->destroy(request->user_data);
 
@@ -92,14 +107,6 @@ static void destroy_request(void *data)
 	free(request);
 }
 
-static bool match_request_id(const void *a, const void *b)
-{
-	const struct mgmt_request *request = a;
-	unsigned int id = PTR_TO_UINT(b);
-
-	return request->id == id;
-}
-
 static bool match_request_index(const void *a, const void *b)
 {
 	const struct mgmt_request *request = a;
@@ -150,6 +157,42 @@ static void mark_notify_removed(void *data , void *user_data)
 		notify->removed = true;
 }
 
+static struct queue **notify_queue(struct mgmt *mgmt, uint16_t event)
+{
+	if (event < MGMT_NOTIFY_TABLE_SIZE)
+		return &mgmt->notify_table[event];
+
+	return &mgmt->notify_other;
+}
+
+static void notify_table_foreach(struct mgmt *mgmt,
+			void (*function)(struct queue *queue, void *user_data),
+			void *user_data)
+{
+	unsigned int i;
+
+	for (i = 0; i < MGMT_NOTIFY_TABLE_SIZE; i++) {
+		if (mgmt->notify_table[i])
+			function(mgmt->notify_table[i], user_data);
+	}
+
+	if (mgmt->notify_other)
+		function(mgmt->notify_other, user_data);
+}
+
+static void notify_table_destroy(struct mgmt *mgmt)
+{
+	unsigned int i;
+
+	for (i = 0; i < MGMT_NOTIFY_TABLE_SIZE; i++) {
+		queue_destroy(mgmt->notify_table[i], NULL);
+		mgmt->notify_table[i] = NULL;
+	}
+
+	queue_destroy(mgmt->notify_other, NULL);
+	mgmt->notify_other = NULL;
+}
+
 static void write_watch_destroy(void *user_data)
 {
 	struct mgmt *mgmt = user_data;
@@ -169,6 +212,7 @@ static bool send_request(struct mgmt *mgmt, struct mgmt_request *request)
 	if (ret < 0) {
 		util_debug(mgmt->debug_callback, mgmt->debug_data,
 				"write failed: %s", strerror(-ret));
+		idmap_remove(mgmt->request_map, request->id);
 		if (request->callback)
 			request->callback(MGMT_STATUS_FAILED, 0, NULL,
 							request->user_data);
@@ -188,6 +232,17 @@ static bool send_request(struct mgmt *mgmt, struct mgmt_request *request)
 	return true;
 }
 
+static struct mgmt_request *pop_request(struct mgmt *mgmt)
+{
+	struct queue_link *link;
+
+	link = queue_list_pop_head(&mgmt->request_queue);
+	if (!link)
+		return NULL;
+
+	return queue_link_data(link, struct mgmt_request, link);
+}
+
 static bool can_write_data(struct io *io, void *user_data)
 {
 	struct mgmt *mgmt = user_data;
@@ -200,7 +255,7 @@ static bool can_write_data(struct io *io, void *user_data)
 		if (!queue_isempty(mgmt->pending_list))
 			return false;
 
-		request = queue_pop_head(mgmt->request_queue);
+		request = pop_request(mgmt);
 		if (!request)
 			return false;
 
@@ -257,6 +312,9 @@ static void request_complete(struct mgmt *mgmt, uint8_t status,
 	request = queue_remove_if(mgmt->pending_list,
 					match_request_opcode_index, &match);
 	if (request) {
+		/* Too late to cancel it from the callback */
+		idmap_remove(mgmt->request_map, request->id);
+
 		if (request->callback)
 			request->callback(status, length, param,
 							request->user_data);
@@ -293,43 +351,51 @@ static void notify_handler(void *data, void *user_data)
 							notify->user_data);
 }
 
+static void remove_notify_removed(struct queue *queue, void *user_data)
+{
+	queue_remove_all(queue, match_notify_removed, NULL, destroy_notify);
+}
+
+/*
+ * Only the handlers registered for the event itself are looked at, which
+ * keeps a burst of Device Found events from walking every handler of every
+ * adapter. Handlers unregistered from a callback are only marked removed
+ * and freed once dispatching is done.
+ */
 static void process_notify(struct mgmt *mgmt, uint16_t event, uint16_t index,
 					uint16_t length, const void *param)
 {
 	struct event_index match = { .event = event, .index = index,
 					.length = length, .param = param };
+	struct queue *queue = *notify_queue(mgmt, event);
+
+	if (queue_isempty(queue))
+		return;
 
 	mgmt->in_notify = true;
 
-	queue_foreach(mgmt->notify_list, notify_handler, &match);
+	queue_foreach(queue, notify_handler, &match);
 
 	mgmt->in_notify = false;
 
 	if (mgmt->need_notify_cleanup) {
-		queue_remove_all(mgmt->notify_list, match_notify_removed,
-							NULL, destroy_notify);
+		notify_table_foreach(mgmt, remove_notify_removed, NULL);
 		mgmt->need_notify_cleanup = false;
 	}
 }
 
-static bool can_read_data(struct io *io, void *user_data)
+static void process_packet(struct mgmt *mgmt, ssize_t bytes_read)
 {
-	struct mgmt *mgmt = user_data;
 	struct mgmt_hdr *hdr;
 	struct mgmt_ev_cmd_complete *cc;
 	struct mgmt_ev_cmd_status *cs;
-	ssize_t bytes_read;
 	uint16_t opcode, event, index, length;
 
-	bytes_read = read(mgmt->fd, mgmt->buf, mgmt->len);
-	if (bytes_read < 0)
-		return false;
-
 	util_hexdump('>', mgmt->buf, bytes_read,
 				mgmt->debug_callback, mgmt->debug_data);
 
 	if (bytes_read < MGMT_HDR_SIZE)
-		return true;
+		return;
 
 	hdr = mgmt->buf;
 	event = btohs(hdr->opcode);
@@ -337,9 +403,7 @@ static bool can_read_data(struct io *io, void *user_data)
 	length = btohs(hdr->len);
 
 	if (bytes_read < length + MGMT_HDR_SIZE)
-		return true;
-
-	mgmt_ref(mgmt);
+		return;
 
 	switch (event) {
 	case MGMT_EV_CMD_COMPLETE:
@@ -371,6 +435,44 @@ static bool can_read_data(struct io *io, void *user_data)
 						mgmt->buf + MGMT_HDR_SIZE);
 		break;
 	}
+}
+
+/*
+ * Reads and dispatches, in order, all the packets already queued on the
+ * socket, up to read_budget per wakeup, so a burst of events such as
+ * Device Found during scanning costs one mainloop iteration rather than
+ * one per event. Whatever is left over wakes the mainloop again.
+ */
+static bool can_read_data(struct io *io, void *user_data)
+{
+	struct mgmt *mgmt = user_data;
+	unsigned int count = 0;
+	ssize_t bytes_read;
+
+	bytes_read = read(mgmt->fd, mgmt->buf, mgmt->len);
+	if (bytes_read < 0)
+		return false;
+
+	mgmt_ref(mgmt);
+
+	while (1) {
+		process_packet(mgmt, bytes_read);
+		count++;
+
+		/* Stop once the owner let go of it from a callback */
+		if (count >= mgmt->read_budget || mgmt->ref_count == 1)
+			break;
+
+		bytes_read = recv(mgmt->fd, mgmt->buf, mgmt->len,
+								MSG_DONTWAIT);
+		if (bytes_read < 0)
+			break;
+	}
+
+	mgmt->read_stats.wakeups++;
+	mgmt->read_stats.events += count;
+	if (count > mgmt->read_stats.max_events)
+		mgmt->read_stats.max_events = count;
 
 	mgmt_unref(mgmt);
 
@@ -390,6 +492,7 @@ struct mgmt *mgmt_new(int fd)
 
 	mgmt->len = 512;
 	mgmt->buf = malloc(mgmt->len);
+	mgmt->read_budget = MGMT_READ_BUDGET;
 	if (!mgmt->buf) {
 		free(mgmt);
 		return NULL;
@@ -402,16 +505,15 @@ struct mgmt *mgmt_new(int fd)
 		return NULL;
 	}
 
-	mgmt->request_queue = queue_new();
+	queue_list_init(&mgmt->request_queue);
 	mgmt->reply_queue = queue_new();
 	mgmt->pending_list = queue_new();
-	mgmt->notify_list = queue_new();
+	mgmt->request_map = idmap_new();
 
 	if (!io_set_read_handler(mgmt->io, can_read_data, mgmt, NULL)) {
-		queue_destroy(mgmt->notify_list, NULL);
+		idmap_free(mgmt->request_map);
 		queue_destroy(mgmt->pending_list, NULL);
 		queue_destroy(mgmt->reply_queue, NULL);
-		queue_destroy(mgmt->request_queue, NULL);
 		io_destroy(mgmt->io);
 		free(mgmt->buf);
 		free(mgmt);
@@ -480,7 +582,6 @@ void mgmt_unref(struct mgmt *mgmt)
 	mgmt_cancel_all(mgmt);
 
 	queue_destroy(mgmt->reply_queue, NULL);
-	queue_destroy(mgmt->request_queue, NULL);
 
 	io_set_write_handler(mgmt->io, NULL, NULL, NULL);
 	io_set_read_handler(mgmt->io, NULL, NULL, NULL);
@@ -498,8 +599,9 @@ void mgmt_unref(struct mgmt *mgmt)
 	mgmt->buf = NULL;
 
 	if (!mgmt->in_notify) {
-		queue_destroy(mgmt->notify_list, NULL);
+		notify_table_destroy(mgmt);
 		queue_destroy(mgmt->pending_list, NULL);
+		idmap_free(mgmt->request_map);
 		free(mgmt);
 		return;
 	}
@@ -531,6 +633,26 @@ bool mgmt_set_close_on_unref(struct mgmt *mgmt, bool do_close)
 	return true;
 }
 
+bool mgmt_set_read_budget(struct mgmt *mgmt, unsigned int budget)
+{
+	if (!mgmt || !budget)
+		return false;
+
+	mgmt->read_budget = budget;
+
+	return true;
+}
+
+bool mgmt_get_read_stats(struct mgmt *mgmt, struct mgmt_read_stats *stats)
+{
+	if (!mgmt || !stats)
+		return false;
+
+	*stats = mgmt->read_stats;
+
+	return true;
+}
+
 static struct mgmt_request *create_request(uint16_t opcode, uint16_t index,
 				uint16_t length, const void *param,
 				mgmt_request_func_t callback,
@@ -571,6 +693,17 @@ static struct mgmt_request *create_request(uint16_t opcode, uint16_t index,
 	return request;
 }
 
+static void add_request(struct mgmt *mgmt, struct mgmt_request *request)
+{
+	if (mgmt->next_request_id < 1)
+		mgmt->next_request_id = 1;
+
+	request->mgmt = mgmt;
+	request->id = mgmt->next_request_id++;
+
+	idmap_insert(mgmt->request_map, request->id, request);
+}
+
 unsigned int mgmt_send(struct mgmt *mgmt, uint16_t opcode, uint16_t index,
 				uint16_t length, const void *param,
 				mgmt_request_func_t callback,
@@ -586,16 +719,9 @@ unsigned int mgmt_send(struct mgmt *mgmt, uint16_t opcode, uint16_t index,
 	if (!request)
 		return 0;
 
-	if (mgmt->next_request_id < 1)
-		mgmt->next_request_id = 1;
-
-	request->id = mgmt->next_request_id++;
+	add_request(mgmt, request);
 
-	if (!queue_push_tail(mgmt->request_queue, request)) {
-		free(request->buf);
-		free(request);
-		return 0;
-	}
+	queue_list_push_tail(&mgmt->request_queue, &request->link);
 
 	wakeup_writer(mgmt);
 
@@ -617,10 +743,7 @@ unsigned int mgmt_send_nowait(struct mgmt *mgmt, uint16_t opcode, uint16_t index
 	if (!request)
 		return 0;
 
-	if (mgmt->next_request_id < 1)
-		mgmt->next_request_id = 1;
-
-	request->id = mgmt->next_request_id++;
+	add_request(mgmt, request);
 
 	if (!send_request(mgmt, request))
 		return 0;
@@ -643,12 +766,10 @@ unsigned int mgmt_reply(struct mgmt *mgmt, uint16_t opcode, uint16_t index,
 	if (!request)
 		return 0;
 
-	if (mgmt->next_request_id < 1)
-		mgmt->next_request_id = 1;
-
-	request->id = mgmt->next_request_id++;
+	add_request(mgmt, request);
 
 	if (!queue_push_tail(mgmt->reply_queue, request)) {
+		idmap_remove(mgmt->request_map, request->id);
 		free(request->buf);
 		free(request);
 		return 0;
@@ -659,6 +780,11 @@ unsigned int mgmt_reply(struct mgmt *mgmt, uint16_t opcode, uint16_t index,
 	return request->id;
 }
 
+/*
+ * Requests are looked up by ID. Those waiting in request_queue, which holds
+ * hundreds of them while an adapter powers on, embed their link and are
+ * unlinked directly; sent ones and replies are few.
+ */
 bool mgmt_cancel(struct mgmt *mgmt, unsigned int id)
 {
 	struct mgmt_request *request;
@@ -666,22 +792,15 @@ bool mgmt_cancel(struct mgmt *mgmt, unsigned int id)
 	if (!mgmt || !id)
 		return false;
 
-	request = queue_remove_if(mgmt->request_queue, match_request_id,
-							UINT_TO_PTR(id));
-	if (request)
-		goto done;
-
-	request = queue_remove_if(mgmt->reply_queue, match_request_id,
-							UINT_TO_PTR(id));
-	if (request)
-		goto done;
-
-	request = queue_remove_if(mgmt->pending_list, match_request_id,
-							UINT_TO_PTR(id));
+	request = idmap_remove(mgmt->request_map, id);
 	if (!request)
 		return false;
 
-done:
+	if (queue_link_is_linked(&request->link))
+		queue_list_remove(&mgmt->request_queue, &request->link);
+	else if (!queue_remove(mgmt->reply_queue, request))
+		queue_remove(mgmt->pending_list, request);
+
 	destroy_request(request);
 
 	wakeup_writer(mgmt);
@@ -689,13 +808,45 @@ done:
 	return true;
 }
 
+/*
+ * Cancels the requests waiting to be sent that match, all of them for a NULL
+ * match as with queue_remove_all. They are taken out first so destroy
+ * callbacks cancelling other requests find a consistent queue.
+ */
+static void cancel_queued(struct mgmt *mgmt, queue_match_func_t match,
+							const void *match_data)
+{
+	struct queue_list cancelled;
+	struct queue_link *link, *next;
+
+	queue_list_init(&cancelled);
+
+	for (link = queue_list_peek_head(&mgmt->request_queue); link;
+								link = next) {
+		struct mgmt_request *request;
+
+		next = queue_list_next(&mgmt->request_queue, link);
+
+		request = queue_link_data(link, struct mgmt_request, link);
+		if (match && !match(request, match_data))
+			continue;
+
+		queue_list_remove(&mgmt->request_queue, link);
+		idmap_remove(mgmt->request_map, request->id);
+		queue_list_push_tail(&cancelled, link);
+	}
+
+	while ((link = queue_list_pop_head(&cancelled)))
+		destroy_request(queue_link_data(link, struct mgmt_request,
+									link));
+}
+
 bool mgmt_cancel_index(struct mgmt *mgmt, uint16_t index)
 {
 	if (!mgmt)
 		return false;
 
-	queue_remove_all(mgmt->request_queue, match_request_index,
-					UINT_TO_PTR(index), destroy_request);
+	cancel_queued(mgmt, match_request_index, UINT_TO_PTR(index));
 	queue_remove_all(mgmt->reply_queue, match_request_index,
 					UINT_TO_PTR(index), destroy_request);
 	queue_remove_all(mgmt->pending_list, match_request_index,
@@ -711,7 +862,7 @@ bool mgmt_cancel_all(struct mgmt *mgmt)
 
 	queue_remove_all(mgmt->pending_list, NULL, NULL, destroy_request);
 	queue_remove_all(mgmt->reply_queue, NULL, NULL, destroy_request);
-	queue_remove_all(mgmt->request_queue, NULL, NULL, destroy_request);
+	cancel_queued(mgmt, NULL, NULL);
 
 	return true;
 }
@@ -721,10 +872,15 @@ unsigned int mgmt_register(struct mgmt *mgmt, uint16_t event, uint16_t index,
 				void *user_data, mgmt_destroy_func_t destroy)
 {
 	struct mgmt_notify *notify;
+	struct queue **queue;
 
 	if (!mgmt || !event)
 		return 0;
 
+	queue = notify_queue(mgmt, event);
+	if (!*queue)
+		*queue = queue_new();
+
 	notify = new0(struct mgmt_notify, 1);
 	notify->event = event;
 	notify->index = index;
@@ -738,7 +894,7 @@ unsigned int mgmt_register(struct mgmt *mgmt, uint16_t event, uint16_t index,
 
 	notify->id = mgmt->next_notify_id++;
 
-	if (!queue_push_tail(mgmt->notify_list, notify)) {
+	if (!queue_push_tail(*queue, notify)) {
 		free(notify);
 		return 0;
 	}
@@ -748,17 +904,24 @@ unsigned int mgmt_register(struct mgmt *mgmt, uint16_t event, uint16_t index,
 
 bool mgmt_unregister(struct mgmt *mgmt, unsigned int id)
 {
-	struct mgmt_notify *notify;
+	struct mgmt_notify *notify = NULL;
+	struct queue *queue = NULL;
+	unsigned int i;
 
 	if (!mgmt || !id)
 		return false;
 
-	notify = queue_remove_if(mgmt->notify_list, match_notify_id,
-							UINT_TO_PTR(id));
-	if (!notify)
+	for (i = 0; i <= MGMT_NOTIFY_TABLE_SIZE && !notify; i++) {
+		queue = i < MGMT_NOTIFY_TABLE_SIZE ? mgmt->notify_table[i] :
+							mgmt->notify_other;
+		notify = queue_find(queue, match_notify_id, UINT_TO_PTR(id));
+	}
+
+	if (!notify || notify->removed)
 		return false;
 
 	if (!mgmt->in_notify) {
+		queue_remove(queue, notify);
 		destroy_notify(notify);
 		return true;
 	}
@@ -769,18 +932,33 @@ bool mgmt_unregister(struct mgmt *mgmt, unsigned int id)
 	return true;
 }
 
+static void mark_queue_removed(struct queue *queue, void *user_data)
+{
+	queue_foreach(queue, mark_notify_removed, user_data);
+}
+
+static void remove_queue_index(struct queue *queue, void *user_data)
+{
+	queue_remove_all(queue, match_notify_index, user_data, destroy_notify);
+}
+
+static void remove_queue_all(struct queue *queue, void *user_data)
+{
+	queue_remove_all(queue, NULL, NULL, destroy_notify);
+}
+
 bool mgmt_unregister_index(struct mgmt *mgmt, uint16_t index)
 {
 	if (!mgmt)
 		return false;
 
 	if (mgmt->in_notify) {
-		queue_foreach(mgmt->notify_list, mark_notify_removed,
+		notify_table_foreach(mgmt, mark_queue_removed,
 							UINT_TO_PTR(index));
 		mgmt->need_notify_cleanup = true;
 	} else
-		queue_remove_all(mgmt->notify_list, match_notify_index,
-					UINT_TO_PTR(index), destroy_notify);
+		notify_table_foreach(mgmt, remove_queue_index,
+							UINT_TO_PTR(index));
 
 	return true;
 }
@@ -791,11 +969,11 @@ bool mgmt_unregister_all(struct mgmt *mgmt)
 		return false;
 
 	if (mgmt->in_notify) {
-		queue_foreach(mgmt->notify_list, mark_notify_removed,
+		notify_table_foreach(mgmt, mark_queue_removed,
 						UINT_TO_PTR(MGMT_INDEX_NONE));
 		mgmt->need_notify_cleanup = true;
 	} else
-		queue_remove_all(mgmt->notify_list, NULL, NULL, destroy_notify);
+		notify_table_foreach(mgmt, remove_queue_all, NULL);
 
 	return true;
 }
@@ -43,6 +43,16 @@ bool mgmt_set_debug(struct mgmt *mgmt, mgmt_debug_func_t callback,
 
 bool mgmt_set_close_on_unref(struct mgmt *mgmt, bool do_close);
 
+/* Packets read per wakeup, events / wakeups is the average batch */
+struct mgmt_read_stats {
+	uint64_t wakeups;
+	uint64_t events;
+	unsigned int max_events;
+};
+
+bool mgmt_set_read_budget(struct mgmt *mgmt, unsigned int budget);
+bool mgmt_get_read_stats(struct mgmt *mgmt, struct mgmt_read_stats *stats);
+
 typedef void (*mgmt_request_func_t)(uint8_t status, uint16_t length,
 					const void *param, void *user_data);
 
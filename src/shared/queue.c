@@ -28,11 +28,19 @@
 #include "src/shared/util.h"
 #include "src/shared/queue.h"
 
+/*
+ * Entries popped off a queue are kept, up to QUEUE_MAX_SPARES, for the next
+ * pushes, so a queue going up and down with traffic stops hitting the heap.
+ */
+#define QUEUE_MAX_SPARES 16
+
 struct queue {
 	int ref_count;
 	struct queue_entry *head;
 	struct queue_entry *tail;
 	unsigned int entries;
+	struct queue_entry *spares;
+	unsigned int num_spares;
 };
 
 static struct queue *queue_ref(struct queue *queue)
@@ -50,6 +58,13 @@ static void queue_unref(struct queue *queue)
 	if (__sync_sub_and_fetch(&queue->ref_count, 1))
 		return;
 
+	while (queue->spares) {
+		struct queue_entry *entry = queue->spares;
+
+		queue->spares = entry->next;
+		free(entry);
+	}
+
 	free(queue);
 }
 
@@ -75,16 +90,37 @@ void queue_destroy(struct queue *queue, queue_destroy_func_t destroy)
 	queue_unref(queue);
 }
 
-static struct queue_entry *queue_entry_new(void *data)
+static struct queue_entry *queue_entry_new(struct queue *queue, void *data)
 {
 	struct queue_entry *entry;
 
-	entry = new0(struct queue_entry, 1);
+	entry = queue->spares;
+	if (entry) {
+		queue->spares = entry->next;
+		queue->num_spares--;
+		entry->next = NULL;
+	} else
+		entry = new0(struct queue_entry, 1);
+
 	entry->data = data;
 
 	return entry;
 }
 
+static void queue_entry_free(struct queue *queue, struct queue_entry *entry)
+{
+	/* While queue_foreach runs it may still step onto the entry */
+	if (queue->ref_count > 1 || queue->num_spares >= QUEUE_MAX_SPARES) {
+		free(entry);
+		return;
+	}
+
+	entry->data = NULL;
+	entry->next = queue->spares;
+	queue->spares = entry;
+	queue->num_spares++;
+}
+
 bool queue_push_tail(struct queue *queue, void *data)
 {
 	struct queue_entry *entry;
@@ -92,7 +128,7 @@ bool queue_push_tail(struct queue *queue, void *data)
 	if (!queue)
 		return false;
 
-	entry = queue_entry_new(data);
+	entry = queue_entry_new(queue, data);
 
 	if (queue->tail)
 		queue->tail->next = entry;
@@ -114,7 +150,7 @@ bool queue_push_head(struct queue *queue, void *data)
 	if (!queue)
 		return false;
 
-	entry = queue_entry_new(data);
+	entry = queue_entry_new(queue, data);
 
 	entry->next = queue->head;
 
@@ -147,7 +183,7 @@ bool queue_push_after(struct queue *queue, void *entry, void *data)
 	if (!qentry)
 		return false;
 
-	new_entry = queue_entry_new(data);
+	new_entry = queue_entry_new(queue, data);
 
 	new_entry->next = qentry->next;
 
@@ -178,7 +214,7 @@ void *queue_pop_head(struct queue *queue)
 
 	data = entry->data;
 
-	free(entry);
+	queue_entry_free(queue, entry);
 	queue->entries--;
 
 	return data;
@@ -266,7 +302,7 @@ bool queue_remove(struct queue *queue, void *data)
 		if (!entry->next)
 			queue->tail = prev;
 
-		free(entry);
+		queue_entry_free(queue, entry);
 		queue->entries--;
 
 		return true;
@@ -302,7 +338,7 @@ void *queue_remove_if(struct queue *queue, queue_match_func_t function,
 
 			data = entry->data;
 
-			free(entry);
+			queue_entry_free(queue, entry);
 			queue->entries--;
 
 			return data;
@@ -353,7 +389,7 @@ unsigned int queue_remove_all(struct queue *queue, queue_match_func_t function,
 			if (destroy)
 				destroy(tmp->data);
 
-			free(tmp);
+			queue_entry_free(queue, tmp);
 			count++;
 		}
 	}
@@ -384,3 +420,83 @@ bool queue_isempty(struct queue *queue)
 
 	return queue->entries == 0;
 }
+
+void queue_list_init(struct queue_list *list)
+{
+	list->head.next = &list->head;
+	list->head.prev = &list->head;
+	list->entries = 0;
+}
+
+static void queue_list_insert(struct queue_list *list, struct queue_link *link,
+				struct queue_link *prev, struct queue_link *next)
+{
+	link->prev = prev;
+	link->next = next;
+	prev->next = link;
+	next->prev = link;
+
+	list->entries++;
+}
+
+void queue_list_push_tail(struct queue_list *list, struct queue_link *link)
+{
+	queue_list_insert(list, link, list->head.prev, &list->head);
+}
+
+void queue_list_push_head(struct queue_list *list, struct queue_link *link)
+{
+	queue_list_insert(list, link, &list->head, list->head.next);
+}
+
+void queue_list_remove(struct queue_list *list, struct queue_link *link)
+{
+	if (!queue_link_is_linked(link))
+		return;
+
+	link->prev->next = link->next;
+	link->next->prev = link->prev;
+	link->next = NULL;
+	link->prev = NULL;
+
+	list->entries--;
+}
+
+struct queue_link *queue_list_peek_head(struct queue_list *list)
+{
+	return queue_list_next(list, &list->head);
+}
+
+struct queue_link *queue_list_pop_head(struct queue_list *list)
+{
+	struct queue_link *link = queue_list_peek_head(list);
+
+	if (link)
+		queue_list_remove(list, link);
+
+	return link;
+}
+
+struct queue_link *queue_list_next(struct queue_list *list,
+						struct queue_link *link)
+{
+	if (link->next == &list->head)
+		return NULL;
+
+	return link->next;
+}
+
+bool queue_link_is_linked(const struct queue_link *link)
+{
+	return link->next != NULL;
+}
+
+unsigned int queue_list_length(struct queue_list *list)
+{
+	return list->entries;
+}
+
+bool queue_list_isempty(struct queue_list *list)
+{
+	return list->entries == 0;
+}
@@ -22,6 +22,7 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 
 typedef void (*queue_destroy_func_t)(void *data);
 
@@ -62,3 +63,36 @@ const struct queue_entry *queue_get_entries(struct queue *queue);
 
 unsigned int queue_length(struct queue *queue);
 bool queue_isempty(struct queue *queue);
+
+/*
+ * Intrusive variant for hot paths. The element embeds a struct queue_link,
+ * so pushing and popping allocate nothing and an element is unlinked in
+ * constant time without looking for it. A link that is not on a list has
+ * NULL pointers, elements must start out zeroed.
+ */
+struct queue_link {
+	struct queue_link *next;
+	struct queue_link *prev;
+};
+
+struct queue_list {
+	struct queue_link head;
+	unsigned int entries;
+};
+
+#define queue_link_data(link, type, member) \
+	((type *) ((char *) (link) - offsetof(type, member)))
+
+void queue_list_init(struct queue_list *list);
+
+void queue_list_push_tail(struct queue_list *list, struct queue_link *link);
+void queue_list_push_head(struct queue_list *list, struct queue_link *link);
+void queue_list_remove(struct queue_list *list, struct queue_link *link);
+struct queue_link *queue_list_pop_head(struct queue_list *list);
+struct queue_link *queue_list_peek_head(struct queue_list *list);
+struct queue_link *queue_list_next(struct queue_list *list,
+						struct queue_link *link);
+
+bool queue_link_is_linked(const struct queue_link *link);
+unsigned int queue_list_length(struct queue_list *list);
+bool queue_list_isempty(struct queue_list *list);
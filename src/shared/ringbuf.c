@@ -266,6 +266,41 @@ int ringbuf_vprintf(struct ringbuf *ringbuf, const char *format, va_list ap)
 	return len;
 }
 
+size_t ringbuf_put(struct ringbuf *ringbuf, const void *data, size_t len)
+{
+	size_t avail, offset, end;
+
+	if (!ringbuf || !data || !len)
+		return 0;
+
+	/* Only store complete chunks of data */
+	avail = ringbuf->size - ringbuf->in + ringbuf->out;
+	if (len > avail)
+		return 0;
+
+	/* Determine how much can be stored before wrapping */
+	offset = ringbuf->in & (ringbuf->size - 1);
+	end = MIN(len, ringbuf->size - offset);
+	memcpy(ringbuf->buffer + offset, data, end);
+
+	if (ringbuf->in_tracing)
+		ringbuf->in_tracing(ringbuf->buffer + offset, end,
+							ringbuf->in_data);
+
+	if (len - end > 0) {
+		/* Put the remainder at the beginning */
+		memcpy(ringbuf->buffer, data + end, len - end);
+
+		if (ringbuf->in_tracing)
+			ringbuf->in_tracing(ringbuf->buffer, len - end,
+							ringbuf->in_data);
+	}
+
+	ringbuf->in += len;
+
+	return len;
+}
+
 ssize_t ringbuf_read(struct ringbuf *ringbuf, int fd)
 {
 	size_t avail, offset, end;
@@ -47,4 +47,5 @@ size_t ringbuf_avail(struct ringbuf *ringbuf);
 int ringbuf_printf(struct ringbuf *ringbuf, const char *format, ...)
 					__attribute__((format(printf, 2, 3)));
 int ringbuf_vprintf(struct ringbuf *ringbuf, const char *format, va_list ap);
+size_t ringbuf_put(struct ringbuf *ringbuf, const void *data, size_t len);
 ssize_t ringbuf_read(struct ringbuf *ringbuf, int fd);
@@ -0,0 +1,890 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Benchmark of the input HID relay without real hardware. An emulated
+ * controller is connected to a bthost acting as the remote input host
+ * and the relay engine of profiles/input moves synthetic reports from a
+ * local SOCK_SEQPACKET socket, as written by a local HID daemon, to the
+ * HIDP interrupt channel, the same way the input host bridge does.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "lib/bluetooth.h"
+#include "lib/l2cap.h"
+#include "lib/mgmt.h"
+
+#include "monitor/bt.h"
+#include "emulator/bthost.h"
+#include "emulator/hciemu.h"
+
+#include "src/shared/tester.h"
+#include "src/shared/mgmt.h"
+
+#include "profiles/input/hidp_defs.h"
+#include "profiles/input/relay.h"
+
+#define L2CAP_PSM_HIDP_INTR	0x13
+
+/* Give up on reports still in flight this long after the last one */
+#define BENCH_SETTLE_TIME	2000
+
+struct test_data {
+	const void *test_data;
+	struct mgmt *mgmt;
+	uint16_t mgmt_index;
+	struct hciemu *hciemu;
+	enum hciemu_type hciemu_type;
+	unsigned int io_id;
+	unsigned int relay_id;
+	unsigned int flush_id;
+	unsigned int producer_id;
+	unsigned int settle_id;
+	uint16_t handle;
+	uint16_t dcid;
+	int sk;
+	int local_sk[2];
+	struct relay_queue *queue;
+	struct relay_stats stats;
+	struct relay_latency latency;
+	struct relay_latency e2e_latency;
+	uint32_t sent;
+	uint32_t received;
+	uint32_t producer_blocked;
+	uint64_t start;
+	uint64_t end;
+	uint64_t cpu_time;
+};
+
+struct bench_data {
+	/* Reports per second produced locally, 0 writes as fast as the
+	 * local socket takes them.
+	 */
+	unsigned int rate;
+	unsigned int reports;
+	enum relay_queue_policy policy;
+	bool merge;
+	bool boot_mouse;
+};
+
+/* Synthetic report as the local HID daemon writes it */
+struct bench_report {
+	uint8_t hdr;
+	uint8_t id;
+	uint8_t payload[HIDP_BOOT_KEYBOARD_SIZE - 2];
+	uint32_t seq;
+	uint64_t timestamp;
+} __attribute__ ((packed));
+
+static unsigned int rate_override;
+static unsigned int reports_override;
+
+static unsigned int bench_rate(const struct bench_data *bench)
+{
+	return rate_override ? rate_override : bench->rate;
+}
+
+static unsigned int bench_reports(const struct bench_data *bench)
+{
+	return reports_override ? reports_override : bench->reports;
+}
+
+/* Time the test may take, producing at the configured rate and settling */
+static unsigned int bench_timeout(const struct bench_data *bench)
+{
+	unsigned int timeout = 10 + BENCH_SETTLE_TIME / 1000;
+
+	if (bench_rate(bench))
+		timeout += bench_reports(bench) / bench_rate(bench);
+
+	return timeout;
+}
+
+static uint64_t thread_cpu_time(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) < 0)
+		return 0;
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void mgmt_debug(const char *str, void *user_data)
+{
+	const char *prefix = user_data;
+
+	tester_print("%s%s", prefix, str);
+}
+
+static void read_info_callback(uint8_t status, uint16_t length,
+					const void *param, void *user_data)
+{
+	struct test_data *data = tester_get_data();
+	const struct mgmt_rp_read_info *rp = param;
+	char addr[18];
+
+	tester_print("Read Info callback");
+	tester_print("  Status: 0x%02x", status);
+
+	if (status || !param) {
+		tester_pre_setup_failed();
+		return;
+	}
+
+	ba2str(&rp->bdaddr, addr);
+
+	tester_print("  Address: %s", addr);
+
+	if (strcmp(hciemu_get_address(data->hciemu), addr)) {
+		tester_pre_setup_failed();
+		return;
+	}
+
+	tester_pre_setup_complete();
+}
+
+static void index_added_callback(uint16_t index, uint16_t length,
+					const void *param, void *user_data)
+{
+	struct test_data *data = tester_get_data();
+
+	tester_print("Index Added callback");
+	tester_print("  Index: 0x%04x", index);
+
+	data->mgmt_index = index;
+
+	mgmt_send(data->mgmt, MGMT_OP_READ_INFO, data->mgmt_index, 0, NULL,
+					read_info_callback, NULL, NULL);
+}
+
+static void index_removed_callback(uint16_t index, uint16_t length,
+					const void *param, void *user_data)
+{
+	struct test_data *data = tester_get_data();
+
+	tester_print("Index Removed callback");
+	tester_print("  Index: 0x%04x", index);
+
+	if (index != data->mgmt_index)
+		return;
+
+	mgmt_unregister_index(data->mgmt, data->mgmt_index);
+
+	mgmt_unref(data->mgmt);
+	data->mgmt = NULL;
+
+	tester_post_teardown_complete();
+}
+
+static void read_index_list_callback(uint8_t status, uint16_t length,
+					const void *param, void *user_data)
+{
+	struct test_data *data = tester_get_data();
+
+	tester_print("Read Index List callback");
+	tester_print("  Status: 0x%02x", status);
+
+	if (status || !param) {
+		tester_pre_setup_failed();
+		return;
+	}
+
+	mgmt_register(data->mgmt, MGMT_EV_INDEX_ADDED, MGMT_INDEX_NONE,
+					index_added_callback, NULL, NULL);
+
+	mgmt_register(data->mgmt, MGMT_EV_INDEX_REMOVED, MGMT_INDEX_NONE,
+					index_removed_callback, NULL, NULL);
+
+	data->hciemu = hciemu_new(data->hciemu_type);
+	if (!data->hciemu) {
+		tester_warn("Failed to setup HCI emulation");
+		tester_pre_setup_failed();
+	}
+
+	tester_print("New hciemu instance created");
+}
+
+static void test_pre_setup(const void *test_data)
+{
+	struct test_data *data = tester_get_data();
+
+	data->mgmt = mgmt_new_default();
+	if (!data->mgmt) {
+		tester_warn("Failed to setup management interface");
+		tester_pre_setup_failed();
+		return;
+	}
+
+	if (tester_use_debug())
+		mgmt_set_debug(data->mgmt, mgmt_debug, "mgmt: ", NULL);
+
+	mgmt_send(data->mgmt, MGMT_OP_READ_INDEX_LIST, MGMT_INDEX_NONE, 0, NULL,
+					read_index_list_callback, NULL, NULL);
+}
+
+static void remove_source(unsigned int *id)
+{
+	if (*id > 0)
+		g_source_remove(*id);
+
+	*id = 0;
+}
+
+static void test_post_teardown(const void *test_data)
+{
+	struct test_data *data = tester_get_data();
+
+	remove_source(&data->io_id);
+	remove_source(&data->relay_id);
+	remove_source(&data->flush_id);
+	remove_source(&data->producer_id);
+	remove_source(&data->settle_id);
+
+	if (data->sk >= 0)
+		close(data->sk);
+	data->sk = -1;
+
+	if (data->local_sk[0] >= 0)
+		close(data->local_sk[0]);
+	if (data->local_sk[1] >= 0)
+		close(data->local_sk[1]);
+	data->local_sk[0] = data->local_sk[1] = -1;
+
+	relay_queue_free(data->queue);
+	data->queue = NULL;
+
+	hciemu_unref(data->hciemu);
+	data->hciemu = NULL;
+}
+
+static void test_data_free(void *test_data)
+{
+	struct test_data *data = test_data;
+
+	free(data);
+}
+
+#define test_bench(name, data, setup, func) \
+	do { \
+		struct test_data *user; \
+		user = calloc(1, sizeof(struct test_data)); \
+		if (!user) \
+			break; \
+		user->hciemu_type = HCIEMU_TYPE_BREDR; \
+		user->sk = -1; \
+		user->local_sk[0] = user->local_sk[1] = -1; \
+		user->test_data = data; \
+		tester_add_full(name, data, \
+				test_pre_setup, setup, func, NULL, \
+				test_post_teardown, bench_timeout(data), \
+				user, test_data_free); \
+	} while (0)
+
+static const struct bench_data bench_125hz = {
+	.rate = 125,
+	.reports = 250,
+};
+
+static const struct bench_data bench_1000hz = {
+	.rate = 1000,
+	.reports = 2000,
+};
+
+static const struct bench_data bench_8000hz = {
+	.rate = 8000,
+	.reports = 16000,
+};
+
+static const struct bench_data bench_flood = {
+	.reports = 20000,
+};
+
+static const struct bench_data bench_flood_coalesce = {
+	.reports = 20000,
+	.policy = RELAY_QUEUE_COALESCE,
+};
+
+static const struct bench_data bench_flood_block = {
+	.reports = 20000,
+	.policy = RELAY_QUEUE_BLOCK,
+};
+
+static const struct bench_data bench_flood_merge = {
+	.reports = 20000,
+	.merge = true,
+	.boot_mouse = true,
+};
+
+static void client_cmd_complete(uint16_t opcode, uint8_t status,
+					const void *param, uint8_t len,
+					void *user_data)
+{
+	switch (opcode) {
+	case BT_HCI_CMD_WRITE_SCAN_ENABLE:
+		tester_print("Client set connectable status 0x%02x", status);
+		break;
+	default:
+		return;
+	}
+
+	if (status)
+		tester_setup_failed();
+	else
+		tester_setup_complete();
+}
+
+static void setup_powered_client_callback(uint8_t status, uint16_t length,
+					const void *param, void *user_data)
+{
+	struct test_data *data = tester_get_data();
+	struct bthost *bthost;
+
+	if (status != MGMT_STATUS_SUCCESS) {
+		tester_setup_failed();
+		return;
+	}
+
+	tester_print("Controller powered on");
+
+	bthost = hciemu_client_get_host(data->hciemu);
+	bthost_set_cmd_complete_cb(bthost, client_cmd_complete, user_data);
+	bthost_write_scan_enable(bthost, 0x03);
+}
+
+static void setup_powered_client(const void *test_data)
+{
+	struct test_data *data = tester_get_data();
+	unsigned char param[] = { 0x01 };
+
+	tester_print("Powering on controller");
+
+	mgmt_send(data->mgmt, MGMT_OP_SET_BONDABLE, data->mgmt_index,
+				sizeof(param), param, NULL, NULL, NULL);
+
+	mgmt_send(data->mgmt, MGMT_OP_SET_POWERED, data->mgmt_index,
+			sizeof(param), param, setup_powered_client_callback,
+			NULL, NULL);
+}
+
+static void bench_report(struct test_data *data)
+{
+	const struct bench_data *bench = data->test_data;
+	uint64_t elapsed = data->end - data->start;
+	uint32_t lost = data->sent - data->received;
+	uint64_t cpu = data->cpu_time / 1000;
+
+	tester_print("Reports: sent %u received %u not delivered %u",
+					data->sent, data->received, lost);
+	tester_print("  Relay queue: %s, %" PRIu64 " dropped, %" PRIu64
+				" merged", relay_queue_policy_to_str(bench->policy),
+				data->stats.dropped, data->stats.merged);
+	tester_print("  Local socket full: %u times", data->producer_blocked);
+
+	if (elapsed)
+		tester_print("  Throughput: %" PRIu64 " reports/s",
+				(uint64_t) data->received * 1000000 / elapsed);
+
+	tester_print("  Batches: %" PRIu64 " avg %.2f max %u, %" PRIu64
+				" wakeups", data->stats.batches,
+				relay_stats_avg_batch(&data->stats),
+				data->stats.max_batch, data->stats.wakeups);
+	tester_print("  Relay latency: p50 %u us p99 %u us max %u us",
+			relay_latency_percentile(&data->latency, 50),
+			relay_latency_percentile(&data->latency, 99),
+			data->latency.max);
+	tester_print("  End-to-end latency: p50 %u us p99 %u us max %u us",
+			relay_latency_percentile(&data->e2e_latency, 50),
+			relay_latency_percentile(&data->e2e_latency, 99),
+			data->e2e_latency.max);
+
+	if (data->stats.reports)
+		tester_print("  Relay CPU: %" PRIu64 " us total, %.2f us/report",
+				cpu, (double) cpu / data->stats.reports);
+}
+
+static void bench_finish(struct test_data *data)
+{
+	remove_source(&data->relay_id);
+	remove_source(&data->flush_id);
+	remove_source(&data->producer_id);
+	remove_source(&data->settle_id);
+
+	if (!data->end)
+		data->end = relay_now();
+
+	bench_report(data);
+
+	if (!data->received)
+		tester_test_failed();
+	else
+		tester_test_passed();
+}
+
+static gboolean bench_settle_timeout(gpointer user_data)
+{
+	struct test_data *data = user_data;
+
+	data->settle_id = 0;
+
+	tester_warn("%u reports still in flight", data->sent - data->received);
+	bench_finish(data);
+
+	return FALSE;
+}
+
+static void bench_received(const void *buf, uint16_t len, void *user_data)
+{
+	struct test_data *data = user_data;
+	const struct bench_data *bench = data->test_data;
+	struct bench_report report;
+
+	if (len != sizeof(report)) {
+		tester_warn("Unexpected report of %u bytes", len);
+		return;
+	}
+
+	memcpy(&report, buf, sizeof(report));
+	relay_latency_record(&data->e2e_latency, report.timestamp, 1);
+
+	data->received++;
+	data->end = relay_now();
+
+	if (data->sent < bench_reports(bench))
+		return;
+
+	/* Merged and dropped reports never arrive */
+	if (data->received + data->stats.dropped + data->stats.merged <
+							data->sent)
+		return;
+
+	bench_finish(data);
+}
+
+static gboolean bench_relay_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data);
+
+static void bench_watch_local(struct test_data *data)
+{
+	GIOChannel *io;
+
+	io = g_io_channel_unix_new(data->local_sk[1]);
+	data->relay_id = g_io_add_watch(io, G_IO_IN | G_IO_ERR | G_IO_HUP |
+					G_IO_NVAL, bench_relay_cb, data);
+	g_io_channel_unref(io);
+}
+
+static gboolean bench_flush_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct test_data *data = user_data;
+	uint64_t cpu = thread_cpu_time();
+	int err;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		data->flush_id = 0;
+		tester_warn("BT channel closed");
+		tester_test_failed();
+		return FALSE;
+	}
+
+	err = relay_queue_flush(data->queue, data->sk, &data->latency);
+	data->cpu_time += thread_cpu_time() - cpu;
+
+	if (err < 0) {
+		data->flush_id = 0;
+		tester_warn("Flush failed: %s (%d)", strerror(-err), -err);
+		tester_test_failed();
+		return FALSE;
+	}
+
+	/* Resume reading the local socket paused by the block policy */
+	if (!data->relay_id && !relay_queue_blocked(data->queue))
+		bench_watch_local(data);
+
+	if (relay_queue_pending(data->queue))
+		return TRUE;
+
+	data->flush_id = 0;
+
+	return FALSE;
+}
+
+static void bench_forward_batch(struct relay_batch *batch, void *user_data)
+{
+	struct test_data *data = user_data;
+	GIOChannel *io;
+	int pending;
+
+	pending = relay_queue_send_batch(data->queue, data->sk, batch,
+						&data->stats, &data->latency);
+	if (pending < 0) {
+		tester_warn("Relay write failed: %s (%d)", strerror(-pending),
+								-pending);
+		return;
+	}
+
+	if (!pending || data->flush_id)
+		return;
+
+	io = g_io_channel_unix_new(data->sk);
+	data->flush_id = g_io_add_watch(io, G_IO_OUT | G_IO_ERR | G_IO_HUP |
+					G_IO_NVAL, bench_flush_cb, data);
+	g_io_channel_unref(io);
+}
+
+static gboolean bench_relay_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct test_data *data = user_data;
+	uint64_t cpu;
+	int count;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		data->relay_id = 0;
+		return FALSE;
+	}
+
+	cpu = thread_cpu_time();
+	count = relay_drain(g_io_channel_unix_get_fd(io), &data->stats,
+						bench_forward_batch, data);
+	data->cpu_time += thread_cpu_time() - cpu;
+
+	if (count < 0) {
+		data->relay_id = 0;
+		tester_warn("Relay read failed: %s (%d)", strerror(-count),
+								-count);
+		tester_test_failed();
+		return FALSE;
+	}
+
+	/* Like the input host with the block policy, stop reading while
+	 * the BT channel cannot take more.
+	 */
+	if (relay_queue_blocked(data->queue)) {
+		data->relay_id = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static bool bench_send_report(struct test_data *data)
+{
+	const struct bench_data *bench = data->test_data;
+	struct bench_report report;
+	ssize_t ret;
+
+	memset(&report, 0, sizeof(report));
+	report.hdr = HIDP_TRANS_DATA | HIDP_DATA_RTYPE_INPUT;
+	report.seq = data->sent;
+
+	if (bench->boot_mouse) {
+		report.id = HIDP_BOOT_MOUSE_REPORT_ID;
+		report.payload[HIDP_BOOT_MOUSE_X - 2] = 1;
+		report.payload[HIDP_BOOT_MOUSE_Y - 2] = 1;
+	} else {
+		report.id = HIDP_BOOT_KEYBOARD_REPORT_ID;
+		report.payload[HIDP_BOOT_KEYBOARD_KEYS - 2] = 4 +
+							data->sent % 26;
+	}
+
+	report.timestamp = relay_now();
+
+	ret = send(data->local_sk[0], &report, sizeof(report), MSG_DONTWAIT);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			data->producer_blocked++;
+		else
+			tester_warn("Local write failed: %s (%d)",
+						strerror(errno), errno);
+		return false;
+	}
+
+	data->sent++;
+
+	return true;
+}
+
+static void bench_producer_done(struct test_data *data)
+{
+	data->producer_id = 0;
+
+	tester_print("All %u reports produced", data->sent);
+
+	data->settle_id = g_timeout_add(BENCH_SETTLE_TIME,
+						bench_settle_timeout, data);
+}
+
+static gboolean bench_produce_rate(gpointer user_data)
+{
+	struct test_data *data = user_data;
+	const struct bench_data *bench = data->test_data;
+	uint64_t due;
+
+	/* Timer ticks are coarse, catch up on every report due by now */
+	due = (relay_now() - data->start) * bench_rate(bench) / 1000000;
+	if (due > bench_reports(bench))
+		due = bench_reports(bench);
+
+	while (data->sent < due) {
+		if (!bench_send_report(data))
+			break;
+	}
+
+	if (data->sent < bench_reports(bench))
+		return TRUE;
+
+	bench_producer_done(data);
+
+	return FALSE;
+}
+
+static gboolean bench_produce_flood(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct test_data *data = user_data;
+	const struct bench_data *bench = data->test_data;
+
+	while (data->sent < bench_reports(bench)) {
+		if (!bench_send_report(data))
+			return TRUE;
+	}
+
+	bench_producer_done(data);
+
+	return FALSE;
+}
+
+static void bench_start(struct test_data *data)
+{
+	const struct bench_data *bench = data->test_data;
+	GIOChannel *io;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0,
+							data->local_sk) < 0) {
+		tester_warn("Can't create local sockets: %s (%d)",
+						strerror(errno), errno);
+		tester_test_failed();
+		return;
+	}
+
+	data->queue = relay_queue_new(RELAY_QUEUE_DEFAULT_SIZE,
+							bench->policy);
+	if (!data->queue) {
+		tester_test_failed();
+		return;
+	}
+
+	relay_queue_set_merge(data->queue, bench->merge);
+
+	bench_watch_local(data);
+
+	if (bench_rate(bench))
+		tester_print("Relaying %u reports at %u reports/s",
+				bench_reports(bench), bench_rate(bench));
+	else
+		tester_print("Relaying %u reports as fast as possible",
+							bench_reports(bench));
+
+	data->start = relay_now();
+
+	if (bench_rate(bench)) {
+		data->producer_id = g_timeout_add(1, bench_produce_rate, data);
+		return;
+	}
+
+	io = g_io_channel_unix_new(data->local_sk[0]);
+	data->producer_id = g_io_add_watch(io, G_IO_OUT, bench_produce_flood,
+									data);
+	g_io_channel_unref(io);
+}
+
+static void bench_l2cap_connect_cb(uint16_t handle, uint16_t cid,
+							void *user_data)
+{
+	struct test_data *data = user_data;
+	struct bthost *bthost = hciemu_client_get_host(data->hciemu);
+
+	data->handle = handle;
+	data->dcid = cid;
+
+	bthost_add_cid_hook(bthost, handle, cid, bench_received, data);
+}
+
+static gboolean l2cap_connect_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct test_data *data = tester_get_data();
+	int err, sk_err, sk;
+	socklen_t len = sizeof(sk_err);
+
+	data->io_id = 0;
+
+	sk = g_io_channel_unix_get_fd(io);
+
+	if (getsockopt(sk, SOL_SOCKET, SO_ERROR, &sk_err, &len) < 0)
+		err = -errno;
+	else
+		err = -sk_err;
+
+	if (err < 0) {
+		tester_warn("Connect failed: %s (%d)", strerror(-err), -err);
+		tester_test_failed();
+		return FALSE;
+	}
+
+	tester_print("HIDP interrupt channel connected");
+
+	bench_start(data);
+
+	return FALSE;
+}
+
+static int connect_intr_sock(struct test_data *data)
+{
+	const uint8_t *master_bdaddr, *client_bdaddr;
+	struct sockaddr_l2 addr;
+	int sk, err;
+
+	master_bdaddr = hciemu_get_master_bdaddr(data->hciemu);
+	client_bdaddr = hciemu_get_client_bdaddr(data->hciemu);
+	if (!master_bdaddr || !client_bdaddr) {
+		tester_warn("No bdaddr");
+		return -ENODEV;
+	}
+
+	sk = socket(PF_BLUETOOTH, SOCK_SEQPACKET | SOCK_NONBLOCK,
+							BTPROTO_L2CAP);
+	if (sk < 0) {
+		err = -errno;
+		tester_warn("Can't create socket: %s (%d)", strerror(errno),
+									errno);
+		return err;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.l2_family = AF_BLUETOOTH;
+	bacpy(&addr.l2_bdaddr, (void *) master_bdaddr);
+	addr.l2_bdaddr_type = BDADDR_BREDR;
+
+	if (bind(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		err = -errno;
+		tester_warn("Can't bind socket: %s (%d)", strerror(errno),
+									errno);
+		close(sk);
+		return err;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.l2_family = AF_BLUETOOTH;
+	bacpy(&addr.l2_bdaddr, (void *) client_bdaddr);
+	addr.l2_bdaddr_type = BDADDR_BREDR;
+	addr.l2_psm = htobs(L2CAP_PSM_HIDP_INTR);
+
+	if (connect(sk, (struct sockaddr *) &addr, sizeof(addr)) < 0 &&
+				!(errno == EAGAIN || errno == EINPROGRESS)) {
+		err = -errno;
+		tester_warn("Can't connect socket: %s (%d)", strerror(errno),
+									errno);
+		close(sk);
+		return err;
+	}
+
+	return sk;
+}
+
+static void test_relay(const void *test_data)
+{
+	struct test_data *data = tester_get_data();
+	struct bthost *bthost = hciemu_client_get_host(data->hciemu);
+	GIOChannel *io;
+
+	bthost_add_l2cap_server(bthost, L2CAP_PSM_HIDP_INTR,
+					bench_l2cap_connect_cb, NULL, data);
+
+	data->sk = connect_intr_sock(data);
+	if (data->sk < 0) {
+		tester_test_failed();
+		return;
+	}
+
+	io = g_io_channel_unix_new(data->sk);
+	data->io_id = g_io_add_watch(io, G_IO_OUT, l2cap_connect_cb, NULL);
+	g_io_channel_unref(io);
+
+	tester_print("Connect in progress");
+}
+
+/* Takes the benchmark's own options out of argv before tester_init() */
+static void parse_bench_options(int *argc, char *argv[])
+{
+	int i, count = 1;
+
+	for (i = 1; i < *argc; i++) {
+		if (!strncmp(argv[i], "--rate=", 7))
+			rate_override = atoi(argv[i] + 7);
+		else if (!strncmp(argv[i], "--reports=", 10))
+			reports_override = atoi(argv[i] + 10);
+		else
+			argv[count++] = argv[i];
+	}
+
+	argv[count] = NULL;
+	*argc = count;
+}
+
+int main(int argc, char *argv[])
+{
+	parse_bench_options(&argc, argv);
+
+	tester_init(&argc, &argv);
+
+	test_bench("HID Relay Bench - 125 Hz", &bench_125hz,
+					setup_powered_client, test_relay);
+	test_bench("HID Relay Bench - 1000 Hz", &bench_1000hz,
+					setup_powered_client, test_relay);
+	test_bench("HID Relay Bench - 8000 Hz", &bench_8000hz,
+					setup_powered_client, test_relay);
+	test_bench("HID Relay Bench - Flood", &bench_flood,
+					setup_powered_client, test_relay);
+	test_bench("HID Relay Bench - Flood Coalesce", &bench_flood_coalesce,
+					setup_powered_client, test_relay);
+	test_bench("HID Relay Bench - Flood Block", &bench_flood_block,
+					setup_powered_client, test_relay);
+	test_bench("HID Relay Bench - Flood Merge", &bench_flood_merge,
+					setup_powered_client, test_relay);
+
+	return tester_run();
+}
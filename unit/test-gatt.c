@@ -48,6 +48,7 @@
 
 struct test_pdu {
 	bool valid;
+	bool wait;
 	uint8_t *data;
 	size_t size;
 };
@@ -90,6 +91,13 @@ struct context {
 		.size = sizeof(data(args)),			\
 	}
 
+/* Nothing to send, the other side sends the next PDU as well */
+#define wait_pdu()						\
+	{							\
+		.valid = true,					\
+		.wait = true,					\
+	}
+
 #define false_pdu()						\
 	{							\
 		.valid = false,					\
@@ -134,6 +142,9 @@ struct context {
 
 #define SERVICE_DATA_1_PDUS						\
 		CLIENT_INIT_PDUS,					\
+		SERVICE_DATA_1_DISC_PDUS
+
+#define SERVICE_DATA_1_DISC_PDUS					\
 		raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),	\
 		raw_pdu(0x11, 0x06, 0x01, 0x00, 0x04, 0x00, 0x01, 0x18),\
 		raw_pdu(0x10, 0x05, 0x00, 0xff, 0xff, 0x00, 0x28),	\
@@ -335,6 +346,7 @@ struct test_step {
 	uint8_t expected_att_ecode;
 	const uint8_t *value;
 	uint16_t length;
+	uint8_t features;
 };
 
 static void destroy_context(struct context *context)
@@ -464,6 +476,11 @@ static gboolean test_handler(GIOChannel *channel, GIOCondition cond,
 	/* Empty client PDU means to trigger something out-of-band. */
 	pdu = &context->data->pdu_list[context->pdu_offset];
 
+	if (pdu->valid && pdu->wait) {
+		context->pdu_offset++;
+		return TRUE;
+	}
+
 	if (pdu->valid && (pdu->size == 0)) {
 		context->pdu_offset++;
 		test_debug("triggering server action", "Empty client pdu: ");
@@ -660,6 +677,7 @@ static struct context *create_context(uint16_t mtu, gconstpointer data)
 {
 	struct context *context = g_new0(struct context, 1);
 	const struct test_data *test_data = data;
+	const struct test_step *step = test_data->step;
 	GIOChannel *channel;
 	int err, sv[2];
 
@@ -691,7 +709,8 @@ static struct context *create_context(uint16_t mtu, gconstpointer data)
 		g_assert(context->client_db);
 
 		context->client = bt_gatt_client_new(context->client_db,
-							context->att, mtu, 0);
+						context->att, mtu,
+						step ? step->features : 0);
 		g_assert(context->client);
 
 		bt_gatt_client_set_debug(context->client, print_debug,
@@ -2039,6 +2058,133 @@ static void test_multiple_read(struct context *context)
 						NULL));
 }
 
+static void bulk_read_cb(bool success,
+			const struct bt_gatt_client_bulk_value *values,
+			uint16_t num_values, void *user_data)
+{
+	struct context *context = user_data;
+	const struct test_step *step = context->data->step;
+
+	g_assert_cmpint(num_values, ==, 2);
+	g_assert_cmpint(values[0].handle, ==, step->handle);
+	g_assert_cmpint(values[1].handle, ==, step->end_handle);
+	g_assert(success == !step->expected_att_ecode);
+
+	g_assert_cmpint(values[0].att_ecode, ==, 0);
+	g_assert_cmpint(values[0].length, ==, step->length);
+	g_assert(memcmp(values[0].value, step->value, step->length) == 0);
+
+	g_assert_cmpint(values[1].att_ecode, ==, step->expected_att_ecode);
+	if (!values[1].att_ecode) {
+		g_assert_cmpint(values[1].length, ==, step->length);
+		g_assert(memcmp(values[1].value, step->value,
+							step->length) == 0);
+	}
+
+	context_quit(context);
+}
+
+static void test_bulk_read(struct context *context)
+{
+	const struct test_step *step = context->data->step;
+	uint16_t handles[2];
+
+	handles[0] = step->handle;
+	handles[1] = step->end_handle;
+
+	g_assert(bt_gatt_client_read_bulk(context->client, handles, 2,
+						bulk_read_cb, context, NULL));
+}
+
+static const struct test_step test_bulk_read_1 = {
+	.handle = 0x0003,
+	.end_handle = 0x0007,
+	.func = test_bulk_read,
+	.value = read_data_1,
+	.length = 0x03
+};
+
+static const struct test_step test_bulk_read_2 = {
+	.handle = 0x0003,
+	.end_handle = 0x0007,
+	.func = test_bulk_read,
+	.value = read_data_1,
+	.length = 0x03,
+	.expected_att_ecode = 0x02
+};
+
+static const struct test_step test_bulk_read_vl_1 = {
+	.handle = 0x0003,
+	.end_handle = 0x0007,
+	.func = test_bulk_read,
+	.value = read_data_1,
+	.length = 0x03,
+	.features = BT_GATT_CHRC_CLI_FEAT_EATT
+};
+
+static const struct test_step test_bulk_read_vl_2 = {
+	.handle = 0x0003,
+	.end_handle = 0x0007,
+	.func = test_bulk_read,
+	.value = read_data_1,
+	.length = 0x03,
+	.expected_att_ecode = 0x02,
+	.features = BT_GATT_CHRC_CLI_FEAT_EATT
+};
+
+/*
+ * With an MTU of 23 at most 11 handles fit in a request. The first
+ * response is truncated in the middle of the 7th value.
+ */
+static const uint16_t bulk_read_vl_handles[] = {
+	0x0001, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006, 0x0007,
+	0x0008, 0x0009, 0x000a, 0x000b, 0x000c, 0x000d
+};
+
+static const uint8_t bulk_read_vl_long[] = { 0x07, 0x08, 0x09 };
+
+static void bulk_read_vl_cb(bool success,
+			const struct bt_gatt_client_bulk_value *values,
+			uint16_t num_values, void *user_data)
+{
+	struct context *context = user_data;
+	uint16_t i;
+
+	g_assert(success);
+	g_assert_cmpint(num_values, ==, G_N_ELEMENTS(bulk_read_vl_handles));
+
+	for (i = 0; i < num_values; i++) {
+		g_assert_cmpint(values[i].handle, ==, bulk_read_vl_handles[i]);
+		g_assert_cmpint(values[i].att_ecode, ==, 0);
+
+		if (i == 6) {
+			g_assert_cmpint(values[i].length, ==,
+						sizeof(bulk_read_vl_long));
+			g_assert(memcmp(values[i].value, bulk_read_vl_long,
+					sizeof(bulk_read_vl_long)) == 0);
+			continue;
+		}
+
+		g_assert_cmpint(values[i].length, ==, 1);
+		g_assert_cmpint(values[i].value[0], ==, i + 1);
+	}
+
+	context_quit(context);
+}
+
+static void test_bulk_read_vl(struct context *context)
+{
+	g_assert(bt_gatt_client_read_bulk(context->client,
+				bulk_read_vl_handles,
+				G_N_ELEMENTS(bulk_read_vl_handles),
+				bulk_read_vl_cb, context, NULL));
+}
+
+static const struct test_step test_bulk_read_vl_3 = {
+	.func = test_bulk_read_vl,
+	.features = BT_GATT_CHRC_CLI_FEAT_EATT
+};
+
 static const struct test_step test_multiple_read_1 = {
 	.handle = 0x0003,
 	.end_handle = 0x0007,
@@ -2281,6 +2427,316 @@ static const struct test_step test_notification_server_1 = {
 	.length = 0x03,
 };
 
+static const uint8_t nfy_mult_data_5[] = { 0x01, 0x02, 0x03, 0x04, 0x05 };
+
+/* The longest value that does not fit a Multiple Handle Value Notification */
+static const uint8_t nfy_mult_data_19[19];
+
+static void check_nfy_mult_stats(struct context *context, unsigned int pdus,
+					unsigned int values,
+					unsigned int flush_full,
+					unsigned int flush_timeout,
+					unsigned int flush_idle)
+{
+	struct bt_gatt_server_nfy_mult_stats stats;
+
+	g_assert(bt_gatt_server_get_nfy_mult_stats(context->server, &stats));
+	g_assert_cmpint(stats.pdus, ==, pdus);
+	g_assert_cmpint(stats.values, ==, values);
+	g_assert_cmpint(stats.flush_full, ==, flush_full);
+	g_assert_cmpint(stats.flush_timeout, ==, flush_timeout);
+	g_assert_cmpint(stats.flush_idle, ==, flush_idle);
+}
+
+static void test_nfy_mult_full(struct context *context)
+{
+	int i;
+
+	/* With an MTU of 23 the third 3 byte value fills up the PDU */
+	for (i = 0; i < 3; i++)
+		g_assert(bt_gatt_server_send_notification(context->server,
+					0x0003, read_data_1,
+					sizeof(read_data_1), true));
+}
+
+static void test_nfy_mult_full_post(struct context *context)
+{
+	check_nfy_mult_stats(context, 1, 3, 1, 0, 0);
+}
+
+static const struct test_step test_nfy_mult_1 = {
+	.func = test_nfy_mult_full,
+	.post_func = test_nfy_mult_full_post,
+};
+
+static void test_nfy_mult_no_fit(struct context *context)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		g_assert(bt_gatt_server_send_notification(context->server,
+					0x0003, read_data_1,
+					sizeof(read_data_1), true));
+
+	/*
+	 * Does not fit behind the other two so they go first, then this one
+	 * once the channel has nothing else to send.
+	 */
+	g_assert(bt_gatt_server_send_notification(context->server, 0x0003,
+					nfy_mult_data_5,
+					sizeof(nfy_mult_data_5), true));
+}
+
+static void test_nfy_mult_no_fit_post(struct context *context)
+{
+	check_nfy_mult_stats(context, 2, 3, 1, 0, 1);
+}
+
+static const struct test_step test_nfy_mult_2 = {
+	.func = test_nfy_mult_no_fit,
+	.post_func = test_nfy_mult_no_fit_post,
+};
+
+static void test_nfy_mult_timeout(struct context *context)
+{
+	/* Nothing else is queued, the latency budget sends it */
+	g_assert(bt_gatt_server_send_notification(context->server, 0x0003,
+					read_data_1, sizeof(read_data_1),
+					true));
+}
+
+static void test_nfy_mult_timeout_post(struct context *context)
+{
+	check_nfy_mult_stats(context, 1, 1, 0, 1, 0);
+}
+
+static const struct test_step test_nfy_mult_3 = {
+	.func = test_nfy_mult_timeout,
+	.post_func = test_nfy_mult_timeout_post,
+};
+
+static void test_nfy_mult_idle(struct context *context)
+{
+	g_assert(bt_gatt_server_send_notification(context->server, 0x0003,
+					read_data_1, sizeof(read_data_1),
+					false));
+
+	/* Sent as soon as the channel is done with the one above */
+	g_assert(bt_gatt_server_send_notification(context->server, 0x0003,
+					read_data_1, sizeof(read_data_1),
+					true));
+}
+
+static void test_nfy_mult_idle_post(struct context *context)
+{
+	check_nfy_mult_stats(context, 1, 1, 0, 0, 1);
+}
+
+static const struct test_step test_nfy_mult_4 = {
+	.func = test_nfy_mult_idle,
+	.post_func = test_nfy_mult_idle_post,
+};
+
+static void test_nfy_mult_single(struct context *context)
+{
+	g_assert(bt_gatt_server_send_notification(context->server, 0x0003,
+					nfy_mult_data_19,
+					sizeof(nfy_mult_data_19), true));
+}
+
+static void test_nfy_mult_single_post(struct context *context)
+{
+	check_nfy_mult_stats(context, 0, 0, 0, 0, 0);
+}
+
+static const struct test_step test_nfy_mult_5 = {
+	.func = test_nfy_mult_single,
+	.post_func = test_nfy_mult_single_post,
+};
+
+static void get_chan(struct bt_att_chan *chan,
+					const struct bt_att_chan_stats *stats,
+					void *user_data)
+{
+	struct bt_att_chan **ptr = user_data;
+
+	*ptr = chan;
+}
+
+static void sched_rsp_cb(uint8_t opcode, const void *pdu, uint16_t length,
+							void *user_data)
+{
+}
+
+static void test_sched_nfy_burst(struct context *context)
+{
+	struct bt_att_chan *chan = NULL;
+	uint8_t pdu[3];
+	uint8_t i;
+
+	bt_att_foreach_chan_stats(context->att, get_chan, &chan);
+	g_assert(chan);
+
+	/* Queued first but has to wait for everything else */
+	put_le16(0x0003, pdu);
+	g_assert(bt_att_send(context->att, BT_ATT_OP_READ_REQ, pdu, 2,
+						sched_rsp_cb, NULL, NULL));
+
+	for (i = 1; i <= 2; i++)
+		bt_att_chan_send_rsp(chan, BT_ATT_OP_READ_RSP, &i, 1);
+
+	/* At most 4 go ahead of each response queued on the channel */
+	for (i = 1; i <= 6; i++) {
+		pdu[2] = i;
+		g_assert(bt_att_send(context->att, BT_ATT_OP_HANDLE_NFY, pdu,
+						sizeof(pdu), NULL, NULL, NULL));
+	}
+}
+
+static void check_nfy_burst_stats(struct bt_att_chan *chan,
+					const struct bt_att_chan_stats *stats,
+					void *user_data)
+{
+	/* MTU response, 6 notifications, 2 responses and the request */
+	g_assert_cmpint(stats->pdus, ==, 10);
+	g_assert_cmpint(stats->reqs, ==, 0);
+	g_assert_cmpint(stats->queued, ==, 1);
+}
+
+static void test_sched_nfy_burst_post(struct context *context)
+{
+	bt_att_foreach_chan_stats(context->att, check_nfy_burst_stats, NULL);
+}
+
+static const struct test_step test_sched_1 = {
+	.func = test_sched_nfy_burst,
+	.post_func = test_sched_nfy_burst_post,
+};
+
+/*
+ * Two bearers, the original one with an MTU of 512 and another one with
+ * the default MTU. A request too big for the latter must not keep it from
+ * sending the one queued behind.
+ */
+struct sched_fits {
+	struct bt_att *att;
+	int fd[2];
+	guint source[2];
+	unsigned int rsps;
+};
+
+static gboolean sched_fits_read(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct sched_fits *data = user_data;
+	int fd = g_io_channel_unix_get_fd(channel);
+	uint8_t buf[512];
+	uint8_t rsp[2];
+	ssize_t len;
+
+	g_assert(!(cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)));
+
+	len = read(fd, buf, sizeof(buf));
+
+	if (fd == data->fd[0]) {
+		g_assert_cmpint(len, ==, 43);
+		g_assert_cmpint(buf[0], ==, BT_ATT_OP_WRITE_REQ);
+		rsp[0] = BT_ATT_OP_WRITE_RSP;
+		len = 1;
+	} else {
+		g_assert_cmpint(len, ==, 3);
+		g_assert_cmpint(buf[0], ==, BT_ATT_OP_READ_REQ);
+		rsp[0] = BT_ATT_OP_READ_RSP;
+		rsp[1] = 0x01;
+		len = 2;
+	}
+
+	g_assert_cmpint(write(fd, rsp, len), ==, len);
+
+	return TRUE;
+}
+
+static void check_sched_fits_stats(struct bt_att_chan *chan,
+					const struct bt_att_chan_stats *stats,
+					void *user_data)
+{
+	/* Each bearer carried one of the requests */
+	g_assert_cmpint(stats->pdus, ==, 1);
+	g_assert_cmpint(stats->reqs, ==, 1);
+	g_assert_cmpint(stats->queued, ==, 0);
+	g_assert(stats->max_latency >= stats->latency);
+}
+
+static gboolean sched_fits_done(gpointer user_data)
+{
+	struct sched_fits *data = user_data;
+	int i;
+
+	bt_att_foreach_chan_stats(data->att, check_sched_fits_stats, NULL);
+
+	bt_att_unref(data->att);
+
+	for (i = 0; i < 2; i++) {
+		g_source_remove(data->source[i]);
+		close(data->fd[i]);
+	}
+
+	g_free(data);
+
+	tester_test_passed();
+
+	return FALSE;
+}
+
+static void sched_fits_rsp_cb(uint8_t opcode, const void *pdu,
+					uint16_t length, void *user_data)
+{
+	struct sched_fits *data = user_data;
+
+	g_assert(opcode == BT_ATT_OP_WRITE_RSP ||
+					opcode == BT_ATT_OP_READ_RSP);
+
+	/* Stats are updated once the response callback returns */
+	if (++data->rsps == 2)
+		g_idle_add(sched_fits_done, data);
+}
+
+static void test_sched_fits(gconstpointer test_data)
+{
+	struct sched_fits *data = g_new0(struct sched_fits, 1);
+	uint8_t pdu[42];
+	int i, sv[2][2];
+
+	for (i = 0; i < 2; i++) {
+		GIOChannel *channel;
+
+		g_assert(!socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+								sv[i]));
+
+		data->fd[i] = sv[i][1];
+
+		channel = g_io_channel_unix_new(sv[i][1]);
+		data->source[i] = g_io_add_watch(channel,
+				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				sched_fits_read, data);
+		g_io_channel_unref(channel);
+	}
+
+	data->att = bt_att_new(sv[0][0], false);
+	g_assert(data->att);
+	bt_att_set_close_on_unref(data->att, true);
+	g_assert(bt_att_set_mtu(data->att, 512));
+	g_assert(!bt_att_attach_fd(data->att, sv[1][0]));
+
+	memset(pdu, 0, sizeof(pdu));
+	put_le16(0x0003, pdu);
+
+	g_assert(bt_att_send(data->att, BT_ATT_OP_WRITE_REQ, pdu, sizeof(pdu),
+					sched_fits_rsp_cb, data, NULL));
+	g_assert(bt_att_send(data->att, BT_ATT_OP_READ_REQ, pdu, 2,
+					sched_fits_rsp_cb, data, NULL));
+}
+
 static uint8_t indication_received;
 
 static void test_indication_cb(void *user_data)
@@ -2345,6 +2801,167 @@ static const struct test_step test_indication_server_1 = {
 	.length = 0x03,
 };
 
+static void test_cache_remove_service(struct context *context)
+{
+	struct gatt_db_attribute *attr;
+
+	attr = gatt_db_get_attribute(context->server_db, 0xffff);
+	g_assert(attr);
+	g_assert(gatt_db_remove_service(context->server_db, attr));
+
+	context_process(context);
+}
+
+static const struct test_step test_cache_remove = {
+	.func = test_cache_remove_service,
+};
+
+static void test_cache_add_service(struct context *context)
+{
+	struct gatt_db_attribute *attr;
+	bt_uuid_t uuid;
+
+	bt_uuid16_create(&uuid, GAP_UUID);
+
+	attr = gatt_db_insert_service(context->server_db, 0x0020, &uuid, true,
+									1);
+	g_assert(attr);
+	g_assert(gatt_db_service_set_active(attr, true));
+
+	context_process(context);
+}
+
+static const struct test_step test_cache_add = {
+	.func = test_cache_add_service,
+};
+
+/*
+ * Two servers on the same database, one with an MTU of 512 and one with
+ * the default MTU. The same request must not be answered from the entry
+ * cached for the other MTU. Such an entry would not fit the default MTU,
+ * so the bearer drops it and the test times out.
+ */
+struct cache_mtu {
+	struct gatt_db *db;
+	struct bt_att *att[2];
+	struct bt_gatt_server *server[2];
+	int fd[2];
+	guint source[2];
+	uint8_t rsp[2][512];
+	ssize_t len[2];
+	unsigned int rsps;
+};
+
+static const uint8_t cache_mtu_req[] = { 0x04, 0x01, 0x00, 0xff, 0xff };
+
+static void cache_mtu_send(struct cache_mtu *data, int i)
+{
+	ssize_t len;
+
+	len = write(data->fd[i], cache_mtu_req, sizeof(cache_mtu_req));
+	g_assert_cmpint(len, ==, sizeof(cache_mtu_req));
+}
+
+static gboolean cache_mtu_done(gpointer user_data)
+{
+	struct cache_mtu *data = user_data;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		g_source_remove(data->source[i]);
+		bt_gatt_server_unref(data->server[i]);
+		bt_att_unref(data->att[i]);
+		close(data->fd[i]);
+	}
+
+	gatt_db_unref(data->db);
+	g_free(data);
+
+	tester_test_passed();
+
+	return FALSE;
+}
+
+static gboolean cache_mtu_read(GIOChannel *channel, GIOCondition cond,
+							gpointer user_data)
+{
+	struct cache_mtu *data = user_data;
+	int fd = g_io_channel_unix_get_fd(channel);
+	uint8_t buf[512];
+	ssize_t len;
+
+	g_assert(!(cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)));
+
+	len = read(fd, buf, sizeof(buf));
+	g_assert_cmpint(buf[0], ==, BT_ATT_OP_FIND_INFO_RSP);
+
+	switch (data->rsps++) {
+	case 0:
+		g_assert(fd == data->fd[0]);
+		g_assert_cmpint(len, >, BT_ATT_DEFAULT_LE_MTU);
+		memcpy(data->rsp[0], buf, len);
+		data->len[0] = len;
+		cache_mtu_send(data, 1);
+		break;
+	case 1:
+		/* Same entries, cut down to fit the default MTU */
+		g_assert(fd == data->fd[1]);
+		g_assert_cmpint(len, <=, BT_ATT_DEFAULT_LE_MTU);
+		g_assert_cmpint(len, <, data->len[0]);
+		g_assert(!memcmp(buf, data->rsp[0], len));
+		memcpy(data->rsp[1], buf, len);
+		data->len[1] = len;
+		cache_mtu_send(data, 0);
+		break;
+	case 2:
+		/* The short response did not replace the long one */
+		g_assert(fd == data->fd[0]);
+		g_assert_cmpint(len, ==, data->len[0]);
+		g_assert(!memcmp(buf, data->rsp[0], len));
+		g_idle_add(cache_mtu_done, data);
+		break;
+	default:
+		g_assert_not_reached();
+	}
+
+	return TRUE;
+}
+
+static void test_cache_mtu(gconstpointer test_data)
+{
+	static const uint16_t mtu[] = { 512, BT_ATT_DEFAULT_LE_MTU };
+	struct cache_mtu *data = g_new0(struct cache_mtu, 1);
+	int i, sv[2];
+
+	data->db = make_test_spec_small_db();
+
+	for (i = 0; i < 2; i++) {
+		GIOChannel *channel;
+
+		g_assert(!socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0,
+									sv));
+
+		data->fd[i] = sv[1];
+
+		channel = g_io_channel_unix_new(sv[1]);
+		data->source[i] = g_io_add_watch(channel,
+				G_IO_IN | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
+				cache_mtu_read, data);
+		g_io_channel_unref(channel);
+
+		data->att[i] = bt_att_new(sv[0], false);
+		g_assert(data->att[i]);
+		bt_att_set_close_on_unref(data->att[i], true);
+		g_assert(bt_att_set_mtu(data->att[i], mtu[i]));
+
+		data->server[i] = bt_gatt_server_new(data->db, data->att[i],
+								mtu[i], 0);
+		g_assert(data->server[i]);
+	}
+
+	cache_mtu_send(data, 0);
+}
+
 int main(int argc, char *argv[])
 {
 	struct gatt_db *service_db_1, *service_db_2, *service_db_3;
@@ -3045,6 +3662,60 @@ int main(int argc, char *argv[])
 			raw_pdu(0x0e, 0x03, 0x00, 0x07, 0x00),
 			raw_pdu(0x0f, 0x01, 0x02, 0x03));
 
+	define_test_client("/bulk/read-1", test_client, service_db_1,
+			&test_bulk_read_1,
+			SERVICE_DATA_1_PDUS,
+			raw_pdu(0x0a, 0x03, 0x00),
+			raw_pdu(0x0b, 0x01, 0x02, 0x03),
+			raw_pdu(0x0a, 0x07, 0x00),
+			raw_pdu(0x0b, 0x01, 0x02, 0x03));
+
+	define_test_client("/bulk/read-2", test_client, service_db_1,
+			&test_bulk_read_2,
+			SERVICE_DATA_1_PDUS,
+			raw_pdu(0x0a, 0x03, 0x00),
+			raw_pdu(0x0b, 0x01, 0x02, 0x03),
+			raw_pdu(0x0a, 0x07, 0x00),
+			raw_pdu(0x01, 0x0a, 0x07, 0x00, 0x02));
+
+	define_test_client("/bulk/read-vl-1", test_client, service_db_1,
+			&test_bulk_read_vl_1,
+			SERVICE_DATA_1_PDUS,
+			raw_pdu(0x20, 0x03, 0x00, 0x07, 0x00),
+			raw_pdu(0x21, 0x03, 0x00, 0x01, 0x02, 0x03, 0x03, 0x00,
+					0x01, 0x02, 0x03));
+
+	define_test_client("/bulk/read-vl-2", test_client, service_db_1,
+			&test_bulk_read_vl_2,
+			SERVICE_DATA_1_PDUS,
+			raw_pdu(0x20, 0x03, 0x00, 0x07, 0x00),
+			raw_pdu(0x01, 0x20, 0x03, 0x00, 0x02),
+			raw_pdu(0x0a, 0x03, 0x00),
+			raw_pdu(0x0b, 0x01, 0x02, 0x03),
+			raw_pdu(0x0a, 0x07, 0x00),
+			raw_pdu(0x01, 0x0a, 0x07, 0x00, 0x02));
+
+	define_test_client("/bulk/read-vl-3", test_client, service_db_1,
+			&test_bulk_read_vl_3,
+			raw_pdu(0x02, 0x00, 0x02),
+			raw_pdu(0x03, 0x17, 0x00),
+			READ_SERVER_FEAT_PDUS,
+			SERVICE_DATA_1_DISC_PDUS,
+			raw_pdu(0x20, 0x01, 0x00, 0x02, 0x00, 0x03, 0x00, 0x04,
+				0x00, 0x05, 0x00, 0x06, 0x00, 0x07, 0x00, 0x08,
+				0x00, 0x09, 0x00, 0x0a, 0x00, 0x0b, 0x00),
+			raw_pdu(0x21, 0x01, 0x00, 0x01, 0x01, 0x00, 0x02, 0x01,
+				0x00, 0x03, 0x01, 0x00, 0x04, 0x01, 0x00, 0x05,
+				0x01, 0x00, 0x06, 0x03, 0x00, 0x07, 0x08),
+			raw_pdu(0x20, 0x0c, 0x00, 0x0d, 0x00),
+			raw_pdu(0x21, 0x01, 0x00, 0x0c, 0x01, 0x00, 0x0d),
+			raw_pdu(0x0c, 0x07, 0x00, 0x02, 0x00),
+			raw_pdu(0x0d, 0x09),
+			raw_pdu(0x20, 0x08, 0x00, 0x09, 0x00, 0x0a, 0x00, 0x0b,
+				0x00),
+			raw_pdu(0x21, 0x01, 0x00, 0x08, 0x01, 0x00, 0x09, 0x01,
+				0x00, 0x0a, 0x01, 0x00, 0x0b));
+
 	define_test_client("/TP/GAR/CL/BI-12-C", test_client, service_db_1,
 			&test_long_read_3,
 			SERVICE_DATA_1_PDUS,
@@ -3267,6 +3938,70 @@ int main(int argc, char *argv[])
 			raw_pdu(),
 			raw_pdu(0x1B, 0x03, 0x00, 0x01, 0x02, 0x03));
 
+	define_test_server("/nfy-mult/full", test_server, ts_small_db,
+			&test_nfy_mult_1,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(),
+			raw_pdu(0x23, 0x03, 0x00, 0x03, 0x00, 0x01, 0x02, 0x03,
+				0x03, 0x00, 0x03, 0x00, 0x01, 0x02, 0x03,
+				0x03, 0x00, 0x03, 0x00, 0x01, 0x02, 0x03));
+
+	define_test_server("/nfy-mult/no-fit", test_server, ts_small_db,
+			&test_nfy_mult_2,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(),
+			raw_pdu(0x23, 0x03, 0x00, 0x03, 0x00, 0x01, 0x02, 0x03,
+				0x03, 0x00, 0x03, 0x00, 0x01, 0x02, 0x03),
+			wait_pdu(),
+			raw_pdu(0x23, 0x03, 0x00, 0x05, 0x00, 0x01, 0x02, 0x03,
+				0x04, 0x05));
+
+	define_test_server("/nfy-mult/timeout", test_server, ts_small_db,
+			&test_nfy_mult_3,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(),
+			raw_pdu(0x23, 0x03, 0x00, 0x03, 0x00, 0x01, 0x02, 0x03));
+
+	define_test_server("/nfy-mult/idle", test_server, ts_small_db,
+			&test_nfy_mult_4,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(),
+			raw_pdu(0x1B, 0x03, 0x00, 0x01, 0x02, 0x03),
+			wait_pdu(),
+			raw_pdu(0x23, 0x03, 0x00, 0x03, 0x00, 0x01, 0x02, 0x03));
+
+	define_test_server("/nfy-mult/single", test_server, ts_small_db,
+			&test_nfy_mult_5,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(),
+			raw_pdu(0x1B, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+				0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+				0x00, 0x00, 0x00, 0x00, 0x00, 0x00));
+
+	define_test_server("/eatt/nfy-burst", test_server, ts_small_db,
+			&test_sched_1,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(),
+			raw_pdu(0x1b, 0x03, 0x00, 0x01),
+			wait_pdu(),
+			raw_pdu(0x1b, 0x03, 0x00, 0x02),
+			wait_pdu(),
+			raw_pdu(0x1b, 0x03, 0x00, 0x03),
+			wait_pdu(),
+			raw_pdu(0x1b, 0x03, 0x00, 0x04),
+			wait_pdu(),
+			raw_pdu(0x0b, 0x01),
+			wait_pdu(),
+			raw_pdu(0x1b, 0x03, 0x00, 0x05),
+			wait_pdu(),
+			raw_pdu(0x1b, 0x03, 0x00, 0x06),
+			wait_pdu(),
+			raw_pdu(0x0b, 0x02),
+			wait_pdu(),
+			raw_pdu(0x0a, 0x03, 0x00));
+
+	tester_add("/eatt/fits", NULL, NULL, test_sched_fits, NULL);
+
 	define_test_server("/TP/GAI/SR/BV-01-C", test_server, ts_small_db,
 			&test_indication_server_1,
 			raw_pdu(0x03, 0x00, 0x02),
@@ -4473,6 +5208,39 @@ int main(int argc, char *argv[])
 			raw_pdu(0x18, 0x01),
 			raw_pdu(0x01, 0x18, 0x25, 0x00, 0x06));
 
+	define_test_server("/robustness/cached-discovery",
+			test_server, ts_small_db, NULL,
+			raw_pdu(0x03, 0x00, 0x02),
+			PRIMARY_DISC_SMALL_DB,
+			PRIMARY_DISC_SMALL_DB,
+			raw_pdu(0x10, 0x20, 0x00, 0x30, 0x00, 0x00, 0x28),
+			raw_pdu(0x01, 0x10, 0x20, 0x00, 0x0a),
+			raw_pdu(0x10, 0x20, 0x00, 0x30, 0x00, 0x00, 0x28),
+			raw_pdu(0x01, 0x10, 0x20, 0x00, 0x0a));
+
+	define_test_server("/robustness/cached-discovery/remove",
+			test_server, make_test_spec_small_db(),
+			&test_cache_remove,
+			raw_pdu(0x03, 0x00, 0x02),
+			PRIMARY_DISC_SMALL_DB,
+			raw_pdu(),
+			raw_pdu(0x10, 0x01, 0x00, 0xff, 0xff, 0x00, 0x28),
+			raw_pdu(0x11, 0x06, 0x10, 0xf0, 0x18, 0xf0, 0x00,
+									0x18));
+
+	define_test_server("/robustness/cached-discovery/add",
+			test_server, make_test_spec_small_db(),
+			&test_cache_add,
+			raw_pdu(0x03, 0x00, 0x02),
+			raw_pdu(0x04, 0x20, 0x00, 0x2f, 0x00),
+			raw_pdu(0x01, 0x04, 0x20, 0x00, 0x0a),
+			raw_pdu(),
+			raw_pdu(0x04, 0x20, 0x00, 0x2f, 0x00),
+			raw_pdu(0x05, 0x01, 0x20, 0x00, 0x00, 0x28));
+
+	tester_add_full("/robustness/cached-discovery/mtu", NULL, NULL, NULL,
+					test_cache_mtu, NULL, NULL, 2, NULL, NULL);
+
 	define_test_server("/robustness/unkown-request",
 			test_server, service_db_1, NULL,
 			raw_pdu(0x03, 0x00, 0x02),
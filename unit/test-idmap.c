@@ -0,0 +1,118 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "src/shared/util.h"
+#include "src/shared/idmap.h"
+#include "src/shared/tester.h"
+
+static void test_basic(const void *data)
+{
+	struct idmap *map;
+	unsigned int i;
+
+	map = idmap_new();
+	g_assert(map != NULL);
+
+	g_assert(!idmap_insert(map, 0, UINT_TO_PTR(1)));
+
+	for (i = 1; i <= 1024; i++)
+		g_assert(idmap_insert(map, i, UINT_TO_PTR(i)));
+
+	g_assert(idmap_count(map) == 1024);
+	g_assert(!idmap_insert(map, 512, UINT_TO_PTR(512)));
+
+	for (i = 1; i <= 1024; i++)
+		g_assert(PTR_TO_UINT(idmap_find(map, i)) == i);
+
+	g_assert(idmap_find(map, 1025) == NULL);
+
+	for (i = 1; i <= 1024; i += 2)
+		g_assert(PTR_TO_UINT(idmap_remove(map, i)) == i);
+
+	g_assert(idmap_count(map) == 512);
+	g_assert(idmap_remove(map, 1) == NULL);
+
+	for (i = 1; i <= 1024; i++) {
+		void *ptr = idmap_find(map, i);
+
+		if (i % 2)
+			g_assert(ptr == NULL);
+		else
+			g_assert(PTR_TO_UINT(ptr) == i);
+	}
+
+	idmap_free(map);
+	tester_test_passed();
+}
+
+/*
+ * IDs come and go the way requests do, with a sliding window of
+ * outstanding ones, checked against a plain array.
+ */
+static void test_window(const void *data)
+{
+	struct idmap *map;
+	bool present[4096] = { };
+	unsigned int i, id;
+
+	map = idmap_new();
+	srand(1);
+
+	for (i = 0; i < 100000; i++) {
+		id = 1 + rand() % G_N_ELEMENTS(present);
+
+		if (present[id - 1]) {
+			g_assert(PTR_TO_UINT(idmap_remove(map, id)) == id);
+			present[id - 1] = false;
+		} else {
+			g_assert(idmap_insert(map, id, UINT_TO_PTR(id)));
+			present[id - 1] = true;
+		}
+	}
+
+	for (id = 1; id <= G_N_ELEMENTS(present); id++) {
+		if (present[id - 1])
+			g_assert(PTR_TO_UINT(idmap_find(map, id)) == id);
+		else
+			g_assert(idmap_find(map, id) == NULL);
+	}
+
+	idmap_free(map);
+	tester_test_passed();
+}
+
+int main(int argc, char *argv[])
+{
+	tester_init(&argc, &argv);
+
+	tester_add("/idmap/basic", NULL, NULL, test_basic, NULL);
+	tester_add("/idmap/window", NULL, NULL, test_window, NULL);
+
+	return tester_run();
+}
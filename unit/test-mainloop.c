@@ -0,0 +1,322 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+
+#include "src/shared/util.h"
+#include "src/shared/mainloop.h"
+
+/*
+ * The tester runs on the GLib main loop, so these tests drive the epoll
+ * based one from src/shared/mainloop.c directly, one mainloop_run() each.
+ */
+
+/* How late a timeout may fire before it counts as a failure */
+#define LATE_MAX	20
+
+#define MAX_TIMEOUTS	16
+
+struct timeout {
+	int id;
+	unsigned int msec;
+	uint64_t added;
+	uint64_t fired;
+	unsigned int count;
+	bool destroyed;
+};
+
+static struct timeout timeouts[MAX_TIMEOUTS];
+static unsigned int fired_order[MAX_TIMEOUTS];
+static unsigned int fired_count;
+static bool failed;
+
+#define check(cond) do {						\
+	if (!(cond)) {							\
+		fprintf(stderr, "%s:%d: check failed: %s\n",		\
+					__FILE__, __LINE__, #cond);	\
+		failed = true;						\
+	}								\
+} while (0)
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void timeout_cb(int id, void *user_data)
+{
+	struct timeout *t = user_data;
+
+	t->fired = now_ms();
+	t->count++;
+
+	if (fired_count < MAX_TIMEOUTS)
+		fired_order[fired_count++] = t - timeouts;
+}
+
+static void timeout_destroy(void *user_data)
+{
+	struct timeout *t = user_data;
+
+	t->destroyed = true;
+}
+
+static int add_timeout(unsigned int index, unsigned int msec,
+					mainloop_timeout_func callback)
+{
+	struct timeout *t = &timeouts[index];
+
+	t->msec = msec;
+	t->added = now_ms();
+	t->id = mainloop_add_timeout(msec, callback, t, timeout_destroy);
+	check(t->id > 0);
+
+	return t->id;
+}
+
+/* Not early, and not later than LATE_MAX */
+static void check_on_time(unsigned int index)
+{
+	struct timeout *t = &timeouts[index];
+
+	check(t->count == 1);
+	check(t->fired >= t->added + t->msec);
+	check(t->fired <= t->added + t->msec + LATE_MAX);
+}
+
+static void quit_cb(int id, void *user_data)
+{
+	mainloop_quit();
+}
+
+static void test_order(void)
+{
+	static const unsigned int delays[] = {
+		200, 1, 64, 63, 5, 65, 130, 2, 128, 129
+	};
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(delays); i++)
+		add_timeout(i, delays[i], timeout_cb);
+
+	mainloop_add_timeout(300, quit_cb, NULL, NULL);
+	mainloop_run();
+
+	check(fired_count == ARRAY_SIZE(delays));
+
+	for (i = 0; i < ARRAY_SIZE(delays); i++) {
+		check_on_time(i);
+		check(timeouts[i].destroyed);
+	}
+
+	/* Ties within the millisecond the timeouts were added at may swap */
+	for (i = 1; i < fired_count; i++) {
+		struct timeout *prev = &timeouts[fired_order[i - 1]];
+		struct timeout *t = &timeouts[fired_order[i]];
+
+		check(prev->added + prev->msec <= t->added + t->msec + 1);
+	}
+}
+
+/* Width of a level 1 slot of the timer wheel in src/shared/mainloop.c */
+#define WHEEL_SLOT	64
+
+static void late_add_cb(int id, void *user_data)
+{
+	timeout_cb(id, user_data);
+
+	add_timeout(2, WHEEL_SLOT - 1, timeout_cb);
+}
+
+static void test_cascade(void)
+{
+	uint64_t now = now_ms();
+	uint64_t boundary;
+
+	/*
+	 * The wheel cascades level 1 at multiples of WHEEL_SLOT ms. Have
+	 * timeout 0 wait in level 1 for a cascade at boundary while a shorter
+	 * one added just before it sits in level 0 and expires after it.
+	 */
+	boundary = (now + 1000) / WHEEL_SLOT * WHEEL_SLOT + WHEEL_SLOT;
+
+	add_timeout(0, boundary + 20 - now, timeout_cb);
+	add_timeout(1, boundary - 10 - now, late_add_cb);
+
+	mainloop_add_timeout(1200, quit_cb, NULL, NULL);
+	mainloop_run();
+
+	check_on_time(0);
+	check_on_time(1);
+	check_on_time(2);
+	check(fired_order[0] == 1);
+	check(fired_order[1] == 0);
+	check(fired_order[2] == 2);
+}
+
+static unsigned int rearm_count;
+
+static void rearm_cb(int id, void *user_data)
+{
+	struct timeout *t = user_data;
+
+	timeout_cb(id, user_data);
+
+	if (++rearm_count < 3) {
+		t->added = now_ms();
+		t->count = 0;
+		check(mainloop_modify_timeout(id, t->msec) == 0);
+	}
+}
+
+static void shorten_cb(int id, void *user_data)
+{
+	struct timeout *t = &timeouts[0];
+
+	timeout_cb(id, user_data);
+
+	/* Move the other one from a higher level to a nearer expiry */
+	t->msec = 30;
+	t->added = now_ms();
+	check(mainloop_modify_timeout(t->id, t->msec) == 0);
+}
+
+static void test_rearm(void)
+{
+	rearm_count = 0;
+
+	add_timeout(0, 5000, timeout_cb);
+	add_timeout(1, 100, shorten_cb);
+	add_timeout(2, 70, rearm_cb);
+
+	mainloop_add_timeout(300, quit_cb, NULL, NULL);
+	mainloop_run();
+
+	check_on_time(0);
+	check_on_time(1);
+
+	/* Fired three times, on time counting from its last re-arm */
+	check(rearm_count == 3);
+	check_on_time(2);
+	check(fired_count == 2 + 3);
+}
+
+static void test_reuse(void)
+{
+	int id;
+
+	id = add_timeout(0, 20, timeout_cb);
+	check(mainloop_remove_timeout(id) == 0);
+	check(timeouts[0].destroyed);
+	check(mainloop_remove_timeout(id) < 0);
+	check(mainloop_modify_timeout(id, 10) < 0);
+
+	/* The freed id is handed out again */
+	check(add_timeout(1, 30, timeout_cb) == id);
+	add_timeout(2, 10, timeout_cb);
+
+	mainloop_add_timeout(100, quit_cb, NULL, NULL);
+	mainloop_run();
+
+	check(timeouts[0].count == 0);
+	check_on_time(1);
+	check_on_time(2);
+}
+
+static void beyond_cb(int id, void *user_data)
+{
+	struct timeout *t = &timeouts[0];
+
+	timeout_cb(id, user_data);
+
+	/* Still parked, bring it back within the wheel */
+	check(t->count == 0);
+	t->msec = 20;
+	t->added = now_ms();
+	check(mainloop_modify_timeout(t->id, t->msec) == 0);
+}
+
+static void test_beyond(void)
+{
+	/* Well past the 2^30 ms covered by the wheel */
+	add_timeout(0, UINT_MAX, timeout_cb);
+	add_timeout(1, 50, beyond_cb);
+	add_timeout(2, 2000, timeout_cb);
+
+	mainloop_add_timeout(150, quit_cb, NULL, NULL);
+	mainloop_run();
+
+	check_on_time(0);
+	check_on_time(1);
+	check(timeouts[2].count == 0);
+	check(timeouts[2].destroyed);
+}
+
+struct test {
+	const char *name;
+	void (*func)(void);
+};
+
+static const struct test tests[] = {
+	{ "/mainloop/timeout/order", test_order },
+	{ "/mainloop/timeout/cascade", test_cascade },
+	{ "/mainloop/timeout/rearm", test_rearm },
+	{ "/mainloop/timeout/reuse", test_reuse },
+	{ "/mainloop/timeout/beyond", test_beyond },
+};
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, passed = 0;
+
+	for (i = 0; i < ARRAY_SIZE(tests); i++) {
+		memset(timeouts, 0, sizeof(timeouts));
+		fired_count = 0;
+		failed = false;
+
+		mainloop_init();
+		tests[i].func();
+
+		printf("%-40s %s\n", tests[i].name,
+					failed ? "Failed" : "Passed");
+		if (!failed)
+			passed++;
+	}
+
+	printf("\nTotal: %u, Passed: %u, Failed: %u\n", i, passed,
+								i - passed);
+
+	return passed == i ? EXIT_SUCCESS : EXIT_FAILURE;
+}
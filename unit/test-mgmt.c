@@ -170,10 +170,8 @@ static struct context *create_context(void)
 	return context;
 }
 
-static void execute_context(struct context *context)
+static void destroy_context(struct context *context)
 {
-	g_main_loop_run(context->main_loop);
-
 	g_list_free_full(context->handler_list, g_free);
 
 	g_source_remove(context->server_source);
@@ -185,6 +183,13 @@ static void execute_context(struct context *context)
 	g_free(context);
 }
 
+static void execute_context(struct context *context)
+{
+	g_main_loop_run(context->main_loop);
+
+	destroy_context(context);
+}
+
 static void add_action(struct context *context,
 				const void *cmd_data, uint16_t cmd_size,
 				const void *rsp_data, uint16_t rsp_size,
@@ -429,6 +434,172 @@ static void test_destroy(gconstpointer data)
 	execute_context(context);
 }
 
+#define BATCH_EVENTS 20
+
+static const unsigned char event_device_found[] =
+				{ 0x12, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00 };
+
+static const struct command_test_data event_test_2 = {
+	.opcode = MGMT_EV_DEVICE_FOUND,
+	.index = 0x0000,
+	.cmd_data = event_device_found,
+	.cmd_size = sizeof(event_device_found),
+};
+
+struct batch_data {
+	struct context *context;
+	unsigned int count;
+};
+
+static void batch_event_cb(uint16_t index, uint16_t length,
+					const void *param, void *user_data)
+{
+	struct batch_data *batch = user_data;
+	const uint8_t *seq = param;
+
+	/* Events are dispatched in the order they were queued */
+	g_assert_cmpint(length, ==, 1);
+	g_assert_cmpint(seq[0], ==, batch->count);
+
+	if (++batch->count == BATCH_EVENTS)
+		context_quit(batch->context);
+}
+
+static void test_event_batch(gconstpointer data)
+{
+	const struct command_test_data *test = data;
+	struct context *context = create_context();
+	struct batch_data batch = { .context = context };
+	struct mgmt_read_stats stats;
+	unsigned char buf[sizeof(event_device_found)];
+	int i;
+
+	mgmt_register(context->mgmt_client, test->opcode, test->index,
+					batch_event_cb, &batch, NULL);
+
+	memcpy(buf, test->cmd_data, test->cmd_size);
+
+	for (i = 0; i < BATCH_EVENTS; i++) {
+		buf[test->cmd_size - 1] = i;
+		g_assert_cmpint(write(context->fd, buf, test->cmd_size), ==,
+								test->cmd_size);
+	}
+
+	g_main_loop_run(context->main_loop);
+
+	/* All queued events are read in as few wakeups as the budget allows */
+	g_assert(mgmt_get_read_stats(context->mgmt_client, &stats));
+	g_assert_cmpint(stats.events, ==, BATCH_EVENTS);
+	g_assert_cmpint(stats.wakeups, ==, 2);
+	g_assert_cmpint(stats.max_events, ==, 16);
+
+	destroy_context(context);
+}
+
+enum cancel_queue {
+	CANCEL_PENDING,
+	CANCEL_REPLY,
+	CANCEL_QUEUED,
+};
+
+struct cancel_request {
+	uint16_t index;
+	enum cancel_queue queue;
+	unsigned int id;
+	bool destroyed;
+};
+
+static void cancel_destroy(void *user_data)
+{
+	struct cancel_request *request = user_data;
+
+	g_assert(!request->destroyed);
+	request->destroyed = true;
+}
+
+/*
+ * Without running the main loop mgmt_send_nowait leaves a request in
+ * pending_list, mgmt_reply in reply_queue and mgmt_send in request_queue.
+ */
+static void cancel_send(struct context *context,
+					struct cancel_request *request)
+{
+	struct mgmt *mgmt = context->mgmt_client;
+
+	switch (request->queue) {
+	case CANCEL_PENDING:
+		request->id = mgmt_send_nowait(mgmt, MGMT_OP_READ_INFO,
+					request->index, 0, NULL, NULL,
+					request, cancel_destroy);
+		break;
+	case CANCEL_REPLY:
+		request->id = mgmt_reply(mgmt, MGMT_OP_READ_INFO,
+					request->index, 0, NULL, NULL,
+					request, cancel_destroy);
+		break;
+	case CANCEL_QUEUED:
+		request->id = mgmt_send(mgmt, MGMT_OP_READ_INFO,
+					request->index, 0, NULL, NULL,
+					request, cancel_destroy);
+		break;
+	}
+
+	g_assert(request->id);
+}
+
+static void test_cancel(gconstpointer data)
+{
+	struct context *context = create_context();
+	struct cancel_request requests[] = {
+		{ 0x0000, CANCEL_PENDING },
+		{ MGMT_INDEX_NONE, CANCEL_PENDING },
+		{ 0x0000, CANCEL_REPLY },
+		{ MGMT_INDEX_NONE, CANCEL_REPLY },
+		{ 0x0000, CANCEL_QUEUED },
+		{ 0x0001, CANCEL_QUEUED },
+		{ MGMT_INDEX_NONE, CANCEL_QUEUED },
+		{ 0x0001, CANCEL_REPLY },
+	};
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(requests); i++)
+		cancel_send(context, &requests[i]);
+
+	/* MGMT_INDEX_NONE only matches the global requests in every queue */
+	g_assert(mgmt_cancel_index(context->mgmt_client, MGMT_INDEX_NONE));
+
+	for (i = 0; i < G_N_ELEMENTS(requests); i++)
+		g_assert(requests[i].destroyed ==
+				(requests[i].index == MGMT_INDEX_NONE));
+
+	g_assert(mgmt_cancel_index(context->mgmt_client, 0x0000));
+
+	for (i = 0; i < G_N_ELEMENTS(requests); i++)
+		g_assert(requests[i].destroyed ==
+				(requests[i].index != 0x0001));
+
+	/* Requests are cancelled by ID from whichever queue they are in */
+	g_assert(mgmt_cancel(context->mgmt_client, requests[5].id));
+	g_assert(requests[5].destroyed);
+	g_assert(!mgmt_cancel(context->mgmt_client, requests[5].id));
+	g_assert(!mgmt_cancel(context->mgmt_client, requests[0].id));
+	g_assert(!requests[7].destroyed);
+	g_assert(mgmt_cancel(context->mgmt_client, requests[7].id));
+	g_assert(requests[7].destroyed);
+
+	for (i = 0; i < G_N_ELEMENTS(requests); i++) {
+		requests[i].destroyed = false;
+		cancel_send(context, &requests[i]);
+	}
+
+	g_assert(mgmt_cancel_all(context->mgmt_client));
+
+	for (i = 0; i < G_N_ELEMENTS(requests); i++)
+		g_assert(requests[i].destroyed);
+
+	destroy_context(context);
+}
+
 int main(int argc, char *argv[])
 {
 	g_test_init(&argc, &argv, NULL);
@@ -443,6 +614,7 @@ int main(int argc, char *argv[])
 
 	g_test_add_data_func("/mgmt/event/1", &event_test_1, test_event);
 	g_test_add_data_func("/mgmt/event/2", &event_test_1, test_event2);
+	g_test_add_data_func("/mgmt/event/3", &event_test_2, test_event_batch);
 
 	g_test_add_data_func("/mgmt/unregister/1", &event_test_1,
 							test_unregister_all);
@@ -451,5 +623,7 @@ int main(int argc, char *argv[])
 
 	g_test_add_data_func("/mgmt/destroy/1", &event_test_1, test_destroy);
 
+	g_test_add_data_func("/mgmt/cancel/1", NULL, test_cancel);
+
 	return g_test_run();
 }
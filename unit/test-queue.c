@@ -25,6 +25,9 @@
 #include <config.h>
 #endif
 
+#include <stdint.h>
+#include <time.h>
+
 #include <glib.h>
 
 #include "src/shared/util.h"
@@ -259,6 +262,251 @@ static void test_remove_all(const void *data)
 	tester_test_passed();
 }
 
+struct foreach_recycle {
+	struct queue *queue;
+	unsigned int visited;
+};
+
+static void foreach_recycle(void *data, void *user_data)
+{
+	struct foreach_recycle *recycle = user_data;
+	unsigned int value = PTR_TO_UINT(data);
+
+	g_assert(value == ++recycle->visited);
+
+	/* Pushing reuses spare entries while the iteration is still running */
+	g_assert(queue_remove(recycle->queue, data));
+	if (value <= 8)
+		g_assert(queue_push_tail(recycle->queue, UINT_TO_PTR(value + 8)));
+}
+
+static void test_foreach_recycle(const void *data)
+{
+	struct foreach_recycle recycle;
+	unsigned int i;
+
+	recycle.queue = queue_new();
+	recycle.visited = 0;
+	g_assert(recycle.queue != NULL);
+
+	/* Leave spare entries around for the pushes to reuse */
+	for (i = 0; i < 32; i++)
+		g_assert(queue_push_tail(recycle.queue, UINT_TO_PTR(i)));
+
+	for (i = 0; i < 32; i++)
+		g_assert(PTR_TO_UINT(queue_pop_head(recycle.queue)) == i);
+
+	for (i = 1; i <= 8; i++)
+		g_assert(queue_push_tail(recycle.queue, UINT_TO_PTR(i)));
+
+	queue_foreach(recycle.queue, foreach_recycle, &recycle);
+	g_assert(recycle.visited == 16);
+	g_assert(queue_isempty(recycle.queue));
+
+	/* Recycling resumes once the iteration is over */
+	for (i = 0; i < 64; i++) {
+		g_assert(queue_push_tail(recycle.queue, UINT_TO_PTR(i)));
+		g_assert(queue_push_head(recycle.queue, UINT_TO_PTR(i + 1)));
+		g_assert(PTR_TO_UINT(queue_pop_head(recycle.queue)) == i + 1);
+	}
+
+	for (i = 0; i < 64; i++)
+		g_assert(PTR_TO_UINT(queue_pop_head(recycle.queue)) == i);
+
+	g_assert(queue_isempty(recycle.queue));
+
+	queue_destroy(recycle.queue, NULL);
+	tester_test_passed();
+}
+
+struct list_item {
+	unsigned int value;
+	struct queue_link link;
+};
+
+static unsigned int list_item_value(struct queue_link *link)
+{
+	return queue_link_data(link, struct list_item, link)->value;
+}
+
+static void test_list_basic(const void *data)
+{
+	struct list_item items[4] = { { 1 }, { 2 }, { 3 }, { 4 } };
+	struct queue_list list;
+	struct queue_link *link;
+
+	queue_list_init(&list);
+	g_assert(queue_list_isempty(&list));
+	g_assert(queue_list_pop_head(&list) == NULL);
+
+	queue_list_push_tail(&list, &items[1].link);
+	queue_list_push_tail(&list, &items[2].link);
+	queue_list_push_head(&list, &items[0].link);
+	queue_list_push_tail(&list, &items[3].link);
+	g_assert(queue_list_length(&list) == 4);
+
+	/* Unlinking from the middle needs no search */
+	queue_list_remove(&list, &items[2].link);
+	g_assert(!queue_link_is_linked(&items[2].link));
+	g_assert(queue_list_length(&list) == 3);
+
+	/* Removing twice is harmless */
+	queue_list_remove(&list, &items[2].link);
+	g_assert(queue_list_length(&list) == 3);
+
+	link = queue_list_peek_head(&list);
+	g_assert(list_item_value(link) == 1);
+	link = queue_list_next(&list, link);
+	g_assert(list_item_value(link) == 2);
+	link = queue_list_next(&list, link);
+	g_assert(list_item_value(link) == 4);
+	g_assert(queue_list_next(&list, link) == NULL);
+
+	g_assert(list_item_value(queue_list_pop_head(&list)) == 1);
+	g_assert(list_item_value(queue_list_pop_head(&list)) == 2);
+	g_assert(list_item_value(queue_list_pop_head(&list)) == 4);
+	g_assert(queue_list_isempty(&list));
+	g_assert(!queue_link_is_linked(&items[3].link));
+
+	tester_test_passed();
+}
+
+/*
+ * Microbenchmarks, they only fail if the containers misbehave. The numbers
+ * are printed for comparison between the two variants and across changes.
+ */
+#define BENCH_ROUNDS	10000
+#define BENCH_DEPTH	32
+#define BENCH_LENGTH	512
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void bench_report(const char *what, unsigned int ops, uint64_t start)
+{
+	uint64_t elapsed = bench_now() - start;
+
+	tester_print("%s: %u ops, %llu.%02llu ns/op", what, ops,
+				(unsigned long long) (elapsed / ops),
+				(unsigned long long) (elapsed * 100 / ops % 100));
+}
+
+static void test_bench_push_pop(const void *data)
+{
+	struct queue *queue;
+	unsigned int round, i;
+	uint64_t start;
+
+	queue = queue_new();
+
+	start = bench_now();
+
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		for (i = 0; i < BENCH_DEPTH; i++)
+			queue_push_tail(queue, UINT_TO_PTR(i + 1));
+
+		for (i = 0; i < BENCH_DEPTH; i++)
+			g_assert(PTR_TO_UINT(queue_pop_head(queue)) == i + 1);
+	}
+
+	bench_report("queue push/pop", BENCH_ROUNDS * BENCH_DEPTH, start);
+
+	queue_destroy(queue, NULL);
+	tester_test_passed();
+}
+
+static void test_bench_list_push_pop(const void *data)
+{
+	struct list_item items[BENCH_DEPTH];
+	struct queue_list list;
+	unsigned int round, i;
+	uint64_t start;
+
+	memset(items, 0, sizeof(items));
+	queue_list_init(&list);
+
+	start = bench_now();
+
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		for (i = 0; i < BENCH_DEPTH; i++) {
+			items[i].value = i + 1;
+			queue_list_push_tail(&list, &items[i].link);
+		}
+
+		for (i = 0; i < BENCH_DEPTH; i++)
+			g_assert(list_item_value(queue_list_pop_head(&list)) ==
+									i + 1);
+	}
+
+	bench_report("list push/pop", BENCH_ROUNDS * BENCH_DEPTH, start);
+
+	tester_test_passed();
+}
+
+/* Cancelling from the middle of a long queue, every other element */
+static void test_bench_remove(const void *data)
+{
+	struct queue *queue;
+	unsigned int round, i;
+	uint64_t start;
+
+	queue = queue_new();
+
+	start = bench_now();
+
+	for (round = 0; round < BENCH_ROUNDS / 100; round++) {
+		for (i = 0; i < BENCH_LENGTH; i++)
+			queue_push_tail(queue, UINT_TO_PTR(i + 1));
+
+		for (i = 0; i < BENCH_LENGTH; i += 2)
+			g_assert(queue_remove(queue, UINT_TO_PTR(i + 1)));
+
+		queue_remove_all(queue, NULL, NULL, NULL);
+	}
+
+	bench_report("queue remove", BENCH_ROUNDS / 100 * BENCH_LENGTH / 2,
+									start);
+
+	queue_destroy(queue, NULL);
+	tester_test_passed();
+}
+
+static void test_bench_list_remove(const void *data)
+{
+	struct list_item *items;
+	struct queue_list list;
+	unsigned int round, i;
+	uint64_t start;
+
+	items = new0(struct list_item, BENCH_LENGTH);
+	queue_list_init(&list);
+
+	start = bench_now();
+
+	for (round = 0; round < BENCH_ROUNDS / 100; round++) {
+		for (i = 0; i < BENCH_LENGTH; i++)
+			queue_list_push_tail(&list, &items[i].link);
+
+		for (i = 0; i < BENCH_LENGTH; i += 2)
+			queue_list_remove(&list, &items[i].link);
+
+		while (queue_list_pop_head(&list))
+			;
+	}
+
+	bench_report("list remove", BENCH_ROUNDS / 100 * BENCH_LENGTH / 2,
+									start);
+
+	free(items);
+	tester_test_passed();
+}
+
 int main(int argc, char *argv[])
 {
 	tester_init(&argc, &argv);
@@ -276,6 +524,16 @@ int main(int argc, char *argv[])
 						test_destroy_remove, NULL);
 	tester_add("/queue/push_after",  NULL, NULL, test_push_after, NULL);
 	tester_add("/queue/remove_all",  NULL, NULL, test_remove_all, NULL);
+	tester_add("/queue/foreach_recycle", NULL, NULL,
+					test_foreach_recycle, NULL);
+	tester_add("/queue/list/basic", NULL, NULL, test_list_basic, NULL);
+	tester_add("/queue/bench/push_pop", NULL, NULL,
+						test_bench_push_pop, NULL);
+	tester_add("/queue/bench/list_push_pop", NULL, NULL,
+					test_bench_list_push_pop, NULL);
+	tester_add("/queue/bench/remove", NULL, NULL, test_bench_remove, NULL);
+	tester_add("/queue/bench/list_remove", NULL, NULL,
+						test_bench_list_remove, NULL);
 
 	return tester_run();
 }
@@ -0,0 +1,699 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "src/shared/tester.h"
+
+#include "profiles/input/hidp_defs.h"
+#include "profiles/input/relay.h"
+#include "profiles/input/relay_shm.h"
+#include "profiles/input/relay_thread.h"
+
+#define FILLER		0xff
+#define RECORD_SIZE	10
+
+struct test_pair {
+	int tx;
+	int rx;
+	unsigned int filler;
+};
+
+static struct relay_batch batch;
+
+static void pair_open(struct test_pair *pair)
+{
+	int sv[2];
+
+	g_assert(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0,
+								sv) == 0);
+
+	pair->tx = sv[0];
+	pair->rx = sv[1];
+	pair->filler = 0;
+}
+
+static void pair_close(struct test_pair *pair)
+{
+	close(pair->tx);
+	close(pair->rx);
+}
+
+/* Fills the socket so that every report sent afterwards gets queued */
+static void pair_fill(struct test_pair *pair)
+{
+	uint8_t filler = FILLER;
+
+	while (send(pair->tx, &filler, 1, MSG_DONTWAIT) == 1)
+		pair->filler++;
+
+	g_assert(pair->filler > 0);
+}
+
+static void pair_unfill(struct test_pair *pair)
+{
+	uint8_t buf[RELAY_MTU];
+
+	for (; pair->filler; pair->filler--) {
+		g_assert(recv(pair->rx, buf, sizeof(buf), 0) == 1);
+		g_assert(buf[0] == FILLER);
+	}
+}
+
+static ssize_t pair_recv(struct test_pair *pair, uint8_t *buf, size_t size)
+{
+	return recv(pair->rx, buf, size, MSG_DONTWAIT);
+}
+
+/* Waits for what another thread sends to fd */
+static ssize_t wait_recv(int fd, uint8_t *buf, size_t size)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	if (poll(&pfd, 1, 1000) != 1)
+		return -ETIMEDOUT;
+
+	return recv(fd, buf, size, MSG_DONTWAIT);
+}
+
+static void batch_reset(void)
+{
+	batch.count = 0;
+	batch.rx_time = relay_now();
+}
+
+static void batch_add(const uint8_t *data, size_t size)
+{
+	g_assert(batch.count < RELAY_BATCH_MAX);
+
+	memcpy(batch.buf[batch.count], data, size);
+	batch.iov[batch.count].iov_base = batch.buf[batch.count];
+	batch.iov[batch.count].iov_len = size;
+	batch.count++;
+}
+
+static void report_fill(uint8_t *report, size_t size, uint8_t seq)
+{
+	report[0] = HIDP_TRANS_DATA | HIDP_DATA_RTYPE_INPUT;
+	memset(report + 1, seq, size - 1);
+}
+
+static void check_report(struct test_pair *pair, size_t size, uint8_t seq)
+{
+	uint8_t buf[RELAY_MTU], expected[RELAY_MTU];
+
+	report_fill(expected, size, seq);
+
+	g_assert(pair_recv(pair, buf, sizeof(buf)) == (ssize_t) size);
+	g_assert(memcmp(buf, expected, size) == 0);
+}
+
+static void test_drop_oldest(const void *data)
+{
+	struct relay_queue *queue;
+	struct test_pair pair;
+	uint8_t report[6];
+	uint8_t buf[RELAY_MTU];
+	unsigned int i;
+
+	/* 64 bytes hold four records of a 6 byte report */
+	queue = relay_queue_new(64, RELAY_QUEUE_DROP_OLDEST);
+	g_assert(queue != NULL);
+
+	for (i = 0; i < 6; i++) {
+		report_fill(report, sizeof(report), i);
+		g_assert(relay_queue_push(queue, report, sizeof(report), 0) ==
+								(i < 4 ? 0 : 1));
+	}
+
+	g_assert(relay_queue_pending(queue) == 4);
+	g_assert(!relay_queue_blocked(queue));
+
+	pair_open(&pair);
+
+	g_assert(relay_queue_flush(queue, pair.tx, NULL) == 4);
+	g_assert(relay_queue_pending(queue) == 0);
+
+	for (i = 2; i < 6; i++)
+		check_report(&pair, sizeof(report), i);
+
+	g_assert(pair_recv(&pair, buf, sizeof(buf)) < 0);
+
+	/* A report larger than the whole queue is refused */
+	g_assert(relay_queue_push(queue, buf, 64, 0) == -EMSGSIZE);
+
+	pair_close(&pair);
+	relay_queue_free(queue);
+	tester_test_passed();
+}
+
+static void recv_report(struct test_pair *pair, const uint8_t *report,
+								size_t size)
+{
+	uint8_t buf[RELAY_MTU];
+
+	g_assert(pair_recv(pair, buf, sizeof(buf)) == (ssize_t) size);
+	g_assert(memcmp(buf, report, size) == 0);
+}
+
+static void test_coalesce(const void *data)
+{
+	static const uint8_t down[] = { 0xa1, 0x01, 0x00, 0x00, 0x04, 0x00,
+						0x00, 0x00, 0x00, 0x00 };
+	static const uint8_t up[] = { 0xa1, 0x01, 0x00, 0x00, 0x00, 0x00,
+						0x00, 0x00, 0x00, 0x00 };
+	static const uint8_t other1[] = { 0xa1, 0x03, 0x10, 0x00, 0x00, 0x00,
+									0x00 };
+	static const uint8_t other2[] = { 0xa1, 0x03, 0x20, 0x00, 0x00, 0x00,
+									0x00 };
+	struct relay_queue *queue;
+	struct test_pair pair;
+
+	queue = relay_queue_new(64, RELAY_QUEUE_COALESCE);
+	g_assert(queue != NULL);
+
+	pair_open(&pair);
+
+	/* With room left nothing is coalesced, the key press survives */
+	g_assert(relay_queue_push(queue, down, sizeof(down), 0) == 0);
+	g_assert(relay_queue_push(queue, up, sizeof(up), 0) == 0);
+	g_assert(relay_queue_push(queue, other1, sizeof(other1), 0) == 0);
+	g_assert(relay_queue_pending(queue) == 3);
+
+	/* Full, the latest state takes the place of the queued one */
+	g_assert(relay_queue_push(queue, other2, sizeof(other2), 0) == 0);
+	g_assert(relay_queue_pending(queue) == 3);
+
+	/* Repeating the latest queued key state is dropped */
+	g_assert(relay_queue_push(queue, up, sizeof(up), 0) == 0);
+	g_assert(relay_queue_pending(queue) == 3);
+
+	g_assert(relay_queue_flush(queue, pair.tx, NULL) == 3);
+	recv_report(&pair, down, sizeof(down));
+	recv_report(&pair, up, sizeof(up));
+	recv_report(&pair, other2, sizeof(other2));
+
+	/* A key change is never folded into a queued report */
+	g_assert(relay_queue_push(queue, down, sizeof(down), 0) == 0);
+	g_assert(relay_queue_push(queue, up, sizeof(up), 0) == 0);
+	g_assert(relay_queue_push(queue, other1, sizeof(other1), 0) == 0);
+	g_assert(relay_queue_push(queue, down, sizeof(down), 0) == 1);
+	g_assert(relay_queue_pending(queue) == 3);
+
+	g_assert(relay_queue_flush(queue, pair.tx, NULL) == 3);
+	recv_report(&pair, up, sizeof(up));
+	recv_report(&pair, other1, sizeof(other1));
+	recv_report(&pair, down, sizeof(down));
+
+	pair_close(&pair);
+	relay_queue_free(queue);
+	tester_test_passed();
+}
+
+static void test_block(const void *data)
+{
+	struct relay_stats stats;
+	struct relay_queue *queue;
+	struct test_pair pair;
+	uint8_t report[6];
+	unsigned int i;
+
+	queue = relay_queue_new(64, RELAY_QUEUE_BLOCK);
+	g_assert(queue != NULL);
+	g_assert(!relay_queue_blocked(queue));
+
+	for (i = 0; i < 4; i++) {
+		report_fill(report, sizeof(report), i);
+		g_assert(relay_queue_push(queue, report, sizeof(report), 0) == 0);
+		g_assert(relay_queue_blocked(queue));
+	}
+
+	/* Nothing queued is ever dropped, the new report is refused */
+	g_assert(relay_queue_push(queue, report, sizeof(report), 0) ==
+								-ENOBUFS);
+	g_assert(relay_queue_pending(queue) == 4);
+
+	pair_open(&pair);
+	pair_fill(&pair);
+
+	/* A full socket leaves the queue blocked */
+	memset(&stats, 0, sizeof(stats));
+	batch_reset();
+	report_fill(report, sizeof(report), 4);
+	batch_add(report, sizeof(report));
+	g_assert(relay_queue_send_batch(queue, pair.tx, &batch, &stats,
+								NULL) == 4);
+	g_assert(stats.dropped == 1);
+	g_assert(relay_queue_blocked(queue));
+
+	pair_unfill(&pair);
+
+	g_assert(relay_queue_flush(queue, pair.tx, NULL) == 4);
+	g_assert(!relay_queue_blocked(queue));
+
+	for (i = 0; i < 4; i++)
+		check_report(&pair, sizeof(report), i);
+
+	pair_close(&pair);
+	relay_queue_free(queue);
+	tester_test_passed();
+}
+
+static void test_expire(const void *data)
+{
+	struct relay_queue *queue;
+	struct test_pair pair;
+	uint8_t report[4];
+
+	queue = relay_queue_new(4096, RELAY_QUEUE_DROP_OLDEST);
+	g_assert(queue != NULL);
+
+	report_fill(report, sizeof(report), 0);
+	g_assert(relay_queue_push(queue, report, sizeof(report), 100) == 0);
+	report_fill(report, sizeof(report), 1);
+	g_assert(relay_queue_push(queue, report, sizeof(report), 250) == 0);
+	report_fill(report, sizeof(report), 2);
+	g_assert(relay_queue_push(queue, report, sizeof(report), 2000) == 0);
+
+	/* Without a max age nothing expires */
+	g_assert(relay_queue_expire(queue, UINT64_MAX / 2) == 0);
+
+	relay_queue_set_max_age(queue, 1000);
+
+	/* Reports exactly max age old are still fresh */
+	g_assert(relay_queue_expire(queue, 1100) == 0);
+	g_assert(relay_queue_expire(queue, 1250) == 1);
+	g_assert(relay_queue_pending(queue) == 2);
+	g_assert(relay_queue_expire(queue, 1251) == 1);
+	g_assert(relay_queue_pending(queue) == 1);
+
+	pair_open(&pair);
+
+	g_assert(relay_queue_flush(queue, pair.tx, NULL) == 1);
+	check_report(&pair, sizeof(report), 2);
+
+	pair_close(&pair);
+	relay_queue_free(queue);
+	tester_test_passed();
+}
+
+/* Keeps the queue full so that records wrap around the end of the ring
+ * at varying offsets, then checks every flushed report is intact.
+ */
+static void test_wrap(const void *data)
+{
+	struct relay_queue *queue;
+	struct test_pair pair;
+	uint8_t report[RELAY_MTU];
+	uint8_t seq = 0;
+	unsigned int round;
+
+	queue = relay_queue_new(64, RELAY_QUEUE_DROP_OLDEST);
+	g_assert(queue != NULL);
+
+	pair_open(&pair);
+
+	for (round = 0; round < 200; round++) {
+		size_t size = 2 + round % 11;
+		unsigned int i, count = 0;
+
+		for (i = 0; i < 10; i++) {
+			report_fill(report, size, seq++);
+			count -= relay_queue_push(queue, report, size, 0);
+			count++;
+		}
+
+		tester_debug("round %u: %u reports of %zu bytes", round,
+								count, size);
+
+		g_assert(count == 64 / (RECORD_SIZE + size));
+		g_assert(relay_queue_pending(queue) == count);
+		g_assert(relay_queue_flush(queue, pair.tx, NULL) ==
+								(int) count);
+
+		for (i = 0; i < count; i++)
+			check_report(&pair, size, seq - count + i);
+
+		/* Keep one record queued so that the ring never resets */
+		report_fill(report, 2, seq++);
+		g_assert(relay_queue_push(queue, report, 2, 0) == 0);
+		g_assert(relay_queue_flush(queue, pair.tx, NULL) == 1);
+		check_report(&pair, 2, seq - 1);
+	}
+
+	pair_close(&pair);
+	relay_queue_free(queue);
+	tester_test_passed();
+}
+
+static void set_protocol(struct relay_queue *queue, uint8_t param)
+{
+	uint8_t hdr = HIDP_TRANS_SET_PROTOCOL | param;
+
+	batch_reset();
+	batch_add(&hdr, 1);
+	relay_queue_track_protocol(queue, &batch);
+}
+
+static unsigned int queue_batch(struct relay_queue *queue,
+					struct test_pair *pair,
+					const uint8_t reports[][7], size_t size,
+					unsigned int count,
+					struct relay_stats *stats)
+{
+	unsigned int i;
+
+	relay_queue_reset(queue);
+	memset(stats, 0, sizeof(*stats));
+
+	batch_reset();
+	for (i = 0; i < count; i++)
+		batch_add(reports[i], size);
+
+	return relay_queue_send_batch(queue, pair->tx, &batch, stats, NULL);
+}
+
+static void test_merge(const void *data)
+{
+	static const uint8_t motion[][7] = {
+		{ 0xa1, 0x02, 0x00, 0x01, 0xff, 0x00, 0x00 },
+		{ 0xa1, 0x02, 0x00, 0x02, 0xfe, 0x01, 0x00 },
+		{ 0xa1, 0x02, 0x01, 0x01, 0x01, 0x00, 0x00 },
+	};
+	static const uint8_t overflow[][7] = {
+		{ 0xa1, 0x02, 0x00, 0x64, 0x00, 0x00, 0x00 },
+		{ 0xa1, 0x02, 0x00, 0x64, 0x00, 0x00, 0x00 },
+		{ 0xa1, 0x02, 0x00, 0x9c, 0x00, 0x00, 0x00 },
+		{ 0xa1, 0x02, 0x00, 0xe4, 0x00, 0x00, 0x00 },
+	};
+	static const uint8_t trailing[][7] = {
+		{ 0xa1, 0x02, 0x00, 0x01, 0x01, 0x00, 0x05 },
+		{ 0xa1, 0x02, 0x00, 0x01, 0x01, 0x00, 0x06 },
+		{ 0xa1, 0x02, 0x00, 0x01, 0x01, 0x00, 0x06 },
+	};
+	static const uint8_t keys[][7] = {
+		{ 0xa1, 0x01, 0x00, 0x00, 0x04, 0x00, 0x00 },
+		{ 0xa1, 0x01, 0x00, 0x00, 0x04, 0x00, 0x00 },
+		{ 0xa1, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00 },
+	};
+	uint8_t keyboard[3][HIDP_BOOT_KEYBOARD_SIZE];
+	struct relay_stats stats;
+	struct relay_queue *queue;
+	struct test_pair pair;
+	uint8_t buf[RELAY_MTU];
+	unsigned int i;
+
+	queue = relay_queue_new(4096, RELAY_QUEUE_DROP_OLDEST);
+	g_assert(queue != NULL);
+
+	pair_open(&pair);
+	pair_fill(&pair);
+
+	/* Report protocol: report ID 2 may be any mouse, never merged */
+	relay_queue_set_merge(queue, true);
+	g_assert(!relay_queue_get_boot_protocol(queue));
+	g_assert(queue_batch(queue, &pair, motion, 6, 2, &stats) == 2);
+	g_assert(stats.merged == 0);
+
+	set_protocol(queue, HIDP_PROTO_BOOT);
+	g_assert(relay_queue_get_boot_protocol(queue));
+
+	/* Disabled merging ignores the protocol */
+	relay_queue_set_merge(queue, false);
+	g_assert(queue_batch(queue, &pair, motion, 6, 2, &stats) == 2);
+	relay_queue_set_merge(queue, true);
+
+	/* Same buttons sum X, Y and wheel, a button change is kept apart */
+	g_assert(queue_batch(queue, &pair, motion, 6, 3, &stats) == 2);
+	g_assert(stats.merged == 1);
+
+	pair_unfill(&pair);
+	g_assert(relay_queue_flush(queue, pair.tx, NULL) == 2);
+	g_assert(pair_recv(&pair, buf, sizeof(buf)) == 6);
+	g_assert(buf[HIDP_BOOT_MOUSE_BUTTONS] == 0x00);
+	g_assert(buf[HIDP_BOOT_MOUSE_X] == 0x03);
+	g_assert(buf[HIDP_BOOT_MOUSE_Y] == 0xfd);
+	g_assert(buf[HIDP_BOOT_MOUSE_WHEEL] == 0x01);
+	g_assert(pair_recv(&pair, buf, sizeof(buf)) == 6);
+	g_assert(memcmp(buf, motion[2], 6) == 0);
+	pair_fill(&pair);
+
+	/* Boot reports without a wheel byte merge X and Y only */
+	g_assert(queue_batch(queue, &pair, motion, 5, 2, &stats) == 1);
+
+	/* 100 + 100 overflows int8, -100 + -28 hits the excluded -128 */
+	g_assert(queue_batch(queue, &pair, overflow, 6, 2, &stats) == 2);
+	g_assert(queue_batch(queue, &pair, overflow + 2, 6, 2, &stats) == 2);
+	g_assert(stats.merged == 0);
+
+	/* Bytes after the wheel have to match */
+	g_assert(queue_batch(queue, &pair, trailing, 7, 2, &stats) == 2);
+	g_assert(queue_batch(queue, &pair, trailing + 1, 7, 2, &stats) == 1);
+
+	/* A repeated boot keyboard state is dropped, a key change is not */
+	for (i = 0; i < 3; i++) {
+		memset(keyboard[i], 0, sizeof(keyboard[i]));
+		memcpy(keyboard[i], keys[i], sizeof(keys[i]));
+	}
+
+	relay_queue_reset(queue);
+	batch_reset();
+	for (i = 0; i < 3; i++)
+		batch_add(keyboard[i], sizeof(keyboard[i]));
+	g_assert(relay_queue_send_batch(queue, pair.tx, &batch, &stats,
+								NULL) == 2);
+
+	/* Back in report protocol nothing is merged anymore */
+	set_protocol(queue, HIDP_PROTO_REPORT);
+	g_assert(!relay_queue_get_boot_protocol(queue));
+	g_assert(queue_batch(queue, &pair, motion, 6, 2, &stats) == 2);
+
+	pair_close(&pair);
+	relay_queue_free(queue);
+	tester_test_passed();
+}
+
+static void test_percentile(const void *data)
+{
+	struct relay_latency lat;
+
+	memset(&lat, 0, sizeof(lat));
+	g_assert(relay_latency_percentile(&lat, 50) == 0);
+
+	/* Below RELAY_HIST_SUB every value has its own bucket */
+	lat.count = 100;
+	lat.buckets[1] = 50;
+	lat.buckets[RELAY_HIST_SUB - 1] = 50;
+	lat.max = RELAY_HIST_SUB - 1;
+	g_assert(relay_latency_percentile(&lat, 1) == 1);
+	g_assert(relay_latency_percentile(&lat, 50) == 1);
+	g_assert(relay_latency_percentile(&lat, 51) == RELAY_HIST_SUB - 1);
+	g_assert(relay_latency_percentile(&lat, 100) == RELAY_HIST_SUB - 1);
+
+	/* The first split power of two holds 32 and 33 in one bucket */
+	memset(&lat, 0, sizeof(lat));
+	lat.count = 1;
+	lat.buckets[2 * RELAY_HIST_SUB] = 1;
+	lat.max = 1000;
+	g_assert(relay_latency_percentile(&lat, 50) == 33);
+
+	/* A bucket never reports more than the largest value seen */
+	lat.max = 32;
+	g_assert(relay_latency_percentile(&lat, 50) == 32);
+
+	/* The last bucket ends at UINT32_MAX */
+	memset(&lat, 0, sizeof(lat));
+	lat.count = 1;
+	lat.buckets[RELAY_HIST_BUCKETS - 1] = 1;
+	lat.max = UINT32_MAX;
+	g_assert(relay_latency_percentile(&lat, 99) == UINT32_MAX);
+
+	tester_test_passed();
+}
+
+static void test_thread_shm(const void *data)
+{
+	static const uint8_t report[] = { 0xa2, 0x01, 0x02 };
+	struct relay_queue *queue;
+	struct test_pair src, dst;
+	uint8_t buf[RELAY_MTU];
+	unsigned int id;
+
+	g_assert(relay_thread_start(0, -1));
+
+	queue = relay_queue_new(4096, RELAY_QUEUE_DROP_OLDEST);
+	g_assert(queue != NULL);
+
+	pair_open(&src);
+	pair_open(&dst);
+
+	id = relay_thread_add(src.rx, dst.tx, RELAY_THREAD_REFUSE_SHM, queue,
+							NULL, NULL, NULL);
+	g_assert(id != 0);
+
+	g_assert(send(src.tx, RELAY_SHM_REQUEST, RELAY_SHM_REQUEST_LEN, 0) ==
+						RELAY_SHM_REQUEST_LEN);
+	g_assert(send(src.tx, report, sizeof(report), 0) == sizeof(report));
+
+	/* The client is refused, the report behind the request still goes */
+	g_assert(wait_recv(src.tx, buf, sizeof(buf)) == RELAY_SHM_REPLY_LEN);
+	g_assert(memcmp(buf, RELAY_SHM_REQUEST, RELAY_SHM_REQUEST_LEN) == 0);
+	g_assert(buf[RELAY_SHM_REQUEST_LEN] == EOPNOTSUPP);
+
+	g_assert(wait_recv(dst.rx, buf, sizeof(buf)) == sizeof(report));
+	g_assert(memcmp(buf, report, sizeof(report)) == 0);
+	g_assert(pair_recv(&dst, buf, sizeof(buf)) < 0);
+
+	g_assert(relay_thread_remove(id, NULL, NULL));
+
+	/* Other routes pass the same bytes on untouched */
+	id = relay_thread_add(src.rx, dst.tx, 0, queue, NULL, NULL, NULL);
+	g_assert(id != 0);
+
+	g_assert(send(src.tx, RELAY_SHM_REQUEST, RELAY_SHM_REQUEST_LEN, 0) ==
+						RELAY_SHM_REQUEST_LEN);
+	g_assert(wait_recv(dst.rx, buf, sizeof(buf)) ==
+						RELAY_SHM_REQUEST_LEN);
+	g_assert(recv(src.tx, buf, sizeof(buf), MSG_DONTWAIT) < 0);
+
+	g_assert(relay_thread_remove(id, NULL, NULL));
+	relay_thread_stop();
+
+	pair_close(&src);
+	pair_close(&dst);
+	relay_queue_free(queue);
+	tester_test_passed();
+}
+
+struct thread_stats {
+	struct relay_queue *queue;
+	struct test_pair src, dst;
+};
+
+static void thread_stats_done(void *user_data)
+{
+	struct thread_stats *test = user_data;
+	static const uint8_t report[] = { 0xa1, 0x01 };
+	uint8_t buf[RELAY_MTU];
+
+	/* The thread closed its copies, nothing holds the sockets open */
+	g_assert(send(test->src.tx, report, sizeof(report), MSG_NOSIGNAL) < 0);
+	g_assert(errno == EPIPE);
+	g_assert(recv(test->dst.rx, buf, sizeof(buf), MSG_DONTWAIT) == 0);
+
+	relay_thread_stop();
+
+	close(test->src.tx);
+	close(test->dst.rx);
+	relay_queue_free(test->queue);
+	g_free(test);
+	tester_test_passed();
+}
+
+static void test_thread_stats(const void *data)
+{
+	struct thread_stats *test = g_new0(struct thread_stats, 1);
+	struct relay_stats stats, none;
+	struct relay_latency latency;
+	uint8_t report[8], buf[RELAY_MTU];
+	unsigned int id, i;
+
+	g_assert(relay_thread_start(0, -1));
+
+	test->queue = relay_queue_new(4096, RELAY_QUEUE_DROP_OLDEST);
+	g_assert(test->queue != NULL);
+
+	pair_open(&test->src);
+	pair_open(&test->dst);
+
+	id = relay_thread_add(test->src.rx, test->dst.tx, 0, test->queue,
+							NULL, NULL, NULL);
+	g_assert(id != 0);
+
+	/* The thread keeps its own fds */
+	close(test->src.rx);
+	close(test->dst.tx);
+
+	for (i = 0; i < 3; i++) {
+		report_fill(report, sizeof(report), i);
+		g_assert(send(test->src.tx, report, sizeof(report), 0) ==
+							sizeof(report));
+		g_assert(wait_recv(test->dst.rx, buf, sizeof(buf)) ==
+							sizeof(report));
+	}
+
+	/* Counters are published once the thread is done with a wakeup */
+	memset(&stats, 0, sizeof(stats));
+	memset(&latency, 0, sizeof(latency));
+
+	for (i = 0; i < 100 && latency.count < 3; i++) {
+		g_assert(relay_thread_collect(id, &stats, &latency));
+		if (latency.count < 3)
+			usleep(10000);
+	}
+
+	g_assert(stats.reports == 3);
+	g_assert(latency.count == 3);
+
+	/* Each count is handed out once */
+	memset(&none, 0, sizeof(none));
+	g_assert(relay_thread_collect(id, &none, NULL));
+	g_assert(none.reports == 0);
+
+	g_assert(relay_thread_remove(id, &none, NULL));
+	g_assert(none.reports == 0);
+	g_assert(!relay_thread_collect(id, NULL, NULL));
+
+	relay_thread_barrier(thread_stats_done, test);
+}
+
+int main(int argc, char *argv[])
+{
+	tester_init(&argc, &argv);
+
+	tester_add("/relay/queue/drop-oldest", NULL, NULL, test_drop_oldest,
+									NULL);
+	tester_add("/relay/queue/coalesce", NULL, NULL, test_coalesce, NULL);
+	tester_add("/relay/queue/block", NULL, NULL, test_block, NULL);
+	tester_add("/relay/queue/expire", NULL, NULL, test_expire, NULL);
+	tester_add("/relay/queue/wrap", NULL, NULL, test_wrap, NULL);
+	tester_add("/relay/queue/merge", NULL, NULL, test_merge, NULL);
+	tester_add("/relay/latency/percentile", NULL, NULL, test_percentile,
+									NULL);
+	tester_add("/relay/thread/shm-refused", NULL, NULL, test_thread_shm,
+									NULL);
+	tester_add("/relay/thread/stats", NULL, NULL, test_thread_stats,
+									NULL);
+
+	return tester_run();
+}
@@ -146,6 +146,60 @@ static void test_printf(const void *data)
 	tester_test_passed();
 }
 
+static void test_put(const void *data)
+{
+	static size_t rb_size = 500;
+	static size_t rb_capa = 512;
+	struct ringbuf *rb;
+	uint8_t buf[rb_capa];
+	uint8_t guard = 0;
+	int i;
+
+	rb = ringbuf_new(rb_size);
+	g_assert(rb != NULL);
+
+	g_assert(ringbuf_put(rb, buf, rb_capa + 1) == 0);
+	g_assert(ringbuf_len(rb) == 0);
+
+	/* Keep a guard byte queued so that the buffer never resets and
+	 * the data wraps around at varying offsets.
+	 */
+	g_assert(ringbuf_put(rb, &guard, 1) == 1);
+
+	for (i = 0; i < 10000; i++) {
+		size_t len, count = i % (rb_capa - 1);
+		uint8_t *ptr;
+
+		if (!count)
+			continue;
+
+		tester_debug("Iteration %i\n", i);
+
+		memset(buf, i, count);
+
+		g_assert(ringbuf_put(rb, buf, count) == count);
+		g_assert(ringbuf_len(rb) == count + 1);
+		g_assert(ringbuf_avail(rb) == rb_capa - count - 1);
+
+		ptr = ringbuf_peek(rb, 1, &len);
+		g_assert(ptr != NULL);
+		len = len < count ? len : count;
+		g_assert(memcmp(buf, ptr, len) == 0);
+
+		if (len < count) {
+			ptr = ringbuf_peek(rb, 1 + len, NULL);
+			g_assert(memcmp(buf + len, ptr, count - len) == 0);
+		}
+
+		g_assert(ringbuf_put(rb, &guard, 1) == 1);
+		g_assert(ringbuf_drain(rb, count + 1) == count + 1);
+		g_assert(ringbuf_len(rb) == 1);
+	}
+
+	ringbuf_free(rb);
+	tester_test_passed();
+}
+
 int main(int argc, char *argv[])
 {
 	tester_init(&argc, &argv);
@@ -153,6 +207,7 @@ int main(int argc, char *argv[])
 	tester_add("/ringbuf/power2", NULL, NULL, test_power2, NULL);
 	tester_add("/ringbuf/alloc", NULL, NULL, test_alloc, NULL);
 	tester_add("/ringbuf/printf", NULL, NULL, test_printf, NULL);
+	tester_add("/ringbuf/put", NULL, NULL, test_put, NULL);
 
 	return tester_run();
 }